@@ -51,6 +51,8 @@ private:
 
 	MainWindowFrame* MainFrame ;
 	wxArrayString commandLineFiles;
+	//File to write refresh timings to, if any
+	std::string refreshTraceFile;
 	wxLocale* usrLocale;
 	long language;
 
@@ -81,10 +83,13 @@ static const wxCmdLineEntryDesc g_cmdLineDesc [] =
 	{ wxCMD_LINE_SWITCH, ("h"), ("help"), ("displays this message"),
 		wxCMD_LINE_VAL_NONE, wxCMD_LINE_OPTION_HELP },
 	{ wxCMD_LINE_PARAM,  NULL, NULL, ("inputfile"), wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL | wxCMD_LINE_PARAM_MULTIPLE},
+	{ wxCMD_LINE_OPTION, NULL, ("trace-refresh"), ("Record the time taken by each filter refresh, writing it to the given file as Chrome trace JSON"),
+		wxCMD_LINE_VAL_STRING, 0},
 	//Unit testing system
 #ifdef DEBUG
 	{ wxCMD_LINE_SWITCH, ("t"), ("test"), ("Run debug unit tests, returns nonzero on test failure, zero on success.\n\t\t"
 		       "XML files may be passed to run , instead of default tests"), wxCMD_LINE_VAL_NONE, wxCMD_LINE_SWITCH},
+	{ wxCMD_LINE_SWITCH, NULL, ("benchmark"), ("Run debug timing benchmarks, returns nonzero on failure"), wxCMD_LINE_VAL_NONE, wxCMD_LINE_SWITCH},
 #endif
   { wxCMD_LINE_NONE,NULL,NULL,NULL,wxCMD_LINE_VAL_NONE,0 }
 
@@ -383,9 +388,22 @@ bool threeDepictApp::OnCmdLineParsed(wxCmdLineParser& parser)
 			}
 		}
 	}
+	else if(parser.Found(wxT("benchmark")))
+	{
+		if(!runBenchmarks(std::cerr))
+		{
+			std::cerr << "Benchmarks failed" << std::endl;
+			return false;
+		}
+		dontLoad=true;
+	}
 	else
 #endif
 	{
+		wxString traceFile;
+		if(parser.Found(wxT("trace-refresh"),&traceFile))
+			refreshTraceFile=stlStr(traceFile);
+
 		for(unsigned int ui=0;ui<parser.GetParamCount();ui++)
 		{
 			wxFileName f;
@@ -485,6 +503,9 @@ bool threeDepictApp::OnInit()
     MainFrame->checkReloadAutosave();
 
 
+    if(refreshTraceFile.size())
+    	MainFrame->setRefreshTraceFile(refreshTraceFile);
+
     if(commandLineFiles.GetCount())
     	MainFrame->SetCommandLineFiles(commandLineFiles);
 
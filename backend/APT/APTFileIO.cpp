@@ -28,6 +28,17 @@
 #include <cstring>
 #include <new>
 
+#if !defined(WIN32) && !defined(WIN64)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 using std::pair;
 using std::string;
@@ -46,8 +57,8 @@ const char *TEXT_LOAD_ERR_STRINGS[] = { "",
 					NTRANS("Unable to reopen file after first scan"),
 					NTRANS("Error whilst reading file contents"),
 					NTRANS("Unexpected file format"),
-					NTRANS("Unexpected file format"),
 					NTRANS("Insufficient memory to continue"),
+					NTRANS("Load aborted by interrupt"),
 					};
 
 const char *POS_ERR_STRINGS[] = { "",
@@ -72,6 +83,7 @@ enum
 	TEXT_ERR_READ_CONTENTS,
 	TEXT_ERR_FORMAT,
 	TEXT_ERR_ALLOC_FAIL,
+	TEXT_ERR_ABORT,
 	TEXT_ERR_ENUM_END //not an error, just end of enum
 };
 
@@ -81,8 +93,8 @@ const char *ION_TEXT_ERR_STRINGS[] = { "",
        					NTRANS("Error re-opening file, after first scan"),
        					NTRANS("Unable to read file contents after open"),
 					NTRANS("Error interpreting field in file"),
-					NTRANS("Incorrect number of fields in file"),
 					NTRANS("Unable to allocate memory to store data"),
+					NTRANS("Load aborted by interrupt"),
 					};
 //---------
 
@@ -192,7 +204,7 @@ unsigned int LimitLoadPosFile(unsigned int inputnumcols, unsigned int outputnumc
 		rng.initTimer();
 		unsigned int dummy;
 		randomDigitSelection(ionsToLoad,maxIons,rng,
-				limitCount,dummy,strongSampling);
+				limitCount,dummy,wantAbort,strongSampling);
 	}
 	catch(std::bad_alloc)
 	{
@@ -201,6 +213,13 @@ unsigned int LimitLoadPosFile(unsigned int inputnumcols, unsigned int outputnumc
 		return POS_ALLOC_FAIL;
 	}
 
+	if(wantAbort)
+	{
+		delete[] buffer;
+		delete[] buffer2;
+		posIons.clear();
+		return POS_ABORT_FAIL;
+	}
 
 	//sort again
 	//NOTE: I tried to use a functor here to get progress
@@ -434,262 +453,651 @@ unsigned int GenericLoadFloatFile(unsigned int inputnumcols, unsigned int output
 }
 
 
-//TODO: Add progress
-unsigned int limitLoadTextFile(unsigned int maxCols, 
-			vector<vector<float> > &data,const char *textFile, const char *delim, const size_t limitCount,
-				unsigned int &progress, ATOMIC_BOOL &wantAbort,bool strongRandom)
+//Minimum number of bytes of text to give to each thread when
+// splitting a text file for parsing
+const size_t TEXT_MIN_CHUNK_SIZE=1<<20;
+
+//!Read-only view of a file's entire contents.
+/*! Uses a memory map where the platform supports it, otherwise
+ * the file is read into a single heap buffer
+ */
+class MappedTextFile
 {
-	ASSERT(maxCols);
-	ASSERT(textFile);
+	private:
+		const char *fileData;
+		size_t fileSize;
+		//true if fileData was obtained from mmap, rather than new[]
+		bool isMapped;
+	public:
+		MappedTextFile() : fileData(0), fileSize(0), isMapped(false) {}
+		~MappedTextFile() { close(); }
+
+		//!Open and map the given file. Returns false on failure
+		bool open(const char *filename);
+		//!Release the file contents
+		void close();
+
+		const char *data() const { return fileData;}
+		size_t size() const { return fileSize;}
+};
 
-	vector<size_t> newLinePositions;
-	std::vector<std::string> subStrs;
+bool MappedTextFile::open(const char *filename)
+{
+	close();
 
-	//Do a brute force scan through the dataset
-	//to locate newlines.
-	char *buffer;
-	const int BUFFER_SIZE=16384; //This is totally a guess. I don't know what is best.
+#if !defined(WIN32) && !defined(WIN64)
+	int fd = ::open(filename,O_RDONLY);
+	if(fd < 0)
+		return false;
 
-	ifstream CFile(textFile,std::ios::binary);
+	struct stat statBuf;
+	if(fstat(fd,&statBuf) || !S_ISREG(statBuf.st_mode))
+	{
+		::close(fd);
+		return false;
+	}
 
-	if(!CFile)
-		return TEXT_ERR_OPEN;
+	fileSize=statBuf.st_size;
+	if(!fileSize)
+	{
+		::close(fd);
+		return true;
+	}
 
+	void *mapPtr=mmap(0,fileSize,PROT_READ,MAP_PRIVATE,fd,0);
+	//The mapping holds its own reference to the file
+	::close(fd);
 
-	//seek to the end of the file
-	//to get the filesize
-	size_t maxPos,curPos;
-	CFile.seekg(0,std::ios::end);
-	maxPos=CFile.tellg();
+	if(mapPtr == MAP_FAILED)
+	{
+		fileSize=0;
+		return false;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(mapPtr,fileSize,MADV_SEQUENTIAL);
+#endif
+	fileData=(const char*)mapPtr;
+	isMapped=true;
+	return true;
+#else
+	//No mmap, fall back to reading the whole file in one go
+	ifstream f(filename,std::ios::binary);
+	if(!f)
+		return false;
 
-	CFile.close();
+	f.seekg(0,std::ios::end);
+	fileSize=f.tellg();
+	f.seekg(0,std::ios::beg);
+	if(!fileSize)
+		return true;
 
-	CFile.open(textFile);
+	char *buf = new (std::nothrow) char[fileSize];
+	if(!buf)
+	{
+		fileSize=0;
+		return false;
+	}
 
-	curPos=0;
+	f.read(buf,fileSize);
+	if(!f.good())
+	{
+		delete[] buf;
+		fileSize=0;
+		return false;
+	}
 
+	fileData=buf;
+	return true;
+#endif
+}
 
-	//Scan through file for end of header.
-	//we define this as the split value being able to generate 
-	//1) Enough data to make interpretable columns
-	//2) Enough columns that can be interpreted.
-	while(CFile.good() && !CFile.eof() && curPos < maxPos)
+void MappedTextFile::close()
+{
+	if(fileData)
 	{
-		string s;
-		curPos = CFile.tellg();
-		getline(CFile,s);
+#if !defined(WIN32) && !defined(WIN64)
+		if(isMapped)
+			munmap((void*)fileData,fileSize);
+		else
+#endif
+			delete[] fileData;
+	}
 
-		if(!CFile.good())
-			return TEXT_ERR_READ_CONTENTS;
+	fileData=0;
+	fileSize=0;
+	isMapped=false;
+}
+
+//!Allocation-free parser for lines of deliminated numerical text
+class TextLineParser
+{
+	private:
+		//Lookup table, true if character is a field separator
+		bool isSep[256];
+	public:
+		TextLineParser(const char *delim);
+
+		//!Parse a line in [start,end), which must not contain a newline
+		/*! Returns the number of fields found. Up to maxCols fields are
+		 * stored in values. Empty fields (repeated separators) are skipped.
+		 * ok is set to false if any of the fields cannot be interpreted
+		 */
+		size_t parseLine(const char *start, const char *end,
+				float *values, size_t maxCols, bool &ok) const;
+
+		//!Returns true if the line [start,end) has any non-separator characters
+		bool hasContent(const char *start, const char *end) const;
+
+		//!Parse a single decimal floating point value, without allocating
+		/*! The entire range must be consumed, else false is returned */
+		static bool parseFloat(const char *start, const char *end, float &f);
+};
 
-		splitStrsRef(s.c_str(),delim,subStrs);	
-		stripZeroEntries(subStrs);
+TextLineParser::TextLineParser(const char *delim)
+{
+	for(unsigned int ui=0;ui<256;ui++)
+		isSep[ui]=false;
+
+	for(const char *c=delim; *c; c++)
+		isSep[(unsigned char)*c]=true;
+
+	//Treat the first half of a windows line ending as whitespace
+	isSep[(unsigned char)'\r']=true;
+}
+
+bool TextLineParser::hasContent(const char *start, const char *end) const
+{
+	for(const char *p=start;p!=end;p++)
+	{
+		if(!isSep[(unsigned char)*p])
+			return true;
+	}
+	return false;
+}
+
+size_t TextLineParser::parseLine(const char *start, const char *end,
+			float *values, size_t maxCols, bool &ok) const
+{
+	ok=true;
+	size_t nFields=0;
+	const char *p=start;
+	while(p!=end)
+	{
+		//Skip separators
+		while(p!=end && isSep[(unsigned char)*p])
+			p++;
 
-		//Skip unstreamable lines
-		bool unStreamable;
-		unStreamable=false;
-		for(unsigned int ui=0; ui<subStrs.size(); ui++)
+		if(p==end)
+			break;
+
+		const char *fieldStart=p;
+		while(p!=end && !isSep[(unsigned char)*p])
+			p++;
+
+		float f;
+		if(!parseFloat(fieldStart,p,f))
+			ok=false;
+		else if(nFields < maxCols)
+			values[nFields]=f;
+
+		nFields++;
+	}
+
+	return nFields;
+}
+
+bool TextLineParser::parseFloat(const char *start, const char *end, float &f)
+{
+	//Exactly representable powers of ten in double precision
+	const double POW_TEN[] = { 1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,
+				1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+	//Significant digits that fit into a 64 bit mantissa
+	const int MAX_MANTISSA_DIGITS=19;
+
+	const char *p=start;
+	bool negative=false;
+	if(p!=end && (*p == '+' || *p == '-'))
+	{
+		negative= (*p == '-');
+		p++;
+	}
+
+	uint64_t mantissa=0;
+	int nDigits=0,exponent=0;
+	bool haveDigits=false;
+
+	//Integer part
+	for(;p!=end && *p >='0' && *p <='9';p++)
+	{
+		haveDigits=true;
+		if(nDigits < MAX_MANTISSA_DIGITS)
+		{
+			mantissa=mantissa*10 + (*p-'0');
+			if(mantissa)
+				nDigits++;
+		}
+		else
+			exponent++;
+	}
+
+	//Fractional part
+	if(p!=end && *p == '.')
+	{
+		p++;
+		for(;p!=end && *p >='0' && *p <='9';p++)
 		{
-			float f;
-			if(stream_cast(f,subStrs[ui]))
+			haveDigits=true;
+			if(nDigits < MAX_MANTISSA_DIGITS)
 			{
-				unStreamable=true;
-				break;
+				mantissa=mantissa*10 + (*p-'0');
+				if(mantissa)
+					nDigits++;
+				exponent--;
 			}
-
 		}
+	}
 
-		//well, we can stream this, so it assume it is not the header.
-		if(!unStreamable)
-			break;	
-	}	
+	if(!haveDigits)
+		return false;
 
-	//could not find any data.. only header.
-	if(!CFile.good() || CFile.eof() || curPos >=maxPos)
-		return TEXT_ERR_ONLY_HEADER;
+	//Exponent part
+	if(p!=end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negExp=false;
+		if(p!=end && (*p == '+' || *p == '-'))
+		{
+			negExp = (*p == '-');
+			p++;
+		}
 
+		if(p==end || *p < '0' || *p > '9')
+			return false;
 
-	CFile.close();
+		int expVal=0;
+		for(;p!=end && *p >='0' && *p <='9';p++)
+		{
+			//Anything this large is well outside float range anyway
+			if(expVal < 10000)
+				expVal=expVal*10 + (*p-'0');
+		}
 
-	//Re-open the file in binary mode to find the newlines
-	CFile.open(textFile,std::ios::binary);
+		if(negExp)
+			exponent-=expVal;
+		else
+			exponent+=expVal;
+	}
 
-	if(!CFile)
-		return TEXT_ERR_REOPEN;
+	//Trailing junk
+	if(p!=end)
+		return false;
 
+	double value=(double)mantissa;
+	if(mantissa)
+	{
+		if(exponent < 0)
+		{
+			if(exponent >= -22)
+				value/=POW_TEN[-exponent];
+			else
+				value*=pow(10.0,exponent);
+		}
+		else if(exponent > 0)
+		{
+			if(exponent <= 22)
+				value*=POW_TEN[exponent];
+			else
+				value*=pow(10.0,exponent);
+		}
+	}
 
-	//Jump to beyond the header
-	CFile.seekg(curPos);
+	f=(float)(negative ? -value : value);
+	return true;
+}
 
+//Locate the start of the first line that is made entirely of numeric fields.
+// Returns false if no such line exists. numFields is set to the
+// number of fields in that line.
+bool findTextDataStart(const MappedTextFile &file, const TextLineParser &parser,
+				size_t &dataStart, size_t &numFields)
+{
+	const char *fileStart=file.data();
+	const char *fileEnd=fileStart+file.size();
 
-	//keep a beginning of file marker
-	newLinePositions.push_back(curPos);
-	bool seenNumeric=false;
-	buffer = new char[BUFFER_SIZE];
-	while(CFile.good() && !CFile.eof() && curPos < maxPos)
+	//Scratch space for the header scan; contents are discarded
+	float scratch[1];
+	const char *lineStart=fileStart;
+	while(lineStart < fileEnd)
 	{
-		size_t bytesToRead;
+		const char *lineEnd=(const char*)memchr(lineStart,'\n',fileEnd-lineStart);
+		if(!lineEnd)
+			lineEnd=fileEnd;
 
-		if(!CFile.good())
+		bool ok;
+		size_t n=parser.parseLine(lineStart,lineEnd,scratch,0,ok);
+		if(ok && n)
 		{
-			delete[] buffer;
-			return TEXT_ERR_READ_CONTENTS;
+			dataStart=lineStart-fileStart;
+			numFields=n;
+			return true;
 		}
-		//read up to BUFFER_SIZE bytes from the file
-		//but only if they are available
-		bytesToRead = std::min(maxPos-curPos,(size_t)BUFFER_SIZE);
 
-		CFile.read(buffer,bytesToRead);
+		lineStart=lineEnd+1;
+	}
+
+	return false;
+}
+
+//Split the region [dataStart, end of file) into chunks that begin on a line boundary,
+// and find the number of non-blank lines in each. If wantStarts is set, then
+// the offset of each non-blank line is also recorded, per chunk
+void chunkTextLines(const MappedTextFile &file, const TextLineParser &parser,
+		size_t dataStart, vector<size_t> &chunkBounds, vector<size_t> &lineCounts,
+		vector<vector<size_t> > *lineStarts)
+{
+	const char *fileStart=file.data();
+	const size_t fileSize=file.size();
+	const size_t dataSize=fileSize-dataStart;
+
+	size_t nChunks=1;
+#ifdef _OPENMP
+	nChunks=omp_get_max_threads()*4;
+#endif
+	nChunks=std::max((size_t)1,std::min(nChunks,dataSize/TEXT_MIN_CHUNK_SIZE));
+
+	//Place the boundaries, moving each to just after a newline
+	chunkBounds.resize(nChunks+1);
+	chunkBounds[0]=dataStart;
+	for(size_t ui=1;ui<nChunks;ui++)
+	{
+		size_t pos=dataStart + (dataSize/nChunks)*ui;
+		pos=std::max(pos,chunkBounds[ui-1]);
+		const char *nl=(const char*)memchr(fileStart+pos,'\n',fileSize-pos);
+		chunkBounds[ui] = nl ? (nl-fileStart)+1 : fileSize;
+	}
+	chunkBounds[nChunks]=fileSize;
 
-		//check that this buffer contains numeric info	
-		for(unsigned int ui=0;ui<bytesToRead; ui++)
+	lineCounts.resize(nChunks);
+	if(lineStarts)
+		lineStarts->resize(nChunks);
+
+	#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<nChunks;ui++)
+	{
+		const char *p=fileStart+chunkBounds[ui];
+		const char *chunkEnd=fileStart+chunkBounds[ui+1];
+		size_t count=0;
+		while(p < chunkEnd)
 		{
-			//Check for a unix-style endline
-			//or the latter part of a windows endline
-			//either or, whatever.
-			if( buffer[ui] == '\n')
+			const char *lineEnd=(const char*)memchr(p,'\n',chunkEnd-p);
+			if(!lineEnd)
+				lineEnd=chunkEnd;
+
+			if(parser.hasContent(p,lineEnd))
 			{
-				//Check that we have not hit a run of non-numeric data
-				if(seenNumeric)
-					newLinePositions.push_back(ui+curPos);
-			} 
-			else if(buffer[ui] >= '0' && buffer[ui] <='9')
-				seenNumeric=true;
+				if(lineStarts)
+					(*lineStarts)[ui].push_back(p-fileStart);
+				count++;
+			}
+			p=lineEnd+1;
 		}
-		
-		curPos+=bytesToRead;	
-	
+		lineCounts[ui]=count;
 	}
-	
-	//Don't keep any newline that hits the end of the file, but do keep a zero position
-	if(newLinePositions.size())
-		newLinePositions.pop_back();
-	CFile.close();
+}
 
+unsigned int loadTextFile(unsigned int maxCols, vector<vector<float> > &data,
+		const char *textFile, const char *delim,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(maxCols);
+	ASSERT(textFile);
+	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(TEXT_LOAD_ERR_STRINGS) == TEXT_ERR_ENUM_END);
+	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(ION_TEXT_ERR_STRINGS) == TEXT_ERR_ENUM_END);
 
-	//OK, so now we know where those pesky endlines are. This gives us jump positions
-	//to new lines in the file. Each component must have some form of numeric data 
-	//preceding it. That numeric data may not be fully parseable, but we assume it is until we know better.
-	//
-	//If it is *not* parseable, just throw an error when we find that out.
+	MappedTextFile file;
+	if(!file.open(textFile))
+		return TEXT_ERR_OPEN;
 
-	//If we are going to load the whole file, don't use a sampling method to do it.
-	if(limitCount >=newLinePositions.size())
-	{
-		delete[] buffer;
+	TextLineParser parser(delim);
 
-		vector<string> header;
-	
-		//Just use the non-sampling method to load.	
-		if(loadTextData(textFile,data,header,delim))
-			return TEXT_ERR_FORMAT;
+	size_t dataStart,numFields;
+	if(!findTextDataStart(file,parser,dataStart,numFields))
+		return TEXT_ERR_ONLY_HEADER;
+
+	const size_t numCols=std::min(numFields,(size_t)maxCols);
+
+	vector<size_t> chunkBounds,lineCounts;
+	chunkTextLines(file,parser,dataStart,chunkBounds,lineCounts,0);
 
-		return 0;	
+	if(wantAbort)
+		return TEXT_ERR_ABORT;
+
+	//Convert line counts into output offsets for each chunk
+	const size_t nChunks=lineCounts.size();
+	vector<size_t> chunkOffsets(nChunks);
+	size_t totalLines=0;
+	for(size_t ui=0;ui<nChunks;ui++)
+	{
+		chunkOffsets[ui]=totalLines;
+		totalLines+=lineCounts[ui];
 	}
 
-	//Generate some random positions to load
-	std::vector<size_t> dataToLoad;
 	try
 	{
-		data.resize(limitCount);
-
-		RandNumGen rng;
-		rng.initTimer();
-		unsigned int dummy;
-		randomDigitSelection(dataToLoad,newLinePositions.size(),rng,
-				limitCount,dummy,strongRandom);
+		data.resize(numCols);
+		for(size_t ui=0;ui<numCols;ui++)
+			data[ui].resize(totalLines);
 	}
 	catch(std::bad_alloc)
 	{
-		delete[] buffer;
+		data.clear();
 		return TEXT_ERR_ALLOC_FAIL;
 	}
 
-	//check for abort before/after sort, as this is a long process that we cannot
-	// safely abort
-	if(wantAbort)
+	const char *fileStart=file.data();
+	bool badFormat=false,spin=false;
+	size_t chunksDone=0;
+	#pragma omp parallel for schedule(dynamic) shared(badFormat,spin,chunksDone)
+	for(size_t ui=0;ui<nChunks;ui++)
 	{
-		delete[] buffer;
-		return POS_ABORT_FAIL;
+		if(spin || badFormat)
+			continue;
+
+		float values[4];
+		vector<float> valueBuf;
+		float *lineValues=values;
+		if(numCols > 4)
+		{
+			valueBuf.resize(numCols);
+			lineValues=&valueBuf[0];
+		}
+
+		size_t outIdx=chunkOffsets[ui];
+		const char *p=fileStart+chunkBounds[ui];
+		const char *chunkEnd=fileStart+chunkBounds[ui+1];
+		while(p < chunkEnd)
+		{
+			const char *lineEnd=(const char*)memchr(p,'\n',chunkEnd-p);
+			if(!lineEnd)
+				lineEnd=chunkEnd;
+
+			bool ok;
+			size_t n=parser.parseLine(p,lineEnd,lineValues,numCols,ok);
+			p=lineEnd+1;
+
+			//Skip blank lines
+			if(!n && ok)
+				continue;
+
+			if(!ok || n < numCols)
+			{
+				badFormat=true;
+				break;
+			}
+
+			for(size_t uj=0;uj<numCols;uj++)
+				data[uj][outIdx]=lineValues[uj];
+			outIdx++;
+		}
+
+		#pragma omp critical
+		{
+		chunksDone++;
+		progress= (unsigned int)((float)chunksDone/(float)nChunks*100.0f);
+		if(wantAbort)
+			spin=true;
+		}
 	}
-	//Sort the data such that we are going to
-	//always jump forwards in the file; better disk access and whatnot.
-	std::sort(dataToLoad.begin(),dataToLoad.end());
-	
-	//check again for abort
-	if(wantAbort)
+
+	if(spin)
 	{
-		delete[] buffer;
-		return POS_ABORT_FAIL;
+		data.clear();
+		return TEXT_ERR_ABORT;
+	}
+
+	if(badFormat)
+	{
+		data.clear();
+		return TEXT_ERR_FORMAT;
 	}
 
-	//OK, so we have  a list of newlines
-	//that we can use as entry points for random seek.
-	//We also have some random entry points (sorted).
-	// Now re-open the file in text mode and try to load the
-	// data specified at the offsets
+	return 0;
+}
 
+unsigned int limitLoadTextFile(unsigned int maxCols,
+			vector<vector<float> > &data,const char *textFile, const char *delim, const size_t limitCount,
+				unsigned int &progress, ATOMIC_BOOL &wantAbort,bool strongRandom)
+{
+	ASSERT(maxCols);
+	ASSERT(textFile);
 
-	//Open file in text mode
-	CFile.open(textFile);
+	MappedTextFile file;
+	if(!file.open(textFile))
+		return TEXT_ERR_OPEN;
 
-	if(!CFile)
-	{
-		delete[] buffer;
-		return TEXT_ERR_REOPEN;
-	}
+	TextLineParser parser(delim);
 
+	//Find the end of the header.
+	//we define this as the first line where every field can be
+	// interpreted as a number
+	size_t dataStart,numFields;
+	if(!findTextDataStart(file,parser,dataStart,numFields))
+		return TEXT_ERR_ONLY_HEADER;
 
-	//OK, now jump to each of the random positions,
-	//as dictated by the endline position 
-	//and attempt a parsing there.
+	const size_t numCols=std::min(numFields,(size_t)maxCols);
 
-	subStrs.clear();
-	for(size_t ui=0;ui<dataToLoad.size();ui++)	
+	//Locate the start of every non-blank line. These are the
+	// entry points for random selection
+	vector<size_t> chunkBounds,lineCounts;
+	vector<vector<size_t> > chunkLineStarts;
+	try
+	{
+		chunkTextLines(file,parser,dataStart,chunkBounds,lineCounts,&chunkLineStarts);
+	}
+	catch(std::bad_alloc)
 	{
+		return TEXT_ERR_ALLOC_FAIL;
+	}
 
-		std::ios::pos_type  nextIonPos;
-		//Jump to position immediately after the newline
-		nextIonPos = (newLinePositions[dataToLoad[ui]]+1);
-		
-		if(CFile.tellg() !=nextIonPos )
-			CFile.seekg(nextIonPos);
+	size_t totalLines=0;
+	for(size_t ui=0;ui<lineCounts.size();ui++)
+		totalLines+=lineCounts[ui];
 
-		string s;
+	//If we are going to load the whole file, don't use a sampling method to do it.
+	if(limitCount >=totalLines)
+	{
+		file.close();
+		return loadTextFile(maxCols,data,textFile,delim,progress,wantAbort);
+	}
 
-		getline(CFile,s);
+	//Generate some random positions to load
+	std::vector<size_t> dataToLoad;
+	try
+	{
+		RandNumGen rng;
+		rng.initTimer();
+		unsigned int dummy;
+		randomDigitSelection(dataToLoad,totalLines,rng,
+				limitCount,dummy,wantAbort,strongRandom);
 
-		//Now attempt to scan the line for the selected columns.
-		//split around whatever delimiter we can find
-		splitStrsRef(s.c_str(),delim,subStrs);	
+		data.resize(numCols);
+		for(size_t ui=0;ui<numCols;ui++)
+			data[ui].resize(dataToLoad.size());
+	}
+	catch(std::bad_alloc)
+	{
+		return TEXT_ERR_ALLOC_FAIL;
+	}
 
-		size_t maxStrs;
-		maxStrs=std::min(subStrs.size(),(size_t)maxCols);
-		if(data.size() < maxStrs)
-			data.resize(maxStrs);
-		
-		for(size_t uj=0;uj<maxStrs;uj++)
+	//check for abort before/after sort, as this is a long process that we cannot
+	// safely abort
+	if(wantAbort)
+		return TEXT_ERR_ABORT;
+	//Sort the data such that we are going to
+	//always jump forwards in the file; better memory access and whatnot.
+	std::sort(dataToLoad.begin(),dataToLoad.end());
+
+	//check again for abort
+	if(wantAbort)
+		return TEXT_ERR_ABORT;
+
+	//Map each selected line number onto the owning chunk's line list
+	vector<size_t> chunkOffsets(lineCounts.size()+1,0);
+	for(size_t ui=0;ui<lineCounts.size();ui++)
+		chunkOffsets[ui+1]=chunkOffsets[ui]+lineCounts[ui];
+
+	const char *fileStart=file.data();
+	const char *fileEnd=fileStart+file.size();
+	bool badFormat=false;
+	#pragma omp parallel for shared(badFormat)
+	for(size_t ui=0;ui<dataToLoad.size();ui++)
+	{
+		if(badFormat)
+			continue;
+
+		size_t chunk=std::upper_bound(chunkOffsets.begin(),chunkOffsets.end(),
+					dataToLoad[ui])-chunkOffsets.begin()-1;
+		const char *lineStart=fileStart+
+			chunkLineStarts[chunk][dataToLoad[ui]-chunkOffsets[chunk]];
+		const char *lineEnd=(const char*)memchr(lineStart,'\n',fileEnd-lineStart);
+		if(!lineEnd)
+			lineEnd=fileEnd;
+
+		float values[4];
+		vector<float> valueBuf;
+		float *lineValues=values;
+		if(numCols > 4)
 		{
-			float tmp;
-			if(stream_cast(tmp,subStrs[uj]))
-			{
-				//FIXME: Allow skipping bad lines
-				//Can't parse line.. Abort.
-				delete[] buffer;
-				return TEXT_ERR_FORMAT;
-			}
+			valueBuf.resize(numCols);
+			lineValues=&valueBuf[0];
+		}
 
-			data[uj].push_back(tmp);
+		bool ok;
+		size_t n=parser.parseLine(lineStart,lineEnd,lineValues,numCols,ok);
+		if(!ok || n < numCols)
+		{
+			//FIXME: Allow skipping bad lines
+			badFormat=true;
+			continue;
 		}
+
+		for(size_t uj=0;uj<numCols;uj++)
+			data[uj][ui]=lineValues[uj];
+	}
+
+	if(badFormat)
+	{
+		data.clear();
+		return TEXT_ERR_FORMAT;
 	}
 
-	delete[] buffer;
 	return 0;
 
 }
 
 
 
+
 unsigned int LoadATOFile(const char *fileName, vector<IonHit> &ions, unsigned int &progress, ATOMIC_BOOL &wantAbort,unsigned int forceEndian)
 {
 
@@ -946,6 +1354,7 @@ unsigned int LoadATOFile(const char *fileName, vector<IonHit> &ions, unsigned in
 
 #ifdef DEBUG
 bool testATOFormat();
+bool testTextLoad();
 
 
 bool testFileIO()
@@ -953,6 +1362,9 @@ bool testFileIO()
 	if(!testATOFormat())
 		return false;
 
+	if(!testTextLoad())
+		return false;
+
 	return true;
 }
 
@@ -1042,4 +1454,59 @@ bool testATOFormat()
 
 }
 
+bool testTextLoad()
+{
+	std::string filename;
+	genRandomFilename(filename);
+
+	const unsigned int NUM_LINES=1000;
+	{
+	std::ofstream outF(filename.c_str());
+	if(!outF)
+	{
+		WARN(false,"Unable to create file for testing text load. skipping");
+		return true;
+	}
+
+	//Header, then mixed deliminators, blank lines and windows line endings
+	outF << "x y z mass" << std::endl;
+	outF << std::endl;
+	for(unsigned int ui=0;ui<NUM_LINES;ui++)
+	{
+		outF << ui*0.5f << ", " << -(int)ui << "\t" << 1.5e-3f << "  " << ui%7 << "\r\n";
+		if(!(ui%100))
+			outF << std::endl;
+	}
+	}
+
+	unsigned int dummyProgress;
+	ATOMIC_BOOL wantAbort;
+	wantAbort=false;
+	vector<vector<float> > data;
+
+	TEST(!loadTextFile(4,data,filename.c_str(),"\t ,",dummyProgress,wantAbort),"Text load");
+	TEST(data.size() == 4,"Column count");
+	TEST(data[0].size() == NUM_LINES,"Row count");
+	for(unsigned int ui=0;ui<NUM_LINES;ui++)
+	{
+		TEST(data[0][ui] == ui*0.5f,"Text load value check");
+		TEST(data[1][ui] == -(float)ui,"Text load value check");
+		TEST(fabs(data[2][ui] - 1.5e-3f) < std::numeric_limits<float>::epsilon(),"Text load value check");
+		TEST(data[3][ui] == ui%7,"Text load value check");
+	}
+
+	//Sampled load should give lines from the file, intact
+	TEST(!limitLoadTextFile(4,data,filename.c_str(),"\t ,",NUM_LINES/10,dummyProgress,wantAbort,false),"Sampled text load");
+	TEST(data.size() == 4,"Column count");
+	TEST(data[0].size() == NUM_LINES/10,"Sampled row count");
+	for(unsigned int ui=0;ui<data[0].size();ui++)
+	{
+		TEST(data[1][ui] == -2.0f*data[0][ui],"Sampled value check");
+	}
+
+	rmFile(filename);
+
+	return true;
+}
+
 #endif
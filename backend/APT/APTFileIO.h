@@ -70,6 +70,19 @@ unsigned int LimitLoadPosFile(unsigned int inputnumcols, unsigned int outputnumc
 
 
 
+//!Load all numeric data from a deliminated text file, using multiple threads
+/*! Leading header lines (any line that is not entirely numeric) are skipped.
+ * Output is stored per-column, with up to maxCols columns. Returns
+ * nonzero on error, which can be used with TEXT_LOAD_ERR_STRINGS
+ */
+unsigned int loadTextFile(unsigned int maxCols, vector<vector<float> > &data,
+		const char *textFile, const char *delim,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+//!Load a random subset of the lines in a deliminated text file
+/*! If limitCount exceeds the number of available lines, the whole
+ * file is loaded. Returns nonzero on error, as for loadTextFile
+ */
 unsigned int limitLoadTextFile(unsigned int numColsTotal, 
 			vector<vector<float> > &data,const char *posFile, const char *deliminator, const size_t limitCount,
 					       	unsigned int &progress, ATOMIC_BOOL &wantAbort,bool strongRandom);
@@ -46,6 +46,23 @@ const char *ABUNDANCE_ERROR[] = { "Unable to read abundance data (opening file)"
 };
 
 
+//Largest number of isotope distributions to cache
+const size_t MAX_ISOTOPE_DIST_CACHE=256;
+
+AbundanceData::AbundanceData() : 
+	isotopeMassTolerance(sqrt(std::numeric_limits<float>::epsilon())),
+	isotopeMinProb(1e-10f)
+{
+}
+
+void AbundanceData::setIsotopeTolerance(float massTolerance, float minProbability)
+{
+	ASSERT(massTolerance >=0.0f && minProbability >=0.0f);
+	isotopeMassTolerance=massTolerance;
+	isotopeMinProb=minProbability;
+	isotopeDistCache.clear();
+}
+
 const char *AbundanceData::getErrorText(size_t errorCode)
 {
 	ASSERT(errorCode < ABUNDANCE_ERROR_ENUM_END);
@@ -72,6 +89,8 @@ size_t AbundanceData::open(const char *file, bool strict)
 	xmlDocPtr doc;
 	xmlParserCtxtPtr context;
 
+	isotopeDistCache.clear();
+
 	context =xmlNewParserCtxt();
 
 	if(!context)
@@ -222,127 +241,110 @@ const ISOTOPE_DATA &AbundanceData::isotope(size_t elemIdx,size_t isotopeIdx) con
 	return isotopeData[elemIdx][isotopeIdx];
 }
 
+//Sort peaks by mass, then merge runs of peaks lying within tolerance
+// of the first peak in the run, at their probability-weighted mean mass.
+// Peaks with probability below minProb are then dropped. A zero tolerance
+// merges only peaks of identical mass
+static void mergeIsotopePeaks(vector<pair<float,float> > &peaks, 
+					float tolerance, float minProb)
+{
+	std::sort(peaks.begin(),peaks.end());
+
+	size_t nOut=0;
+	for(size_t ui=0;ui<peaks.size();)
+	{
+		//Each run holds at least its first peak
+		double massSum=peaks[ui].first*(double)peaks[ui].second;
+		double probSum=peaks[ui].second;
+		size_t uj;
+		for(uj=ui+1;uj<peaks.size() && 
+			peaks[uj].first-peaks[ui].first <= tolerance;uj++)
+		{
+			massSum+=peaks[uj].first*(double)peaks[uj].second;
+			probSum+=peaks[uj].second;
+		}
+		ui=uj;
+
+		if(probSum <=0 || probSum < minProb)
+			continue;
+
+		peaks[nOut++]=make_pair((float)(massSum/probSum),(float)probSum);
+	}
+	peaks.resize(nOut);
+}
+
 void AbundanceData::generateIsotopeDist(const vector<size_t> &elementIdx,
 					const vector<size_t> &frequency,
 				vector<pair<float,float> > &massDist, size_t chargeCount) const
 {
 	ASSERT(chargeCount);
 	ASSERT(frequency.size() == elementIdx.size());
-	//Search out the given isotopes, and compute the peaks
-	// that would be seen for this isotope combination
-
-	//map of vectors for the available isotopes
-	map<unsigned int, vector< pair<float,float> > > isotopeMassDist;
-	vector<float> bulkConcentration(frequency.size());
-
-	size_t total=std::accumulate(frequency.begin(),frequency.end(),0);
 
-	for(size_t ui=0;ui<frequency.size();ui++)
-		bulkConcentration[ui]=frequency[ui]/(float)total;
-
-	//For each isotope, retrieve  its (mass,probability dist) values
-	// placing into a map
+	//Find the composition, combining repeated elements
 	//--
+	map<size_t,size_t> elementCount;
 	for(size_t ui=0;ui<elementIdx.size();ui++)
-	{
-		size_t curIso;
-		curIso = elementIdx[ui];
-
-		//If we have seen isotope before, move on
-		if(isotopeMassDist.find(curIso) != isotopeMassDist.end())
-			continue;
-
-		vector<pair<float,float> > thisIsotope;
-		for(size_t uj=0;uj<isotopeData[curIso].size();uj++)
-		{
-			//Compute the probability of this isotope's presence in
-			// the sampled concentration
-			thisIsotope.push_back(make_pair(isotopeData[curIso][uj].mass,
-				isotopeData[curIso][uj].abundance));
-		}
-
-		isotopeMassDist[curIso] = thisIsotope;
-		thisIsotope.clear();
+		elementCount[elementIdx[ui]]+=frequency[ui];
 
-	}
+	pair<vector<pair<size_t,size_t> >,size_t> key;
+	key.first.assign(elementCount.begin(),elementCount.end());
+	key.second=chargeCount;
 	//--
 
-
-	//Given the isotopes we have, permute the mass spectra
-	vector<pair<float,float> > peakProbs;
-	for(size_t ui=0;ui<elementIdx.size();ui++)
+	//Re-use the result if we have computed it before
+	map<pair<vector<pair<size_t,size_t> >,size_t>, 
+		vector<pair<float,float> > >::const_iterator cacheIt;
+	cacheIt=isotopeDistCache.find(key);
+	if(cacheIt!=isotopeDistCache.end())
 	{
+		massDist=cacheIt->second;
+		return;
+	}
 
-		for(size_t repeat=0;repeat<frequency[ui];repeat++)
+	//Build the distribution by convolving in one atom at a time. Peaks
+	// that end up at the same mass are merged after each step, so the number
+	// of peaks is bounded by the mass range over the tolerance, rather than
+	// growing as (isotopes)^(atoms)
+	vector<pair<float,float> > peakProbs,newProbs;
+	for(size_t ui=0;ui<key.first.size();ui++)
+	{
+		const vector<ISOTOPE_DATA> &iso=isotopeData[key.first[ui].first];
+		for(size_t repeat=0;repeat<key.first[ui].second;repeat++)
 		{
-			vector< pair<float,float> >::const_iterator  isoBegin,isoEnd;
-			isoBegin = isotopeMassDist[elementIdx[ui]].begin();
-			isoEnd = isotopeMassDist[elementIdx[ui]].end();
-
-			vector<pair<float,float> > newProbs;
-			//If this is the very first item in our list,
-			// simply push on the value, rather than modifying the
-			// distribution
+			//If this is the very first atom, its isotopes are the distribution 
 			if(peakProbs.empty())
 			{
-				//The masses will be added to, and the probabilities multipled	
-				for(vector<pair<float,float> >::const_iterator it=isoBegin;
-					it!=isoEnd;++it)
-					peakProbs.push_back(*it);
+				for(size_t uj=0;uj<iso.size();uj++)
+					peakProbs.push_back(make_pair(iso[uj].mass,iso[uj].abundance));
 			}
 			else
 			{
+				//The masses will be added to, and the probabilities multipled	
+				newProbs.clear();
+				newProbs.reserve(peakProbs.size()*iso.size());
 				for(size_t uj=0;uj<peakProbs.size();uj++)
 				{
-				
-					//The masses will be added to, and the probabilities multipled	
-					for(vector<pair<float,float> >::const_iterator it=isoBegin;
-						it!=isoEnd;++it)
+					for(size_t uk=0;uk<iso.size();uk++)
 					{
-						pair<float,float> newMass;
-
-						newMass.first=peakProbs[uj].first+it->first;
-						newMass.second=peakProbs[uj].second*it->second;
-						newProbs.push_back(newMass);
+						newProbs.push_back(make_pair(peakProbs[uj].first+iso[uk].mass,
+							peakProbs[uj].second*iso[uk].abundance));
 					}
-
 				}
-				
 				peakProbs.swap(newProbs);
-				newProbs.clear();
 			}
-		}
-	}
-
-
-	float tolerance=sqrt(std::numeric_limits<float>::epsilon());
 
-	vector<bool> killPeaks(peakProbs.size(),false);
-	//Find the non-unique peaks and sum them
-	for(size_t ui=0;ui<peakProbs.size();ui++)
-	{
-		for(size_t uj=ui+1;uj<peakProbs.size();uj++)
-		{
-			if(fabs(peakProbs[ui].first-peakProbs[uj].first) <tolerance &&
-				peakProbs[uj].second > 0.0f)
-			{
-
-				peakProbs[ui].second+=peakProbs[uj].second;
-				peakProbs[uj].second=0.0f;
-				killPeaks[uj]=true;
-			}
+			mergeIsotopePeaks(peakProbs,isotopeMassTolerance,isotopeMinProb);
 		}
 	}
-	
-	vectorMultiErase(peakProbs,killPeaks);
-	massDist.swap(peakProbs);
 
+	for(size_t ui=0;ui<peakProbs.size();ui++)
+		peakProbs[ui].first/=(float)chargeCount;
 
-	for(size_t ui=0;ui<massDist.size();ui++)
-	{
-		massDist[ui].first/=(float)chargeCount;
-	}
+	if(isotopeDistCache.size() >= MAX_ISOTOPE_DIST_CACHE)
+		isotopeDistCache.clear();
+	isotopeDistCache[key]=peakProbs;
 
+	massDist.swap(peakProbs);
 }
 
 
@@ -420,6 +422,79 @@ bool AbundanceData::runUnitTests(const char *tableFile)
 
 	TEST(massDist.size() == 4, "Iron has 4 isotopes");
 
+	//Check against the full product of isotopes, for Fe2O3
+	elements.push_back(massTable.symbolIndex("O"));
+	concentrations[0]=2;
+	concentrations.push_back(3);
+	massTable.generateIsotopeDist(elements,concentrations,massDist,2);
+
+	vector<pair<float,float> > bruteDist(1,make_pair(0.0f,1.0f));
+	for(size_t ui=0;ui<elements.size();ui++)
+	{
+		const vector<ISOTOPE_DATA> &iso=massTable.isotopes(elements[ui]);
+		for(size_t repeat=0;repeat<concentrations[ui];repeat++)
+		{
+			vector<pair<float,float> > newDist;
+			for(size_t uj=0;uj<bruteDist.size();uj++)
+			{
+				for(size_t uk=0;uk<iso.size();uk++)
+				{
+					newDist.push_back(make_pair(bruteDist[uj].first+iso[uk].mass,
+						bruteDist[uj].second*iso[uk].abundance));
+				}
+			}
+			bruteDist.swap(newDist);
+		}
+	}
+
+	//Every likely peak must be found at the same mass, with the same
+	// total probability
+	vector<float> peakProb(massDist.size(),0.0f);
+	for(size_t ui=0;ui<bruteDist.size();ui++)
+	{
+		if(bruteDist[ui].second < 1e-8f)
+			continue;
+
+		float mass=bruteDist[ui].first/2.0f;
+		size_t nearest=0;
+		for(size_t uj=1;uj<massDist.size();uj++)
+		{
+			if(fabs(massDist[uj].first-mass) < fabs(massDist[nearest].first-mass))
+				nearest=uj;
+		}
+		TEST(fabs(massDist[nearest].first-mass) < 0.001f,"isotope peak mass");
+		peakProb[nearest]+=bruteDist[ui].second;
+	}
+
+	float probSum=0;
+	for(size_t ui=0;ui<massDist.size();ui++)
+	{
+		TEST(fabs(peakProb[ui] - massDist[ui].second) < 1e-5f,"isotope peak probability");
+		probSum+=massDist[ui].second;
+		if(ui)
+			TEST(massDist[ui].first > massDist[ui-1].first,"isotope peak order");
+	}
+	TEST(fabs(probSum-1.0f) < 1e-4f,"isotope distribution total");
+
+	//Large molecules should not explode combinatorially
+	concentrations[0]=20;
+	concentrations[1]=30;
+	massTable.generateIsotopeDist(elements,concentrations,massDist);
+	probSum=0;
+	for(size_t ui=0;ui<massDist.size();ui++)
+		probSum+=massDist[ui].second;
+	TEST(massDist.size() && massDist.size() < 10000,"large isotope distribution");
+	TEST(fabs(probSum-1.0f) < 1e-3f,"large isotope distribution total");
+
+	//Zero tolerance only merges identical masses, so should still
+	// give iron's 4 isotopes
+	massTable.setIsotopeTolerance(0,0);
+	elements.resize(1);
+	concentrations.resize(1);
+	concentrations[0]=1;
+	massTable.generateIsotopeDist(elements,concentrations,massDist);
+	TEST(massDist.size() == 4, "Iron has 4 isotopes, zero tolerance");
+
 	massTable.checkErrors();
 
 	return true;	
@@ -21,6 +21,7 @@
 #include <vector>
 #include <string>
 #include <utility>
+#include <map>
 
 // Example
 //======
@@ -68,10 +69,22 @@ class AbundanceData
 	// this is esentially a lookup (isotope # -> atom #)
 	std::vector<size_t> atomicNumber;
 
+	//!Peaks closer in mass than this are merged in isotope distributions
+	float isotopeMassTolerance;
+	//!Peaks less probable than this are dropped from isotope distributions
+	float isotopeMinProb;
+
+	//!Isotope distributions already computed, keyed by composition
+	// ((element,count) pairs, sorted by element) and charge
+	mutable std::map<std::pair<std::vector<std::pair<size_t,size_t> >,size_t>,
+			std::vector<std::pair<float,float> > > isotopeDistCache;
+
 	//Check the abundance table for inconsistenceis
 	void checkErrors() const; 
 
 	public:
+		AbundanceData();
+
 		//!Attempt to open the abundance data file, return 0 on success
 		size_t open(const char *file, bool strict=false);	
 
@@ -89,7 +102,13 @@ class AbundanceData
 	
 		const std::vector<ISOTOPE_DATA> &isotopes(size_t offset) const { return isotopeData[offset];}
 
-		//Compute the mass-probability distribution for a set of ions
+		//!Set the mass tolerance for merging peaks, and the probability
+		// below which peaks are dropped, in generated isotope distributions
+		void setIsotopeTolerance(float massTolerance, float minProbability);
+
+		//Compute the mass-probability distribution for a set of ions.
+		// Peaks are returned in ascending mass order. Results are cached,
+		// so this is not safe to call from several threads at once
 		void generateIsotopeDist(const std::vector<size_t> &elementIdx,
 					const std::vector<size_t> &frequency,
 					std::vector<std::pair<float,float> > &massDist,size_t solutionCharge=1) const;
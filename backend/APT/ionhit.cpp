@@ -18,11 +18,18 @@
 
 
 #include "ionhit.h"
+
+#include <cstdio>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 using std::vector;
 
+//Number of ions converted at a time by each thread, when writing to file
+const size_t ION_WRITE_BLOCK_SIZE=16384;
+//Upper bound on the length of one text record, four %g values
+const size_t ION_TEXT_RECORD_MAX=128;
+
 IonAxisCompare::IonAxisCompare()
 {
 }
@@ -107,16 +114,13 @@ float IonHit::operator[](unsigned int idx) const
 unsigned int IonHit::makePos(const vector<IonHit> &ionVec, const char *filename)
 {
 	std::ofstream CFile(filename,std::ios::binary);
-	float floatBuffer[4];
 
 	if (!CFile)
 		return 1;
 
-	for (unsigned int ui=0; ui<ionVec.size(); ui++)
-	{
-		ionVec[ui].makePosData(floatBuffer);
-		CFile.write((char *)floatBuffer,4*sizeof(float));
-	}
+	if(!writeBlocks(CFile,ionVec,PosBlockFormatter()))
+		return 1;
+
 	return 0;
 }
 
@@ -133,16 +137,7 @@ unsigned int IonHit::appendFile(const vector<IonHit> &points, const char *name,
 			if(!posFile)
 				return 1;
 
-			float data[4];	
-			
-			for(unsigned int ui=0; ui< points.size(); ui++)
-			{
-				points[ui].makePosData(data);
-				posFile.write((char *)data, 4*sizeof(float));
-			}
-
-
-			if(posFile.good())
+			if(writeBlocks(posFile,points,PosBlockFormatter()))
 				return 0;
 			else
 				return 1;
@@ -153,10 +148,7 @@ unsigned int IonHit::appendFile(const vector<IonHit> &points, const char *name,
 			if(!textFile)
 				return 1;
 
-			for(unsigned int ui=0;ui<points.size();ui++)
-				textFile << points[ui][0] << " " << points[ui][1] << " " << points[ui][2]  << " " << points[ui][3] << std::endl;
-
-			if(textFile.good())
+			if(writeBlocks(textFile,points,TextBlockFormatter()))
 				return 0;
 			else
 				return 1;
@@ -166,6 +158,67 @@ unsigned int IonHit::appendFile(const vector<IonHit> &points, const char *name,
 	}
 }
 
+//Adapts an IonBlockFormatter for writeOrderedBlocks
+class IonBlockConverter
+{
+	private:
+		const vector<IonHit> &ions;
+		const IonBlockFormatter &formatter;
+	public:
+		IonBlockConverter(const vector<IonHit> &i, const IonBlockFormatter &f) :
+			ions(i), formatter(f) {}
+
+		void operator()(size_t block, vector<char> &buffer) const
+		{
+			size_t start=block*ION_WRITE_BLOCK_SIZE;
+			size_t end=std::min(start+ION_WRITE_BLOCK_SIZE,ions.size());
+			formatter.format(ions,start,end,buffer);
+		}
+};
+
+bool IonHit::writeBlocks(std::ostream &f, const vector<IonHit> &points,
+					const IonBlockFormatter &formatter)
+{
+	const size_t nBlocks=(points.size()+ION_WRITE_BLOCK_SIZE-1)/ION_WRITE_BLOCK_SIZE;
+	return writeOrderedBlocks(f,nBlocks,IonBlockConverter(points,formatter));
+}
+
+void PosBlockFormatter::format(const vector<IonHit> &ions, size_t start,
+				size_t end, vector<char> &buffer) const
+{
+	ASSERT(start < end && end <=ions.size());
+	buffer.resize((end-start)*IonHit::DATA_SIZE);
+
+	float *out = (float *)&(buffer[0]);
+	for(size_t ui=start;ui<end;ui++)
+	{
+		ions[ui].makePosData(out);
+		out+=4;
+	}
+}
+
+void TextBlockFormatter::format(const vector<IonHit> &ions, size_t start,
+				size_t end, vector<char> &buffer) const
+{
+	ASSERT(start < end && end <=ions.size());
+	buffer.resize((end-start)*ION_TEXT_RECORD_MAX);
+
+	//Blocks are formatted in worker threads, which need the C locale
+	// to get a "." decimal separator
+	ThreadCNumericLocale cLocale;
+
+	//%g matches the default formatting of a float by an ostream
+	size_t len=0;
+	for(size_t ui=start;ui<end;ui++)
+	{
+		const Point3D &p=ions[ui].getPosRef();
+		len+=snprintf(&(buffer[len]),ION_TEXT_RECORD_MAX,"%g %g %g %g\n",
+				p[0],p[1],p[2],ions[ui].getMassToCharge());
+	}
+	ASSERT(len <=buffer.size());
+	buffer.resize(len);
+}
+
 void IonHit::getPoints(const vector<IonHit> &ions, vector<Point3D> &p)
 {
 	p.resize(ions.size());
@@ -322,6 +375,67 @@ bool testIonHit()
 
 	TEST(biggerBox.contains(bc),"Check boundcube size");
 
+	//Check that block-wise export matches ion-by-ion output, 
+	// over several blocks, including a partial block
+	h.clear();
+	RandNumGen rng;
+	rng.initTimer();
+	for(size_t ui=0;ui<2*ION_WRITE_BLOCK_SIZE+17;ui++)
+	{
+		hit.setPos(Point3D(rng.genUniformDev()*100.0f-50.0f,
+			rng.genUniformDev()*100.0f-50.0f,rng.genUniformDev()*1e5f));
+		hit.setMassToCharge(rng.genUniformDev()*1e-3f);
+		h.push_back(hit);
+	}
+
+	std::string posRef,textRef;
+	{
+	std::ostringstream textStream;
+	for(size_t ui=0;ui<h.size();ui++)
+	{
+		float data[4];
+		h[ui].makePosData(data);
+		posRef.append((const char *)data,IonHit::DATA_SIZE);
+		textStream << h[ui][0] << " " << h[ui][1] << " " << h[ui][2]  << " " << h[ui][3] << std::endl;
+	}
+	textRef=textStream.str();
+	}
+
+	const char *EXPORT_FILE="test-ionexport.tmp";
+	for(unsigned int format=IONFORMAT_POS; format<=IONFORMAT_TEXT; format++)
+	{
+		std::string fileStr;
+		if(format == IONFORMAT_POS)
+		{
+			TEST(!IonHit::makePos(h,EXPORT_FILE),"pos export");
+		}
+		else
+		{
+			std::ofstream truncFile(EXPORT_FILE);
+			truncFile.close();
+			TEST(!IonHit::appendFile(h,EXPORT_FILE,format),"text export");
+		}
+
+		std::ios::openmode mode=std::ios::in;
+		if(format == IONFORMAT_POS)
+			mode|=std::ios::binary;
+		std::ifstream inFile(EXPORT_FILE,mode);
+		TEST(inFile.good(),"reopen export");
+		std::ostringstream content;
+		content << inFile.rdbuf();
+		fileStr=content.str();
+
+		if(format == IONFORMAT_POS)
+		{
+			TEST(fileStr == posRef,"pos export content");
+		}
+		else
+		{
+			TEST(fileStr == textRef,"text export content");
+		}
+	}
+	remove(EXPORT_FILE);
+
 	return true;
 }
 
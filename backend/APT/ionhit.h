@@ -21,6 +21,7 @@
 
 #include "common/basics.h"
 class Point3D;
+class IonBlockFormatter;
 
 
 //TODO: Move to member of ionHit itself
@@ -30,6 +31,8 @@ enum
 	IONFORMAT_POS=1,
 	IONFORMAT_TEXT,
 	IONFORMAT_VTK,
+	IONFORMAT_VTK_BINARY,
+	IONFORMAT_VTU,
 	IONFORMAT_ENUM_END
 };
 
@@ -89,6 +92,12 @@ class IonHit
 
 		//Save a pos file, overwriting any previous data at this location
 		static unsigned int makePos(const std::vector<IonHit> &points, const char *name);
+
+		//Write ions to a stream, converting blocks of ions to their file
+		// form in parallel. Blocks are written in order, overlapped with
+		// the conversion of later blocks. Returns false if the write failed
+		static bool writeBlocks(std::ostream &f, const std::vector<IonHit> &points,
+					const IonBlockFormatter &formatter);
 		//---
 
 		const IonHit &operator=(const IonHit &obj);
@@ -108,6 +117,34 @@ class IonAxisCompare
 			{return p1.getPos()[axis]<p2.getPos()[axis];};
 };
 
+//!Converts runs of ions into the bytes written to file, for IonHit::writeBlocks
+class IonBlockFormatter
+{
+	public:
+		virtual ~IonBlockFormatter() {};
+		//!Overwrite buffer with the file form of ions [start,end). This is
+		// called concurrently on different ranges
+		virtual void format(const std::vector<IonHit> &ions, size_t start,
+				size_t end, std::vector<char> &buffer) const=0;
+};
+
+//!POS records; x,y,z and mass-to-charge as big-endian floats
+class PosBlockFormatter : public IonBlockFormatter
+{
+	public:
+		void format(const std::vector<IonHit> &ions, size_t start,
+				size_t end, std::vector<char> &buffer) const;
+};
+
+//!Text records; x,y,z and mass-to-charge separated by spaces, one ion per
+// line. The C numeric locale must be active while formatting
+class TextBlockFormatter : public IonBlockFormatter
+{
+	public:
+		void format(const std::vector<IonHit> &ions, size_t start,
+				size_t end, std::vector<char> &buffer) const;
+};
+
 #ifdef DEBUG
 //unit testing
 bool testIonHit();
@@ -20,6 +20,13 @@
 #include "vtk.h"
 
 #include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#include "common/endianTest.h"
 
 using std::endl;
 using std::vector;
@@ -27,126 +34,471 @@ using std::string;
 using std::cerr;
 
 
-//Adapted with permission (2016) from mVTK, by
-// guillaume flandin
-unsigned int vtk_write_legacy(const std::string &filename, unsigned int format,
-		const std::vector<IonHit> &ions)
-{
+//Upper bound on the length of one VTK ASCII ion record, three %g values
+const size_t VTK_ASCII_RECORD_MAX=96;
 
-	std::ofstream f;
+//!ASCII VTK records for IonHit::writeBlocks; either the ion positions,
+// or the mass-to-charge values, one ion per line
+class VTKAsciiBlockFormatter : public IonBlockFormatter
+{
+	private:
+		bool positions;
+	public:
+		VTKAsciiBlockFormatter(bool writePositions) : positions(writePositions) {}
+
+		void format(const vector<IonHit> &ions, size_t start,
+				size_t end, vector<char> &buffer) const
+		{
+			buffer.resize((end-start)*VTK_ASCII_RECORD_MAX);
+
+			//Blocks are formatted in worker threads, which need
+			// the C locale to get a "." decimal separator
+			ThreadCNumericLocale cLocale;
+
+			size_t len=0;
+			for(size_t ui=start;ui<end;ui++)
+			{
+				if(positions)
+				{
+					const Point3D &p=ions[ui].getPosRef();
+					len+=snprintf(&(buffer[len]),VTK_ASCII_RECORD_MAX,
+							"%g %g %g\n",p[0],p[1],p[2]);
+				}
+				else
+				{
+					len+=snprintf(&(buffer[len]),VTK_ASCII_RECORD_MAX,
+							"%g\n",ions[ui].getMassToCharge());
+				}
+			}
+			buffer.resize(len);
+		}
+};
+
+//Number of tuples converted at a time by each thread, when writing arrays
+const size_t VTK_BLOCK_TUPLES=16384;
+//Width of the offset attributes, which are filled in after the data is written
+const unsigned int VTK_OFFSET_DIGITS=20;
+
+//!Array source for ion positions, as x,y,z float triples
+class IonPositionSource : public VTKArraySource
+{
+	private:
+		const vector<IonHit> &ions;
+	public:
+		IonPositionSource(const vector<IonHit> &i) : ions(i) {}
+		size_t size() const { return ions.size();}
+		size_t componentBytes() const { return sizeof(float);}
+		size_t numComponents() const { return 3;}
+		void format(size_t start, size_t end, vector<char> &buffer) const
+		{
+			buffer.resize((end-start)*3*sizeof(float));
+			float *out=(float*)&(buffer[0]);
+			for(size_t ui=start;ui<end;ui++)
+			{
+				const Point3D &p=ions[ui].getPosRef();
+				*out++=p[0];
+				*out++=p[1];
+				*out++=p[2];
+			}
+		}
+};
+
+//!Array source for ion mass-to-charge values
+class IonMassSource : public VTKArraySource
+{
+	private:
+		const vector<IonHit> &ions;
+	public:
+		IonMassSource(const vector<IonHit> &i) : ions(i) {}
+		size_t size() const { return ions.size();}
+		size_t componentBytes() const { return sizeof(float);}
+		void format(size_t start, size_t end, vector<char> &buffer) const
+		{
+			buffer.resize((end-start)*sizeof(float));
+			float *out=(float*)&(buffer[0]);
+			for(size_t ui=start;ui<end;ui++)
+				out[ui-start]=ions[ui].getMassToCharge();
+		}
+};
+
+//!Array source for points, as x,y,z float triples
+class PointArraySource : public VTKArraySource
+{
+	private:
+		const vector<Point3D> &pts;
+	public:
+		PointArraySource(const vector<Point3D> &p) : pts(p) {}
+		size_t size() const { return pts.size();}
+		size_t componentBytes() const { return sizeof(float);}
+		size_t numComponents() const { return 3;}
+		void format(size_t start, size_t end, vector<char> &buffer) const
+		{
+			buffer.resize((end-start)*3*sizeof(float));
+			float *out=(float*)&(buffer[0]);
+			for(size_t ui=start;ui<end;ui++)
+			{
+				*out++=pts[ui][0];
+				*out++=pts[ui][1];
+				*out++=pts[ui][2];
+			}
+		}
+};
+
+//Converts blocks of an array source for writeOrderedBlocks, either as
+// they are, or byte swapped to big-endian
+class ArrayBlockConverter
+{
+	private:
+		const VTKArraySource &src;
+		bool bigEndian;
+	public:
+		ArrayBlockConverter(const VTKArraySource &s, bool toBigEndian) :
+			src(s), bigEndian(toBigEndian) {}
+
+		void operator()(size_t block, vector<char> &buffer) const
+		{
+			size_t start=block*VTK_BLOCK_TUPLES;
+			size_t end=std::min(start+VTK_BLOCK_TUPLES,src.size());
+			src.format(start,end,buffer);
+
+			if(bigEndian && is_littleendian())
+			{
+				const size_t width=src.componentBytes();
+				for(size_t ui=0;ui<buffer.size();ui+=width)
+					std::reverse(buffer.begin()+ui,buffer.begin()+ui+width);
+			}
+		}
+};
+
+//Converts blocks of an array source into zlib streams, for writeOrderedBlocks 
+class ZlibBlockConverter
+{
+	private:
+		const VTKArraySource &src;
+		ATOMIC_BOOL *failed;
+	public:
+		ZlibBlockConverter(const VTKArraySource &s, ATOMIC_BOOL *failFlag) :
+			src(s), failed(failFlag) {}
+
+		void operator()(size_t block, vector<char> &buffer) const
+		{
+			size_t start=block*VTK_BLOCK_TUPLES;
+			size_t end=std::min(start+VTK_BLOCK_TUPLES,src.size());
+
+			vector<char> raw;
+			src.format(start,end,raw);
+
+			uLongf compressedLen=compressBound(raw.size());
+			buffer.resize(compressedLen);
+			if(compress2((Bytef*)&(buffer[0]),&compressedLen,
+				(const Bytef*)&(raw[0]),raw.size(),Z_BEST_SPEED) != Z_OK)
+			{
+				*failed=true;
+				compressedLen=0;
+			}
+			buffer.resize(compressedLen);
+		}
+};
+
+bool vtk_write_legacy_binary_array(std::ostream &f, const VTKArraySource &src)
+{
+	const size_t nBlocks=(src.size()+VTK_BLOCK_TUPLES-1)/VTK_BLOCK_TUPLES;
+	return writeOrderedBlocks(f,nBlocks,ArrayBlockConverter(src,true));
+}
 
-	if(format != VTK_ASCII)
-	{
-		cerr << "Binary mode is not implemented"
-			<< endl;
+VTKAppendedData::VTKAppendedData(std::ostream &outFile, unsigned int enc) : 
+	f(outFile), encoding(enc), nWritten(0)
+{
+	ASSERT(encoding < VTK_XML_ENUM_END);
+}
 
-		return VTK_ERR_NOT_IMPLEMENTED;
-	}
+std::string VTKAppendedData::fileAttributes() const
+{
+	std::string s;
+	if(is_littleendian())
+		s="byte_order=\"LittleEndian\"";
+	else
+		s="byte_order=\"BigEndian\"";
 
-	f.open(filename.c_str());
+	s+=" header_type=\"UInt64\"";
+	if(encoding == VTK_XML_ZLIB)
+		s+=" compressor=\"vtkZLibDataCompressor\"";
 
-	if(!f)
-		return VTK_ERR_FILE_OPEN_FAIL;
-		
+	return s;
+}
 
+void VTKAppendedData::writeOffset()
+{
+	f << "offset=\"";
+	offsetPos.push_back(f.tellp());
+	f << string(VTK_OFFSET_DIGITS,'0') << "\" ";
+}
 
-	f << "# vtk DataFile Version 2.0\n";
-	f << "Saved using AtomProbe Tools\n";
-	f << "ASCII\n\n";
+void VTKAppendedData::beginData()
+{
+	f << "  <AppendedData encoding=\"raw\">\n   _";
+	dataStart=f.tellp();
+}
 
-	f << "DATASET UNSTRUCTURED_GRID\n";
-	f << "POINTS " << ions.size() << " float\n";
-	//Write ion data which is the support points for later scalar data
-	for(unsigned int ui=0;ui<ions.size(); ui++)
+bool VTKAppendedData::writeArray(const VTKArraySource &src)
+{
+	ASSERT(nWritten < offsetPos.size());
+
+	//Fill in the offset for this array
+	std::streampos arrayStart=f.tellp();
+	std::ostringstream offsetStr;
+	offsetStr.width(VTK_OFFSET_DIGITS);
+	offsetStr.fill('0');
+	offsetStr << (unsigned long long)(arrayStart-dataStart);
+	f.seekp(offsetPos[nWritten]);
+	f << offsetStr.str();
+	f.seekp(arrayStart);
+	nWritten++;
+
+	const size_t nBlocks=(src.size()+VTK_BLOCK_TUPLES-1)/VTK_BLOCK_TUPLES;
+	const size_t tupleBytes=src.componentBytes()*src.numComponents();
+	if(encoding == VTK_XML_RAW)
 	{
-		f << ions[ui][0] << " " << ions[ui][1] << " "<< 
-			ions[ui][2] << "\n";
-	}	
+		uint64_t nBytes=src.size()*tupleBytes;
+		f.write((const char*)&nBytes,sizeof(nBytes));
+		return writeOrderedBlocks(f,nBlocks,ArrayBlockConverter(src,false));
+	}
 
-	f << "POINT_DATA " << ions.size() << endl;
+	//Compressed arrays have a header of the block count, the
+	// uncompressed block size, the size of the final block if partial, 
+	// and the compressed size of each block. Reserve space for it,
+	// then fill it in once the block sizes are known
+	vector<uint64_t> header(3+nBlocks,0);
+	f.write((const char*)&(header[0]),header.size()*sizeof(uint64_t));
+
+	ATOMIC_BOOL failed;
+	failed=false;
+	vector<size_t> blockSizes;
+	if(!writeOrderedBlocks(f,nBlocks,ZlibBlockConverter(src,&failed),&blockSizes) || failed)
+		return false;
+
+	header[0]=nBlocks;
+	header[1]=VTK_BLOCK_TUPLES*tupleBytes;
+	header[2]=(src.size()%VTK_BLOCK_TUPLES)*tupleBytes;
+	for(size_t ui=0;ui<nBlocks;ui++)
+		header[3+ui]=blockSizes[ui];
+
+	std::streampos arrayEnd=f.tellp();
+	f.seekp(arrayStart);
+	f.write((const char*)&(header[0]),header.size()*sizeof(uint64_t));
+	f.seekp(arrayEnd);
+
+	return f.good();
+}
 
-	f << "SCALARS masstocharge float\n"; 
-	f << "LOOKUP_TABLE default\n";
+bool VTKAppendedData::finish()
+{
+	ASSERT(nWritten == offsetPos.size());
+	f << "\n  </AppendedData>\n</VTKFile>\n";
+	return f.good();
+}
 
-	for(unsigned int ui=0;ui<ions.size(); ui++)
-	{
-		f << ions[ui].getMassToCharge() << "\n";
-	}
+void vtk_write_xml_header(std::ostream &f, const char *dataType,
+		const VTKAppendedData &appended, const std::string &datasetAttributes)
+{
+	f << "<?xml version=\"1.0\"?>\n";
+	f << "<VTKFile type=\"" << dataType << "\" version=\"1.0\" " 
+		<< appended.fileAttributes() << ">\n";
+	f << "  <" << dataType;
+	if(datasetAttributes.size())
+		f << " " << datasetAttributes;
+	f << ">\n";
+}
+
+//Write points, with one scalar value each, as a .vtu file with no cells,
+// in the same way as the legacy ion writer
+static unsigned int vtk_write_xml_points(const std::string &filename, unsigned int encoding,
+		const VTKArraySource &pts, const VTKArraySource &values,
+		const std::string &valueName)
+{
+	ASSERT(pts.size() == values.size());
+	if(encoding >= VTK_XML_ENUM_END)
+		return VTK_ERR_NOT_IMPLEMENTED;
+
+	std::ofstream f(filename.c_str(),std::ios::binary);
+	if(!f)
+		return VTK_ERR_FILE_OPEN_FAIL;
 
+	VTKAppendedData appended(f,encoding);
+	vtk_write_xml_header(f,"UnstructuredGrid",appended,"");
+	f << "    <Piece NumberOfPoints=\"" << pts.size() << "\" NumberOfCells=\"0\">\n";
+	f << "      <PointData Scalars=\"" << valueName << "\">\n";
+	f << "        <DataArray type=\"Float32\" Name=\"" << valueName << "\" format=\"appended\" ";
+	appended.writeOffset();
+	f << "/>\n";
+	f << "      </PointData>\n";
+	f << "      <Points>\n";
+	f << "        <DataArray type=\"Float32\" NumberOfComponents=\"3\" format=\"appended\" ";
+	appended.writeOffset();
+	f << "/>\n";
+	f << "      </Points>\n";
+	f << "      <Cells>\n";
+	f << "        <DataArray type=\"Int64\" Name=\"connectivity\" format=\"ascii\"></DataArray>\n";
+	f << "        <DataArray type=\"Int64\" Name=\"offsets\" format=\"ascii\"></DataArray>\n";
+	f << "        <DataArray type=\"UInt8\" Name=\"types\" format=\"ascii\"></DataArray>\n";
+	f << "      </Cells>\n";
+	f << "    </Piece>\n";
+	f << "  </UnstructuredGrid>\n";
+
+	appended.beginData();
+	if(!appended.writeArray(values) || !appended.writeArray(pts))
+		return VTK_ERR_FILE_WRITE_FAIL;
+	if(!appended.finish())
+		return VTK_ERR_FILE_WRITE_FAIL;
 
 	return 0;
 }
 
-//TODO: This is a template function, we will need to move it to the header
-template<class T>
-unsigned int vtk_write_legacy(const std::string &filename, unsigned int format,
-
-		const Voxels<T> &vox)
+unsigned int vtk_write_xml(const std::string &filename, 
+	unsigned int encoding, const std::vector<IonHit> &ions)
 {
+	return vtk_write_xml_points(filename,encoding,IonPositionSource(ions),
+					IonMassSource(ions),"masstocharge");
+}
 
-	std::ofstream f;
-
-	if(format != VTK_ASCII)
-	{
-		cerr << "Binary mode is not implemented"
-			<< endl;
+unsigned int vtk_write_xml(const std::string &filename, unsigned int encoding,
+	const std::vector<Point3D> &pts, const std::vector<float> &values,
+	const std::string &valueName)
+{
+	return vtk_write_xml_points(filename,encoding,PointArraySource(pts),
+				VectorArraySource<float>(values),valueName);
+}
 
+//Adapted with permission (2016) from mVTK, by
+// guillaume flandin
+unsigned int vtk_write_legacy(const std::string &filename, unsigned int format,
+		const std::vector<IonHit> &ions)
+{
+	if(format >= VTK_FORMAT_ENUM_END)
 		return VTK_ERR_NOT_IMPLEMENTED;
-	}
 
-	f.open(filename.c_str());
+	std::ofstream f;
+	if(format == VTK_BINARY)
+		f.open(filename.c_str(),std::ios::binary);
+	else
+		f.open(filename.c_str());
 
 	if(!f)
 		return VTK_ERR_FILE_OPEN_FAIL;
 		
 
 
-	f << "# vtk DataFile Version 3.0\n";
+	f << "# vtk DataFile Version 2.0\n";
 	f << "Saved using AtomProbe Tools\n";
-	f << "ASCII\n\n";
-
-	size_t nx,ny,nz;
-	vox.getSize(nx,ny,nz);
-	f << "DATASET RECTILINEAR_GRID\n";
-	f << "DIMENSIONS " << nx << " " << ny << " " << nz << endl;
+	if(format == VTK_BINARY)
+		f << "BINARY\n\n";
+	else
+		f << "ASCII\n\n";
 
+	f << "DATASET UNSTRUCTURED_GRID\n";
+	f << "POINTS " << ions.size() << " float\n";
 
-	f << "X_COORDINATES " << nx << " float" << endl;
-	for(unsigned int ui=0;ui<nx;ui++)
-	{
-		f << vox.getPoint((nx-1)-ui,0,0)[0] << " ";
-	}
-	f << endl; 
-	
-	f << "Y_COORDINATES " << ny << " float" << endl;
-	for(unsigned int ui=0;ui<ny;ui++)
+	bool ok;
+	if(format == VTK_BINARY)
 	{
-		f << vox.getPoint(0,ui,0)[1] << " ";
+		ok=vtk_write_legacy_binary_array(f,IonPositionSource(ions));
+		f << "\n";
+		f << "POINT_DATA " << ions.size() << endl;
+		f << "SCALARS masstocharge float\n"; 
+		f << "LOOKUP_TABLE default\n";
+		ok = ok && vtk_write_legacy_binary_array(f,IonMassSource(ions));
+		f << "\n";
 	}
-	f << endl; 
-	
-	f << "Z_COORDINATES " << nz << " float" << endl;
-	for(unsigned int ui=0;ui<nz;ui++)
+	else
 	{
-		f << vox.getPoint(0,0,ui)[2] << " ";
-	}
-	f << endl; 
-	
+		//Write ion data which is the support points for later scalar data
+		ok=IonHit::writeBlocks(f,ions,VTKAsciiBlockFormatter(true));
 
-	f << "POINT_DATA " << vox.size() << endl;
-	f << "SCALARS masstocharge float\n"; 
-	f << "LOOKUP_TABLE default\n";
+		f << "POINT_DATA " << ions.size() << endl;
 
-	for(unsigned int ui=0;ui<vox.size(); ui++)
-	{
-		f << vox.getData(ui)<< "\n";
+		f << "SCALARS masstocharge float\n"; 
+		f << "LOOKUP_TABLE default\n";
+
+		ok = ok && IonHit::writeBlocks(f,ions,VTKAsciiBlockFormatter(false));
 	}
+
+	if(!ok || !f.good())
+		return VTK_ERR_FILE_WRITE_FAIL;
+
 	return 0;
 }
 
 
 #ifdef DEBUG
 
+//Read a whole file into a string
+static bool readWholeFile(const char *filename, std::string &content)
+{
+	std::ifstream f(filename,std::ios::binary);
+	if(!f)
+		return false;
+	std::ostringstream ss;
+	ss << f.rdbuf();
+	content=ss.str();
+	return true;
+}
+
+//Extract the given appended array from the contents of a VTK XML
+// file written by VTKAppendedData, decompressing as needed
+static bool readAppendedArray(const std::string &file, unsigned int arrayNum,
+			std::string &data)
+{
+	size_t attribPos=0;
+	for(unsigned int ui=0;ui<=arrayNum;ui++)
+	{
+		attribPos=file.find("offset=\"",attribPos);
+		if(attribPos == string::npos)
+			return false;
+		attribPos+=8;
+	}
+	unsigned long long offset;
+	std::istringstream offsetStr(file.substr(attribPos,VTK_OFFSET_DIGITS));
+	if(!(offsetStr >> offset))
+		return false;
+
+	size_t pos=file.find('_',file.find("<AppendedData"));
+	if(pos == string::npos)
+		return false;
+	pos+=1+offset;
+
+	uint64_t value;
+	if(file.find("vtkZLibDataCompressor") == string::npos)
+	{
+		memcpy(&value,file.data()+pos,sizeof(value));
+		if(pos+sizeof(value)+value > file.size())
+			return false;
+		data=file.substr(pos+sizeof(value),value);
+		return true;
+	}
+
+	vector<uint64_t> header(3);
+	memcpy(&(header[0]),file.data()+pos,3*sizeof(uint64_t));
+	header.resize(3+header[0]);
+	memcpy(&(header[0]),file.data()+pos,header.size()*sizeof(uint64_t));
+	pos+=header.size()*sizeof(uint64_t);
+
+	data.clear();
+	for(size_t ui=0;ui<header[0];ui++)
+	{
+		uLongf blockLen=header[1];
+		if(ui+1 == header[0] && header[2])
+			blockLen=header[2];
+
+		vector<char> block(blockLen);
+		if(uncompress((Bytef*)&(block[0]),&blockLen,
+			(const Bytef*)file.data()+pos,header[3+ui]) != Z_OK)
+			return false;
+		data.append(&(block[0]),blockLen);
+		pos+=header[3+ui];
+	}
+	return true;
+}
+
 bool testVTKExport()
 {
 	vector<IonHit> ions;
@@ -169,6 +521,114 @@ bool testVTKExport()
 
 	vtk_write_legacy("debug-vox.vtk",VTK_ASCII,v);
 
+	//Check the binary and XML ion writers, over several blocks
+	//--
+	RandNumGen rng;
+	rng.initTimer();
+	ions.clear();
+	for(size_t ui=0;ui<2*VTK_BLOCK_TUPLES+5;ui++)
+	{
+		ions.push_back(IonHit(Point3D(rng.genUniformDev(),rng.genUniformDev(),
+			rng.genUniformDev()*100.0f),rng.genUniformDev()*100.0f));
+	}
+
+	const char *ION_FILES[] = { "debug-ions-ascii.vtk", "debug-ions-binary.vtk",
+					"debug-ions-raw.vtu", "debug-ions-zlib.vtu"};
+	TEST(!vtk_write_legacy(ION_FILES[0],VTK_ASCII,ions),"ASCII ion write");
+	TEST(!vtk_write_legacy(ION_FILES[1],VTK_BINARY,ions),"binary ion write");
+	TEST(!vtk_write_xml(ION_FILES[2],VTK_XML_RAW,ions),"raw XML ion write");
+	TEST(!vtk_write_xml(ION_FILES[3],VTK_XML_ZLIB,ions),"zlib XML ion write");
+
+	std::string ionContent[4];
+	for(unsigned int ui=0;ui<4;ui++)
+	{
+		TEST(readWholeFile(ION_FILES[ui],ionContent[ui]),"ion file read");
+		remove(ION_FILES[ui]);
+	}
+
+	//Binary legacy has 16 bytes per ion, ASCII needs more for the same precision
+	TEST(ionContent[1].size() < ionContent[0].size(),"binary smaller than ASCII");
+	TEST(ionContent[2].size() >= ions.size()*16,"raw XML size"); 
+
+	//Legacy binary points are big-endian floats, after the POINTS line
+	const std::string &binary=ionContent[1];
+	size_t pos=binary.find("float\n");
+	TEST(pos != string::npos,"binary POINTS line");
+	pos+=6;
+	TEST(binary.size() >= pos+ions.size()*3*sizeof(float),"binary ion size");
+
+	std::string xmlPts,xmlMass,zlibPts,zlibMass;
+	TEST(readAppendedArray(ionContent[2],0,xmlMass),"raw mass array");
+	TEST(readAppendedArray(ionContent[2],1,xmlPts),"raw point array");
+	TEST(readAppendedArray(ionContent[3],0,zlibMass),"zlib mass array");
+	TEST(readAppendedArray(ionContent[3],1,zlibPts),"zlib point array");
+	TEST(xmlPts.size() == ions.size()*3*sizeof(float),"point array size");
+	TEST(xmlMass.size() == ions.size()*sizeof(float),"mass array size");
+	TEST(xmlPts == zlibPts && xmlMass == zlibMass,"zlib round trip");
+
+	for(size_t ui=0;ui<ions.size();ui++)
+	{
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			float fBinary,fXML;
+			memcpy(&fBinary,binary.data()+pos+(3*ui+uj)*sizeof(float),sizeof(float));
+			if(is_littleendian())
+				floatSwapBytes(&fBinary);
+			memcpy(&fXML,xmlPts.data()+(3*ui+uj)*sizeof(float),sizeof(float));
+
+			TEST(fBinary == ions[ui][uj],"binary ion position");
+			TEST(fXML == ions[ui][uj],"XML ion position");
+		}
+		float fMass;
+		memcpy(&fMass,xmlMass.data()+ui*sizeof(float),sizeof(float));
+		TEST(fMass == ions[ui].getMassToCharge(),"XML ion mass");
+	}
+	//--
+
+	//Check the binary and XML voxel writers. A small
+	// blob in an empty grid should compress well
+	//--
+	v.resize(32,32,32);
+	v.fill(0);
+	for(size_t ui=12;ui<20;ui++)
+	{
+		for(size_t uj=12;uj<20;uj++)
+		{
+			for(size_t uk=12;uk<20;uk++)
+				v.setData(ui,uj,uk,ui+uj*uk);
+		}
+	}
+
+	const char *VOX_FILES[] = { "debug-vox-ascii.vtk", "debug-vox-binary.vtk",
+					"debug-vox-raw.vti", "debug-vox-zlib.vti"};
+	TEST(!vtk_write_legacy(VOX_FILES[0],VTK_ASCII,v),"ASCII voxel write");
+	TEST(!vtk_write_legacy(VOX_FILES[1],VTK_BINARY,v),"binary voxel write");
+	TEST(!vtk_write_xml(VOX_FILES[2],VTK_XML_RAW,v),"raw XML voxel write");
+	TEST(!vtk_write_xml(VOX_FILES[3],VTK_XML_ZLIB,v),"zlib XML voxel write");
+
+	std::string voxContent[4];
+	for(unsigned int ui=0;ui<4;ui++)
+	{
+		TEST(readWholeFile(VOX_FILES[ui],voxContent[ui]),"voxel file read");
+		remove(VOX_FILES[ui]);
+	}
+
+	TEST(voxContent[1].size() >= v.size()*sizeof(float),"binary voxel size");
+	TEST(voxContent[3].size() < voxContent[2].size()/10,"zlib compresses voxels");
+
+	std::string xmlVox,zlibVox;
+	TEST(readAppendedArray(voxContent[2],0,xmlVox),"raw voxel array");
+	TEST(readAppendedArray(voxContent[3],0,zlibVox),"zlib voxel array");
+	TEST(xmlVox.size() == v.size()*sizeof(float),"voxel array size");
+	TEST(xmlVox == zlibVox,"zlib voxel round trip");
+	for(size_t ui=0;ui<v.size();ui++)
+	{
+		float f;
+		memcpy(&f,xmlVox.data()+ui*sizeof(float),sizeof(float));
+		TEST(f == v.getData(ui),"XML voxel value");
+	}
+	//--
+
 	return true;	
 }
 
@@ -20,6 +20,9 @@
 
 #include <vector>
 #include <string>
+#include <fstream>
+#include <sstream>
+#include <cstring>
 
 #include "ionhit.h"
 #include "common/voxels.h"
@@ -28,6 +31,7 @@ enum
 {
 	VTK_ERR_FILE_OPEN_FAIL=1,
 	VTK_ERR_NOT_IMPLEMENTED,
+	VTK_ERR_FILE_WRITE_FAIL,
 	VTK_ERR_ENUM_END
 };
 
@@ -38,17 +42,262 @@ enum
 	VTK_FORMAT_ENUM_END
 };
 
-//write ions to a VTK (paraview compatible) file. 
-// FIXME : This currenly only supports ASCII mode. 
-//	Need binary mode because of the large files we have
+//!Encodings for the appended data of VTK XML files
+enum
+{
+	VTK_XML_RAW,
+	VTK_XML_ZLIB,
+	VTK_XML_ENUM_END
+};
+
+//!Names of VTK scalar types, for the types that can be written
+template<class T> struct VTKTypeInfo;
+template<> struct VTKTypeInfo<float> { static const char *legacyName() { return "float";} static const char *xmlName() { return "Float32";} };
+template<> struct VTKTypeInfo<double> { static const char *legacyName() { return "double";} static const char *xmlName() { return "Float64";} };
+template<> struct VTKTypeInfo<char> { static const char *legacyName() { return "char";} static const char *xmlName() { return "Int8";} };
+template<> struct VTKTypeInfo<unsigned char> { static const char *legacyName() { return "unsigned_char";} static const char *xmlName() { return "UInt8";} };
+template<> struct VTKTypeInfo<short> { static const char *legacyName() { return "short";} static const char *xmlName() { return "Int16";} };
+template<> struct VTKTypeInfo<unsigned short> { static const char *legacyName() { return "unsigned_short";} static const char *xmlName() { return "UInt16";} };
+template<> struct VTKTypeInfo<int> { static const char *legacyName() { return "int";} static const char *xmlName() { return "Int32";} };
+template<> struct VTKTypeInfo<unsigned int> { static const char *legacyName() { return "unsigned_int";} static const char *xmlName() { return "UInt32";} };
+
+//!A data array to be written to a VTK file, supplied in blocks of tuples
+class VTKArraySource
+{
+	public:
+		virtual ~VTKArraySource() {};
+		//!Number of tuples in the array
+		virtual size_t size() const=0;
+		//!Size of one scalar component, in bytes 
+		virtual size_t componentBytes() const=0;
+		//!Number of components in each tuple
+		virtual size_t numComponents() const { return 1;}
+		//!Overwrite buffer with the native-endian bytes of tuples
+		// [start,end). This is called concurrently on different ranges
+		virtual void format(size_t start, size_t end, std::vector<char> &buffer) const=0;
+};
+
+//!Array source for the values of a voxel grid, in x-fastest order
+template<class T>
+class VoxelArraySource : public VTKArraySource
+{
+	private:
+		const Voxels<T> &vox;
+	public:
+		VoxelArraySource(const Voxels<T> &v) : vox(v) {}
+		size_t size() const { return vox.size();}
+		size_t componentBytes() const { return sizeof(T);}
+		void format(size_t start, size_t end, std::vector<char> &buffer) const
+		{
+			buffer.resize((end-start)*sizeof(T));
+			T *out=(T*)&(buffer[0]);
+			for(size_t ui=start;ui<end;ui++)
+				out[ui-start]=vox.getData(ui);
+		}
+};
+
+//!Array source for a vector of values
+template<class T>
+class VectorArraySource : public VTKArraySource
+{
+	private:
+		const std::vector<T> &values;
+	public:
+		VectorArraySource(const std::vector<T> &v) : values(v) {}
+		size_t size() const { return values.size();}
+		size_t componentBytes() const { return sizeof(T);}
+		void format(size_t start, size_t end, std::vector<char> &buffer) const
+		{
+			buffer.resize((end-start)*sizeof(T));
+			memcpy(&(buffer[0]),&(values[start]),(end-start)*sizeof(T));
+		}
+};
+
+//!Write an array to a legacy binary VTK file, in big-endian order
+bool vtk_write_legacy_binary_array(std::ostream &f, const VTKArraySource &src);
+
+//!Writes the data arrays of a VTK XML file to its appended data section.
+/*! Usage is to call writeOffset() inside each DataArray tag, as the XML
+ * is written, then beginData(), then writeArray() for each array in the
+ * same order, then finish(). Offsets and compression headers are filled
+ * in by seeking back, so the stream must be seekable
+ */
+class VTKAppendedData
+{
+	private:
+		std::ostream &f;
+		unsigned int encoding;
+		//!File positions of the offset attributes, still to be filled
+		std::vector<std::streampos> offsetPos;
+		//!Number of arrays written so far
+		size_t nWritten;
+		//!Position of the first byte of data
+		std::streampos dataStart;
+	public:
+		VTKAppendedData(std::ostream &f, unsigned int encoding);
+
+		//!The attributes for the VTKFile tag that describe the encoding
+		std::string fileAttributes() const;
+		//!Write the offset attribute for the next DataArray
+		void writeOffset();
+		//!Start the appended data section
+		void beginData();
+		//!Write the next array. Returns false on write failure
+		bool writeArray(const VTKArraySource &src);
+		//!Close the appended data section and the file tag
+		bool finish();
+};
+
+//write ions to a legacy VTK (paraview compatible) file, in ASCII or binary form
 unsigned int vtk_write_legacy(const std::string &filename, 
 	unsigned int format, const std::vector<IonHit> &ions);
 
-unsigned int vtk_write_legacy(const std::string &filename, 
-	unsigned int format, const Voxels<class T> &vox);
+//write voxels to a legacy VTK file, as a rectilinear grid, in ASCII or binary form
+template<class T>
+unsigned int vtk_write_legacy(const std::string &filename, unsigned int format,
+		const Voxels<T> &vox)
+{
+	if(format >= VTK_FORMAT_ENUM_END)
+		return VTK_ERR_NOT_IMPLEMENTED;
+
+	std::ofstream f;
+	if(format == VTK_BINARY)
+		f.open(filename.c_str(),std::ios::binary);
+	else
+		f.open(filename.c_str());
+
+	if(!f)
+		return VTK_ERR_FILE_OPEN_FAIL;
+		
+
+
+	f << "# vtk DataFile Version 3.0\n";
+	f << "Saved using AtomProbe Tools\n";
+	if(format == VTK_BINARY)
+		f << "BINARY\n\n";
+	else
+		f << "ASCII\n\n";
+
+	size_t n[3];
+	vox.getSize(n[0],n[1],n[2]);
+	f << "DATASET RECTILINEAR_GRID\n";
+	f << "DIMENSIONS " << n[0] << " " << n[1] << " " << n[2] << std::endl;
+
+	const char *AXIS_NAMES[3] = {"X_COORDINATES","Y_COORDINATES","Z_COORDINATES"};
+	for(unsigned int axis=0;axis<3;axis++)
+	{
+		std::vector<float> coords(n[axis]);
+		for(size_t ui=0;ui<n[axis];ui++)
+		{
+			switch(axis)
+			{
+				case 0:
+					coords[ui]=vox.getPoint((n[0]-1)-ui,0,0)[0];
+					break;
+				case 1:
+					coords[ui]=vox.getPoint(0,ui,0)[1];
+					break;
+				case 2:
+					coords[ui]=vox.getPoint(0,0,ui)[2];
+					break;
+			}
+		}
+
+		f << AXIS_NAMES[axis] << " " << n[axis] << " float" << std::endl;
+		if(format == VTK_BINARY)
+			vtk_write_legacy_binary_array(f,VectorArraySource<float>(coords));
+		else
+		{
+			for(size_t ui=0;ui<n[axis];ui++)
+				f << coords[ui] << " ";
+		}
+		f << std::endl; 
+	}
+
+	f << "POINT_DATA " << vox.size() << std::endl;
+	if(format == VTK_BINARY)
+	{
+		f << "SCALARS masstocharge " << VTKTypeInfo<T>::legacyName() << "\n"; 
+		f << "LOOKUP_TABLE default\n";
+		if(!vtk_write_legacy_binary_array(f,VoxelArraySource<T>(vox)))
+			return VTK_ERR_FILE_WRITE_FAIL;
+	}
+	else
+	{
+		f << "SCALARS masstocharge float\n"; 
+		f << "LOOKUP_TABLE default\n";
+
+		for(size_t ui=0;ui<vox.size(); ui++)
+		{
+			f << vox.getData(ui)<< "\n";
+		}
+	}
+
+	if(!f.good())
+		return VTK_ERR_FILE_WRITE_FAIL;
+	return 0;
+}
+
+//write ions to a VTK XML unstructured grid (.vtu) file, with the
+// data appended raw or zlib compressed (VTK_XML_ enum)
+unsigned int vtk_write_xml(const std::string &filename, 
+	unsigned int encoding, const std::vector<IonHit> &ions);
+
+//write points with one value each to a VTK XML unstructured grid (.vtu),
+// e.g. the active voxels of a sparse grid
+unsigned int vtk_write_xml(const std::string &filename, unsigned int encoding,
+	const std::vector<Point3D> &pts, const std::vector<float> &values,
+	const std::string &valueName);
+
+//Write the start of a VTK XML file, up to and including the dataset tag
+void vtk_write_xml_header(std::ostream &f, const char *dataType,
+		const VTKAppendedData &appended, const std::string &datasetAttributes);
+
+//write voxels to a VTK XML image data (.vti) file, with the
+// data appended raw or zlib compressed (VTK_XML_ enum)
+template<class T>
+unsigned int vtk_write_xml(const std::string &filename, unsigned int encoding,
+		const Voxels<T> &vox)
+{
+	if(encoding >= VTK_XML_ENUM_END)
+		return VTK_ERR_NOT_IMPLEMENTED;
+
+	std::ofstream f(filename.c_str(),std::ios::binary);
+	if(!f)
+		return VTK_ERR_FILE_OPEN_FAIL;
+
+	size_t n[3];
+	vox.getSize(n[0],n[1],n[2]);
+	Point3D origin=vox.getMinBounds();
+	Point3D pitch=vox.getPitch();
+
+	std::ostringstream extent,attribs;
+	extent << "0 " << n[0]-1 << " 0 " << n[1]-1 << " 0 " << n[2]-1;
+	attribs << "WholeExtent=\"" << extent.str() << "\" Origin=\"" 
+		<< origin[0] << " " << origin[1] << " " << origin[2] << "\" Spacing=\""
+		<< pitch[0] << " " << pitch[1] << " " << pitch[2] << "\"";
+
+	VTKAppendedData appended(f,encoding);
+	vtk_write_xml_header(f,"ImageData",appended,attribs.str());
+	f << "    <Piece Extent=\"" << extent.str() << "\">\n";
+	f << "      <PointData Scalars=\"value\">\n";
+	f << "        <DataArray type=\"" << VTKTypeInfo<T>::xmlName() << "\" Name=\"value\" format=\"appended\" ";
+	appended.writeOffset();
+	f << "/>\n";
+	f << "      </PointData>\n";
+	f << "    </Piece>\n";
+	f << "  </ImageData>\n";
+
+	appended.beginData();
+	if(!appended.writeArray(VoxelArraySource<T>(vox)))
+		return VTK_ERR_FILE_WRITE_FAIL;
+	if(!appended.finish())
+		return VTK_ERR_FILE_WRITE_FAIL;
+	return 0;
+}
 
 #ifdef DEBUG
 //unit testing
 bool testVTKExport();
 #endif
-#endif 
+#endif
@@ -594,7 +594,7 @@ unsigned int IonStreamData::exportStreams(const std::vector<const FilterStreamDa
 
 	f.close();
 
-	if(format != IONFORMAT_VTK)
+	if(format == IONFORMAT_POS || format == IONFORMAT_TEXT)
 	{
 		for(unsigned int ui=0; ui<selectedStreams.size(); ui++)
 		{
@@ -647,7 +647,24 @@ unsigned int IonStreamData::exportStreams(const std::vector<const FilterStreamDa
 			}
 		}
 
-		if(vtk_write_legacy(outFile,VTK_ASCII,ionvec))
+		unsigned int errCode;
+		switch(format)
+		{
+			case IONFORMAT_VTK:
+				errCode=vtk_write_legacy(outFile,VTK_ASCII,ionvec);
+				break;
+			case IONFORMAT_VTK_BINARY:
+				errCode=vtk_write_legacy(outFile,VTK_BINARY,ionvec);
+				break;
+			case IONFORMAT_VTU:
+				errCode=vtk_write_xml(outFile,VTK_XML_RAW,ionvec);
+				break;
+			default:
+				ASSERT(false);
+				errCode=1;
+		}
+
+		if(errCode)
 			return 1;
 		//--
 	}
@@ -657,18 +674,23 @@ unsigned int IonStreamData::exportStreams(const std::vector<const FilterStreamDa
 
 IonStreamData::IonStreamData() : 
 	r(1.0f), g(0.0f), b(0.0f), a(1.0f), 
-	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)")
+	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)"), indexInBudget(false)
 {
 	streamType=STREAM_TYPE_IONS;
 }
 
 IonStreamData::IonStreamData(const Filter *f) : FilterStreamData(f), 
 	r(1.0f), g(0.0f), b(0.0f), a(1.0f), 
-	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)")
+	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)"), indexInBudget(false)
 {
 	streamType=STREAM_TYPE_IONS;
 }
 
+IonStreamData::~IonStreamData()
+{
+	releaseShare();
+}
+
 void IonStreamData::estimateIonParameters(const std::vector<const FilterStreamData *> &inData)
 {
 
@@ -765,7 +787,193 @@ void IonStreamData::estimateIonParameters(const IonStreamData *i)
 
 void IonStreamData::clear()
 {
+	releaseShare();
 	data.clear();
+	selections.clear();
+	spatialIndex.clear();
+	lodTree.reset();
+	pendingTransform=AffineTransform3D();
+}
+
+void IonStreamData::releaseShare()
+{
+	if(!dataShare)
+		return;
+
+	//dataShare is also held by dataSelection, so any further users are
+	// other streams' selections. Hand our ions over to them, rather than
+	// copying, as we are about to modify or free them
+	if(dataShare.use_count() > 2)
+	{
+		dataShare->owned.swap(data);
+		dataShare->ions=&dataShare->owned;
+	}
+
+	dataSelection.clear();
+	dataShare.reset();
+}
+
+const std::vector<IonSelection> &IonStreamData::shareIons() const
+{
+	if(!selections.empty() || data.empty())
+		return selections;
+
+	//Select all of data, in place. The stream is unchanged by this
+	if(!dataShare)
+	{
+		dataShare.reset(new SharedIonArray(&data));
+
+		IonSelection sel;
+		sel.source=dataShare;
+		sel.selectAll=true;
+		dataSelection.assign(1,sel);
+	}
+
+	return dataSelection;
+}
+
+void IonStreamData::materialiseSelections()
+{
+	if(selections.empty())
+		return;
+
+	ASSERT(data.empty());
+
+	size_t total=0;
+	for(size_t ui=0;ui<selections.size();ui++)
+		total+=selections[ui].size();
+	data.resize(total);
+
+	size_t offset=0;
+	for(size_t ui=0;ui<selections.size();ui++)
+	{
+		const IonSelection &sel=selections[ui];
+		#pragma omp parallel for
+		for(size_t uj=0;uj<sel.size();uj++)
+			data[offset+uj]=sel[uj];
+		offset+=sel.size();
+	}
+
+	selections.clear();
+	spatialIndex.clear();
+}
+
+IonStreamData *IonStreamData::cloneMaterialised() const
+{
+	IonStreamData *out = new IonStreamData;
+
+	out->r=r;
+	out->g=g;
+	out->b=b;
+	out->a=a;
+	out->ionSize=ionSize;
+	out->valueType=valueType;
+	out->parent=parent;
+	out->cached=0;
+
+	try
+	{
+		out->data.resize(getNumBasicObjects());
+	}
+	catch(std::bad_alloc)
+	{
+		delete out;
+		return 0;
+	}
+
+	//Copy the ions, transforming them on the way if needed
+	const vector<IonSelection> &sel=shareIons();
+	const bool transform=hasPendingTransform();
+	const AffineTransform3D t=pendingTransform;
+	size_t offset=0;
+	for(size_t ui=0;ui<sel.size();ui++)
+	{
+		const IonSelection &s=sel[ui];
+		IonHit *dest=&(out->data[offset]);
+		#pragma omp parallel for
+		for(size_t uj=0;uj<s.size();uj++)
+		{
+			dest[uj]=s[uj];
+			if(transform)
+			{
+				Point3D p=t.apply(dest[uj].getPosRef());
+				dest[uj].setPos(p.getValue(0),p.getValue(1),p.getValue(2));
+			}
+		}
+		offset+=s.size();
+	}
+	ASSERT(offset == out->data.size());
+
+	return out;
+}
+
+void IonStreamData::applyPendingTransform()
+{
+	if(!hasPendingTransform())
+		return;
+
+	//Shared ions cannot be modified in place. If other streams select
+	// from our ions, leave them the originals, and transform a copy
+	materialiseSelections();
+	if(dataShare && dataShare.use_count() > 2)
+	{
+		vector<IonHit> ownCopy(data);
+		releaseShare();
+		data.swap(ownCopy);
+	}
+	else
+		releaseShare();
+
+	spatialIndex.clear();
+	lodTree.reset();
+
+	const AffineTransform3D t=pendingTransform;
+	#pragma omp parallel for
+	for(size_t ui=0;ui<data.size();ui++)
+	{
+		Point3D p=t.apply(data[ui].getPosRef());
+		data[ui].setPos(p.getValue(0),p.getValue(1),p.getValue(2));
+	}
+
+	pendingTransform=AffineTransform3D();
+}
+
+void IonStreamData::getTransformedBoundCube(BoundCube &b) const
+{
+	ASSERT(getNumBasicObjects());
+	if(!hasPendingTransform() && selections.empty())
+	{
+		IonHit::getBoundCube(data,b);
+		return;
+	}
+
+	//Transform each point on-the-fly, without modifying the data
+	unsigned int nT=1;
+#ifdef _OPENMP
+	nT=omp_get_max_threads();
+#endif
+	vector<BoundCube> cubes(nT);
+	for(unsigned int ui=0;ui<nT;ui++)
+		cubes[ui].setInverseLimits(true);
+
+	const vector<IonSelection> &sel=shareIons();
+	for(size_t ui=0;ui<sel.size();ui++)
+	{
+		const IonSelection &s=sel[ui];
+		#pragma omp parallel for
+		for(size_t uj=0;uj<s.size();uj++)
+		{
+			unsigned int tid=0;
+#ifdef _OPENMP
+			tid=omp_get_thread_num();
+#endif
+			cubes[tid].expand(pendingTransform.apply(s[uj].getPosRef()));
+		}
+	}
+
+	b.setInverseLimits(true);
+	for(unsigned int ui=0;ui<nT;ui++)
+		b.expand(cubes[ui]);
 }
 
 IonStreamData *IonStreamData::cloneSampled(float fraction) const
@@ -781,9 +989,10 @@ IonStreamData *IonStreamData::cloneSampled(float fraction) const
 	out->valueType=valueType;
 	out->parent=parent;
 	out->cached=0;
+	out->pendingTransform=pendingTransform;
 
 
-	out->data.reserve(fraction*data.size()*0.9f);
+	out->data.reserve(fraction*getNumBasicObjects()*0.9f);
 
 	
 	RandNumGen rng;
@@ -794,12 +1003,25 @@ IonStreamData *IonStreamData::cloneSampled(float fraction) const
 			out->data.push_back(data[ui]);	
 	}
 
+	for(size_t ui=0;ui<selections.size();ui++)
+	{
+		const IonSelection &sel=selections[ui];
+		for(size_t uj=0;uj<sel.size();uj++)
+		{
+			if(rng.genUniformDev() < fraction)
+				out->data.push_back(sel[uj]);	
+		}
+	}
+
 	return out;
 }
 
 size_t IonStreamData::getNumBasicObjects() const
 {
-	return data.size();
+	size_t n=data.size();
+	for(size_t ui=0;ui<selections.size();ui++)
+		n+=selections[ui].size();
+	return n;
 }
 
 
@@ -837,16 +1059,18 @@ void VoxelStreamData::clear()
 ////////////// openvdb ////////////////////////////////////////////////////////////
 
 OpenVDBGridStreamData::OpenVDBGridStreamData() : representationType(VOXEL_REPRESENT_ISOSURF),
-	r(0.5f),g(0.5f),b(0.5f),a(1.0f), isovalue(0.07f), voxelsize(2.0f)
+	r(0.5f),g(0.5f),b(0.5f),a(1.0f), isovalue(0.07f), voxelsize(2.0f), splatSize(1.0f)
 {
 	streamType=STREAM_TYPE_OPENVDBGRID;
+	binCount[0]=binCount[1]=binCount[2]=0;
 	openvdb::FloatGrid::Ptr grid = openvdb::FloatGrid::create();	
 }
 
 OpenVDBGridStreamData::OpenVDBGridStreamData(const Filter *f) : FilterStreamData(f), representationType(VOXEL_REPRESENT_ISOSURF),
-	r(0.5f),g(0.5f),b(0.5f),a(1.0f), isovalue(0.07f), voxelsize(2.0f)
+	r(0.5f),g(0.5f),b(0.5f),a(1.0f), isovalue(0.07f), voxelsize(2.0f), splatSize(1.0f)
 {
 	streamType=STREAM_TYPE_OPENVDBGRID;
+	binCount[0]=binCount[1]=binCount[2]=0;
 	openvdb::FloatGrid::Ptr grid = openvdb::FloatGrid::create();
 }
 
@@ -864,6 +1088,91 @@ void OpenVDBGridStreamData::clear()
 	grid->clear();
 }
 
+bool OpenVDBGridStreamData::toDense(Voxels<float> &vox) const
+{
+	ASSERT(grid);
+
+	openvdb::CoordBBox box;
+	if(binCount[0] && binCount[1] && binCount[2])
+	{
+		box=openvdb::CoordBBox(openvdb::Coord(0,0,0),
+			openvdb::Coord(binCount[0]-1,binCount[1]-1,binCount[2]-1));
+	}
+	else
+		box=grid->evalActiveVoxelBoundingBox();
+	if(box.empty())
+		return false;
+
+	//Copy the region into a dense grid, with
+	// voxel (0,0,0) at the lower corner of the region
+	const openvdb::Coord dim=box.dim();
+	const openvdb::Coord start=box.min();
+	openvdb::Vec3d lower=grid->indexToWorld(start);
+	openvdb::Vec3d upper=grid->indexToWorld(start+dim);
+
+	if(vox.resize(dim[0],dim[1],dim[2],Point3D(lower[0],lower[1],lower[2]),
+					Point3D(upper[0],upper[1],upper[2])))
+		return false;
+
+#pragma omp parallel for
+	for(int uk=0;uk<dim[2];uk++)
+	{
+		openvdb::FloatGrid::ConstAccessor accessor=grid->getConstAccessor();
+		for(int uj=0;uj<dim[1];uj++)
+		{
+			for(int ui=0;ui<dim[0];ui++)
+			{
+				vox.setData(ui,uj,uk,
+					accessor.getValue(start+openvdb::Coord(ui,uj,uk)));
+			}
+		}
+	}
+
+	return true;
+}
+
+unsigned int OpenVDBGridStreamData::exportVTK(const std::string &filename, bool dense,
+						unsigned int encoding) const
+{
+	ASSERT(grid);
+
+	if(dense && (binCount[0] || !grid->evalActiveVoxelBoundingBox().empty()))
+	{
+		//Values are written at the grid points, so place these at the voxel positions
+		Voxels<float> vox;
+		if(!toDense(vox))
+			return VTK_ERR_FILE_WRITE_FAIL;
+
+		return vtk_write_xml(filename,encoding,vox);
+	}
+
+	//Write each active voxel as a point, expanding any active tiles
+	vector<Point3D> pts;
+	vector<float> values;
+	pts.reserve(grid->activeVoxelCount());
+	values.reserve(grid->activeVoxelCount());
+	for(openvdb::FloatGrid::ValueOnCIter it=grid->cbeginValueOn(); it; ++it)
+	{
+		openvdb::CoordBBox tileBox;
+		it.getBoundingBox(tileBox);
+		const openvdb::Coord &tMin=tileBox.min(), &tMax=tileBox.max();
+		for(int uk=tMin[2];uk<=tMax[2];uk++)
+		{
+			for(int uj=tMin[1];uj<=tMax[1];uj++)
+			{
+				for(int ui=tMin[0];ui<=tMax[0];ui++)
+				{
+					openvdb::Vec3d p=grid->indexToWorld(openvdb::Coord(ui,uj,uk));
+					pts.push_back(Point3D(p[0],p[1],p[2]));
+					values.push_back(*it);
+				}
+			}
+		}
+	}
+
+	return vtk_write_xml(filename,encoding,pts,values,"value");
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////
 
 RangeStreamData::RangeStreamData() : rangeFile(0)
@@ -1055,7 +1364,7 @@ void Filter::initFilter(const std::vector<const FilterStreamData *> &dataIn,
 	std::copy(dataIn.begin(),dataIn.end(),dataOut.begin());
 }
 
-ProgressData::ProgressData()
+ProgressData::ProgressData() : trace(0)
 {
 	step=0;
 	maxStep=0;
@@ -1093,6 +1402,182 @@ const ProgressData &ProgressData::operator=(const ProgressData &oth)
 	return *this;
 }
 
+const ProgressStepName &ProgressStepName::operator=(const std::string &s)
+{
+	std::string::operator=(s);
+	if(trace)
+		trace->beginStep(s);
+	return *this;
+}
+
+RefreshTrace::RefreshTrace()
+{
+	clear();
+}
+
+void RefreshTrace::clear()
+{
+	spans.clear();
+	openSpans.clear();
+	gettimeofday(&startTime,NULL);
+}
+
+double RefreshTrace::elapsed() const
+{
+	timeval t;
+	gettimeofday(&t,NULL);
+	return (t.tv_sec - startTime.tv_sec)*1e6 + (t.tv_usec-startTime.tv_usec);
+}
+
+void RefreshTrace::beginSpan(const std::string &name, const char *category)
+{
+	TRACE_SPAN span;
+	span.name=name;
+	span.category=category;
+	span.depth=openSpans.size();
+	span.start=elapsed();
+	span.duration=0;
+	span.cacheHit=false;
+	span.bytesOut=0;
+	span.peakMemory=0;
+
+	openSpans.push_back(spans.size());
+	spans.push_back(span);
+}
+
+void RefreshTrace::endSpan()
+{
+	ASSERT(openSpans.size());
+	TRACE_SPAN &span=spans[openSpans.back()];
+	span.duration=elapsed()-span.start;
+	span.peakMemory=getPeakRAM();
+	openSpans.pop_back();
+}
+
+void RefreshTrace::beginStep(const std::string &name)
+{
+	endStep();
+	beginSpan(name,"step");
+}
+
+void RefreshTrace::endStep()
+{
+	if(openSpans.size() && spans[openSpans.back()].category == "step")
+		endSpan();
+}
+
+void RefreshTrace::setCacheHit(bool hit)
+{
+	ASSERT(openSpans.size());
+	spans[openSpans.back()].cacheHit=hit;
+}
+
+void RefreshTrace::setBytesOut(size_t bytes)
+{
+	ASSERT(openSpans.size());
+	spans[openSpans.back()].bytesOut=bytes;
+}
+
+//Escape a string for use inside JSON quotes
+static std::string jsonEscape(const std::string &s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for(size_t ui=0;ui<s.size();ui++)
+	{
+		switch(s[ui])
+		{
+			case '"':
+				out+="\\\"";
+				break;
+			case '\\':
+				out+="\\\\";
+				break;
+			case '\n':
+				out+="\\n";
+				break;
+			case '\t':
+				out+="\\t";
+				break;
+			default:
+				if((unsigned char)s[ui] < 0x20)
+					out+=' ';
+				else
+					out+=s[ui];
+		}
+	}
+	return out;
+}
+
+void RefreshTrace::writeChromeTrace(std::ostream &f) const
+{
+	//Use "complete" events, which carry their own duration. Spans
+	// on a single thread nest by their times
+	f << "{\"traceEvents\":[" << std::endl;
+	for(size_t ui=0;ui<spans.size();ui++)
+	{
+		const TRACE_SPAN &s=spans[ui];
+		f << "{\"name\":\"" << jsonEscape(s.name) << "\",\"cat\":\"" 
+			<< jsonEscape(s.category) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+			<< "\"ts\":" << (unsigned long long)s.start 
+			<< ",\"dur\":" << (unsigned long long)s.duration 
+			<< ",\"args\":{\"bytesOut\":" << s.bytesOut 
+			<< ",\"peakMemoryKB\":" << s.peakMemory;
+		if(s.category == "filter")
+			f << ",\"cache\":\"" << (s.cacheHit ? "hit" : "miss") << "\"";
+		f << "}}";
+		if(ui+1 < spans.size())
+			f << ",";
+		f << std::endl;
+	}
+	f << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+}
+
+void RefreshTrace::writeSummary(std::ostream &f) const
+{
+	struct FILTER_SUMMARY
+	{
+		size_t refreshes,cacheHits,bytesOut,peakMemory;
+		double time;
+	};
+
+	//Sum the spans for each filter, keeping the order they were first seen
+	std::vector<std::string> names;
+	std::map<std::string,FILTER_SUMMARY> summaries;
+	for(size_t ui=0;ui<spans.size();ui++)
+	{
+		const TRACE_SPAN &s=spans[ui];
+		if(s.category != "filter")
+			continue;
+
+		if(summaries.find(s.name) == summaries.end())
+		{
+			FILTER_SUMMARY blank={0,0,0,0,0.0};
+			summaries[s.name]=blank;
+			names.push_back(s.name);
+		}
+
+		FILTER_SUMMARY &sum=summaries[s.name];
+		sum.refreshes++;
+		if(s.cacheHit)
+			sum.cacheHits++;
+		sum.bytesOut+=s.bytesOut;
+		sum.peakMemory=std::max(sum.peakMemory,s.peakMemory);
+		sum.time+=s.duration;
+	}
+
+	f << TRANS("Filter") << "\t" << TRANS("Refreshes") << "\t" 
+		<< TRANS("Cache hits") << "\t" << TRANS("Time (ms)") << "\t" 
+		<< TRANS("Output (MB)") << "\t" << TRANS("Peak memory (MB)") << std::endl;
+	for(size_t ui=0;ui<names.size();ui++)
+	{
+		const FILTER_SUMMARY &sum=summaries[names[ui]];
+		f << names[ui] << "\t" << sum.refreshes << "\t" << sum.cacheHits << "\t"
+			<< sum.time/1000.0 << "\t" << sum.bytesOut/(1024.0*1024.0) << "\t"
+			<< sum.peakMemory/1024.0 << std::endl;
+	}
+}
+
 #ifdef DEBUG
 extern Filter *makeFilter(unsigned int ui);
 extern Filter *makeFilter(const std::string &s);
@@ -56,6 +56,9 @@ class Voxels;
 
 #include <wx/propgrid/propgrid.h>
 
+#include <memory>
+#include <sys/time.h>
+
 const unsigned int NUM_CALLBACK=50000;
 
 const unsigned int IONDATA_SIZE=4;
@@ -262,12 +265,71 @@ class FilterPropGroup
 	
 };
 
+class IonSpatialIndex;
+class PointLODTree;
+
+//!Ion array that selections read from
+/*! This refers to the data of the ion stream that shared it, so sharing
+ * does not copy or move the ions. If that stream is cleared or destroyed
+ * whilst selections still refer to it, the stream hands its ions over to
+ * this object, which keeps them for as long as the selections need them
+ */
+class SharedIonArray
+{
+public:
+	//!The ions. Points either to the sharing stream's data, or to owned
+	const std::vector<IonHit> *ions;
+	//!Ions handed over by the stream that shared them
+	std::vector<IonHit> owned;
+
+	SharedIonArray(const std::vector<IonHit> *v) : ions(v) {}
+};
+
+//!A selection of ions from an ion array, which may be shared between ion streams
+class IonSelection
+{
+public:
+	//!Ions to select from. These must not be modified whilst shared
+	std::shared_ptr<const SharedIonArray> source;
+	//!Offsets of the selected ions in source. Ignored if selectAll is set
+	std::vector<size_t> indices;
+	//!If true, every ion in source is selected
+	bool selectAll;
+
+	IonSelection() : selectAll(false) {}
+
+	//!The ion array that is selected from
+	const std::vector<IonHit> &sourceIons() const { return *(source->ions);}
+
+	//!Number of selected ions
+	size_t size() const { return selectAll ? source->ions->size() : indices.size();}
+	//!Obtain the nth selected ion
+	const IonHit &operator[](size_t n) const 
+		{ return selectAll ? (*source->ions)[n] : (*source->ions)[indices[n]];}
+	//!Convert an offset into this selection into an offset into source
+	size_t sourceIndex(size_t n) const { return selectAll ? n : indices[n];}
+};
+
 //!Point with m-t-c value data
 class IonStreamData : public FilterStreamData
 {
+private:
+	//!Shared view of data, created by shareIons
+	mutable std::shared_ptr<SharedIonArray> dataShare;
+	//!Selection of all of data, as returned by shareIons
+	mutable std::vector<IonSelection> dataSelection;
+
+	//!Give any shared view of data its own copy of the ions, so
+	// that data may be modified or freed
+	void releaseShare();
+
+	//Streams are shared by pointer, and are not copied
+	IonStreamData(const IonStreamData &);
+	IonStreamData &operator=(const IonStreamData &);
 public:
 	IonStreamData();
 	IonStreamData(const Filter *f);
+	~IonStreamData();
 	void clear();
 
 	//Sample the data vector to the specified fraction
@@ -292,6 +354,57 @@ public:
 	//!Apply filter to input data stream	
 	std::vector<IonHit> data;
 
+	//!Affine transform that has not yet been applied to the positions in data.
+	// Only filters that accept pending transforms will see this as non-identity
+	AffineTransform3D pendingTransform;
+
+	//!True if the ion positions still need transforming by pendingTransform
+	bool hasPendingTransform() const { return !pendingTransform.isIdentity();}
+
+	//!Apply any pending transform to the ion positions, and reset it to identity
+	void applyPendingTransform();
+
+	//!Obtain the bounding box of the ion positions, after applying any pending transform
+	void getTransformedBoundCube(BoundCube &b) const;
+
+	//!Ions selected from shared arrays. If non-empty, these are the
+	// stream's ions, and data is empty. Only filters that accept 
+	// selections will see this as non-empty
+	std::vector<IonSelection> selections;
+
+	//!True if the ions are held as selections, rather than in data
+	bool hasSelections() const { return !selections.empty();}
+
+	//!Obtain the ions as selections, so that other streams can select from
+	// them without copying. Ions held in data are selected where they are;
+	// the stream itself is not modified
+	const std::vector<IonSelection> &shareIons() const;
+
+	//!Copy any selected ions into data, and drop the selections
+	void materialiseSelections();
+
+	//!True if consumers that need plain, final ion positions must be
+	// given a materialised copy
+	bool needsMaterialise() const { return hasSelections() || hasPendingTransform();}
+
+	//!Create a new, uncached stream with the same ions and appearance,
+	// holding the ions in data, with any pending transform applied. 
+	// Returns 0 if out of memory
+	IonStreamData *cloneMaterialised() const;
+
+	//!Spatial indices over the ions of each selection, built on demand
+	// by IonSpatialIndex::getIndex. Dropped whenever the ions move or are
+	// reordered, so that indices held by cached streams can be reused
+	mutable std::vector<std::shared_ptr<const IonSpatialIndex> > spatialIndex;
+	//!True if the stream, along with its spatial indices, fits within the 
+	// cache budget. Set by the filter tree for the cached streams it holds
+	mutable bool indexInBudget;
+
+	//!Level-of-detail tree over the ion positions, built by the scene when 
+	// drawing large streams. Only kept for cached streams, within the cache
+	// budget. Dropped whenever the ions move or change
+	mutable std::shared_ptr<const PointLODTree> lodTree;
+
 	//!export given filterstream data pointers as ion data
 	static unsigned int exportStreams(const std::vector<const FilterStreamData *> &selected, 
 							const std::string &outFile, unsigned int format=IONFORMAT_POS);
@@ -333,10 +446,27 @@ public:
 	size_t getNumBasicObjects() const ;
 	void clear();
 
+	//!Copy the grid into a dense voxel set. This spans binCount voxels
+	// from the index origin if set, otherwise just the active voxels.
+	// Returns false if there are none, or on allocation failure
+	bool toDense(Voxels<float> &v) const;
+
+	//!Write the grid to a VTK XML file, with the data encoded as per
+	// the VTK_XML_ enum. Dense output is image data (.vti) spanning the
+	// region used by toDense, sparse output one point per active voxel (.vtu).
+	// Returns 0 on success, or a VTK_ERR_ value
+	unsigned int exportVTK(const std::string &filename, bool dense,
+				unsigned int encoding) const;
+
 	unsigned int representationType;
 	float r,g,b,a;
 	double isovalue;
 	float voxelsize;
+	//!Point size, for point cloud representation
+	float splatSize;
+	//!Number of voxels the grid nominally spans along each axis, starting
+	// at index (0,0,0). Zero if the grid has no fixed extent
+	size_t binCount[3];
 	//!Apply filter to input data stream	
 	openvdb::FloatGrid::Ptr grid;	
 };
@@ -704,6 +834,16 @@ class Filter
 
 		//Can we be a useful filter, even if given no input specified by the Use mask?
 		virtual bool isUsefulAsAppend() const { return false;}
+
+		//!Return true if this filter can process ion streams that hold
+		// selections. Otherwise the filter tree copies the selected
+		// ions into the stream data, before refreshing this filter
+		virtual bool acceptsIonSelections() const { return false;}
+
+		//!Return true if this filter can process ion streams whose 
+		// positions still have a pending affine transform. Otherwise the
+		// filter tree applies the transform before refreshing this filter
+		virtual bool acceptsPendingTransforms() const { return false;}
 	
 		template<typename T>	
 		static void getStreamsOfType(const std::vector<const FilterStreamData *> &vec, std::vector<const T *> &dataOut);
@@ -781,9 +921,92 @@ bool Filter::applyPropertyNow(T &prop, const std::string &val, bool &needUp)
 }
 //--
 
+//!Records nested, timed spans during a filter tree refresh, such as
+// each filter's refresh and the steps within it. Nothing is recorded
+// unless a trace is attached to the refresh's ProgressData
+class RefreshTrace
+{
+	public:
+		struct TRACE_SPAN
+		{
+			std::string name;
+			//!Type of span, e.g. "filter" or "step"
+			std::string category;
+			//!Nesting level, zero for outermost spans
+			unsigned int depth;
+			//!Start time relative to the trace start, and duration, in microseconds
+			double start,duration;
+			//!True if the span's filter used its cache
+			bool cacheHit;
+			//!Approximate size of the data produced in this span
+			size_t bytesOut;
+			//!Peak memory used by the program at the end of the span, in kB
+			size_t peakMemory;
+		};
+	private:
+		std::vector<TRACE_SPAN> spans;
+		//!Offsets of spans that have not yet ended, innermost last
+		std::vector<size_t> openSpans;
+		//!Time at which the trace was started
+		timeval startTime;
+
+		//!Time since trace start, in microseconds
+		double elapsed() const;
+	public:
+		RefreshTrace();
+
+		//!Discard all spans, and restart the trace clock
+		void clear();
+
+		//!Start a new span, inside any currently open span
+		void beginSpan(const std::string &name, const char *category);
+		//!End the innermost open span
+		void endSpan();
+		//!Start a new step inside the current span, ending any previous step
+		void beginStep(const std::string &name);
+		//!End the current step, if there is one
+		void endStep();
+
+		//!Record cache use for the innermost open span
+		void setCacheHit(bool hit);
+		//!Record the amount of data produced in the innermost open span
+		void setBytesOut(size_t bytes);
+
+		const std::vector<TRACE_SPAN> &getSpans() const { return spans;}
+
+		//!Write the spans as Chrome trace-event JSON, as viewed by
+		// chrome://tracing or similar
+		void writeChromeTrace(std::ostream &f) const;
+		//!Write a table of refresh time, cache use and output for each filter
+		void writeSummary(std::ostream &f) const;
+};
+
+//!Name of the current progress step. If a trace is attached,
+// assigning a new name starts a new step in the trace
+class ProgressStepName : public std::string
+{
+	private:
+		RefreshTrace *trace;
+	public:
+		ProgressStepName() : trace(0) {}
+		//!Copies only the name; the trace is not shared
+		ProgressStepName(const ProgressStepName &o) : std::string(o), trace(0) {}
+
+		const ProgressStepName &operator=(const ProgressStepName &o) 
+			{ std::string::operator=(o); return *this;}
+		const ProgressStepName &operator=(const std::string &s);
+		const ProgressStepName &operator=(const char *s) 
+			{ return operator=(std::string(s));}
+
+		void setTrace(RefreshTrace *t) { trace=t;}
+};
+
 //!Class that tracks the progress of scene updates
 class ProgressData
 {
+	private:
+		//!Trace to record refresh timings into, if any
+		RefreshTrace *trace;
 	public:
 		//!Progress of filter (out of 100, or -1 for no progress information) for current filter
 		unsigned int filterProgress;
@@ -802,10 +1025,15 @@ class ProgressData
 		const Filter *curFilter;
 
 		//!Name of current operation, if specified
-		std::string stepName;
+		ProgressStepName stepName;
 
 		ProgressData(); 
 
+		//!Record timings of refresh operations into the given trace. 
+		// This is kept by reset(), and not copied between objects
+		void setTrace(RefreshTrace *t) { trace=t; stepName.setTrace(t);}
+		RefreshTrace *getTrace() const { return trace;}
+
 		bool operator==(const ProgressData &o) const;
 		const ProgressData &operator=(const ProgressData &o);
 
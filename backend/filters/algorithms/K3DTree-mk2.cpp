@@ -20,6 +20,10 @@
 
 #include "backend/APT/ionhit.h"
 
+#ifdef DEBUG
+#include "common/mathfuncs.h"
+#endif
+
 #include <stack>
 #include <queue>
 
@@ -394,6 +398,137 @@ void K3DTreeMk2::ptsInSphere(const Point3D &origin, float radius,
 	
 }
 
+//Sqr distances from a point to the nearest and furthest
+// parts of an axis aligned box, given as [axis][min/max]
+static inline void boxSqrDistRange(const Point3D &pt, const float bounds[3][2],
+				float &nearSqr, float &farSqr)
+{
+	nearSqr=farSqr=0;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		float dLow,dHigh;
+		dLow=pt[ui]-bounds[ui][0];
+		dHigh=bounds[ui][1]-pt[ui];
+
+		if(dLow < 0)
+			nearSqr+=dLow*dLow;
+		else if(dHigh < 0)
+			nearSqr+=dHigh*dHigh;
+
+		dLow=std::max(fabs(dLow),fabs(dHigh));
+		farSqr+=dLow*dLow;
+	}
+}
+
+//Subtrees smaller than this are scanned point by point when counting
+// points in a sphere, rather than walked
+const size_t SPHERE_COUNT_SCAN_SIZE=16;
+
+//Walk entry for sphere counting. Only the box is kept,
+// as the BoundCube validity flags are not needed here
+class SphereCountWalk
+{
+	public:
+		size_t index;
+		//Inclusive range of the array occupied by this subtree
+		size_t first,last;
+		unsigned int depth;
+		float bounds[3][2];
+};
+
+size_t K3DTreeMk2::countPtsInSphere(const Point3D &origin, float radius,
+		bool excludeSelf, float selfSqrDist) const
+{
+	if(indexedPoints.empty())
+		return 0;
+
+	const float sqrRadius=radius*radius;
+	if(!treeBounds.intersects(origin,sqrRadius))
+		return 0;
+
+	size_t count=0;
+	//Nodes whose subtree boxes intersect the sphere, but which
+	// have not yet been examined. Walking depth first bounds
+	// the stack by the tree depth
+	vector<SphereCountWalk> nodeStack;
+	nodeStack.reserve(maxDepth+2);
+
+	SphereCountWalk curWalk;
+	curWalk.index=treeRoot;
+	curWalk.first=0;
+	curWalk.last=indexedPoints.size()-1;
+	curWalk.depth=0;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		curWalk.bounds[ui][0]=treeBounds.getBound(ui,0);
+		curWalk.bounds[ui][1]=treeBounds.getBound(ui,1);
+	}
+	nodeStack.push_back(curWalk);
+
+	while(!nodeStack.empty())
+	{
+		curWalk=nodeStack.back();
+		nodeStack.pop_back();
+
+		float nearSqr,farSqr;
+		boxSqrDistRange(origin,curWalk.bounds,nearSqr,farSqr);
+		if(nearSqr > sqrRadius)
+			continue;
+
+		//If the whole subtree lies in the sphere, we can count it in one go,
+		// unless it could hold points that we need to exclude
+		if(farSqr < sqrRadius && !(excludeSelf && nearSqr <=selfSqrDist))
+		{
+			count+=curWalk.last-curWalk.first+1;
+			continue;
+		}
+
+		//Small subtrees are cheaper to scan directly, as they are contiguous
+		if(curWalk.last-curWalk.first < SPHERE_COUNT_SCAN_SIZE)
+		{
+			for(size_t ui=curWalk.first;ui<=curWalk.last;ui++)
+			{
+				float sqrDist;
+				sqrDist=indexedPoints[ui].first.sqrDist(origin);
+				if(sqrDist < sqrRadius && !(excludeSelf && sqrDist <=selfSqrDist))
+					count++;
+			}
+			continue;
+		}
+
+		const size_t nodeIdx=curWalk.index;
+		const Point3D &nodePt=indexedPoints[nodeIdx].first;
+		float sqrDist;
+		sqrDist=nodePt.sqrDist(origin);
+		if(sqrDist < sqrRadius && !(excludeSelf && sqrDist <=selfSqrDist))
+			count++;
+
+		//Children occupy the parts of the range either side of the node
+		const unsigned int axis=curWalk.depth%3;
+		const float splitVal=nodePt[axis];
+		curWalk.depth++;
+		if(nodes[nodeIdx].childRight != (size_t) -1)
+		{
+			SphereCountWalk rightWalk=curWalk;
+			rightWalk.index=nodes[nodeIdx].childRight;
+			rightWalk.first=nodeIdx+1;
+			rightWalk.bounds[axis][0]=splitVal;
+			nodeStack.push_back(rightWalk);
+		}	
+
+		if(nodes[nodeIdx].childLeft != (size_t) -1)
+		{
+			curWalk.index=nodes[nodeIdx].childLeft;
+			curWalk.last=nodeIdx-1;
+			curWalk.bounds[axis][1]=splitVal;
+			nodeStack.push_back(curWalk);
+		}	
+	}
+
+	ASSERT(count <=indexedPoints.size());
+	return count;
+}
+
 size_t K3DTreeMk2::findNearestUntagged(const Point3D &searchPt,
 				const BoundCube &domainCube, bool shouldTag, size_t pseudoRoot)
 {
@@ -1125,6 +1260,70 @@ bool K3DMk2Tests()
 	TEST(tree.getBoxInTree(testBox)==2,"subtree test pt2");
 	//---
 
+	//Check the sphere counting against both the enumerating
+	// query and a brute-force count
+	//---
+	RandNumGen rng;
+	rng.initTimer();
+	const unsigned int NUM_PTS=5000;
+	pts.resize(NUM_PTS);
+	for(unsigned int ui=0;ui<NUM_PTS;ui++)
+	{
+		pts[ui]=Point3D(rng.genUniformDev()*10.0f,
+			rng.genUniformDev()*10.0f,rng.genUniformDev()*10.0f);
+	}
+	//Duplicate some points, so that self-exclusion has coincident points to drop
+	for(unsigned int ui=0;ui<50;ui++)
+		pts[NUM_PTS-1-ui]=pts[ui];
+
+	vector<Point3D> ptsCopy;
+	ptsCopy=pts;
+	tree.resetPts(pts,false);
+	TEST(tree.build(),"Tree build");
+
+	const float RADII[] = {0.5f, 1.0f, 2.0f, 20.0f};
+	for(unsigned int ui=0;ui<4;ui++)
+	{
+		for(unsigned int uj=0;uj<200;uj++)
+		{
+			Point3D origin;
+			origin = ptsCopy[uj];
+
+			vector<size_t> found;
+			tree.ptsInSphere(origin,RADII[ui],found);
+
+			size_t nearCount=0,selfCount=0;
+			for(unsigned int uk=0;uk<NUM_PTS;uk++)
+			{
+				float sqrDist;
+				sqrDist=ptsCopy[uk].sqrDist(origin);
+				if(sqrDist < RADII[ui]*RADII[ui])
+					nearCount++;
+				if(sqrDist == 0.0f)
+					selfCount++;
+			}
+
+			TEST(tree.countPtsInSphere(origin,RADII[ui]) == found.size(),
+							"count matches enumeration");
+			TEST(found.size() == nearCount, "count matches brute force");
+			TEST(tree.countPtsInSphere(origin,RADII[ui],true) == nearCount-selfCount,
+							"self-excluded count");
+		}
+	}
+
+	//A sphere that misses the tree entirely
+	TEST(tree.countPtsInSphere(Point3D(-50,-50,-50),1.0f) == 0,"disjoint sphere count");
+
+	//Points exactly on the sphere are outside it, even when the
+	// whole tree box touches the sphere
+	pts.clear();
+	for(unsigned int ui=0;ui<8;ui++)
+		pts.push_back(Point3D((ui&1) ? 2 : -2,(ui&2) ? 2: -2, (ui&4) ? 1 : -1));
+	tree.resetPts(pts,false);
+	TEST(tree.build(),"Tree build");
+	TEST(tree.countPtsInSphere(Point3D(0,0,0),3.0f) == 0,"sphere surface count");
+	//---
+
 	return true;
 
 }
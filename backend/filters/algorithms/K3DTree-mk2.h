@@ -140,6 +140,15 @@ class K3DTreeMk2
 		// this origin
 		void ptsInSphere(const Point3D &origin, float radius,
 			std::vector<size_t> &pts) const;
+
+		//Count the points that lie within the sphere (pts < radius) of given
+		// radius, centered upon this origin, without enumerating them.
+		// Subtrees wholly inside the sphere are counted in O(1), from their
+		// extent in the tree array.
+		// If excludeSelf is set, points with a sqr distance to the origin of 
+		// selfSqrDist or less are not counted (by default, exact coincidence only)
+		size_t countPtsInSphere(const Point3D &origin, float radius,
+			bool excludeSelf=false, float selfSqrDist=0.0f) const;
 	
 		//!Get the contigous node IDs for a subset of points in the tree that are contained
 		// within a sphere positioned about pt, with a sqr radius of sqrDist.
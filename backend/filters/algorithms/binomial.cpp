@@ -27,6 +27,12 @@
 #include <vector>
 #include <utility>
 #include <numeric>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using std::pair;
 using std::vector;
@@ -57,48 +63,166 @@ void setGridABCoords(unsigned int binIdx, unsigned int *direction,unsigned int *
 		float *binLen, const BoundCube  &totalBound, GRID_ENTRY &gridEntry);
 //---
 
+//Ion used during segmentation; its position along the extrusion axis,
+// and the offset of its species in the selected ion list
+struct BINNED_ION
+{
+	float z;
+	unsigned int selection;
+};
+
+//Grid entry that has been filled, and the position of its last ion
+struct COMPLETED_GRID
+{
+	float zEnd;
+	size_t column;
+	size_t offset;
+};
+
+class CompareCompletedGrid
+{
+	public:
+		inline bool operator()(const COMPLETED_GRID &a, const COMPLETED_GRID &b) const
+		{
+			if(a.zEnd != b.zEnd)
+				return a.zEnd < b.zEnd;
+			return a.column < b.column;
+		}
+};
+
+//Map a float to an unsigned int with the same sort order
+inline unsigned int floatSortKey(float f)
+{
+	unsigned int u;
+	memcpy(&u,&f,sizeof(float));
+	return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+//Stable radix sort of ions by z, using tmp as scratch of the same size
+void radixSortBinnedIons(BINNED_ION *ions, BINNED_ION *tmp, size_t n)
+{
+	BINNED_ION *src=ions, *dst=tmp;
+	for(unsigned int shift=0;shift<32;shift+=8)
+	{
+		size_t count[257];
+		std::fill(count,count+257,0);
+		for(size_t ui=0;ui<n;ui++)
+			count[((floatSortKey(src[ui].z) >> shift) & 0xff) +1]++;
+
+		//Skip digits that every ion shares
+		if(std::find(count+1,count+257,n) != count+257)
+			continue;
+
+		for(size_t ui=1;ui<257;ui++)
+			count[ui]+=count[ui-1];
+		for(size_t ui=0;ui<n;ui++)
+			dst[count[(floatSortKey(src[ui].z) >> shift) & 0xff]++]=src[ui];
+		std::swap(src,dst);
+	}
+
+	if(src != ions)
+		std::copy(src,src+n,ions);
+}
+
 int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 			const std::vector<size_t> &selectedIons, const SEGMENT_OPTION &segmentOptions,
 			vector<GRID_ENTRY> &completedGridEntries)
 {
-
-	//Step 1 - filter the ions to only the ranges we want to examine
-	std::vector<IonHit> filteredIons;
-
-	//Convert the selection into a map.
-	map<size_t,size_t> selectionMapping;
+	//Segmentation proceeds in several passes over the ions, without copying 
+	// or comparison sorting them:
+	// - classify each ion by its selected species, and find their bounds
+	// - count the ions in each grid column, and scatter them into column order
+	// - radix sort each column along the extrusion axis, and cut into blocks
+
+	//Convert the selection into a lookup table (ionID -> selection)
+	vector<unsigned int> selectionMapping(rng->getNumIons(),(unsigned int)-1);
 	for(size_t ui=0;ui<selectedIons.size();ui++)
 	{
 		ASSERT(selectedIons[ui] < rng->getNumIons());
 		selectionMapping[selectedIons[ui]] = ui;
 	}
 
-	//Filter ions by ranging
-	for(size_t ui=0;ui<ions.size();ui++)
+	size_t nT=1;
+#ifdef _OPENMP
+	nT=omp_get_max_threads();
+#endif
+	nT=std::max((size_t)1,std::min(nT,ions.size()));
+
+	//Step 1 - Classify the ions, skipping unranged or unselected species
+	//--
+	vector<unsigned int> ionSelection;
+	try
 	{
-		unsigned int ionID;
-		ionID = rng->getIonID(ions[ui].getMassToCharge());
-		
-		//Skip unranged ions
-		if(ionID == (unsigned int)-1)
-			continue;
+		ionSelection.resize(ions.size());
+	}
+	catch(std::bad_alloc)
+	{
+		return BINOMIAL_NO_MEM;
+	}
+
+	vector<float> threadBounds(nT*6);
+	vector<size_t> threadCount(nT,0);
+#pragma omp parallel for
+	for(size_t t=0;t<nT;t++)
+	{
+		float *bounds=&threadBounds[t*6];
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			bounds[ui]=std::numeric_limits<float>::max();
+			bounds[ui+3]=-std::numeric_limits<float>::max();
+		}
+
+		const size_t start=ions.size()*t/nT, end=ions.size()*(t+1)/nT;
+		for(size_t ui=start;ui<end;ui++)
+		{
+			unsigned int ionID;
+			ionID = rng->getIonID(ions[ui].getMassToCharge());
+
+			if(ionID == (unsigned int)-1 || 
+				selectionMapping[ionID] == (unsigned int)-1)
+			{
+				ionSelection[ui]=(unsigned int)-1;
+				continue;
+			}
+			ionSelection[ui]=selectionMapping[ionID];
+			threadCount[t]++;
 
-		filteredIons.push_back(ions[ui]);
+			const Point3D &p=ions[ui].getPosRef();
+			for(unsigned int uj=0;uj<3;uj++)
+			{
+				bounds[uj]=std::min(p[uj],bounds[uj]);
+				bounds[uj+3]=std::max(p[uj],bounds[uj+3]);
+			}
+		}
 	}
-	
+
+	size_t nFiltered=std::accumulate(threadCount.begin(),threadCount.end(),(size_t)0);
+	if(!nFiltered)
+		return 0;
+
 	//Obtain the bounding box for the filtered ions
 	BoundCube totalBound;
-	IonHit::getBoundCube(filteredIons,totalBound);
-
-	// Sort the ions according to their Z value
+	{
+	float bounds[6];
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		bounds[ui]=std::numeric_limits<float>::max();
+		bounds[ui+3]=-std::numeric_limits<float>::max();
+	}
+	for(size_t t=0;t<nT;t++)
+	{
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			bounds[ui]=std::min(threadBounds[t*6+ui],bounds[ui]);
+			bounds[ui+3]=std::max(threadBounds[t*6+ui+3],bounds[ui+3]);
+		}
+	}
+	totalBound.setBounds(bounds[0],bounds[1],bounds[2],
+				bounds[3],bounds[4],bounds[5]);
+	}
 	//--
-	unsigned int extrusionAxis=segmentOptions.extrusionDirection;
-	IonAxisCompare axisCmp(extrusionAxis);
 
-	std::sort(filteredIons.begin(),
-			filteredIons.end(),axisCmp);
-
-	//--
+	unsigned int extrusionAxis=segmentOptions.extrusionDirection;
 
 	unsigned int direction[2];
 	float binLen[2];
@@ -118,7 +242,7 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 			
 			//The target volume for each grid cube
 			float desiredVolume;
-			desiredVolume= (float)segmentOptions.nIons/(float)filteredIons.size()*totalBound.volume();
+			desiredVolume= (float)segmentOptions.nIons/(float)nFiltered*totalBound.volume();
 
 			//Compute the target cube size
 			targetL = powf(desiredVolume,1.0f/3.0f);
@@ -139,110 +263,158 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 			ASSERT(false);
 	}
 
-	//Now extrude the grid through the points in the given extrusion direction
-
-	GRID_ENTRY *gridEntries;
 	size_t nGrids=nBins[0]*nBins[1];
+
+	Point3D lowBound;
+	totalBound.getBound(lowBound,0);
+
+	//Step 2 - Bucket the ions by grid column with a counting sort
+	//--
+	vector<size_t> columnStart;
+	vector<BINNED_ION> binnedIons,scratch;
 	try
 	{
-		gridEntries = new GRID_ENTRY[nGrids];
+		//Per-thread counts for each column, then per-thread write offsets
+		vector<size_t> offsets(nT*nGrids,0);
+#pragma omp parallel for
+		for(size_t t=0;t<nT;t++)
+		{
+			size_t *colCount=&offsets[t*nGrids];
+			const size_t start=ions.size()*t/nT, end=ions.size()*(t+1)/nT;
+			for(size_t ui=start;ui<end;ui++)
+			{
+				if(ionSelection[ui] == (unsigned int)-1)
+					continue;
+
+				//Find the X y division for the ion
+				Point3D ionOffset;
+				ionOffset=ions[ui].getPos() - lowBound;
+				unsigned int xPos,yPos;
+				xPos =ionOffset[direction[0]]/binLen[0];
+				yPos = ionOffset[direction[1]]/binLen[1];
+				colCount[rowMajorOffset(xPos,yPos,nBins[1])]++;
+			}
+		}
+
+		columnStart.resize(nGrids+1);
+		size_t pos=0;
+		for(size_t ui=0;ui<nGrids;ui++)
+		{
+			columnStart[ui]=pos;
+			for(size_t t=0;t<nT;t++)
+			{
+				size_t n=offsets[t*nGrids+ui];
+				offsets[t*nGrids+ui]=pos;
+				pos+=n;
+			}
+		}
+		columnStart[nGrids]=pos;
+		ASSERT(pos == nFiltered);
+
+		binnedIons.resize(nFiltered);
+		scratch.resize(nFiltered);
+
+		//Each thread writes its ions in input order, so columns stay stable
+#pragma omp parallel for
+		for(size_t t=0;t<nT;t++)
+		{
+			size_t *colPos=&offsets[t*nGrids];
+			const size_t start=ions.size()*t/nT, end=ions.size()*(t+1)/nT;
+			for(size_t ui=start;ui<end;ui++)
+			{
+				if(ionSelection[ui] == (unsigned int)-1)
+					continue;
+
+				Point3D ionOffset;
+				ionOffset=ions[ui].getPos() - lowBound;
+				unsigned int xPos,yPos;
+				xPos =ionOffset[direction[0]]/binLen[0];
+				yPos = ionOffset[direction[1]]/binLen[1];
+
+				BINNED_ION &b=binnedIons[colPos[rowMajorOffset(xPos,yPos,nBins[1])]++];
+				b.z=ions[ui][extrusionAxis];
+				b.selection=ionSelection[ui];
+			}
+		}
 	}
 	catch(std::bad_alloc)
 	{
 		return BINOMIAL_NO_MEM;
 	}
+	//--
 
-#ifdef DEBUG
-	BoundCube wrappingBound=totalBound;
-	wrappingBound.expand(0.1f);
-#endif
-
-	//Initialise the grid entries
+	//Step 3 - Order each column along the extrusion axis, then 
+	// extrude the grid through the points, completing a grid entry 
+	// each time it reaches the target ion count
 	//--
+	vector<vector<GRID_ENTRY> > columnEntries(nGrids);
+	vector<vector<float> > columnEnds(nGrids);
+
 	float zStart = totalBound.getBound(extrusionAxis,0);
-#pragma omp parallel for 
+	const size_t nSelected=selectedIons.size();
+#pragma omp parallel for schedule(dynamic)
 	for(size_t ui=0;ui<nGrids;ui++)
 	{
-		//Set the start and end 
-		gridEntries[ui].nIons.resize(selectedIons.size(),0);
-		gridEntries[ui].totalIons=0;
-		gridEntries[ui].startPt[extrusionAxis]=gridEntries[ui].endPt[extrusionAxis]=zStart;
+		const size_t start=columnStart[ui],end=columnStart[ui+1];
+		radixSortBinnedIons(&binnedIons[start],&scratch[start],end-start);
 
-		setGridABCoords(ui,direction,nBins,binLen,totalBound,gridEntries[ui]);
-	}
-	//--
+		GRID_ENTRY gridEntry;
+		gridEntry.nIons.resize(nSelected,0);
+		gridEntry.totalIons=0;
+		gridEntry.startPt[extrusionAxis]=gridEntry.endPt[extrusionAxis]=zStart;
+		setGridABCoords(ui,direction,nBins,binLen,totalBound,gridEntry);
 
-	Point3D lowBound;
-	totalBound.getBound(lowBound,0);
+		for(size_t uj=start;uj<end;uj++)
+		{
+			const BINNED_ION &b=binnedIons[uj];
+			gridEntry.nIons[b.selection]++;
+			gridEntry.totalIons++;
 
-	completedGridEntries.reserve(((float)filteredIons.size()/segmentOptions.nIons)*0.5f);
-	for(size_t ui=0;ui<filteredIons.size(); ui++)
-	{	
-		//Find the X y division for the ion
-		unsigned int xPos,yPos;
-		Point3D ionOffset;
-		ionOffset=filteredIons[ui].getPos() - lowBound;
-		xPos =ionOffset[direction[0]]/binLen[0];
-		yPos = ionOffset[direction[1]]/binLen[1];
+			//Update grid end
+			gridEntry.endPt[extrusionAxis]=b.z-lowBound[extrusionAxis];
 
-		
-		//Find the bin that this new ion is in,
-		// and its range value
-		unsigned int binIdx,selectionId,range;
-		binIdx = rowMajorOffset(xPos,yPos,nBins[1]);
-		
-		//get range
-		range=rng->getIonID(filteredIons[ui].getMassToCharge());
-		ASSERT(range!=(unsigned int)-1);
-
-		//convert range ID to selection ID
-		//TODO: It might be faster not use the map, but rather
-		// to use a fixed (but oversized) array to do the idx remapping.
-		// the mem cost is pretty negligible for any sensible use case
-		ASSERT(selectionMapping.find(range) != selectionMapping.end());
-		selectionId= selectionMapping.find(range)->second;
-
-		//Increment the nIons for the given bin
-		gridEntries[binIdx].nIons[selectionId]++;
-		gridEntries[binIdx].totalIons++;
-
-		//Update grid end
-		gridEntries[binIdx].endPt[extrusionAxis]=ionOffset[extrusionAxis];
-
-		//Check to see if we need to finish this grid entry
-		if(gridEntries[binIdx].totalIons ==segmentOptions.nIons)
-		{
+			//Check to see if we need to finish this grid entry
+			if(gridEntry.totalIons ==segmentOptions.nIons)
+			{
 #ifdef DEBUG
-			//Set the grid end
-			gridEntries[binIdx].endPt[extrusionAxis] = filteredIons[ui].getPos()[extrusionAxis];
+				//Set the grid end
+				gridEntry.endPt[extrusionAxis] = b.z;
 #endif
-			completedGridEntries.push_back(gridEntries[binIdx]);
-
-			//Reset the grid for the next round
-			// TODO: Should we initialise zStart to this ion,
-			//   or should we snap it to the next ion we encounter?
-			gridEntries[binIdx].startPt[extrusionAxis] =filteredIons[ui].getPos()[extrusionAxis];
-			gridEntries[binIdx].endPt[extrusionAxis]=filteredIons[ui].getPos()[extrusionAxis];
-
-			//Set the box x-y (where extrusion=z)  coordinates.
-			setGridABCoords(binIdx,direction,nBins,
-					binLen,totalBound,gridEntries[binIdx]);
-	
-			//Set the start for the next grid, but not the end
-			gridEntries[binIdx].startPt.setValue(extrusionAxis,gridEntries[binIdx].startPt[extrusionAxis]);
-			
-			for(size_t ui=0;ui<selectedIons.size();ui++)
-				gridEntries[binIdx].nIons[ui]=0;
-			gridEntries[binIdx].totalIons=0;
+				columnEntries[ui].push_back(gridEntry);
+				columnEnds[ui].push_back(b.z);
+
+				//Reset the grid for the next round
+				gridEntry.startPt[extrusionAxis] =b.z;
+				gridEntry.endPt[extrusionAxis]=b.z;
+				for(size_t uk=0;uk<nSelected;uk++)
+					gridEntry.nIons[uk]=0;
+				gridEntry.totalIons=0;
+			}
 
+			ASSERT(gridEntry.totalIons < segmentOptions.nIons);
 		}
-
-		ASSERT(gridEntries[binIdx].totalIons < segmentOptions.nIons);
-
 	}
+	//--
 
-	delete[] gridEntries;
+	//Report the grid entries in the order they were completed,
+	// by sweeping along the extrusion axis
+	vector<COMPLETED_GRID> completed;
+	for(size_t ui=0;ui<nGrids;ui++)
+	{
+		for(size_t uj=0;uj<columnEnds[ui].size();uj++)
+		{
+			COMPLETED_GRID c;
+			c.zEnd=columnEnds[ui][uj];
+			c.column=ui;
+			c.offset=uj;
+			completed.push_back(c);
+		}
+	}
+	std::sort(completed.begin(),completed.end(),CompareCompletedGrid());
 
+	completedGridEntries.reserve(completedGridEntries.size()+completed.size());
+	for(size_t ui=0;ui<completed.size();ui++)
+		completedGridEntries.push_back(columnEntries[completed[ui].column][completed[ui].offset]);
 
 	//Go through the grid entries, and delete the ones we don't want
 	vector<bool> killEntries;
@@ -493,6 +665,7 @@ void setGridABCoords(unsigned int binIdx, unsigned int *direction,unsigned int *
 #include <sys/time.h>
 
 bool testBinomialBinning();
+bool testBinomialSegmentation();
 bool testBinomialGSLChi();
 bool testBinomialRandomnessTruePositive();
 bool testBinomialRandomnessTrueNegative();
@@ -502,6 +675,7 @@ bool testBinomial()
 {
 	TEST(testBinomialGSLChi(),"Binomial GSL");
 	TEST(testBinomialBinning(),"Binomial Binning");
+	TEST(testBinomialSegmentation(),"Binomial segmentation");
 	TEST(testBinomialRandomnessTruePositive(),"Binomial random correctly detected");
 	TEST(testBinomialRandomnessTrueNegative(),"Binomial non-random correclty deteced");
 	return true;
@@ -687,6 +861,148 @@ bool testBinomialGSLChi()
 	return true;
 }
 
+//Segment ions by fully sorting them along the extrusion axis, 
+// then sweeping through them. Used to check countBinnedIons
+void referenceBinnedIons(const vector<IonHit> &ions, const RangeFile *rng,
+			const vector<size_t> &selectedIons, const SEGMENT_OPTION &segmentOptions,
+			vector<GRID_ENTRY> &completedGridEntries)
+{
+	map<size_t,size_t> selectionMapping;
+	for(size_t ui=0;ui<selectedIons.size();ui++)
+		selectionMapping[selectedIons[ui]] = ui;
+
+	vector<IonHit> filteredIons;
+	for(size_t ui=0;ui<ions.size();ui++)
+	{
+		unsigned int ionID;
+		ionID = rng->getIonID(ions[ui].getMassToCharge());
+		if(ionID != (unsigned int)-1 && 
+			selectionMapping.find(ionID) != selectionMapping.end())
+			filteredIons.push_back(ions[ui]);
+	}
+	
+	BoundCube totalBound;
+	IonHit::getBoundCube(filteredIons,totalBound);
+
+	unsigned int extrusionAxis=segmentOptions.extrusionDirection;
+	std::stable_sort(filteredIons.begin(), filteredIons.end(),
+					IonAxisCompare(extrusionAxis));
+
+	unsigned int direction[2];
+	float binLen[2];
+	unsigned int nBins[2];
+	direction[0]=(extrusionAxis+1)%3;
+	direction[1]=(extrusionAxis+2)%3;
+
+	float desiredVolume,targetL;
+	desiredVolume= (float)segmentOptions.nIons/(float)filteredIons.size()*totalBound.volume();
+	targetL = powf(desiredVolume,1.0f/3.0f);
+	for(size_t ui=0; ui<2;ui++)
+	{
+		float s;
+		s= totalBound.getSize(direction[ui]);
+		nBins[ui] = s/targetL+1;
+		binLen[ui] = s/nBins[ui]+1;
+	}
+
+	vector<GRID_ENTRY> gridEntries(nBins[0]*nBins[1]);
+	float zStart = totalBound.getBound(extrusionAxis,0);
+	for(size_t ui=0;ui<gridEntries.size();ui++)
+	{
+		gridEntries[ui].nIons.resize(selectedIons.size(),0);
+		gridEntries[ui].totalIons=0;
+		gridEntries[ui].startPt[extrusionAxis]=gridEntries[ui].endPt[extrusionAxis]=zStart;
+		setGridABCoords(ui,direction,nBins,binLen,totalBound,gridEntries[ui]);
+	}
+
+	Point3D lowBound;
+	totalBound.getBound(lowBound,0);
+	for(size_t ui=0;ui<filteredIons.size(); ui++)
+	{	
+		Point3D ionOffset;
+		ionOffset=filteredIons[ui].getPos() - lowBound;
+		unsigned int xPos,yPos;
+		xPos =ionOffset[direction[0]]/binLen[0];
+		yPos = ionOffset[direction[1]]/binLen[1];
+
+		GRID_ENTRY &g=gridEntries[rowMajorOffset(xPos,yPos,nBins[1])];
+		g.nIons[selectionMapping[rng->getIonID(filteredIons[ui].getMassToCharge())]]++;
+		g.totalIons++;
+		g.endPt[extrusionAxis]=ionOffset[extrusionAxis];
+
+		if(g.totalIons ==segmentOptions.nIons)
+		{
+			g.endPt[extrusionAxis] = filteredIons[ui].getPos()[extrusionAxis];
+			completedGridEntries.push_back(g);
+
+			g.startPt[extrusionAxis] =filteredIons[ui].getPos()[extrusionAxis];
+			g.endPt[extrusionAxis]=filteredIons[ui].getPos()[extrusionAxis];
+			for(size_t uj=0;uj<selectedIons.size();uj++)
+				g.nIons[uj]=0;
+			g.totalIons=0;
+		}
+	}
+}
+
+//Check the segmentation against a full sort of the ions
+bool testBinomialSegmentation()
+{
+	RangeFile rng;
+
+	RGBf col;
+	col.red=col.green=col.blue=0.5f;
+	rng.addIon("A","A",col);
+	rng.addIon("B","B",col);
+	rng.addIon("C","C",col);
+	rng.addRange(0.5,1.5,rng.getIonID("A"));
+	rng.addRange(1.5,2.5,rng.getIonID("B"));
+	rng.addRange(2.5,3.5,rng.getIonID("C"));
+
+	//Positions along the extrusion axis are unique, so the order
+	// in which ions are encountered is well defined
+	const unsigned int NUM_IONS=20000;
+	vector<IonHit> ions(NUM_IONS);
+	RandNumGen rnd;
+	rnd.initTimer();
+	for(unsigned int ui=0;ui<NUM_IONS; ui++)
+	{
+		ions[ui].setPos(rnd.genUniformDev()*10.0f,rnd.genUniformDev()*10.0f,
+				(float)((ui*7919)%NUM_IONS)/100.0f);
+		//Include unranged ions, and ions of an unselected species
+		ions[ui].setMassToCharge(rnd.genUniformDev()*4.0f);
+	}
+
+	vector<size_t> selectedIons;
+	selectedIons.push_back(rng.getIonID("A"));
+	selectedIons.push_back(rng.getIonID("C"));
+
+	SEGMENT_OPTION segOpt;
+	segOpt.nIons=25;
+	segOpt.extrusionDirection=2;
+	//Keep every grid, as the reference does not cut by aspect ratio
+	segOpt.extrudeMaxRatio=std::numeric_limits<float>::max();
+	segOpt.strategy=BINOMIAL_SEGMENT_AUTO_BRICK;
+
+	vector<GRID_ENTRY> g,gRef;
+	TEST(!countBinnedIons(ions,&rng,selectedIons,segOpt,g),"binomial binning");
+	referenceBinnedIons(ions,&rng,selectedIons,segOpt,gRef);
+
+	TEST(g.size() == gRef.size(),"grid count");
+	TEST(g.size() > 100,"grid count");
+	for(size_t ui=0;ui<g.size();ui++)
+	{
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			TEST(g[ui].startPt[uj] == gRef[ui].startPt[uj],"grid start");
+			TEST(g[ui].endPt[uj] == gRef[ui].endPt[uj],"grid end");
+		}
+		TEST(g[ui].totalIons == gRef[ui].totalIons,"grid total");
+		TEST(g[ui].nIons == gRef[ui].nIons,"grid counts");
+	}
+
+	return true;
+}
+
 bool testBinomialBinning()
 {
 	RangeFile rng;
@@ -0,0 +1,498 @@
+/*
+ * cellList.cpp - Uniform cell list for fixed radius neighbour searches
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cellList.h"
+
+#ifdef DEBUG
+#include "common/mathfuncs.h"
+#endif
+
+#include <cmath>
+#include <limits>
+
+using std::vector;
+
+//Maximum number of cells per point. Sparse data uses larger cells,
+// rather than spending memory and time on empty ones
+const float MAX_CELLS_PER_POINT=2.0f;
+
+//Fraction of a cell by which search ranges are widened, so
+// that rounding cannot exclude a cell touched by the sphere
+const float CELL_RANGE_PAD=1e-4f;
+
+//Beyond this number of expected neighbours per search, the tree's
+// whole-subtree counting (cost ~r^2) overtakes scanning cells (cost ~r^3)
+const float CELL_LIST_MAX_NEIGHBOURS=1e6f;
+
+//Below this number of expected neighbours per search, the grid would
+// need more than MAX_CELLS_PER_POINT cells to reach the search radius.
+// Cells then grow beyond the radius, and clustered data can pile up
+// in a few cells, so the tree is the safer choice
+const float CELL_LIST_MIN_NEIGHBOURS=MAX_CELLS_PER_POINT*4.0f/3.0f*M_PI;
+
+CellList::CellList() : cellSize(1.0f)
+{
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		gridOrigin[ui]=0;
+		gridSize[ui]=0;
+	}
+}
+
+void CellList::resetPts(std::vector<Point3D> &pts, bool clear)
+{
+	ptX.resize(pts.size());
+	ptY.resize(pts.size());
+	ptZ.resize(pts.size());
+	origIndex.resize(pts.size());
+
+#pragma omp parallel for
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		ptX[ui]=pts[ui][0];
+		ptY[ui]=pts[ui][1];
+		ptZ[ui]=pts[ui][2];
+		origIndex[ui]=ui;
+	}
+
+	if(clear)
+		pts.clear();
+
+	cellStart.clear();
+}
+
+void CellList::build(float newCellSize)
+{
+	ASSERT(newCellSize > 0);
+
+	cellStart.clear();
+	if(origIndex.empty())
+		return;
+
+	const size_t nPts=origIndex.size();
+
+	//Find the point bounds
+	float bounds[3][2];
+	const vector<float> *coords[3] = {&ptX,&ptY,&ptZ};
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		bounds[ui][0]=bounds[ui][1]=(*coords[ui])[0];
+		for(size_t uj=1;uj<nPts;uj++)
+		{
+			bounds[ui][0]=std::min(bounds[ui][0],(*coords[ui])[uj]);
+			bounds[ui][1]=std::max(bounds[ui][1],(*coords[ui])[uj]);
+		}
+		gridOrigin[ui]=bounds[ui][0];
+	}
+
+	//Size the grid, growing the cells if there would be too many
+	cellSize=newCellSize;
+	double totalCells;
+	do
+	{
+		totalCells=1;
+		for(unsigned int ui=0;ui<3;ui++)
+			totalCells*=floor((bounds[ui][1]-bounds[ui][0])/cellSize)+1.0;
+
+		if(totalCells <= std::max(1.0,(double)MAX_CELLS_PER_POINT*nPts))
+			break;
+
+		cellSize*=cbrt(totalCells/((double)MAX_CELLS_PER_POINT*nPts))*1.01;
+	}while(true);
+
+	for(unsigned int ui=0;ui<3;ui++)
+		gridSize[ui]=(size_t)((bounds[ui][1]-bounds[ui][0])/cellSize)+1;
+
+	const size_t cellCount=gridSize[0]*gridSize[1]*gridSize[2];
+
+	//Find each point's cell, x varying fastest
+	vector<size_t> cellKeys(nPts);
+#pragma omp parallel for
+	for(size_t ui=0;ui<nPts;ui++)
+	{
+		size_t cellIdx[3];
+		const float p[3] = {ptX[ui],ptY[ui],ptZ[ui]};
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			cellIdx[uj]=(size_t)((p[uj]-gridOrigin[uj])/cellSize);
+			cellIdx[uj]=std::min(cellIdx[uj],gridSize[uj]-1);
+		}
+		cellKeys[ui]=cellIdx[0] + gridSize[0]*(cellIdx[1] + gridSize[1]*cellIdx[2]);
+	}
+
+	//Counting sort by cell
+	cellStart.assign(cellCount+1,0);
+	for(size_t ui=0;ui<nPts;ui++)
+		cellStart[cellKeys[ui]+1]++;
+	for(size_t ui=0;ui<cellCount;ui++)
+		cellStart[ui+1]+=cellStart[ui];
+
+	vector<size_t> insertPos(cellStart.begin(),cellStart.end()-1);
+	vector<float> sortX(nPts),sortY(nPts),sortZ(nPts);
+	vector<size_t> sortIndex(nPts);
+	for(size_t ui=0;ui<nPts;ui++)
+	{
+		size_t dest;
+		dest=insertPos[cellKeys[ui]]++;
+		sortX[dest]=ptX[ui];
+		sortY[dest]=ptY[ui];
+		sortZ[dest]=ptZ[ui];
+		sortIndex[dest]=origIndex[ui];
+	}
+
+	ptX.swap(sortX);
+	ptY.swap(sortY);
+	ptZ.swap(sortZ);
+	origIndex.swap(sortIndex);
+}
+
+bool CellList::cellRange(unsigned int axis, float low, float high,
+				size_t &first, size_t &last) const
+{
+	float lowCell,highCell;
+	lowCell=(low-gridOrigin[axis])/cellSize - CELL_RANGE_PAD;
+	highCell=(high-gridOrigin[axis])/cellSize + CELL_RANGE_PAD;
+
+	if(highCell < 0 || lowCell >= (float)gridSize[axis])
+		return false;
+
+	first = lowCell < 0 ? 0 : (size_t)lowCell;
+	last = std::min((size_t)highCell,gridSize[axis]-1);
+	return true;
+}
+
+float CellList::sqrDistToCell(unsigned int axis, float value, size_t cell) const
+{
+	float delta;
+	delta=value - (gridOrigin[axis]+cell*cellSize);
+	if(delta < 0)
+		return delta*delta;
+
+	delta-=cellSize;
+	if(delta > 0)
+		return delta*delta;
+
+	return 0;
+}
+
+bool CellList::rowRange(const Point3D &origin, float sqrRadius, size_t iy, size_t iz,
+				size_t &start, size_t &end) const
+{
+	//What is left of the radius after moving across to this row
+	float sqrRemain;
+	sqrRemain=sqrRadius*(1.0f+CELL_RANGE_PAD) - sqrDistToCell(1,origin[1],iy)
+					- sqrDistToCell(2,origin[2],iz);
+	if(sqrRemain < 0)
+		return false;
+
+	size_t first,last;
+	float remain;
+	remain=sqrt(sqrRemain);
+	if(!cellRange(0,origin[0]-remain,origin[0]+remain,first,last))
+		return false;
+
+	const size_t rowKey=gridSize[0]*(iy + gridSize[1]*iz);
+	start=cellStart[rowKey+first];
+	end=cellStart[rowKey+last+1];
+	return start!=end;
+}
+
+size_t CellList::countPtsInSphere(const Point3D &origin, float radius,
+				bool excludeSelf, float selfSqrDist) const
+{
+	if(cellStart.empty())
+		return 0;
+
+	size_t yFirst,yLast,zFirst,zLast;
+	if(!cellRange(1,origin[1]-radius,origin[1]+radius,yFirst,yLast) ||
+		!cellRange(2,origin[2]-radius,origin[2]+radius,zFirst,zLast))
+		return 0;
+
+	const float sqrRadius=radius*radius;
+	//Points this close are excluded. Distances are never negative,
+	// so a negative limit excludes nothing
+	const float selfLimit = excludeSelf ? selfSqrDist : -1.0f;
+	const float ox=origin[0], oy=origin[1], oz=origin[2];
+	const float *px=&ptX[0], *py=&ptY[0], *pz=&ptZ[0];
+
+	size_t count=0;
+	for(size_t iz=zFirst;iz<=zLast;iz++)
+	{
+		for(size_t iy=yFirst;iy<=yLast;iy++)
+		{
+			size_t start,end;
+			if(!rowRange(origin,sqrRadius,iy,iz,start,end))
+				continue;
+
+			//Branch free, so the compiler can vectorise the distance tests
+			unsigned int rowCount=0;
+#if defined(_OPENMP) && _OPENMP >= 201307
+#pragma omp simd reduction(+:rowCount)
+#endif
+			for(size_t ui=start;ui<end;ui++)
+			{
+				float dx,dy,dz,sqrDist;
+				dx=px[ui]-ox;
+				dy=py[ui]-oy;
+				dz=pz[ui]-oz;
+				sqrDist=dx*dx+dy*dy+dz*dz;
+				rowCount+=(sqrDist < sqrRadius) & (sqrDist > selfLimit);
+			}
+			count+=rowCount;
+		}
+	}
+
+	return count;
+}
+
+void CellList::ptsInSphere(const Point3D &origin, float radius,
+				vector<size_t> &pts) const
+{
+	if(cellStart.empty())
+		return;
+
+	size_t yFirst,yLast,zFirst,zLast;
+	if(!cellRange(1,origin[1]-radius,origin[1]+radius,yFirst,yLast) ||
+		!cellRange(2,origin[2]-radius,origin[2]+radius,zFirst,zLast))
+		return;
+
+	const float sqrRadius=radius*radius;
+	for(size_t iz=zFirst;iz<=zLast;iz++)
+	{
+		for(size_t iy=yFirst;iy<=yLast;iy++)
+		{
+			size_t start,end;
+			if(!rowRange(origin,sqrRadius,iy,iz,start,end))
+				continue;
+
+			for(size_t ui=start;ui<end;ui++)
+			{
+				float dx,dy,dz;
+				dx=ptX[ui]-origin[0];
+				dy=ptY[ui]-origin[1];
+				dz=ptZ[ui]-origin[2];
+				if(dx*dx+dy*dy+dz*dz < sqrRadius)
+					pts.push_back(ui);
+			}
+		}
+	}
+}
+
+Point3D CellList::getPt(size_t index) const
+{
+	ASSERT(index < ptX.size());
+	return Point3D(ptX[index],ptY[index],ptZ[index]);
+}
+
+size_t CellList::getOrigIndex(size_t index) const
+{
+	ASSERT(index < origIndex.size());
+	return origIndex[index];
+}
+
+FixedRadiusSearch::FixedRadiusSearch() : useCellList(false), radius(0)
+{
+}
+
+bool FixedRadiusSearch::preferCellList(size_t numPts, const BoundCube &bounds, float radius)
+{
+	if(!numPts || !bounds.isValid() || radius <=0)
+		return false;
+
+	//Flat or degenerate data has no meaningful volume density
+	float vol;
+	vol=bounds.volume();
+	if(vol <= std::numeric_limits<float>::epsilon())
+		return false;
+
+	//Expected number of neighbours in each search, assuming uniform density
+	float neighbours;
+	neighbours = (float)numPts/vol*4.0f/3.0f*M_PI*radius*radius*radius;
+
+	return neighbours >= CELL_LIST_MIN_NEIGHBOURS &&
+			neighbours <= CELL_LIST_MAX_NEIGHBOURS;
+}
+
+void FixedRadiusSearch::resetPts(std::vector<Point3D> &pts, float searchRadius, bool clear)
+{
+	radius=searchRadius;
+
+	BoundCube bounds;
+	if(!pts.empty())
+		bounds.setBounds(pts);
+	useCellList=preferCellList(pts.size(),bounds,radius);
+
+	cellList=CellList();
+	tree.clear();
+	if(useCellList)
+		cellList.resetPts(pts,clear);
+	else
+		tree.resetPts(pts,clear);
+}
+
+bool FixedRadiusSearch::build()
+{
+	if(useCellList)
+	{
+		cellList.build(radius);
+		return true;
+	}
+
+	return tree.build();
+}
+
+size_t FixedRadiusSearch::countPtsInSphere(const Point3D &origin,
+				bool excludeSelf, float selfSqrDist) const
+{
+	if(useCellList)
+		return cellList.countPtsInSphere(origin,radius,excludeSelf,selfSqrDist);
+	else
+		return tree.countPtsInSphere(origin,radius,excludeSelf,selfSqrDist);
+}
+
+void FixedRadiusSearch::ptsInSphere(const Point3D &origin, vector<size_t> &pts) const
+{
+	size_t firstNew=pts.size();
+	if(useCellList)
+	{
+		cellList.ptsInSphere(origin,radius,pts);
+		for(size_t ui=firstNew;ui<pts.size();ui++)
+			pts[ui]=cellList.getOrigIndex(pts[ui]);
+	}
+	else
+	{
+		tree.ptsInSphere(origin,radius,pts);
+		for(size_t ui=firstNew;ui<pts.size();ui++)
+			pts[ui]=tree.getOrigIndex(pts[ui]);
+	}
+}
+
+#ifdef DEBUG
+
+bool cellListTests()
+{
+	RandNumGen rng;
+	rng.initTimer();
+
+	//Points at roughly the density of a reconstruction (~40/nm^3)
+	const unsigned int NUM_PTS=20000;
+	const float BOX_SIZE=8.0f;
+	vector<Point3D> pts(NUM_PTS);
+	for(unsigned int ui=0;ui<NUM_PTS;ui++)
+	{
+		pts[ui]=Point3D(rng.genUniformDev()*BOX_SIZE,
+			rng.genUniformDev()*BOX_SIZE,rng.genUniformDev()*BOX_SIZE);
+	}
+	//Duplicate some points, so that self-exclusion has coincident points to drop
+	for(unsigned int ui=0;ui<50;ui++)
+		pts[NUM_PTS-1-ui]=pts[ui];
+
+	K3DTreeMk2 tree;
+	vector<Point3D> ptsCopy;
+	ptsCopy=pts;
+	tree.resetPts(ptsCopy);
+	TEST(tree.build(),"Tree build");
+
+	//Check searches agree with the tree, at, below and above the cell size
+	const float RADII[] = {0.5f,1.0f,1.3f,2.5f};
+	for(unsigned int ui=0;ui<4;ui++)
+	{
+		CellList cells;
+		ptsCopy=pts;
+		cells.resetPts(ptsCopy);
+		cells.build(1.0f);
+		TEST(cells.size() == NUM_PTS,"cell list size");
+
+		for(unsigned int uj=0;uj<200;uj++)
+		{
+			//Search about both data points, and arbitrary points (some outside the data)
+			Point3D origin;
+			if(uj%2)
+				origin=pts[uj];
+			else
+			{
+				origin=Point3D(rng.genUniformDev()*(BOX_SIZE+2)-1,
+					rng.genUniformDev()*(BOX_SIZE+2)-1,
+					rng.genUniformDev()*(BOX_SIZE+2)-1);
+			}
+
+			TEST(cells.countPtsInSphere(origin,RADII[ui]) ==
+				tree.countPtsInSphere(origin,RADII[ui]),"count matches tree");
+			TEST(cells.countPtsInSphere(origin,RADII[ui],true) ==
+				tree.countPtsInSphere(origin,RADII[ui],true),"self-excluded count matches tree");
+
+			vector<size_t> found;
+			cells.ptsInSphere(origin,RADII[ui],found);
+			TEST(found.size() == cells.countPtsInSphere(origin,RADII[ui]),"enumeration matches count");
+			for(size_t uk=0;uk<found.size();uk++)
+			{
+				TEST(pts[cells.getOrigIndex(found[uk])].sqrDist(origin) <
+					RADII[ui]*RADII[ui],"found point in sphere");
+			}
+		}
+	}
+
+	//Sparse data should grow the cells, rather than allocate a huge grid
+	{
+		vector<Point3D> sparse;
+		sparse.push_back(Point3D(0,0,0));
+		sparse.push_back(Point3D(1000,1000,1000));
+		sparse.push_back(Point3D(1000,1000,1000.5));
+		CellList cells;
+		cells.resetPts(sparse);
+		cells.build(1.0f);
+		TEST(cells.numCells() <= 6,"sparse cell count");
+		TEST(cells.countPtsInSphere(Point3D(1000,1000,1000),1.0f) == 2,"sparse count");
+		TEST(cells.countPtsInSphere(Point3D(1000,1000,1000),1.0f,true) == 1,"sparse self-excluded count");
+	}
+
+	//Engine selection: a reconstruction-like density at 1-2nm radii
+	// should use the cell list. Very sparse or very large searches should not
+	BoundCube bc;
+	bc.setBounds(Point3D(0,0,0),Point3D(10,10,10));
+	TEST(FixedRadiusSearch::preferCellList(40000,bc,1.0f),"cell list choice");
+	TEST(FixedRadiusSearch::preferCellList(40000,bc,2.0f),"cell list choice");
+	TEST(!FixedRadiusSearch::preferCellList(40,bc,1.0f),"sparse tree choice");
+	TEST(!FixedRadiusSearch::preferCellList(4000000,bc,5.0f),"large radius tree choice");
+
+	//Both engines should give the same answers through the common interface
+	for(unsigned int ui=0;ui<2;ui++)
+	{
+		FixedRadiusSearch search;
+		ptsCopy=pts;
+		//~40/nm^3 at 1 nm selects the cell list, at 0.2 nm the tree
+		float radius = ui ? 0.2f : 1.0f;
+		search.resetPts(ptsCopy,radius);
+		TEST(search.usingCellList() == !ui,"engine selection");
+		TEST(search.build(),"search build");
+
+		for(unsigned int uj=0;uj<100;uj++)
+		{
+			vector<size_t> found;
+			search.ptsInSphere(pts[uj],found);
+			TEST(found.size() == search.countPtsInSphere(pts[uj]),"search count");
+			TEST(found.size() == tree.countPtsInSphere(pts[uj],radius),"search count matches tree");
+			for(size_t uk=0;uk<found.size();uk++)
+				TEST(pts[found[uk]].sqrDist(pts[uj]) < radius*radius,"search index mapping");
+		}
+	}
+
+	return true;
+}
+
+#endif
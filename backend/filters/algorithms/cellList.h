@@ -0,0 +1,137 @@
+/*
+ * cellList.h - Uniform cell list for fixed radius neighbour searches
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CELLLIST_H
+#define CELLLIST_H
+
+#include <vector>
+
+#include "K3DTree-mk2.h"
+
+//!Uniform grid of cubic cells, for repeated searches at a fixed radius
+/*! Points are stored sorted by cell, x fastest, in separate coordinate
+ * arrays. A row of cells along x is then one contiguous block, so a
+ * search about a point with radius no larger than the cell size scans
+ * at most 9 contiguous blocks (the 27 neighbouring cells).
+ */
+class CellList
+{
+	private:
+		//!Point coordinates, sorted by cell
+		std::vector<float> ptX,ptY,ptZ;
+		//!Offset of each point in the array given to resetPts
+		std::vector<size_t> origIndex;
+		//!Start offset of each cell's points. Has one more entry than there are cells
+		std::vector<size_t> cellStart;
+
+		//!Lower corner of the grid
+		float gridOrigin[3];
+		//!Number of cells along each axis
+		size_t gridSize[3];
+		//!Edge length of each cell
+		float cellSize;
+
+		//!Find the range of cells along the given axis that overlap [low,high].
+		// returns false if there are none
+		bool cellRange(unsigned int axis, float low, float high,
+					size_t &first, size_t &last) const;
+
+		//!Squared distance from value to the nearest part of cell, along axis
+		float sqrDistToCell(unsigned int axis, float value, size_t cell) const;
+
+		//!Find the range of point offsets within radius of origin, in the row
+		// of cells at (iy,iz). Returns false if the row cannot hold any such point
+		bool rowRange(const Point3D &origin, float sqrRadius, size_t iy, size_t iz,
+				size_t &start, size_t &end) const;
+	public:
+		CellList();
+
+		//!Set the points to search. The grid is not usable until build() is called
+		void resetPts(std::vector<Point3D> &pts, bool clear=true);
+
+		//!Bin the points into cells of the given size. Searches work with
+		// any radius, but are fastest for radii at, or just below, the cell size
+		void build(float cellSize);
+
+		//!Number of points held
+		size_t size() const { return origIndex.size();}
+
+		//!Number of cells in the grid
+		size_t numCells() const { return cellStart.empty() ? 0 : cellStart.size()-1;}
+
+		//!Count the points that lie within the sphere (pts < radius). If excludeSelf
+		// is set, points with a sqr distance to the origin of selfSqrDist or
+		// less are not counted (by default, exact coincidence only)
+		size_t countPtsInSphere(const Point3D &origin, float radius,
+				bool excludeSelf=false, float selfSqrDist=0.0f) const;
+
+		//!Find the indices of all points that lie within the sphere (pts < radius).
+		// Indices are internal; use getOrigIndex to map back to the input array
+		void ptsInSphere(const Point3D &origin, float radius,
+				std::vector<size_t> &pts) const;
+
+		//Obtain a point from its internal index
+		Point3D getPt(size_t index) const;
+
+		//Convert an internal index into the offset in the array given to resetPts
+		size_t getOrigIndex(size_t index) const;
+};
+
+//!Fixed radius neighbour search, using whichever of a cell list or KD tree
+// is expected to be faster for the given radius and point density
+class FixedRadiusSearch
+{
+	private:
+		CellList cellList;
+		K3DTreeMk2 tree;
+		bool useCellList;
+		float radius;
+	public:
+		FixedRadiusSearch();
+
+		//!True if, for points with the given count and bounds, a cell list
+		// is expected to outperform the KD tree for searches at this radius
+		static bool preferCellList(size_t numPts, const BoundCube &bounds, float radius);
+
+		//!Set the points and the search radius, and select the search engine
+		void resetPts(std::vector<Point3D> &pts, float radius, bool clear=true);
+
+		//!Build the search engine. Returns false if the build was aborted
+		bool build();
+
+		//!Count the points within the search radius. See CellList::countPtsInSphere
+		size_t countPtsInSphere(const Point3D &origin,
+				bool excludeSelf=false, float selfSqrDist=0.0f) const;
+
+		//!Find the points within the search radius, as offsets in the
+		// array given to resetPts
+		void ptsInSphere(const Point3D &origin, std::vector<size_t> &pts) const;
+
+		//!True if the cell list was selected, false for the KD tree
+		bool usingCellList() const { return useCellList;}
+
+		//!Number of points held
+		size_t size() const { return useCellList ? cellList.size() : tree.size();}
+};
+
+#ifdef DEBUG
+//Cell list unit tests
+// - return true on OK, false on fail
+bool cellListTests();
+#endif
+#endif
@@ -36,7 +36,7 @@ using std::vector;
 #endif
 extern "C"
 {
-	#include <qhull/qhull_a.h>
+	#include <libqhull_r/qhull_ra.h>
 }
 #ifdef __POWERPC__
 	#pragma pop_macro("__POWERPC__")
@@ -191,9 +191,11 @@ unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim
 	if(points.size() < 4) 
 		return 1;
 
-	unsigned int dummyProg;
+	//Keep the hull, so we can examine its facets
+	qhT qhState;
+	qhT *qh=&qhState;
 	vector<Point3D> theHull;
-	if(computeConvexHull(points,progress,wantAbort,theHull,false,false))
+	if(computeConvexHull(points,progress,wantAbort,theHull,0,qh))
 		return 2;
 
 	Point3D midPoint(0,0,0);
@@ -211,9 +213,9 @@ unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim
 	Point3D hullCentroid(0.0f,0.0f,0.0f);
 	float massPyramids=0.0f;
 	//Run through the faced list
-	facetT *curFac = qh facet_list;
+	facetT *curFac = qh->facet_list;
 	
-	while(curFac != qh facet_tail)
+	while(curFac != qh->facet_tail)
 	{
 		vertexT *vertex;
 		Point3D pyramidCentroid;
@@ -265,8 +267,8 @@ unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim
 	float minDist=std::numeric_limits<float>::max();
 	//find the smallest distance between the centroid and the
 	//convex hull
-       	curFac=qh facet_list;
-	while(curFac != qh facet_tail)
+       	curFac=qh->facet_list;
+	while(curFac != qh->facet_tail)
 	{
 		float temp;
 		Point3D vertexPt[3];
@@ -299,15 +301,18 @@ unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim
 	scaleFactor = 1  - reductionDim/ minDist;
 
 	if(scaleFactor < 0.0f)
+	{
+		freeConvexHull(qh);
 		return RDF_ERR_NEGATIVE_SCALE_FACT;
+	}
 
 	
 	//now scan through the input points and see if they
 	//lie in the reduced convex hull
-	vertexT *vertex = qh vertex_list;	
+	vertexT *vertex = qh->vertex_list;	
 
 	unsigned int ui=0;
-	while(vertex !=qh vertex_tail)
+	while(vertex !=qh->vertex_tail)
 	{
 		//Translate around hullCentroid before scaling, 
 		//then undo translation after scale
@@ -325,7 +330,7 @@ unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim
 	//convex hull F1, F2, ... , Fn is negative,
 	//then P does NOT lie inside the convex hull.
 	pointResult.reserve(points.size()/2);
-	curFac = qh facet_list;
+	curFac = qh->facet_list;
 	
 	//minimum distance from centroid to convex hull
 	for(unsigned int ui=points.size(); ui--;)
@@ -337,8 +342,8 @@ unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim
 		fZ = points[ui][2];
 		
 		//loop through the facets
-		curFac = qh facet_list;
-		while(curFac != qh facet_tail)
+		curFac = qh->facet_list;
+		while(curFac != qh->facet_tail)
 		{
 			//Dont ask. It just grabs the first coords of the vertex
 			//associated with this facet
@@ -366,7 +371,7 @@ reduced_loop_next:
 	;
 	}
 
-	freeConvexHull();
+	freeConvexHull(qh);
 
 	return 0;
 }
@@ -0,0 +1,697 @@
+/*
+ * sparseVoxels.cpp - Sparse voxel storage, backed by an OpenVDB grid
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sparseVoxels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include <openvdb/tree/LeafManager.h>
+#include <openvdb/tools/Prune.h>
+
+#ifdef DEBUG
+#include "common/mathfuncs.h"
+#endif
+
+using std::vector;
+
+SparseVoxels::SparseVoxels() : minBound(0,0,0), maxBound(0,0,0)
+{
+	grid=openvdb::FloatGrid::create(0.0f);
+	for(unsigned int ui=0;ui<3;ui++)
+		binCount[ui]=0;
+}
+
+SparseVoxels::SparseVoxels(const SparseVoxels &v)
+{
+	*this=v;
+}
+
+SparseVoxels &SparseVoxels::operator=(const SparseVoxels &v)
+{
+	if(this == &v)
+		return *this;
+
+	grid=v.grid->deepCopy();
+	for(unsigned int ui=0;ui<3;ui++)
+		binCount[ui]=v.binCount[ui];
+	minBound=v.minBound;
+	maxBound=v.maxBound;
+	return *this;
+}
+
+void SparseVoxels::init(size_t nX, size_t nY, size_t nZ, const BoundCube &bounds)
+{
+	binCount[0]=nX;
+	binCount[1]=nY;
+	binCount[2]=nZ;
+	bounds.getBounds(minBound,maxBound);
+
+	grid=openvdb::FloatGrid::create(0.0f);
+
+	//Index (x,y,z) maps to the lower corner of that voxel
+	Point3D pitch=getPitch();
+	openvdb::math::Transform::Ptr xform=openvdb::math::Transform::createLinearTransform(1.0);
+	xform->preScale(openvdb::Vec3d(pitch[0],pitch[1],pitch[2]));
+	xform->postTranslate(openvdb::Vec3d(minBound[0],minBound[1],minBound[2]));
+	grid->setTransform(xform);
+}
+
+void SparseVoxels::clear()
+{
+	grid->clear();
+}
+
+void SparseVoxels::getSize(size_t &x, size_t &y, size_t &z) const
+{
+	x=binCount[0];
+	y=binCount[1];
+	z=binCount[2];
+}
+
+void SparseVoxels::getAxisBounds(size_t axis, float &minV, float &maxV) const
+{
+	minV=minBound[axis];
+	maxV=maxBound[axis];
+}
+
+Point3D SparseVoxels::getPitch() const
+{
+	return Point3D((float)1.0/(float)binCount[0]*(maxBound[0]-minBound[0]),
+			(float)1.0/(float)binCount[1]*(maxBound[1]-minBound[1]),
+			(float)1.0/(float)binCount[2]*(maxBound[2]-minBound[2]));
+}
+
+float SparseVoxels::getBinVolume() const
+{
+	Point3D size = maxBound - minBound;
+	double volume = 1.0;
+	for (int i = 0; i < 3; i++)
+		volume *= size[i] / binCount[i];
+
+	return volume;
+}
+
+void SparseVoxels::getIndexWithUpper(size_t &x, size_t &y, size_t &z, const Point3D &p) const
+{
+	x=(size_t)((p[0]-minBound[0])/(maxBound[0]-minBound[0])*(float)binCount[0]);
+	y=(size_t)((p[1]-minBound[1])/(maxBound[1]-minBound[1])*(float)binCount[1]);
+	z=(size_t)((p[2]-minBound[2])/(maxBound[2]-minBound[2])*(float)binCount[2]);
+
+	//Points on the upper bound belong to the last voxel
+	if(x==binCount[0] &&
+		fabs(p[0] -maxBound[0]) < sqrtf(std::numeric_limits<float>::epsilon()))
+		x--;
+	if(y==binCount[1] &&
+		fabs(p[1] -maxBound[1]) < sqrtf(std::numeric_limits<float>::epsilon()))
+		y--;
+	if(z==binCount[2] &&
+		fabs(p[2] -maxBound[2]) < sqrtf(std::numeric_limits<float>::epsilon()))
+		z--;
+}
+
+float SparseVoxels::getData(size_t x, size_t y, size_t z) const
+{
+	ASSERT(x < binCount[0] && y < binCount[1] && z < binCount[2]);
+	return grid->getConstAccessor().getValue(openvdb::Coord(x,y,z));
+}
+
+void SparseVoxels::setData(size_t x, size_t y, size_t z, float v)
+{
+	ASSERT(x < binCount[0] && y < binCount[1] && z < binCount[2]);
+	grid->getAccessor().setValue(openvdb::Coord(x,y,z),v);
+}
+
+void SparseVoxels::minMax(float &min, float &max) const
+{
+	//Empty voxels hold zero
+	bool haveValue=false;
+	if(numActive() < getSize())
+	{
+		min=max=0;
+		haveValue=true;
+	}
+
+	for(openvdb::FloatGrid::ValueOnCIter it=grid->cbeginValueOn(); it; ++it)
+	{
+		float v=it.getValue();
+		if(!haveValue)
+		{
+			min=max=v;
+			haveValue=true;
+		}
+		else
+		{
+			min=std::min(min,v);
+			max=std::max(max,v);
+		}
+	}
+
+	if(!haveValue)
+		min=max=0;
+}
+
+void SparseVoxels::calculateDensity()
+{
+	Point3D size = maxBound - minBound;
+	// calculate the volume of a voxel
+	double volume = 1.0;
+	for (int i = 0; i < 3; i++)
+		volume *= size[i] / binCount[i];
+
+	for(openvdb::FloatGrid::ValueOnIter it=grid->beginValueOn(); it; ++it)
+		it.setValue(it.getValue()/volume);
+}
+
+void SparseVoxels::operator/=(const SparseVoxels &v)
+{
+	ASSERT(v.getSize() == getSize());
+
+	//Empty voxels are 0/b, which stays zero
+	openvdb::FloatGrid::ConstAccessor denom=v.grid->getConstAccessor();
+	for(openvdb::FloatGrid::ValueOnIter it=grid->beginValueOn(); it; ++it)
+	{
+		float d=denom.getValue(it.getCoord());
+		if(d)
+			it.setValue(it.getValue()/d);
+		else
+		{
+			ASSERT(!it.getValue());
+		}
+	}
+}
+
+bool SparseVoxels::convolveAxis(const openvdb::FloatGrid &src, unsigned int axis,
+		const vector<float> &kernel, openvdb::FloatGrid::Ptr &result,
+		ATOMIC_BOOL &wantAbort) const
+{
+	typedef openvdb::FloatTree::LeafNodeType LeafType;
+
+	ASSERT(axis < 3);
+	ASSERT(kernel.size() % 2);
+
+	const long radius=kernel.size()/2;
+	const long n=binCount[axis];
+	const long leafDim=LeafType::DIM;
+
+	//Output extends at most one radius along the axis beyond the
+	// input. Give the result the input's leaves, plus those within
+	// this distance along the axis, then fill these in place
+	result=openvdb::FloatGrid::create(0.0f);
+	result->setTransform(src.transform().copy());
+	openvdb::FloatTree &tree=result->tree();
+	tree.topologyUnion(src.tree());
+	tree.voxelizeActiveTiles();
+
+	vector<openvdb::Coord> origins;
+	for(openvdb::FloatTree::LeafCIter it=tree.cbeginLeaf(); it; ++it)
+		origins.push_back(it->origin());
+	for(size_t ui=0;ui<origins.size();ui++)
+	{
+		openvdb::Coord c=origins[ui];
+		long lo=std::max(0L,(long)c[axis]-radius);
+		long hi=std::min(n-1,(long)c[axis]+leafDim-1+radius);
+		for(long p=lo-lo%leafDim;p<=hi;p+=leafDim)
+		{
+			c[axis]=p;
+			tree.touchLeaf(c);
+		}
+	}
+	vector<openvdb::Coord>().swap(origins);
+
+	//Each leaf is filtered independently, reading the input through
+	// a per-thread accessor
+	openvdb::tree::LeafManager<openvdb::FloatTree> leaves(tree);
+	const long nLeaves=leaves.leafCount();
+	bool spin=false;
+#pragma omp parallel
+	{
+	openvdb::FloatGrid::ConstAccessor acc=src.getConstAccessor();
+#pragma omp for schedule(dynamic)
+	for(long ui=0;ui<nLeaves;ui++)
+	{
+		if(spin)
+			continue;
+
+		LeafType &leaf=leaves.leaf(ui);
+		for(openvdb::Index uj=0;uj<LeafType::SIZE;uj++)
+		{
+			const openvdb::Coord c=leaf.offsetToGlobalCoord(uj);
+			const long o=c[axis];
+			float sum=0;
+			if(o < n)
+			{
+				openvdb::Coord s=c;
+				for(long k=-radius;k<=radius;k++)
+				{
+					s[axis]=mirrorVoxelIndex(o+k,n);
+					sum+=kernel[k+radius]*acc.getValue(s);
+				}
+			}
+
+			//Zero is the background value, so need not be stored
+			if(sum)
+				leaf.setValueOn(uj,sum);
+			else
+				leaf.setValueOff(uj,0.0f);
+		}
+
+		if(wantAbort)
+			spin=true;
+	}
+	}
+
+	if(spin)
+		return false;
+
+	openvdb::tools::pruneInactive(tree);
+	return true;
+}
+
+bool SparseVoxels::separableConvolve(const vector<float> *kernels[3],
+		openvdb::FloatGrid::Ptr &result, ATOMIC_BOOL &wantAbort) const
+{
+	openvdb::FloatGrid::Ptr cur=grid;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		openvdb::FloatGrid::Ptr next;
+		if(!convolveAxis(*cur,ui,*(kernels[ui]),next,wantAbort))
+			return false;
+		cur=next;
+	}
+
+	result=cur;
+	return true;
+}
+
+bool SparseVoxels::isotropicGaussianSmooth(float stdev, float windowRatio, ATOMIC_BOOL &wantAbort)
+{
+	vector<float> gauss;
+	gaussianKernel(stdev,windowRatio,0,gauss);
+
+	const vector<float> *kernels[3]={&gauss,&gauss,&gauss};
+	openvdb::FloatGrid::Ptr result;
+	if(!separableConvolve(kernels,result,wantAbort))
+		return false;
+
+	grid=result;
+	return true;
+}
+
+bool SparseVoxels::laplaceOfGaussian(float stdev, float windowRatio, ATOMIC_BOOL &wantAbort)
+{
+	vector<float> gauss,secondDeriv;
+	gaussianKernel(stdev,windowRatio,0,gauss);
+	gaussianKernel(stdev,windowRatio,2,secondDeriv);
+
+	//Sum the second derivative along each axis, each smoothed
+	// along the other two
+	openvdb::FloatGrid::Ptr sum;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		const vector<float> *kernels[3]={&gauss,&gauss,&gauss};
+		kernels[ui]=&secondDeriv;
+
+		openvdb::FloatGrid::Ptr term;
+		if(!separableConvolve(kernels,term,wantAbort))
+			return false;
+
+		if(!sum)
+			sum=term;
+		else
+			openvdb::tools::compSum(*sum,*term);
+	}
+
+	grid=sum;
+	return true;
+}
+
+void SparseVoxels::getSlice(size_t normalAxis, size_t offset, float *p) const
+{
+	ASSERT(normalAxis < 3);
+	ASSERT(offset < binCount[normalAxis]);
+
+	//In-plane axes, as for Voxels::getSlice. Output is p[posB*nA + posA]
+	size_t dimA,dimB;
+	switch(normalAxis)
+	{
+		case 0:
+			dimA=1;
+			dimB=2;
+			break;
+		case 1:
+			dimA=0;
+			dimB=2;
+			break;
+		case 2:
+			dimA=0;
+			dimB=1;
+			break;
+		default:
+			ASSERT(false);
+	}
+	size_t nA=binCount[dimA];
+
+	openvdb::FloatGrid::ConstAccessor acc=grid->getConstAccessor();
+	openvdb::Coord c;
+	c[normalAxis]=offset;
+	for(size_t ui=0;ui<binCount[dimA];ui++)
+	{
+		c[dimA]=ui;
+		for(size_t uj=0;uj<binCount[dimB];uj++)
+		{
+			c[dimB]=uj;
+			p[uj*nA + ui] = acc.getValue(c);
+		}
+	}
+}
+
+void SparseVoxels::getInterpSlice(size_t normal, float offset,
+		float *p, size_t interpMode) const
+{
+	ASSERT(offset <=1.0f && offset >=0.0f);
+
+	switch(interpMode)
+	{
+		case VOX_INTERP_NONE:
+		{
+			size_t slicePos;
+			slicePos=roundf(offset*binCount[normal]);
+			slicePos=std::min(slicePos,binCount[normal]-1);
+			getSlice(normal,slicePos,p);
+			break;
+		}
+		case VOX_INTERP_LINEAR:
+		{
+			//Find the upper and lower bounds, then
+			// limit them so we don't fall off the end of the dataset
+			size_t sliceUpper,sliceLower;
+			if(binCount[normal] == 1)
+				sliceUpper=sliceLower=0;
+			else
+			{
+				sliceUpper=ceilf(offset*binCount[normal]);
+
+				if(sliceUpper >=binCount[normal])
+					sliceUpper=binCount[normal]-1;
+				else if(sliceUpper==0)
+					sliceUpper=1;
+
+				sliceLower=sliceUpper-1;
+			}
+
+			size_t numEntries=binCount[(normal+1)%3]*binCount[(normal+2)%3];
+			vector<float> pLower(numEntries);
+
+			getSlice(normal,sliceLower,&(pLower[0]));
+			getSlice(normal,sliceUpper,p);
+
+			//Get the decimal part of the float
+			float integ;
+			float delta=modff(offset*binCount[normal],&integ);
+			for(size_t ui=0;ui<numEntries;ui++)
+				p[ui] = delta*(p[ui]-pLower[ui]) + pLower[ui];
+			break;
+		}
+		default:
+			ASSERT(false);
+	}
+}
+
+size_t SparseVoxels::writeFile(const char *filename) const
+{
+	std::ofstream file(filename, std::ios::binary);
+
+	if(!file)
+		return 1;
+
+	//Write a row at a time, x fastest
+	openvdb::FloatGrid::ConstAccessor acc=grid->getConstAccessor();
+	vector<float> row(binCount[0]);
+	for(size_t uk=0;uk<binCount[2];uk++)
+	{
+		for(size_t uj=0;uj<binCount[1];uj++)
+		{
+			for(size_t ui=0;ui<binCount[0];ui++)
+				row[ui]=acc.getValue(openvdb::Coord(ui,uj,uk));
+
+			file.write((const char *)&(row[0]),row.size()*sizeof(float));
+			if(!file.good())
+				return 2;
+		}
+	}
+	return 0;
+}
+
+void SparseVoxels::toDense(Voxels<float> &v) const
+{
+	BoundCube bounds;
+	bounds.setBounds(minBound,maxBound);
+	v.init(binCount[0],binCount[1],binCount[2],bounds);
+	v.fill(0);
+
+	openvdb::FloatGrid::ConstAccessor acc=grid->getConstAccessor();
+	for(openvdb::FloatGrid::ValueOnCIter it=grid->cbeginValueOn(); it; ++it)
+	{
+		openvdb::CoordBBox box;
+		it.getBoundingBox(box);
+		for(openvdb::Int32 uk=box.min()[2];uk<=box.max()[2];uk++)
+		{
+			for(openvdb::Int32 uj=box.min()[1];uj<=box.max()[1];uj++)
+			{
+				for(openvdb::Int32 ui=box.min()[0];ui<=box.max()[0];ui++)
+					v.setData(ui,uj,uk,it.getValue());
+			}
+		}
+	}
+}
+
+#ifdef DEBUG
+
+//Brute force reference for separable filtering, with mirrored boundaries
+static void referenceConvolve(const Voxels<float> &src, const vector<float> *kernels[3],
+					Voxels<float> &dest)
+{
+	size_t n[3];
+	src.getSize(n[0],n[1],n[2]);
+	src.clone(dest);
+
+	Voxels<float> tmp;
+	src.clone(tmp);
+	for(unsigned int axis=0;axis<3;axis++)
+	{
+		const vector<float> &k=*(kernels[axis]);
+		long radius=k.size()/2;
+		for(size_t uk=0;uk<n[2];uk++)
+		{
+			for(size_t uj=0;uj<n[1];uj++)
+			{
+				for(size_t ui=0;ui<n[0];ui++)
+				{
+					size_t c[3]={ui,uj,uk};
+					float sum=0;
+					for(long ul=-radius;ul<=radius;ul++)
+					{
+						size_t s[3]={ui,uj,uk};
+						s[axis]=mirrorVoxelIndex((long)c[axis]+ul,n[axis]);
+						sum+=k[ul+radius]*tmp.getData(s[0],s[1],s[2]);
+					}
+					dest.setData(ui,uj,uk,sum);
+				}
+			}
+		}
+		dest.clone(tmp);
+	}
+}
+
+static bool sameVoxels(const SparseVoxels &s, const Voxels<float> &d, float tol)
+{
+	size_t n[3];
+	d.getSize(n[0],n[1],n[2]);
+	for(size_t uk=0;uk<n[2];uk++)
+	{
+		for(size_t uj=0;uj<n[1];uj++)
+		{
+			for(size_t ui=0;ui<n[0];ui++)
+			{
+				if(fabs(s.getData(ui,uj,uk) - d.getData(ui,uj,uk)) > tol)
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool sparseVoxelTests()
+{
+	RandNumGen rng;
+	rng.initTimer();
+
+	//A thin rod of data along z, touching the z bounds and one x bound,
+	// so that filtering sees both interior and mirrored boundaries
+	const size_t NX=12,NY=9,NZ=15;
+	BoundCube bc;
+	bc.setBounds(Point3D(-1,0,2),Point3D(5,3,9.5));
+
+	SparseVoxels sparse,sparseDenom;
+	Voxels<float> dense,denseDenom;
+	sparse.init(NX,NY,NZ,bc);
+	sparseDenom.init(NX,NY,NZ,bc);
+	dense.init(NX,NY,NZ,bc);
+	denseDenom.init(NX,NY,NZ,bc);
+	for(size_t uk=0;uk<NZ;uk++)
+	{
+		for(size_t uj=3;uj<5;uj++)
+		{
+			for(size_t ui=0;ui<3;ui++)
+			{
+				float denom=floorf(rng.genUniformDev()*10)+1.0f;
+				float v=floorf(rng.genUniformDev()*denom);
+				sparse.setData(ui,uj,uk,v);
+				dense.setData(ui,uj,uk,v);
+				sparseDenom.setData(ui,uj,uk,denom);
+				denseDenom.setData(ui,uj,uk,denom);
+			}
+		}
+	}
+
+	TEST(sparse.numActive() == NZ*2*3,"active voxel count");
+	TEST(sameVoxels(sparse,dense,0),"set/get");
+
+	//Copies must not share data
+	{
+	SparseVoxels copy(sparse);
+	copy.setData(5,5,5,1.0f);
+	TEST(sparse.getData(5,5,5) == 0,"copy independence");
+	}
+
+	//Bounds and indexing
+	Point3D pMin,pMax;
+	sparse.getBounds(pMin,pMax);
+	TEST(pMin == Point3D(-1,0,2) && pMax == Point3D(5,3,9.5),"bounds");
+	TEST(sparse.getPitch() == dense.getPitch(),"pitch");
+	for(unsigned int ui=0;ui<100;ui++)
+	{
+		Point3D p(rng.genUniformDev()*6-1,rng.genUniformDev()*3,
+					rng.genUniformDev()*7.5+2);
+		size_t s[3],d[3];
+		sparse.getIndexWithUpper(s[0],s[1],s[2],p);
+		dense.getIndexWithUpper(d[0],d[1],d[2],p);
+		TEST(s[0] == d[0] && s[1] == d[1] && s[2] == d[2],"index lookup");
+	}
+	size_t s[3];
+	sparse.getIndexWithUpper(s[0],s[1],s[2],pMax);
+	TEST(s[0] == NX-1 && s[1] == NY-1 && s[2] == NZ-1,"upper bound index");
+
+	//Empty voxels take part in the limits
+	float minS,maxS,minD,maxD;
+	sparse.minMax(minS,maxS);
+	dense.minMax(minD,maxD);
+	TEST(minS == minD && maxS == maxD,"min/max");
+
+	//Normalisation
+	{
+	SparseVoxels sparseDensity(sparse);
+	Voxels<float> denseDensity;
+	dense.clone(denseDensity);
+	sparseDensity.calculateDensity();
+	denseDensity.calculateDensity();
+	TEST(sameVoxels(sparseDensity,denseDensity,0),"density");
+
+	SparseVoxels sparseRatio(sparse);
+	Voxels<float> denseRatio;
+	dense.clone(denseRatio);
+	sparseRatio/=sparseDenom;
+	denseRatio/=denseDenom;
+	TEST(sameVoxels(sparseRatio,denseRatio,0),"ratio");
+	}
+
+	//Filtering, against a brute force reference
+	{
+	const float STDEV=1.2f, WINDOW=2.5f;
+	vector<float> gauss,secondDeriv;
+	gaussianKernel(STDEV,WINDOW,0,gauss);
+	gaussianKernel(STDEV,WINDOW,2,secondDeriv);
+	const size_t RADIUS=gauss.size()/2;
+
+	ATOMIC_BOOL wantAbort(false);
+	SparseVoxels sparseGauss(sparse);
+	TEST(sparseGauss.isotropicGaussianSmooth(STDEV,WINDOW,wantAbort),"gaussian");
+	const vector<float> *kernels[3]={&gauss,&gauss,&gauss};
+	Voxels<float> ref;
+	referenceConvolve(dense,kernels,ref);
+	TEST(sameVoxels(sparseGauss,ref,1e-4f),"gaussian values");
+	//Output should not spread beyond the kernel radius
+	TEST(sparseGauss.numActive() <= NZ*(3+RADIUS)*(2+2*RADIUS),"gaussian support");
+
+	SparseVoxels sparseLoG(sparse);
+	TEST(sparseLoG.laplaceOfGaussian(STDEV,WINDOW,wantAbort),"LoG");
+	Voxels<float> refSum;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		kernels[0]=kernels[1]=kernels[2]=&gauss;
+		kernels[ui]=&secondDeriv;
+		Voxels<float> term;
+		referenceConvolve(dense,kernels,term);
+		if(!ui)
+			term.clone(refSum);
+		else
+		{
+			for(size_t uj=0;uj<term.getSize();uj++)
+				refSum.setData(uj,refSum.getData(uj)+term.getData(uj));
+		}
+	}
+	TEST(sameVoxels(sparseLoG,refSum,1e-4f),"LoG values");
+
+	//Aborted filtering leaves the data alone
+	wantAbort=true;
+	SparseVoxels aborted(sparse);
+	TEST(!aborted.isotropicGaussianSmooth(STDEV,WINDOW,wantAbort),"abort");
+	TEST(sameVoxels(aborted,dense,0),"abort leaves data");
+	}
+
+	//Slices, against the dense implementation
+	vector<float> sliceS,sliceD;
+	for(unsigned int axis=0;axis<3;axis++)
+	{
+		size_t n[3]={NX,NY,NZ};
+		size_t nSlice=dense.getSize()/n[axis];
+		sliceS.resize(nSlice);
+		sliceD.resize(nSlice);
+		const float OFFSETS[]={0.0f,0.13f,0.5f,0.77f,1.0f};
+		for(unsigned int ui=0;ui<THREEDEP_ARRAYSIZE(OFFSETS);ui++)
+		{
+			for(unsigned int mode=0;mode<VOX_INTERP_ENUM_END;mode++)
+			{
+				sparse.getInterpSlice(axis,OFFSETS[ui],&(sliceS[0]),mode);
+				dense.getInterpSlice(axis,OFFSETS[ui],&(sliceD[0]),mode);
+				TEST(sliceS == sliceD,"slice");
+			}
+		}
+	}
+
+	//Conversion to dense
+	Voxels<float> converted;
+	sparse.toDense(converted);
+	TEST(sameVoxels(sparse,converted,0),"dense conversion");
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * sparseVoxels.h - Sparse voxel storage, backed by an OpenVDB grid
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPARSEVOXELS_H
+#define SPARSEVOXELS_H
+
+#include <vector>
+
+#include "common/voxels.h"
+#include "../openvdb_includes.h"
+
+//!Sparse counterpart to Voxels<float>, for data that fills little of its bounds
+/*! Only voxels that have been given a value use memory; all others read
+ * as zero. Voxel (x,y,z) covers the same region as in a Voxels<float>
+ * with the same bounds and bin counts, and the grid's transform maps
+ * index (x,y,z) to that voxel's lower corner.
+ */
+class SparseVoxels
+{
+	private:
+		openvdb::FloatGrid::Ptr grid;
+		size_t binCount[3];
+		Point3D minBound,maxBound;
+
+		//!Convolve the grid along one axis, with mirrored boundaries.
+		// Returns false if aborted
+		bool convolveAxis(const openvdb::FloatGrid &src, unsigned int axis,
+				const std::vector<float> &kernel, openvdb::FloatGrid::Ptr &result,
+				ATOMIC_BOOL &wantAbort) const;
+
+		//!Apply the kernels along each axis in turn. Returns false if aborted
+		bool separableConvolve(const std::vector<float> *kernels[3],
+				openvdb::FloatGrid::Ptr &result, ATOMIC_BOOL &wantAbort) const;
+	public:
+		SparseVoxels();
+		//!Copies hold their own grid
+		SparseVoxels(const SparseVoxels &v);
+		SparseVoxels &operator=(const SparseVoxels &v);
+
+		//!Set the size and bounds, discarding any data
+		void init(size_t nX, size_t nY, size_t nZ, const BoundCube &bounds);
+
+		//!Discard the data
+		void clear();
+
+		//!Get the number of bins along each axis
+		void getSize(size_t &x, size_t &y, size_t &z) const;
+		//!Total number of voxels, including empty ones
+		size_t getSize() const { return binCount[0]*binCount[1]*binCount[2];}
+
+		void getBounds(Point3D &pMin, Point3D &pMax) const { pMin=minBound;pMax=maxBound;}
+		void getAxisBounds(size_t axis, float &minV, float &maxV) const;
+		Point3D getPitch() const;
+		float getBinVolume() const;
+
+		//!Get the voxel holding the point, as per Voxels::getIndexWithUpper
+		void getIndexWithUpper(size_t &x, size_t &y, size_t &z, const Point3D &p) const;
+
+		float getData(size_t x, size_t y, size_t z) const;
+		void setData(size_t x, size_t y, size_t z, float v);
+
+		//!Number of voxels that hold a value
+		size_t numActive() const { return grid->activeVoxelCount();}
+		//!Memory used by the grid, in bytes
+		size_t getMemUsage() const { return grid->memUsage();}
+
+		//!Get the underlying grid
+		openvdb::FloatGrid::Ptr getGrid() const { return grid;}
+
+		//!Minimum and maximum over all voxels, including empty ones
+		void minMax(float &min, float &max) const;
+
+		//!Divide each voxel by its volume
+		void calculateDensity();
+
+		//!Divide by another grid of the same size. As for Voxels, voxels
+		// with a zero divisor are left alone
+		void operator/=(const SparseVoxels &v);
+
+		//!Gaussian smoothing, as per Voxels::isotropicGaussianSmooth.
+		// Returns false if aborted
+		bool isotropicGaussianSmooth(float stdev, float windowRatio, ATOMIC_BOOL &wantAbort);
+
+		//!Laplacian of Gaussian, as per Voxels::laplaceOfGaussian.
+		// Returns false if aborted
+		bool laplaceOfGaussian(float stdev, float windowRatio, ATOMIC_BOOL &wantAbort);
+
+		//!Obtain a slice, with the layout used by Voxels::getSlice
+		void getSlice(size_t normal, size_t offset, float *p) const;
+
+		//!Obtain an interpolated slice, as per Voxels::getInterpSlice
+		void getInterpSlice(size_t normal, float offset, float *p,
+						size_t interpMode) const;
+
+		//!Write the voxels as raw floats, in the layout used by
+		// Voxels::writeFile. Returns nonzero on failure
+		size_t writeFile(const char *filename) const;
+
+		//!Copy the data into a dense voxel set
+		void toDense(Voxels<float> &v) const;
+};
+
+#ifdef DEBUG
+//Sparse voxel unit tests
+// - return true on OK, false on fail
+bool sparseVoxelTests();
+#endif
+#endif
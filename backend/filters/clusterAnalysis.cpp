@@ -17,6 +17,7 @@
 */
 #include "clusterAnalysis.h"
 #include "filterCommon.h"
+#include "algorithms/cellList.h"
 
 #include <queue>
 #include <algorithm>
@@ -96,6 +97,20 @@ const float SPHERE_PRESEARCH_CUTOFF = 75;
 const bool WANT_COUNT_BULK_FORCROP=false;
 
 
+//Build a fixed radius search over the points of a tree. Search results
+// are tree indices, so they can be used directly with the tree's tags
+bool buildTreeRadiusSearch(const K3DTreeMk2 &tree, float radius, FixedRadiusSearch &search)
+{
+	vector<Point3D> pts(tree.size());
+#pragma omp parallel for
+	for(size_t ui=0;ui<pts.size();ui++)
+		pts[ui]=tree.getPtRef(ui);
+
+	search.resetPts(pts,radius);
+	return search.build();
+}
+
+
 
 void makeFrequencyTable(const IonStreamData *i ,const RangeFile *r, 
 				std::vector<std::pair<string,size_t> > &freqTable) 
@@ -1985,6 +2000,10 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 	coreTree.getBoundCube(bCore);
 	if(enableBulkLink)
 		bulkTree.getBoundCube(bBulk);
+
+	FixedRadiusSearch coreLinkSearch;
+	if(!buildTreeRadiusSearch(coreTree,linkDist,coreLinkSearch))
+		return FILTER_ERR_ABORT;
 		
 
 	//----------
@@ -2036,7 +2055,7 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 
 			//Find all the points in a sphere around this one
 			vector<size_t> nnIdxs;
-			coreTree.ptsInSphere(*(coreTree.getPt(curPt)),linkDist,nnIdxs);
+			coreLinkSearch.ptsInSphere(coreTree.getPtRef(curPt),nnIdxs);
 
 			//Loop over this solute's NNs
 			for(size_t uj=0;uj<nnIdxs.size();uj++)
@@ -2131,6 +2150,10 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 		{
 			bulkTree.getBoundCube(bBulk);
 
+			FixedRadiusSearch bulkLinkSearch;
+			if(!buildTreeRadiusSearch(bulkTree,bulkLink,bulkLinkSearch))
+				return FILTER_ERR_ABORT;
+
 			//So-called "envelope" step.
 			size_t prog=PROGRESS_REDUCE;
 			//Now do the same thing with the matrix, but use the clusters as the "seed"
@@ -2147,7 +2170,7 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 
 					//Scan for bulkTree NNs.
 					vector<size_t> nnIdxs;
-					bulkTree.ptsInSphere(*(coreTree.getPt(curIdx)),bulkLink,nnIdxs);
+					bulkLinkSearch.ptsInSphere(coreTree.getPtRef(curIdx),nnIdxs);
 
 					//loop over the points we found
 					for(unsigned int uj=0;uj<nnIdxs.size();uj++)
@@ -335,7 +335,6 @@ unsigned int DataLoadFilter::refresh(const std::vector<const FilterStreamData *>
 		{
 
 			vector<vector<float> > outDat;
-			vector<std::string> headerData;
 		
 			if(doSample)
 			{
@@ -352,8 +351,9 @@ unsigned int DataLoadFilter::refresh(const std::vector<const FilterStreamData *>
 			}
 			else
 			{
-				//Load the entire text data using 
-				if((uiErr=loadTextData(ionFilename.c_str(),outDat,headerData,TEXT_DELIMINATORS)))
+				//Load the entire text data, in parallel
+				if((uiErr=loadTextFile(4,outDat,ionFilename.c_str(),TEXT_DELIMINATORS,
+						progress.filterProgress,(*Filter::wantAbort))))
 				{
 					consoleOutput.push_back(string(TRANS("Error loading file: ")) + ionFilename);
 					delete ionData;
@@ -26,6 +26,19 @@
 #include <wx/filename.h>
 #include <wx/dir.h>
 
+#include <stdint.h>
+
+#if !defined(__WIN32__) && !defined(__WIN64__)
+	#define EXTPROG_HAVE_PIPES
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <signal.h>
+	#include <errno.h>
+	#include <pthread.h>
+	#include <sys/wait.h>
+#endif
+
 using std::vector;
 using std::string;
 using std::pair;
@@ -45,12 +58,308 @@ enum
 	READPOS_FAIL,
 	SUBSTITUTE_FAIL,
 	COMMAND_FAIL, 
+	PIPE_FAIL,
 	EXT_PROG_ERR_ENUM_END, 
 };
 
+const char *EXCHANGE_MODE_NAMES[] = {
+	NTRANS("Files"),
+	NTRANS("Pipe")
+};
+
+//Pipe exchange stream header; magic, version, then ion count
+const char PIPE_MAGIC[4] = {'3','D','I','O'};
+const uint32_t PIPE_VERSION=1;
+const size_t PIPE_HEADER_SIZE=16;
+//Number of ions converted at a time, when streaming to the program
+const size_t PIPE_BLOCK_IONS=16384;
+//Interval between abort checks whilst exchanging data, in ms
+const int PIPE_POLL_MS=100;
+
+#ifdef EXTPROG_HAVE_PIPES
+//Produces the bytes sent to the external program in pipe mode, one
+// header or block of POS records at a time
+class PipeInputWriter
+{
+	private:
+		const vector<const vector<IonHit> *> &streams;
+		size_t curStream,curIon;
+		bool headerSent;
+	public:
+		PipeInputWriter(const vector<const vector<IonHit> *> &s) :
+			streams(s), curStream(0), curIon(0), headerSent(false) {}
+
+		//Overwrite buffer with the next bytes to send. Returns false
+		// if all data has been produced
+		bool next(vector<char> &buffer)
+		{
+			if(curStream == streams.size())
+				return false;
+
+			const vector<IonHit> &ions=*(streams[curStream]);
+			ASSERT(ions.size());
+			if(!headerSent)
+			{
+				buffer.resize(PIPE_HEADER_SIZE);
+				memcpy(&(buffer[0]),PIPE_MAGIC,4);
+				uint64_t count=ions.size();
+				for(unsigned int ui=0;ui<4;ui++)
+					buffer[4+ui]=(char)((PIPE_VERSION >> (8*(3-ui))) & 0xff);
+				for(unsigned int ui=0;ui<8;ui++)
+					buffer[8+ui]=(char)((count >> (8*(7-ui))) & 0xff);
+				headerSent=true;
+				return true;
+			}
+
+			size_t end=std::min(curIon+PIPE_BLOCK_IONS,ions.size());
+			PosBlockFormatter().format(ions,curIon,end,buffer);
+			curIon=end;
+			if(curIon == ions.size())
+			{
+				curStream++;
+				curIon=0;
+				headerSent=false;
+			}
+			return true;
+		}
+};
+
+//Split the external program's pipe output into ion streams. 
+// Returns false if the output is malformed
+static bool parsePipeOutput(const vector<char> &output, vector<vector<IonHit> > &ionStreams)
+{
+	size_t pos=0;
+	while(pos < output.size())
+	{
+		if(output.size()-pos < PIPE_HEADER_SIZE)
+			return false;
+
+		const unsigned char *header=(const unsigned char*)&(output[pos]);
+		if(memcmp(header,PIPE_MAGIC,4))
+			return false;
+
+		uint32_t version=0;
+		for(unsigned int ui=0;ui<4;ui++)
+			version=(version << 8) | header[4+ui];
+		uint64_t count=0;
+		for(unsigned int ui=0;ui<8;ui++)
+			count=(count << 8) | header[8+ui];
+
+		if(version != PIPE_VERSION)
+			return false;
+
+		pos+=PIPE_HEADER_SIZE;
+		if(count > (output.size()-pos)/IonHit::DATA_SIZE)
+			return false;
+
+		ionStreams.resize(ionStreams.size()+1);
+		vector<IonHit> &ions=ionStreams.back();
+		ions.resize(count);
+		for(size_t ui=0;ui<count;ui++)
+		{
+			float record[4];
+			memcpy(record,&(output[pos]),IonHit::DATA_SIZE);
+			if(is_littleendian())
+			{
+				for(unsigned int uj=0;uj<4;uj++)
+					floatSwapBytes(record+uj);
+			}
+			ions[ui].setHit(record);
+			pos+=IonHit::DATA_SIZE;
+		}
+	}
+
+	return true;
+}
+
+//Run the command through the shell, streaming the given ions to its stdin
+// whilst collecting its stdout. Returns 0 on success, or an error code
+static unsigned int runPiped(const string &command, 
+		const vector<const vector<IonHit> *> &inputs, vector<char> &output)
+{
+	int toChild[2],fromChild[2];
+	if(pipe(toChild))
+		return PIPE_FAIL;
+	if(pipe(fromChild))
+	{
+		close(toChild[0]);
+		close(toChild[1]);
+		return PIPE_FAIL;
+	}
+
+	//Writing to a program that has stopped reading raises SIGPIPE. 
+	// Block it in this thread, so the write fails with EPIPE instead
+	sigset_t pipeSet,oldSet;
+	sigemptyset(&pipeSet);
+	sigaddset(&pipeSet,SIGPIPE);
+	pthread_sigmask(SIG_BLOCK,&pipeSet,&oldSet);
+
+	pid_t child=fork();
+	if(child == -1)
+	{
+		close(toChild[0]);
+		close(toChild[1]);
+		close(fromChild[0]);
+		close(fromChild[1]);
+		pthread_sigmask(SIG_SETMASK,&oldSet,0);
+		return SYSTEM_EXEC_FAIL;
+	}
+
+	if(!child)
+	{
+		//Only async-signal-safe calls may be made here
+		dup2(toChild[0],STDIN_FILENO);
+		dup2(fromChild[1],STDOUT_FILENO);
+		close(toChild[0]);
+		close(toChild[1]);
+		close(fromChild[0]);
+		close(fromChild[1]);
+		//The signal mask survives exec, so restore it
+		sigprocmask(SIG_SETMASK,&oldSet,0);
+		execl("/bin/sh","sh","-c",command.c_str(),(char*)0);
+		_exit(127);
+	}
+
+	close(toChild[0]);
+	close(fromChild[1]);
+	int inFd=toChild[1], outFd=fromChild[0];
+	fcntl(inFd,F_SETFL,fcntl(inFd,F_GETFL) | O_NONBLOCK);
+
+	//Write and read at the same time, as the program may start
+	// producing output before it has consumed all of its input
+	PipeInputWriter writer(inputs);
+	vector<char> inBuf;
+	size_t inPos=0;
+	char readBuf[65536];
+	unsigned int errCode=0;
+	while(inFd != -1 || outFd != -1)
+	{
+		if(*Filter::wantAbort)
+		{
+			errCode=FILTER_ERR_ABORT;
+			break;
+		}
+
+		pollfd fds[2];
+		nfds_t nFds=0;
+		int inIdx=-1,outIdx=-1;
+		if(inFd != -1)
+		{
+			fds[nFds].fd=inFd;
+			fds[nFds].events=POLLOUT;
+			inIdx=nFds++;
+		}
+		if(outFd != -1)
+		{
+			fds[nFds].fd=outFd;
+			fds[nFds].events=POLLIN;
+			outIdx=nFds++;
+		}
+
+		if(poll(fds,nFds,PIPE_POLL_MS) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			errCode=PIPE_FAIL;
+			break;
+		}
+
+		if(inIdx != -1 && fds[inIdx].revents)
+		{
+			if(inPos == inBuf.size())
+			{
+				inPos=0;
+				if(!writer.next(inBuf))
+				{
+					//All sent; signal end of input
+					close(inFd);
+					inFd=-1;
+				}
+			}
+
+			if(inFd != -1)
+			{
+				ssize_t nWritten=write(inFd,&(inBuf[inPos]),inBuf.size()-inPos);
+				if(nWritten >= 0)
+					inPos+=nWritten;
+				else if(errno != EAGAIN && errno != EINTR)
+				{
+					//The program may legitimately stop reading
+					// early (EPIPE). Anything else is a failure
+					close(inFd);
+					inFd=-1;
+					if(errno != EPIPE)
+					{
+						errCode=PIPE_FAIL;
+						break;
+					}
+				}
+			}
+		}
+
+		if(outIdx != -1 && fds[outIdx].revents)
+		{
+			ssize_t nRead=read(outFd,readBuf,sizeof(readBuf));
+			if(nRead > 0)
+				output.insert(output.end(),readBuf,readBuf+nRead);
+			else if(!nRead || (errno != EAGAIN && errno != EINTR))
+			{
+				close(outFd);
+				outFd=-1;
+			}
+		}
+	}
+
+	if(inFd != -1)
+		close(inFd);
+	if(outFd != -1)
+		close(outFd);
+	if(errCode)
+		kill(child,SIGTERM);
+
+	int status;
+	while(waitpid(child,&status,0) == -1 && errno == EINTR)
+	{
+	}
+
+	//Discard any SIGPIPE raised whilst blocked, then restore the mask
+	sigset_t pending;
+	sigpending(&pending);
+	if(sigismember(&pending,SIGPIPE))
+	{
+		int sig;
+		sigwait(&pipeSet,&sig);
+	}
+	pthread_sigmask(SIG_SETMASK,&oldSet,0);
+
+	if(errCode)
+		return errCode;
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status))
+		return COMMAND_FAIL;
+
+	return 0;
+}
+#endif
+
+//Create an output ion stream, with the default appearance
+static IonStreamData *newOutputIons(const Filter *parent)
+{
+	IonStreamData *d = new IonStreamData();
+	d->parent=parent;
+	//TODO: some kind of secondary file for specification of
+	//ion attribs?
+	d->r = 1.0;
+	d->g=0;
+	d->b=0;
+	d->a=1.0;
+	d->ionSize = 2.0;
+	return d;
+}
+
 //=== External program filter === 
 ExternalProgramFilter::ExternalProgramFilter() : alwaysCache(false),
-		cleanInput(true)
+		cleanInput(true), exchangeMode(EXTERNALPROGRAM_EXCHANGE_FILES)
 {
 	cacheOK=false;
 	cache=false; 
@@ -65,6 +374,7 @@ Filter *ExternalProgramFilter::cloneUncached() const
 	p->commandLine=commandLine;
 	p->alwaysCache=alwaysCache;
 	p->cleanInput=cleanInput;
+	p->exchangeMode=exchangeMode;
 
 	//We are copying whether to cache or not,
 	//not the cache itself
@@ -231,6 +541,13 @@ unsigned int ExternalProgramFilter::refresh(const std::vector<const FilterStream
 	}
 	vector<string> ionOutputNames,plotOutputNames;
 
+	//Ion streams to send through the pipe, in pipe mode
+	bool usePipe=false;
+#ifdef EXTPROG_HAVE_PIPES
+	usePipe=(exchangeMode == EXTERNALPROGRAM_EXCHANGE_PIPE);
+#endif
+	vector<const vector<IonHit> *> pipeIons;
+
 	//Compute the bounding box of the incoming streams
 	string s;
 	wxString tempDir;
@@ -268,6 +585,13 @@ unsigned int ExternalProgramFilter::refresh(const std::vector<const FilterStream
 
 				if(i->data.empty())
 					break;
+
+				if(usePipe)
+				{
+					pipeIons.push_back(&(i->data));
+					break;
+				}
+
 				//Save the data to a file
 				wxString tmpStr;
 
@@ -317,7 +641,7 @@ unsigned int ExternalProgramFilter::refresh(const std::vector<const FilterStream
 
 	//Nothing to do.
 	if(plotOutputNames.empty() &&
-		ionOutputNames.empty())
+		ionOutputNames.empty() && pipeIons.empty())
 	{
 		progress.filterProgress=100;
 		return 0;
@@ -348,11 +672,21 @@ unsigned int ExternalProgramFilter::refresh(const std::vector<const FilterStream
 	progress.stepName=TRANS("Execute");	
 
 	//Execute the program
-	//TODO: IO redirection - especially under windows?
-	result=std::system(substitutedCommand.c_str());
+	vector<char> pipeOutput;
+	if(usePipe)
+	{
+#ifdef EXTPROG_HAVE_PIPES
+		result=runPiped(substitutedCommand,pipeIons,pipeOutput);
+#endif
+	}
+	else
+	{
+		//TODO: IO redirection - especially under windows?
+		result=std::system(substitutedCommand.c_str());
 
-	if(result == -1)
-		return SYSTEM_EXEC_FAIL; 
+		if(result == -1)
+			return SYSTEM_EXEC_FAIL; 
+	}
 
 	if(cleanInput)
 	{
@@ -374,20 +708,56 @@ unsigned int ExternalProgramFilter::refresh(const std::vector<const FilterStream
 	}
 	wxSetWorkingDirectory(origDir);	
 	if(result)
+	{
+		//Piped runs give an error code, rather than the program's status
+		if(usePipe)
+			return result;
 		return COMMAND_FAIL; 
+	}
 	
 	wxSetWorkingDirectory(origDir);	
 
-	wxDir *dir = new wxDir;
-	wxArrayString *a = new wxArrayString;
-	if(workingDir.size())
-		dir->GetAllFiles((workingDir),a,wxT("*.pos"),wxDIR_FILES);
-	else
-		dir->GetAllFiles(wxGetCwd(),a,wxT("*.pos"),wxDIR_FILES);
-
 	progress.step=3;
 	progress.stepName=TRANS("Collate output");	
 
+	if(usePipe)
+	{
+		//Ions come back through the pipe, rather than as POS files
+		vector<vector<IonHit> > ionStreams;
+#ifdef EXTPROG_HAVE_PIPES
+		if(!parsePipeOutput(pipeOutput,ionStreams))
+			return READPOS_FAIL;
+#endif
+		vector<char>().swap(pipeOutput);
+
+		for(size_t ui=0;ui<ionStreams.size();ui++)
+		{
+			if(ionStreams[ui].empty())
+				continue;
+
+			IonStreamData *d=newOutputIons(this);
+			d->data.swap(ionStreams[ui]);
+			if(alwaysCache)
+			{
+				d->cached=1;
+				filterOutputs.push_back(d);
+			}
+			else
+				d->cached=0;
+			getOut.push_back(d);
+		}
+	}
+
+	wxDir *dir = new wxDir;
+	wxArrayString *a = new wxArrayString;
+	if(!usePipe)
+	{
+		if(workingDir.size())
+			dir->GetAllFiles((workingDir),a,wxT("*.pos"),wxDIR_FILES);
+		else
+			dir->GetAllFiles(wxGetCwd(),a,wxT("*.pos"),wxDIR_FILES);
+	}
+
 	//read the output files, which is assumed to be any "pos" file
 	//in the working dir
 	for(unsigned int ui=0;ui<a->Count(); ui++)
@@ -404,15 +774,7 @@ unsigned int ExternalProgramFilter::refresh(const std::vector<const FilterStream
 			wxTmpStr=(*a)[ui];
 			sTmp = stlStr(wxTmpStr);
 			unsigned int dummy;
-			IonStreamData *d = new IonStreamData();
-			d->parent=this;
-			//TODO: some kind of secondary file for specification of
-			//ion attribs?
-			d->r = 1.0;
-			d->g=0;
-			d->b=0;
-			d->a=1.0;
-			d->ionSize = 2.0;
+			IonStreamData *d = newOutputIons(this);
 
 			unsigned int index2[] = {
 					0, 1, 2, 3
@@ -593,6 +955,16 @@ void ExternalProgramFilter::getProperties(FilterPropGroup &propertyList) const
 	p.key=EXTERNALPROGRAM_KEY_ALWAYSCACHE;		
 	propertyList.addProperty(p,curGroup);
 
+	vector<pair<unsigned int,string> > choices;
+	for(unsigned int ui=0;ui<EXTERNALPROGRAM_EXCHANGE_ENUM_END;ui++)
+		choices.push_back(make_pair(ui,TRANS(EXCHANGE_MODE_NAMES[ui])));
+	p.name=TRANS("Ion exchange");
+	p.data=choiceString(choices,exchangeMode);
+	p.type=PROPERTY_TYPE_CHOICE;
+	p.helpText=TRANS("Pass ions to the program as POS files, or stream them through its standard input and output (see manual)");
+	p.key=EXTERNALPROGRAM_KEY_EXCHANGE;
+	propertyList.addProperty(p,curGroup);
+
 	propertyList.setGroupTitle(curGroup,TRANS("Data"));
 }
 
@@ -634,6 +1006,29 @@ bool ExternalProgramFilter::setProperty(  unsigned int key,
 				return false;
 			break;
 		}
+		case EXTERNALPROGRAM_KEY_EXCHANGE:
+		{
+			unsigned int newMode=EXTERNALPROGRAM_EXCHANGE_ENUM_END;
+			for(unsigned int ui=0;ui<EXTERNALPROGRAM_EXCHANGE_ENUM_END;ui++)
+			{
+				if(value == TRANS(EXCHANGE_MODE_NAMES[ui]))
+				{
+					newMode=ui;
+					break;
+				}
+			}
+
+			if(newMode == EXTERNALPROGRAM_EXCHANGE_ENUM_END)
+				return false;
+
+			if(newMode != exchangeMode)
+			{
+				exchangeMode=newMode;
+				needUpdate=true;
+				clearCache();
+			}
+			break;
+		}
 		default:
 			ASSERT(false);
 
@@ -656,7 +1051,8 @@ std::string  ExternalProgramFilter::getSpecificErrString(unsigned int code) cons
 			"Unable to parse plot result from external program",
 			"Unable to load ions from external program", 
 			"Unable to perform commandline substitution",
-			"Error executing external program, returned nonzero" };
+			"Error executing external program, returned nonzero",
+			"Error exchanging data with external program" };
 	
 	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(errStrs) == EXT_PROG_ERR_ENUM_END);
 	ASSERT(code < EXT_PROG_ERR_ENUM_END);
@@ -682,6 +1078,7 @@ bool ExternalProgramFilter::writeState(std::ostream &f,unsigned int format, unsi
 			f << tabs(depth+1) << "<workingdir name=\"" << escapeXML(convertFileStringToCanonical(workingDir)) << "\"/>" << endl;
 			f << tabs(depth+1) << "<alwayscache value=\"" << alwaysCache << "\"/>" << endl;
 			f << tabs(depth+1) << "<cleaninput value=\"" << cleanInput << "\"/>" << endl;
+			f << tabs(depth+1) << "<exchange value=\"" << exchangeMode << "\"/>" << endl;
 			f << tabs(depth) << "</" << trueName() << ">" << endl;
 			break;
 
@@ -740,6 +1137,18 @@ bool ExternalProgramFilter::readState(xmlNodePtr &nodePtr, const std::string &st
 	if(!boolStrDec(tmpStr,cleanInput))
 		return false;
 
+	//Retrieve exchange mode (optional; older states only used files)
+	xmlNodePtr tmpNode=nodePtr;
+	exchangeMode=EXTERNALPROGRAM_EXCHANGE_FILES;
+	if(XMLGetNextElemAttrib(nodePtr,tmpStr,"exchange","value"))
+	{
+		if(stream_cast(exchangeMode,tmpStr) || 
+			exchangeMode >= EXTERNALPROGRAM_EXCHANGE_ENUM_END)
+			return false;
+	}
+	else
+		nodePtr=tmpNode;
+
 	return true;
 }
 
@@ -922,6 +1331,85 @@ bool ExternalProgramFilter::substituteTest()
 
 }
 
+bool ExternalProgramFilter::pipeTest()
+{
+	//Stand-in external programs, for the pipe exchange mode
+	// these use only the shell and coreutils
+	const unsigned int NUM_PTS=100;
+	auto_ptr<IonStreamData> dataA,dataB;
+	dataA.reset(createTestPosData(NUM_PTS));
+	dataB.reset(createTestPosData(NUM_PTS/2));
+
+	wxString tmpDir;
+	tmpDir=wxFileName::GetTempDir() + wxT("/3Depict-pipe/");
+	if(wxDirExists(tmpDir))
+	{
+		wxFileName dirFile(tmpDir);
+		dirFile.Rmdir( wxPATH_RMDIR_RECURSIVE);
+	}
+	wxMkdir(tmpDir);
+
+	ExternalProgramFilter* f = new ExternalProgramFilter;
+	f->setCaching(false);
+
+	bool needUp;
+	TEST(f->setProperty(EXTERNALPROGRAM_KEY_EXCHANGE,
+		TRANS(EXCHANGE_MODE_NAMES[EXTERNALPROGRAM_EXCHANGE_PIPE]),needUp),"Set prop");
+	TEST(f->setProperty(EXTERNALPROGRAM_KEY_WORKDIR,stlStr(tmpDir),needUp),"Set prop");
+
+	vector<const FilterStreamData*> streamIn,streamOut;
+	streamIn.push_back(dataA.get());
+	streamIn.push_back(dataB.get());
+	ProgressData p;
+
+	//Echo all streams back - output must match input
+	TEST(f->setProperty(EXTERNALPROGRAM_KEY_COMMAND,"cat",needUp),"Set prop");
+	TEST(!f->refresh(streamIn,streamOut,p),"refresh error code");
+	TEST(streamOut.size() == 2,"stream count");
+	for(unsigned int ui=0;ui<streamOut.size();ui++)
+	{
+		TEST(streamOut[ui]->getStreamType() == STREAM_TYPE_IONS,"stream type");
+		const IonStreamData *in = (const IonStreamData*)streamIn[ui];
+		const IonStreamData *out = (const IonStreamData*)streamOut[ui];
+		TEST(out->data.size() == in->data.size(),"Number of ions");
+		for(unsigned int uj=0;uj<out->data.size();uj++)
+		{
+			TEST(out->data[uj].getPos() == in->data[uj].getPos(),"position");
+			TEST(out->data[uj].getMassToCharge() == 
+				in->data[uj].getMassToCharge(),"mass");
+		}
+		delete streamOut[ui];
+	}
+	streamOut.clear();
+
+	//Program that exits without reading its input, or writing anything.
+	// Input is large enough to fill the pipe
+	auto_ptr<IonStreamData> bigData;
+	bigData.reset(createTestPosData(200000));
+	vector<const FilterStreamData*> bigIn;
+	bigIn.push_back(bigData.get());
+	TEST(f->setProperty(EXTERNALPROGRAM_KEY_COMMAND,"true",needUp),"Set prop");
+	TEST(!f->refresh(bigIn,streamOut,p),"refresh error code");
+	TEST(streamOut.empty(),"stream count");
+
+	//Truncated output must be rejected
+	TEST(f->setProperty(EXTERNALPROGRAM_KEY_COMMAND,"head -c 20",needUp),"Set prop");
+	TEST(f->refresh(streamIn,streamOut,p) == READPOS_FAIL,"truncated output");
+	TEST(streamOut.empty(),"stream count");
+
+	//Nonzero exit status
+	TEST(f->setProperty(EXTERNALPROGRAM_KEY_COMMAND,"cat > /dev/null; exit 3",needUp),"Set prop");
+	TEST(f->refresh(streamIn,streamOut,p) == COMMAND_FAIL,"exit status");
+	TEST(streamOut.empty(),"stream count");
+
+	delete f;
+
+	wxFileName dirFile(tmpDir);
+	dirFile.Rmdir( wxPATH_RMDIR_RECURSIVE);
+
+	return true;
+}
+
 bool ExternalProgramFilter::runUnitTests() 
 {
 	if(!echoTest())
@@ -934,6 +1422,11 @@ bool ExternalProgramFilter::runUnitTests()
 	if(!substituteTest())
 		return false;
 #endif
+
+#if !defined(__APPLE__) && !defined(__WIN32__) && !defined(__WIN64__)
+	if(!pipeTest())
+		return false;
+#endif
 	return true;
 }
 
@@ -26,7 +26,26 @@ enum
 	EXTERNALPROGRAM_KEY_COMMAND,
 	EXTERNALPROGRAM_KEY_WORKDIR,
 	EXTERNALPROGRAM_KEY_ALWAYSCACHE,
-	EXTERNALPROGRAM_KEY_CLEANUPINPUT
+	EXTERNALPROGRAM_KEY_CLEANUPINPUT,
+	EXTERNALPROGRAM_KEY_EXCHANGE
+};
+
+//!How ion data is passed to and from the external program
+enum
+{
+	//!Ions are written to temporary POS files, substituted for %i/%I in
+	// the command. Any POS file left in the working dir is read back
+	EXTERNALPROGRAM_EXCHANGE_FILES,
+	//!Ions are streamed through the program's stdin and stdout (POSIX
+	// only; otherwise files are used). Each ion stream is sent as a 16 byte
+	// header, then one POS record per ion (x,y,z,mass-to-charge, as
+	// big-endian float32). The header is the 4 bytes "3DIO", then a
+	// big-endian uint32 version (1), then a big-endian uint64 ion count.
+	// Input ends at end-of-file. The program replies on stdout in the
+	// same form, each header starting a new output stream. Plots are
+	// still exchanged by files
+	EXTERNALPROGRAM_EXCHANGE_PIPE,
+	EXTERNALPROGRAM_EXCHANGE_ENUM_END
 };
 
 //!External program filter
@@ -43,6 +62,8 @@ class ExternalProgramFilter : public Filter
 		bool alwaysCache;
 		//!Erase generated input files for ext. program after running?
 		bool cleanInput;
+		//!How ions are passed to the program, EXTERNALPROGRAM_EXCHANGE_ enum
+		unsigned int exchangeMode;
 
 		static size_t substituteVariables(const std::string &commandStr,
 				const std::vector<std::string> &ions, const std::vector<std::string> &plots, 
@@ -100,6 +121,8 @@ class ExternalProgramFilter : public Filter
 		bool runUnitTests();
 
 		bool substituteTest();
+
+		bool pipeTest();
 #endif
 };
 
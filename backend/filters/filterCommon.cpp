@@ -21,22 +21,25 @@
 #include "common/colourmap.h"
 #include "wx/wxcommon.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //TODO: Work out where the payoff for this is
 //grab size when doing convex hull calculations
 const unsigned int HULL_GRAB_SIZE=4096;
+//Number of points per block when discarding interior points in parallel
+const size_t HULL_FILTER_BLOCK=65536;
 
 using std::ostream;
 using std::vector;
 using std::endl;
 using std::string;
 
-bool qhullInited=false;
-
-//Wrapper for qhull single-pass run
-unsigned int doHull(unsigned int bufferSize, double *buffer, 
-			vector<Point3D> &resHull, Point3D &midPoint,	
-			bool wantVolume, bool freeHullOnExit);
+//Wrapper for qhull single-pass run. The hull is left in qh, which the
+// caller must release with freeConvexHull, even on failure
+unsigned int doHull(qhT *qh, size_t bufferSize, double *buffer, 
+				const char *args);
 
 void writeVectorsXML(ostream &f,const char *containerName,
 		const vector<Point3D> &vectorParams, unsigned int depth)
@@ -275,294 +278,468 @@ unsigned int getIonstreamIonID(const IonStreamData *d, const RangeFile *r)
 }
 
 
-//FIXME: Abort pointer?
-unsigned int computeConvexHull(const vector<const FilterStreamData*> &data, unsigned int *progress,
-					std::vector<Point3D> &curHull, bool wantVolume,bool freeHull)
+//Directions along which extreme points are found, for discarding
+// interior hull points (Akl-Toussaint heuristic). These are the face,
+// edge and corner directions of a cube
+void getHullExtremeDirections(vector<Point3D> &dirs)
 {
+	dirs.clear();
+	for(int ui=-1;ui<=1;ui++)
+	{
+		for(int uj=-1;uj<=1;uj++)
+		{
+			for(int uk=-1;uk<=1;uk++)
+			{
+				if(ui || uj || uk)
+					dirs.push_back(Point3D(ui,uj,uk));
+			}
+		}
+	}
+}
 
-	size_t numPts;
-	numPts=numElements(data,STREAM_TYPE_IONS);
-	//Easy case of no data
-	if(numPts < 4)
-		return 0;
+inline const Point3D &hullPosition(const Point3D &p) { return p;}
+inline const Point3D &hullPosition(const IonHit &h) { return h.getPosRef();}
 
-	double *buffer;
-	double *tmp;
-	//Use malloc so we can re-alloc
-	buffer =(double*) malloc(HULL_GRAB_SIZE*3*sizeof(double));
+//Update the most extreme point along each direction, using the given points.
+// extremeVal and extremePt must be initialised by the caller
+template<class T>
+void findExtremePoints(const vector<T> &pts, const vector<Point3D> &dirs, 
+			vector<float> &extremeVal, vector<Point3D> &extremePt)
+{
+	unsigned int nT=1;
+#ifdef _OPENMP
+	nT=omp_get_max_threads();
+#endif
+	const size_t nDirs=dirs.size();
+	vector<float> threadVal(nT*nDirs,-std::numeric_limits<float>::max());
+	vector<Point3D> threadPt(nT*nDirs);
 
-	if(!buffer)
-		return HULL_ERR_NO_MEM;
+	#pragma omp parallel for
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		unsigned int tid=0;
+#ifdef _OPENMP
+		tid=omp_get_thread_num();
+#endif
+		const Point3D &p=hullPosition(pts[ui]);
+		for(size_t uj=0;uj<nDirs;uj++)
+		{
+			float v=p.dotProd(dirs[uj]);
+			if(v > threadVal[tid*nDirs+uj])
+			{
+				threadVal[tid*nDirs+uj]=v;
+				threadPt[tid*nDirs+uj]=p;
+			}
+		}
+	}
 
-	size_t bufferOffset=0;
+	for(unsigned int ui=0;ui<nT;ui++)
+	{
+		for(size_t uj=0;uj<nDirs;uj++)
+		{
+			if(threadVal[ui*nDirs+uj] > extremeVal[uj])
+			{
+				extremeVal[uj]=threadVal[ui*nDirs+uj];
+				extremePt[uj]=threadPt[ui*nDirs+uj];
+			}
+		}
+	}
+}
 
-	//Do the convex hull in steps for two reasons
-	// 1) qhull chokes on large data
-	// 2) we need to check for abort every now and again, so we have to
-	//   work in batches.
-	Point3D midPoint;
-	float maxSqrDist=-1;
-	size_t n=0;
-	for(size_t ui=0; ui<data.size(); ui++)
+//Append the points that are not strictly inside the polytope with the given
+// face planes to survivors. For each plane, normal.p + offset is negative inside
+template<class T>
+unsigned int filterHullInterior(const vector<T> &pts, const vector<Point3D> &normals,
+			const vector<float> &offsets, vector<Point3D> &survivors)
+{
+	const size_t nBlocks=(pts.size()+HULL_FILTER_BLOCK-1)/HULL_FILTER_BLOCK;
+	vector<vector<Point3D> > blockKeep(nBlocks);
+
+	bool spin=false,memFail=false;
+	#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<nBlocks;ui++)
 	{
-		if(data[ui]->getStreamType() != STREAM_TYPE_IONS)
+		if(spin)
 			continue;
 
-		const IonStreamData* ions=(const IonStreamData*)data[ui];
-
-		for(size_t uj=0; uj<ions->data.size(); uj++)
-		{		//Do contained-in-sphere check
-			if(!curHull.size() || midPoint.sqrDist(ions->data[uj].getPos())>= maxSqrDist)
+		size_t end=std::min(pts.size(),(ui+1)*HULL_FILTER_BLOCK);
+		try
+		{
+			for(size_t uj=ui*HULL_FILTER_BLOCK;uj<end;uj++)
 			{
-				//Copy point data into hull buffer
-				buffer[3*bufferOffset]=ions->data[uj].getPos()[0];
-				buffer[3*bufferOffset+1]=ions->data[uj].getPos()[1];
-				buffer[3*bufferOffset+2]=ions->data[uj].getPos()[2];
-				bufferOffset++;
-
-				//If we have hit the hull grab size, perform a hull
-
-				if(bufferOffset == HULL_GRAB_SIZE)
+				const Point3D &p=hullPosition(pts[uj]);
+				size_t uk;
+				for(uk=0;uk<normals.size();uk++)
 				{
-					bufferOffset+=curHull.size();
-					tmp=(double*)realloc(buffer,
-							     3*bufferOffset*sizeof(double));
-					if(!tmp)
-					{
-						free(buffer);
-
-						return HULL_ERR_NO_MEM;
-					}
-
-					buffer=tmp;
-					//Copy in the old hull
-					for(size_t uk=0; uk<curHull.size(); uk++)
-					{
-						buffer[3*(HULL_GRAB_SIZE+uk)]=curHull[uk][0];
-						buffer[3*(HULL_GRAB_SIZE+uk)+1]=curHull[uk][1];
-						buffer[3*(HULL_GRAB_SIZE+uk)+2]=curHull[uk][2];
-					}
-
-					unsigned int errCode=0;
-					
-					errCode=doHull(bufferOffset,buffer,curHull,midPoint,wantVolume,freeHull);
-					if(errCode)
-					{
-						free(buffer);
-						return errCode;
-					}
-
-
-					//Now compute the min sqr distance
-					//to the vertex, so we can fast-reject
-					maxSqrDist=std::numeric_limits<float>::max();
-					for(size_t ui=0; ui<curHull.size(); ui++)
-						maxSqrDist=std::min(maxSqrDist,curHull[ui].sqrDist(midPoint));
-					//reset buffer size
-					bufferOffset=0;
+					if(normals[uk].dotProd(p) + offsets[uk] >= 0)
+						break;
 				}
 
+				//With no planes, there is no known interior
+				if(normals.empty() || uk != normals.size())
+					blockKeep[ui].push_back(p);
 			}
-			n++;
+		}
+		catch(std::bad_alloc)
+		{
+			memFail=spin=true;
+		}
 
-			//Update the progress information, and run abort check
-			if(*Filter::wantAbort)
-			{
-				free(buffer);
-				return HULL_ERR_USER_ABORT;
-			}
+		if(*Filter::wantAbort)
+			spin=true;
+	}
 
-			*progress= (unsigned int)((float)(n)/((float)numPts)*100.0f);
+	if(memFail)
+		return HULL_ERR_NO_MEM;
+	if(spin)
+		return HULL_ERR_USER_ABORT;
 
-		}
+	size_t total=survivors.size();
+	for(size_t ui=0;ui<nBlocks;ui++)
+		total+=blockKeep[ui].size();
+	try
+	{
+		survivors.reserve(total);
+	}
+	catch(std::bad_alloc)
+	{
+		return HULL_ERR_NO_MEM;
+	}
+	for(size_t ui=0;ui<nBlocks;ui++)
+	{
+		survivors.insert(survivors.end(),blockKeep[ui].begin(),blockKeep[ui].end());
+		vector<Point3D>().swap(blockKeep[ui]);
 	}
 
-	//Need at least 4 objects to construct a sufficiently large buffer
-	if(bufferOffset + curHull.size() > 4)
+	return 0;
+}
+
+//Obtain the face planes of the hull of the extreme points, shrunk 
+// inwards slightly to allow for rounding. Returns false if the
+// extreme points do not enclose a volume
+bool getExtremePolytope(const vector<Point3D> &extremePt,
+		const vector<float> &extremeVal, vector<Point3D> &normals, vector<float> &offsets)
+{
+	vector<double> buffer(extremePt.size()*3);
+	float scale=0;
+	for(size_t ui=0;ui<extremePt.size();ui++)
 	{
-		//Re-allocate the buffer to determine the last hull size
-		tmp=(double*)realloc(buffer,
-		                     3*(bufferOffset+curHull.size())*sizeof(double));
-		if(!tmp)
-		{
-			free(buffer);
-			return HULL_ERR_NO_MEM;
-		}
-		buffer=tmp;
+		for(unsigned int uj=0;uj<3;uj++)
+			buffer[3*ui+uj]=extremePt[ui][uj];
+		scale=std::max(scale,fabsf(extremeVal[ui]));
+	}
+	const float margin=scale*sqrtf(std::numeric_limits<float>::epsilon());
 
-		#pragma omp parallel for
-		for(unsigned int ui=0; ui<curHull.size(); ui++)
+	qhT qhState;
+	qhT *qh=&qhState;
+	bool ok=false;
+	if(!doHull(qh,extremePt.size(),&buffer[0],"qhull QJ") && qh->num_facets)
+	{
+		facetT *curFac=qh->facet_list;
+		while(curFac != qh->facet_tail)
 		{
-			buffer[3*(bufferOffset+ui)]=curHull[ui][0];
-			buffer[3*(bufferOffset+ui)+1]=curHull[ui][1];
-			buffer[3*(bufferOffset+ui)+2]=curHull[ui][2];
+			normals.push_back(Point3D(curFac->normal[0],
+				curFac->normal[1],curFac->normal[2]));
+			offsets.push_back(curFac->offset + margin);
+			curFac=curFac->next;
 		}
+		ok=true;
+	}
+	freeConvexHull(qh);
 
-		unsigned int errCode=doHull(bufferOffset+curHull.size(),buffer,
-						curHull,midPoint,wantVolume,freeHull);
+	return ok;
+}
 
-		if(errCode)
-		{
-			free(buffer);
-			//FIXME: Free the last convex hull mem??
-			return errCode;
-		}
+//Copy the hull vertices out of qhull
+unsigned int getHullVertices(qhT *qh, vector<Point3D> &resHull)
+{
+	try
+	{
+		resHull.resize(qh->num_vertices);
+	}
+	catch(std::bad_alloc)
+	{
+		return HULL_ERR_NO_MEM;
 	}
 
+	vertexT *vertex;
+	vertex= qh->vertex_list;
+	size_t curPt=0;
+	while(vertex != qh->vertex_tail)
+	{
+		resHull[curPt]=Point3D(vertex->point[0],
+				vertex->point[1],
+				vertex->point[2]);
+		curPt++;
+		vertex = vertex->next;
+	}
+	ASSERT(curPt == resHull.size());
 
-	free(buffer);
 	return 0;
 }
 
-unsigned int computeConvexHull(const vector<Point3D> &data, unsigned int *progress,
-				const bool &abortPtr,std::vector<Point3D> &curHull, bool wantVolume, bool freeHull)
+//Compute the hull of the points in [start,end) in batches of HULL_GRAB_SIZE,
+// re-hulling each batch together with the current hull's vertices.
+// Points inside the current hull's inscribed sphere are skipped
+unsigned int batchHull(const vector<Point3D> &pts, size_t start, size_t end,
+			vector<Point3D> &curHull, const bool &spin)
 {
+	curHull.clear();
 
-	//Easy case of no data
-	if(data.size()< 4)
-		return 0;
-
-	double *buffer;
-	double *tmp;
-	//Use malloc so we can re-alloc
-	buffer =(double*) malloc(HULL_GRAB_SIZE*3*sizeof(double));
-
-	if(!buffer)
+	vector<double> buffer;
+	try
+	{
+		buffer.reserve(3*HULL_GRAB_SIZE);
+	}
+	catch(std::bad_alloc)
+	{
 		return HULL_ERR_NO_MEM;
+	}
 
-	size_t bufferOffset=0;
-
-	//Do the convex hull in steps for two reasons
-	// 1) qhull chokes on large data
-	// 2) we need to run the callback every now and again, so we have to
-	//   work in batches.
 	Point3D midPoint;
-	float maxSqrDist=-1;
-
-
-
-	for(size_t uj=0; uj<data.size(); uj++)
+	float innerSqrDist=-1;
+	//Runs one past the end, to hull any remaining points
+	for(size_t ui=start;ui<=end;ui++)
 	{
-		//Do contained-in-sphere check
-		if(!curHull.size() || midPoint.sqrDist(data[uj])>= maxSqrDist)
+		if(ui < end)
 		{
-		
-			//Copy point data into hull buffer
-			buffer[3*bufferOffset]=data[uj][0];
-			buffer[3*bufferOffset+1]=data[uj][1];
-			buffer[3*bufferOffset+2]=data[uj][2];
-			bufferOffset++;
-
-			//If we have hit the hull grab size, perform a hull
-
-			if(bufferOffset == HULL_GRAB_SIZE)
-			{
-				bufferOffset+=curHull.size();
-				tmp=(double*)realloc(buffer,
-						     3*bufferOffset*sizeof(double));
-				if(!tmp)
-				{
-					free(buffer);
-
-					return HULL_ERR_NO_MEM;
-				}
+			if(curHull.size() && midPoint.sqrDist(pts[ui]) < innerSqrDist)
+				continue;
+
+			buffer.push_back(pts[ui][0]);
+			buffer.push_back(pts[ui][1]);
+			buffer.push_back(pts[ui][2]);
+			
+			if(buffer.size() < 3*HULL_GRAB_SIZE)
+				continue;
+		}
+		else if(buffer.empty())
+			break;
 
-				buffer=tmp;
-				//Copy in the old hull
-				for(size_t uk=0; uk<curHull.size(); uk++)
-				{
-					buffer[3*(HULL_GRAB_SIZE+uk)]=curHull[uk][0];
-					buffer[3*(HULL_GRAB_SIZE+uk)+1]=curHull[uk][1];
-					buffer[3*(HULL_GRAB_SIZE+uk)+2]=curHull[uk][2];
-				}
+		if(spin || *Filter::wantAbort)
+			return HULL_ERR_USER_ABORT;
 
-				unsigned int errCode=0;
-				
-				errCode=doHull(bufferOffset,buffer,curHull,midPoint,wantVolume,freeHull);
-				if(errCode)
-					return errCode;
+		//Hull this batch, together with the old hull
+		for(size_t uj=0;uj<curHull.size();uj++)
+		{
+			buffer.push_back(curHull[uj][0]);
+			buffer.push_back(curHull[uj][1]);
+			buffer.push_back(curHull[uj][2]);
+		}
 
+		//Need at least 4 points for a hull
+		if(buffer.size() < 12)
+			break;
 
-				//Now compute the min sqr distance
-				//to the vertex, so we can fast-reject
-				maxSqrDist=std::numeric_limits<float>::max();
-				for(size_t ui=0; ui<curHull.size(); ui++)
-					maxSqrDist=std::min(maxSqrDist,curHull[ui].sqrDist(midPoint));
-				//reset buffer size
-				bufferOffset=0;
+		qhT qhState;
+		qhT *qh=&qhState;
+		unsigned int errCode;
+		errCode=doHull(qh,buffer.size()/3,&buffer[0],"qhull QJ");
+		if(!errCode)
+			errCode=getHullVertices(qh,curHull);
+		
+		//Find the largest sphere around the vertex centroid
+		// that lies inside the hull, so we can fast-reject
+		if(!errCode && curHull.size())
+		{
+			midPoint=Point3D(0,0,0);
+			for(size_t uj=0;uj<curHull.size();uj++)
+				midPoint+=curHull[uj];
+			midPoint*=1.0f/(float)curHull.size();
+
+			innerSqrDist=std::numeric_limits<float>::max();
+			facetT *curFac=qh->facet_list;
+			while(curFac != qh->facet_tail)
+			{
+				float d=-(curFac->offset + curFac->normal[0]*midPoint[0] + 
+					curFac->normal[1]*midPoint[1]+ curFac->normal[2]*midPoint[2]);
+				innerSqrDist=std::min(innerSqrDist,std::max(d,0.0f)*std::max(d,0.0f));
+				curFac=curFac->next;
 			}
 		}
+		freeConvexHull(qh);
 
-		if(*Filter::wantAbort)
+		if(errCode == HULL_ERR_NO_HULL)
 		{
-			free(buffer);
-			return HULL_ERR_USER_ABORT;
+			//Degenerate data, e.g. flat. Leave it for the final hull
+			curHull.assign(pts.begin()+start,pts.begin()+end);
+			return 0;
 		}
+		else if(errCode)
+			return errCode;
+		
+		buffer.clear();
+	}
 
-		*progress= (unsigned int)((float)(uj)/((float)data.size())*100.0f);
+	//If we never managed to hull anything, pass the points on unchanged
+	if(curHull.empty())
+		curHull.assign(pts.begin()+start,pts.begin()+end);
 
-	}
+	return 0;
+}
 
+//Compute the hull from points that survived interior point removal.
+// Large sets are split across threads, each of which finds the hull
+// of its share. The final hull is computed from the union of these
+unsigned int hullCandidates(const vector<Point3D> &candidates, unsigned int *progress,
+		vector<Point3D> &hullPts, float *volume, qhT *keepHull)
+{
+	unsigned int nT=1;
+#ifdef _OPENMP
+	nT=omp_get_max_threads();
+#endif
+	size_t nChunks=std::min((size_t)nT,candidates.size()/HULL_GRAB_SIZE);
 
-	//Build the final hull, using the remaining points, and the
-	// filtered hull points
-	//Need at least 4 objects to construct a sufficiently large buffer
-	if(bufferOffset + curHull.size() > 4)
+	vector<Point3D> finalPts;
+	if(nChunks > 1)
 	{
-		//Re-allocate the buffer to determine the last hull size
-		tmp=(double*)realloc(buffer,
-		                     3*(bufferOffset+curHull.size())*sizeof(double));
-		if(!tmp)
+		vector<vector<Point3D> > chunkHull(nChunks);
+		vector<unsigned int> chunkErr(nChunks,0);
+		bool spin=false;
+		#pragma omp parallel for schedule(dynamic)
+		for(size_t ui=0;ui<nChunks;ui++)
 		{
-			free(buffer);
-			return HULL_ERR_NO_MEM;
+			size_t start=(candidates.size()*ui)/nChunks;
+			size_t end=(candidates.size()*(ui+1))/nChunks;
+			chunkErr[ui]=batchHull(candidates,start,end,chunkHull[ui],spin);
+			if(chunkErr[ui])
+				spin=true;
 		}
-		buffer=tmp;
 
-		#pragma omp parallel for
-		for(unsigned int ui=0; ui<curHull.size(); ui++)
+		for(size_t ui=0;ui<nChunks;ui++)
 		{
-			buffer[3*(bufferOffset+ui)]=curHull[ui][0];
-			buffer[3*(bufferOffset+ui)+1]=curHull[ui][1];
-			buffer[3*(bufferOffset+ui)+2]=curHull[ui][2];
+			if(chunkErr[ui])
+				return chunkErr[ui];
+			finalPts.insert(finalPts.end(),chunkHull[ui].begin(),chunkHull[ui].end());
 		}
+	}
+	else
+	{
+		unsigned int errCode;
+		const bool noSpin=false;
+		if((errCode=batchHull(candidates,0,candidates.size(),finalPts,noSpin)))
+			return errCode;
+	}
 
-		unsigned int errCode=doHull(bufferOffset+curHull.size(),buffer,curHull,midPoint,wantVolume,freeHull);
+	*progress=90;
 
-		if(errCode)
-		{
-			free(buffer);
-			//Free the last convex hull mem
+	if(finalPts.size() < 4)
+		return 0;
+
+	vector<double> buffer(finalPts.size()*3);
+	for(size_t ui=0;ui<finalPts.size();ui++)
+	{
+		buffer[3*ui]=finalPts[ui][0];
+		buffer[3*ui+1]=finalPts[ui][1];
+		buffer[3*ui+2]=finalPts[ui][2];
+	}
+
+	//Joggle the input, such that only simplical facets are generated. Also compute area/volume
+	qhT qhState;
+	qhT *qh = keepHull ? keepHull : &qhState;
+	unsigned int errCode;
+	errCode=doHull(qh,finalPts.size(),&buffer[0],
+			volume ? "qhull QJ FA" : "qhull QJ");
+	if(!errCode)
+		errCode=getHullVertices(qh,hullPts);
+	if(!errCode && volume)
+		*volume=qh->totvol;
+	*progress=100;
+
+	if(!keepHull || errCode)
+		freeConvexHull(qh);
+
+	//Degenerate input has no hull, and so zero volume. This is 
+	// only an error if the caller wants to inspect the hull
+	if(errCode == HULL_ERR_NO_HULL && !keepHull)
+	{
+		hullPts.clear();
+		errCode=0;
+	}
+
+	return errCode;
+}
+
+//Compute the convex hull of the positions in the given point vectors
+template<class T>
+unsigned int computeConvexHullFrom(const vector<const vector<T> *> &data, unsigned int *progress,
+			vector<Point3D> &hullPts, float *volume, qhT *keepHull)
+{
+	hullPts.clear();
+	if(volume)
+		*volume=0;
+
+	size_t numPts=0;
+	for(size_t ui=0;ui<data.size();ui++)
+		numPts+=data[ui]->size();
+
+	//Easy case of no data
+	if(numPts < 4)
+		return 0;
+
+	//Find the extreme points of the data, in a number of directions. 
+	// Any point strictly inside their hull cannot be on the final hull
+	vector<Point3D> dirs,extremePt;
+	getHullExtremeDirections(dirs);
+	vector<float> extremeVal(dirs.size(),-std::numeric_limits<float>::max());
+	extremePt.resize(dirs.size());
+	for(size_t ui=0;ui<data.size();ui++)
+		findExtremePoints(*(data[ui]),dirs,extremeVal,extremePt);
+
+	if(*Filter::wantAbort)
+		return HULL_ERR_USER_ABORT;
+	*progress=10;
+
+	vector<Point3D> normals,candidates;
+	vector<float> offsets;
+	if(!getExtremePolytope(extremePt,extremeVal,normals,offsets))
+	{
+		//Data is (near) flat, so cannot be filtered. Keep everything
+		normals.clear();
+		offsets.clear();
+	}
+
+	unsigned int errCode;
+	for(size_t ui=0;ui<data.size();ui++)
+	{
+		if((errCode=filterHullInterior(*(data[ui]),normals,offsets,candidates)))
 			return errCode;
-		}
 	}
+	*progress=40;
 
+	//The extreme points themselves are on the hull, and ensure
+	// there are always enough points to hull
+	candidates.insert(candidates.end(),extremePt.begin(),extremePt.end());
 
-	free(buffer);
-	return 0;
+	return hullCandidates(candidates,progress,hullPts,volume,keepHull);
 }
 
-unsigned int doHull(unsigned int bufferSize, double *buffer, 
-			vector<Point3D> &resHull, Point3D &midPoint, bool wantVolume ,
-			bool freeHullOnExit)
+unsigned int computeConvexHull(const vector<const FilterStreamData*> &data, unsigned int *progress,
+					std::vector<Point3D> &curHull, float *volume, qhT *keepHull)
 {
-	if(qhullInited)
+	vector<const vector<IonHit> *> ionData;
+	for(size_t ui=0; ui<data.size(); ui++)
 	{
-		qh_freeqhull(qh_ALL);
-		int curlong,totlong;
-		//This seems to be required? Cannot find any documentation on the difference
-		// between qh_freeqhull and qh_memfreeshort. qhull appears to leak when just using qh_freeqhull
-		qh_memfreeshort (&curlong, &totlong);    
-		qhullInited=false;
+		if(data[ui]->getStreamType() != STREAM_TYPE_IONS)
+			continue;
+
+		ionData.push_back(&(((const IonStreamData*)data[ui])->data));
 	}
 
+	return computeConvexHullFrom(ionData,progress,curHull,volume,keepHull);
+}
+
+unsigned int computeConvexHull(const vector<Point3D> &data, unsigned int *progress,
+				const bool &abortPtr,std::vector<Point3D> &curHull, float *volume, qhT *keepHull)
+{
+	vector<const vector<Point3D> *> pointData(1,&data);
+	return computeConvexHullFrom(pointData,progress,curHull,volume,keepHull);
+}
 
-	const int dim=3;
-	//Now compute the new hull
-	//Generate the convex hull
-	//(result is stored in qh's globals :(  )
-	//note that the input is "joggled" to 
-	//ensure simplicial facet generation
+unsigned int doHull(qhT *qh, size_t bufferSize, double *buffer, const char *args)
+{
+	//Each hull has its own qhull state, so hulls may be computed concurrently
+	qh_zero(qh,stderr);
 
 	//Qhull >=2012 has a "feature" where it won't accept null arguments for the output
 	// there is no clear way to shut it up.
@@ -579,96 +756,35 @@ unsigned int doHull(unsigned int bufferSize, double *buffer,
 		outSquelch=stderr;
 	}
 
-	 //Joggle the output, such that only simplical facets are generated, Also compute area/volume
-	const char *argsOptions[]= { "qhull QJ FA",
-				   "qhull QJ"
-					};
-
-	const char *args;
-	if(wantVolume)
-		args = argsOptions[0];
-	else
-		args=argsOptions[1];
-	
-
-	qh_new_qhull(	dim,
+	int exitCode;
+	exitCode=qh_new_qhull(qh,3,
 			bufferSize,
 			buffer,
 			false,
 			(char *)args ,
 			outSquelch, //QHULL's interface is bizarre, no way to set null pointer in qhull 2012 - result is inf. loop in qhull_fprintf and error reporting func. 
 			outSquelch);
-	qhullInited=true;
 
 	if(outSquelch !=stderr)
 	{
 		fclose(outSquelch);
 	}
 
-	unsigned int numPoints=0;
-	//count points
-	//--	
-	//OKay, whilst this may look like invalid syntax,
-	//qh is actually a macro from qhull
-	//that creates qh. or qh-> as needed
-	numPoints = qh num_vertices;	
-	//--	
-	midPoint=Point3D(0,0,0);	
-
-	if(!numPoints)
-		return 0;
-
-	//store points in vector
-	//--
-	try
-	{
-		resHull.resize(numPoints);	
-	}
-	catch(std::bad_alloc)
-	{
-		return HULL_ERR_NO_MEM;
-	}
-	//--
-
-	//Compute mean point
-	//--
-	vertexT *vertex;
-	vertex= qh vertex_list;
-	int curPt=0;
-	while(vertex != qh vertex_tail)
-	{
-		resHull[curPt]=Point3D(vertex->point[0],
-				vertex->point[1],
-				vertex->point[2]);
-		midPoint+=resHull[curPt];
-		curPt++;
-		vertex = vertex->next;
-	}
-	midPoint*=1.0f/(float)numPoints;
-	//--
-	if(freeHullOnExit)
-	{
-		qh_freeqhull(qh_ALL);
-		int curlong,totlong;
-		//This seems to be required? Cannot find any documentation on the difference
-		// between qh_freeqhull and qh_memfreeshort. qhull appears to leak when just using qh_freeqhull
-		qh_memfreeshort (&curlong, &totlong);    
-		qhullInited=false;
-	
-	}
+	//Failure is typically degenerate (e.g. flat) input, which has no hull
+	if(exitCode)
+		return HULL_ERR_NO_HULL;
 
 	return 0;
 }
 
 
-void freeConvexHull()
+void freeConvexHull(qhT *qh)
 {
-	qh_freeqhull(qh_ALL);
+	qh_freeqhull(qh,!qh_ALL);
 	int curlong,totlong;
 	//This seems to be required? Cannot find any documentation on the difference
 	// between qh_freeqhull and qh_memfreeshort. qhull appears to leak when just using qh_freeqhull
-	qh_memfreeshort (&curlong, &totlong);    
-	qhullInited=false;
+	qh_memfreeshort (qh,&curlong, &totlong);    
 }
 
 DrawColourBarOverlay *makeColourBar(float minV, float maxV,size_t nColours,size_t colourMap, bool reverseMap, float alpha) 
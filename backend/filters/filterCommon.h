@@ -27,6 +27,12 @@
 
 #include "backend/APT/APTRanges.h"
 
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 //QHull library
 #ifdef __POWERPC__
 	#pragma push_macro("__POWERPC__")
@@ -34,7 +40,7 @@
 #endif
 extern "C"
 {
-	#include <qhull/qhull_a.h>
+	#include <libqhull_r/qhull_ra.h>
 }
 #ifdef __POWERPC__
 	#pragma pop_macro("__POWERPC__")
@@ -45,6 +51,7 @@ enum
 {
 	HULL_ERR_NO_MEM=1,
 	HULL_ERR_USER_ABORT,
+	HULL_ERR_NO_HULL,
 	HULL_ERR_ENUM_END
 };
 
@@ -193,17 +200,158 @@ unsigned int extendDataVector(std::vector<T> &dest, const std::vector<IonHit> &v
 
 const RangeFile *getRangeFile(const std::vector<const FilterStreamData*> &dataIn);
 
-//Compute the convex hull of a set of input points from fiilterstream data
+//!Bin number that causes scatterToBins to drop an item
+const unsigned int SCATTER_DISCARD=(unsigned int)-1;
+//!Smallest number of items given to each thread by scatterToBins
+const size_t SCATTER_MIN_BLOCK=16384;
+
+//!Append the items of each input to the end of the given bins, in input
+// order. binners[i]->bin(j) gives the bin number for item j of input i (or
+// SCATTER_DISCARD), and binners[i]->value(j) the value to store, for j in
+// [0,counts[i]). Each thread first counts its own block of items per bin; a
+// prefix sum of these counts then gives every thread a fixed write position
+// in each bin, so the bins are resized exactly once, over all inputs, and
+// filled in parallel without further allocation, keeping the input order.
+// As bin() is called twice for each item, it should be cheap. Progress is 
+// reported as the percentage of progressTotal items complete, with 
+// progressOffset items done beforehand. Returns nonzero on user abort, in
+// which case bin contents are undefined
+template<class V, class Binner>
+unsigned int scatterToBins(const std::vector<const Binner *> &binners,
+		const std::vector<size_t> &counts,
+		const std::vector<std::vector<V> *> &bins, unsigned int &progress,
+		size_t progressOffset, size_t progressTotal)
+{
+	ASSERT(binners.size() == counts.size());
+
+	//Offset of each input's first item, as if the inputs were joined
+	std::vector<size_t> inputStart(counts.size()+1,0);
+	for(size_t ui=0;ui<counts.size();ui++)
+		inputStart[ui+1]=inputStart[ui]+counts[ui];
+	const size_t count=inputStart.back();
+
+	const size_t numBins=bins.size();
+	size_t nT=1;
+#ifdef _OPENMP
+	nT=omp_get_max_threads();
+#endif
+	nT=std::max((size_t)1,std::min(nT,count/SCATTER_MIN_BLOCK));
+
+	//Per-thread counts for each bin, which become each thread's write offset
+	std::vector<size_t> offsets(nT*numBins,0);
+
+	//Pass 1 : count the items in each bin
+	bool spin=false;
+	#pragma omp parallel for shared(spin)
+	for(size_t t=0;t<nT;t++)
+	{
+		const size_t start=count*t/nT,end=count*(t+1)/nT;
+		size_t *binCount=&offsets[t*numBins];
+		size_t input=std::upper_bound(inputStart.begin(),inputStart.end(),start)-
+							inputStart.begin()-1;
+		for(size_t ui=start;ui<end;ui++)
+		{
+			while(ui >= inputStart[input+1])
+				input++;
+
+			unsigned int bin=binners[input]->bin(ui-inputStart[input]);
+			if(bin != SCATTER_DISCARD)
+			{
+				ASSERT(bin < numBins);
+				binCount[bin]++;
+			}
+
+			//The first thread reports progress for everyone
+			if(!((ui-start+1)%NUM_CALLBACK))
+			{
+				if(spin)
+					break;
+				if(!t)
+				{
+					progress=(unsigned int)(100.0f*(float)(progressOffset+
+						(ui-start)*nT/2)/(float)progressTotal);
+					if(*Filter::wantAbort)
+						spin=true;
+				}
+			}
+		}
+	}
+	if(spin)
+		return 1;
+
+	//Each thread writes after the items of the threads before it
+	for(size_t ui=0;ui<numBins;ui++)
+	{
+		size_t pos=bins[ui]->size();
+		for(size_t t=0;t<nT;t++)
+		{
+			size_t n=offsets[t*numBins+ui];
+			offsets[t*numBins+ui]=pos;
+			pos+=n;
+		}
+		bins[ui]->resize(pos);
+	}
+
+	//Pass 2 : scatter the items into place
+	#pragma omp parallel for shared(spin)
+	for(size_t t=0;t<nT;t++)
+	{
+		const size_t start=count*t/nT,end=count*(t+1)/nT;
+		size_t *binPos=&offsets[t*numBins];
+		size_t input=std::upper_bound(inputStart.begin(),inputStart.end(),start)-
+							inputStart.begin()-1;
+		for(size_t ui=start;ui<end;ui++)
+		{
+			while(ui >= inputStart[input+1])
+				input++;
+
+			const Binner *binner=binners[input];
+			unsigned int bin=binner->bin(ui-inputStart[input]);
+			if(bin != SCATTER_DISCARD)
+				(*bins[bin])[binPos[bin]++]=binner->value(ui-inputStart[input]);
+
+			if(!((ui-start+1)%NUM_CALLBACK))
+			{
+				if(spin)
+					break;
+				if(!t)
+				{
+					progress=(unsigned int)(100.0f*(float)(progressOffset+
+						(count+(ui-start)*nT)/2)/(float)progressTotal);
+					if(*Filter::wantAbort)
+						spin=true;
+				}
+			}
+		}
+	}
+
+	return spin;
+}
+
+//!Append items [0,count) of a single input to the end of the given bins, as above
+template<class V, class Binner>
+unsigned int scatterToBins(size_t count, const Binner &binner, 
+		const std::vector<std::vector<V> *> &bins, unsigned int &progress,
+		size_t progressOffset, size_t progressTotal)
+{
+	return scatterToBins(std::vector<const Binner *>(1,&binner),
+		std::vector<size_t>(1,count),bins,progress,progressOffset,progressTotal);
+}
+
+//Compute the convex hull of a set of input points from fiilterstream data.
+// If volume is non-null, the hull volume is also computed. If keepHull is
+// non-null, qhull's hull is left in it, and must be released with
+// freeConvexHull. Each call has its own qhull state, so is reentrant
 unsigned int computeConvexHull(const std::vector<const FilterStreamData*> &data, 
 			unsigned int *progress, 
-			std::vector<Point3D> &hullPts, bool wantVolume, bool freeHull=true);
+			std::vector<Point3D> &hullPts, float *volume=0, qhT *keepHull=0);
 //Compute the convex hull of a set of input points
 unsigned int computeConvexHull(const std::vector<Point3D> &data, 
 			unsigned int *progress, const bool &abortPtr,
-			std::vector<Point3D> &hullPts, bool wantVolume, bool freeHull=true);
+			std::vector<Point3D> &hullPts, float *volume=0, qhT *keepHull=0);
 
-//Release the memory held by qhull, and notify the computeConvexHull routines that this has been done
-void freeConvexHull();
+//Release the memory held by a qhull hull
+void freeConvexHull(qhT *qh);
 //Draw a colour bar
 DrawColourBarOverlay *makeColourBar(float minV, float maxV,size_t nColours,size_t colourMap, bool reverseMap=false, float alpha=1.0f) ;
 
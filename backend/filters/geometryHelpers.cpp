@@ -32,8 +32,6 @@ using std::vector;
 
 const size_t DEFAULT_NUM_CALLBACK=5000;
 
-//These numbers have not been optimised. On a 2CPU system, I cannot find
-// a case where the // option is outrun by the linear one, over 3 averages
 //---
 //Minimum number of input points before we will do reserve testing
 const size_t MIN_SAMPLE_TEST = 1000;
@@ -41,6 +39,18 @@ const size_t MIN_SAMPLE_TEST = 1000;
 const size_t MIN_PARALLELISE = 20000;
 //---
 
+//Number of ions processed per block in parallel filtering
+const size_t CROP_BLOCK_SIZE=65536;
+
+//Minimum number of ions in a cached stream before it is spatially indexed
+const size_t SPATIAL_INDEX_MIN_IONS=500000;
+//Target mean number of ions per spatial index cell
+const size_t SPATIAL_INDEX_CELL_OCCUPANCY=256;
+//Maximum number of cells in a spatial index
+const size_t SPATIAL_INDEX_MAX_CELLS=1<<22;
+//Number of cells processed per block in indexed filtering
+const size_t CROP_CELL_BLOCK_SIZE=256;
+
 CropHelper::CropHelper(	size_t totalData,size_t filterMode,
 			vector<Point3D> &vectors, vector<float> &scalars)
 {
@@ -164,7 +174,7 @@ unsigned int CropHelper::runFilter(const vector<IonHit> &dataIn,
 		vector<size_t> samples;
 		unsigned int dummy;
 		randomDigitSelection(samples,dataIn.size(),rng, 
-				SAMPLE_SIZE,dummy);
+				SAMPLE_SIZE,dummy,*Filter::wantAbort);
 
 		size_t tally=0;
 		for(size_t ui=0;ui<SAMPLE_SIZE;ui++)
@@ -180,12 +190,11 @@ unsigned int CropHelper::runFilter(const vector<IonHit> &dataIn,
 #ifndef _OPENMP
 	return runFilterLinear(dataIn,dataOut,allocHint,progressStart,progressEnd,progress);
 #else
-	if(dataIn.size() < MIN_PARALLELISE  || rng.genUniformDev() < 0.5f)
+	//With one thread, the parallel algorithm's extra pass is pure overhead
+	if(dataIn.size() < MIN_PARALLELISE || omp_get_max_threads() < 2)
 		return runFilterLinear(dataIn,dataOut,allocHint,progressStart,progressEnd,progress);
 	else
-	{
-		return runFilterParallel(dataIn,dataOut,allocHint,progressStart,progressEnd,progress);
-	}
+		return runFilterParallel(dataIn,dataOut,progressStart,progressEnd,progress);
 #endif
 }
 
@@ -232,90 +241,381 @@ unsigned int CropHelper::runFilterLinear(const vector<IonHit> &dataIn,
 }
 
 unsigned int CropHelper::runFilterParallel(const vector<IonHit> &dataIn,
-				vector<IonHit> &dataOut, float allocHint, float minProg,float maxProg, unsigned int &prog )
+				vector<IonHit> &dataOut, float minProg,float maxProg, unsigned int &prog )
 {
+	//Filter in blocks. First flag the ions that pass, counting
+	// each block's ions, then prefix-sum the counts to obtain each 
+	// block's output position, and finally copy the ions across.
+	// This keeps the input order, and needs no per-thread buffers
+	const size_t n=dataIn.size();
+	size_t nBlocks=(n+CROP_BLOCK_SIZE-1)/CROP_BLOCK_SIZE;
 #ifdef _OPENMP
+	nBlocks=std::max((size_t)omp_get_max_threads(),nBlocks);
+#endif
 
-	size_t n=0;
-	const size_t PROGRESS_REDUCE=5000;
-	size_t curProg=PROGRESS_REDUCE;
-
-	//Create a vector of indices for which 
-	// points successfully passed the test
-	size_t nThreads=omp_get_max_threads();
-	vector<size_t> inside[nThreads];
+	vector<char> keep;
+	//Number of ions kept before each block
+	vector<size_t> blockOffset;
+	try
+	{
+		keep.resize(n);
+		blockOffset.resize(nBlocks+1,0);
+	}
+	catch(std::bad_alloc)
+	{
+		return ERR_CROP_INSUFFICIENT_MEM;
+	}
 
-	if(allocHint > 0.0f)
+	size_t nDone=0;
+	bool spin=false;
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0; ui<nBlocks; ui++)
 	{
-		try
+		if(spin)
+			continue;
+
+		size_t start=(n*ui)/nBlocks;
+		size_t end=(n*(ui+1))/nBlocks;
+		size_t count=0;
+		for(size_t uj=start;uj<end;uj++)
 		{
-		for(size_t ui=0;ui<nThreads;ui++)
-			inside[ui].reserve((unsigned int)( (float)dataIn.size()*allocHint)/nThreads);
+			//Use XOR operand on cropFunc conditional
+			bool inside=((this->*cropFunc)(dataIn[uj].getPosRef())) ^ invertedClip;
+			keep[uj]=inside;
+			count+=inside;
 		}
-		catch(std::bad_alloc)
+		blockOffset[ui+1]=count;
+
+		//Update progress, once per block
+#pragma omp critical
 		{
-			return ERR_CROP_INSUFFICIENT_MEM;
+		nDone+=end-start;
+		prog = (float)nDone/(float)n * (maxProg-minProg)+minProg;
+		
+		if(*Filter::wantAbort)
+			spin=true;
 		}
 	}
+
+	if(spin)
+		return ERR_CROP_CALLBACK_FAIL;
+
+	//Exclusive prefix sum of block counts
+	for(size_t ui=0;ui<nBlocks;ui++)
+		blockOffset[ui+1]+=blockOffset[ui];
+
+	//Append the kept ions to the output
+	size_t outStart=dataOut.size();
+	try
+	{
+		dataOut.resize(outStart+blockOffset[nBlocks]);
+	}
+	catch(std::bad_alloc)
+	{
+		return ERR_CROP_INSUFFICIENT_MEM;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<nBlocks;ui++)
+	{
+		size_t end=(n*(ui+1))/nBlocks;
+		size_t dest=outStart+blockOffset[ui];
+		for(size_t uj=(n*ui)/nBlocks;uj<end; uj++)
+		{
+			if(keep[uj])
+				dataOut[dest++] = dataIn[uj];
+		}
+		ASSERT(dest == outStart+blockOffset[ui+1]);
+	}
+
+	prog=maxProg;
+	return 0;
+}
+
+unsigned int CropHelper::runFilterSelection(const IonSelection &selIn,
+				vector<size_t> &selected, float minProg,float maxProg, unsigned int &prog )
+{
+	//As per runFilterParallel, flag the passing ions block-wise,
+	// then prefix-sum the counts to find where each block's output goes.
+	// Only offsets are written, which is cheap enough to always do in parallel
+	const size_t n=selIn.size();
+	size_t nBlocks=(n+CROP_BLOCK_SIZE-1)/CROP_BLOCK_SIZE;
+#ifdef _OPENMP
+	nBlocks=std::max((size_t)omp_get_max_threads(),nBlocks);
+#endif
+
+	vector<char> keep;
+	vector<size_t> blockOffset;
+	try
+	{
+		keep.resize(n);
+		blockOffset.resize(nBlocks+1,0);
+	}
+	catch(std::bad_alloc)
+	{
+		return ERR_CROP_INSUFFICIENT_MEM;
+	}
+
+	size_t nDone=0;
 	bool spin=false;
-#pragma omp parallel for 
-	for(size_t ui=0; ui<dataIn.size(); ui++)
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0; ui<nBlocks; ui++)
 	{
 		if(spin)
 			continue;
 
-		//Use XOR operand on cropFunc conditional
-		if(((this->*cropFunc)(dataIn[ui].getPosRef())) ^ invertedClip)
-			inside[omp_get_thread_num()].push_back(ui);
-		
-		//update progress every PROGRESS_REDUCE ions
-		if(!curProg--)
+		size_t start=(n*ui)/nBlocks;
+		size_t end=(n*(ui+1))/nBlocks;
+		size_t count=0;
+		for(size_t uj=start;uj<end;uj++)
 		{
+			bool inside=((this->*cropFunc)(selIn[uj].getPosRef())) ^ invertedClip;
+			keep[uj]=inside;
+			count+=inside;
+		}
+		blockOffset[ui+1]=count;
+
 #pragma omp critical
+		{
+		nDone+=end-start;
+		prog = (float)nDone/(float)n * (maxProg-minProg)+minProg;
+		
+		if(*Filter::wantAbort)
+			spin=true;
+		}
+	}
+
+	if(spin)
+		return ERR_CROP_CALLBACK_FAIL;
+
+	for(size_t ui=0;ui<nBlocks;ui++)
+		blockOffset[ui+1]+=blockOffset[ui];
+
+	size_t outStart=selected.size();
+	try
+	{
+		selected.resize(outStart+blockOffset[nBlocks]);
+	}
+	catch(std::bad_alloc)
+	{
+		return ERR_CROP_INSUFFICIENT_MEM;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<nBlocks;ui++)
+	{
+		size_t end=(n*(ui+1))/nBlocks;
+		size_t dest=outStart+blockOffset[ui];
+		for(size_t uj=(n*ui)/nBlocks;uj<end; uj++)
+		{
+			if(keep[uj])
+				selected[dest++] = selIn.sourceIndex(uj);
+		}
+	}
+
+	prog=maxProg;
+	return 0;
+}
+
+unsigned int CropHelper::runFilterIndexed(const IonSelection &selIn,
+		const IonSpatialIndex &index, vector<size_t> &selected, 
+		float minProg,float maxProg, unsigned int &prog )
+{
+	ASSERT(index.size() == selIn.size());
+
+	//Each block of cells collects the selection offsets of its 
+	// passing ions. These are concatenated, then sorted to input order
+	const size_t nCells=index.numCells();
+	size_t nBlocks=(nCells+CROP_CELL_BLOCK_SIZE-1)/CROP_CELL_BLOCK_SIZE;
+	vector<vector<size_t> > blockOut;
+	try
+	{
+		blockOut.resize(nBlocks);
+	}
+	catch(std::bad_alloc)
+	{
+		return ERR_CROP_INSUFFICIENT_MEM;
+	}
+
+	size_t nDone=0;
+	bool spin=false,memFail=false;
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<nBlocks;ui++)
+	{
+		if(spin)
+			continue;
+
+		size_t end=std::min(nCells,(ui+1)*CROP_CELL_BLOCK_SIZE);
+		vector<size_t> &out=blockOut[ui];
+		try
+		{
+			for(size_t uj=ui*CROP_CELL_BLOCK_SIZE;uj<end;uj++)
 			{
-			n+=PROGRESS_REDUCE;
-			prog = (float)n/(float)dataIn.size() * (maxProg-minProg)+minProg;
-			
-			if(*Filter::wantAbort)
-				spin=true;
+				BoundCube b;
+				index.getCellBounds(uj,b);
+				switch(classifyBox(b))
+				{
+					case CROP_CELL_OUTSIDE:
+						break;
+					case CROP_CELL_INSIDE:
+					{
+						for(size_t uk=index.cellBegin(uj);uk<index.cellEnd(uj);uk++)
+							out.push_back(index.selectionIndex(uk));
+						break;
+					}
+					case CROP_CELL_PARTIAL:
+					{
+						for(size_t uk=index.cellBegin(uj);uk<index.cellEnd(uj);uk++)
+						{
+							size_t offset=index.selectionIndex(uk);
+							if(((this->*cropFunc)(selIn[offset].getPosRef())) ^ invertedClip)
+								out.push_back(offset);
+						}
+						break;
+					}
+					default:
+						ASSERT(false);
+				}
 			}
-			curProg=PROGRESS_REDUCE;
+		}
+		catch(std::bad_alloc)
+		{
+			memFail=spin=true;
+		}
+
+#pragma omp critical
+		{
+		nDone+=end-ui*CROP_CELL_BLOCK_SIZE;
+		prog = (float)nDone/(float)nCells* (maxProg-minProg)+minProg;
+		
+		if(*Filter::wantAbort)
+			spin=true;
 		}
 	}
 
+	if(memFail)
+		return ERR_CROP_INSUFFICIENT_MEM;
 	if(spin)
 		return ERR_CROP_CALLBACK_FAIL;
 
-	//map the successful ions into a single output block
-	// --
-	vector<size_t> offsets;
-	offsets.resize(nThreads);
-	size_t totalOut=0;
-	for(size_t ui=0;ui<nThreads; ui++)
+	const size_t origSize=selected.size();
+	vector<size_t> blockOffset(nBlocks+1,origSize);
+	for(size_t ui=0;ui<nBlocks;ui++)
+		blockOffset[ui+1]=blockOffset[ui]+blockOut[ui].size();
+
+	try
+	{
+		selected.resize(blockOffset[nBlocks]);
+	}
+	catch(std::bad_alloc)
+	{
+		return ERR_CROP_INSUFFICIENT_MEM;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<nBlocks;ui++)
 	{
-		offsets[ui]=totalOut;
-		totalOut+=inside[ui].size();
+		std::copy(blockOut[ui].begin(),blockOut[ui].end(),
+				selected.begin()+blockOffset[ui]);
+		vector<size_t>().swap(blockOut[ui]);
 	}
 
-	//Do the merge each batch of data back into single output
-	dataOut.resize(totalOut);
-#pragma omp parallel for 
-	for(size_t ui=0;ui<nThreads;ui++)
+	//Restore input order, then convert to offsets into the source
+	std::sort(selected.begin()+origSize,selected.end());
+	if(!selIn.selectAll)
 	{
-		size_t offset;
-		offset=offsets[ui];
-		for(size_t uj=0;uj<inside[ui].size(); uj++)
-			dataOut[offset + uj] = dataIn[inside[ui][uj]];
+#pragma omp parallel for
+		for(size_t ui=origSize;ui<selected.size();ui++)
+			selected[ui]=selIn.indices[selected[ui]];
 	}
-	// -- 
-#else
-	ASSERT(false); // what are you doing here??
-#endif
 
 	prog=maxProg;
 	return 0;
 }
 
+unsigned int CropHelper::classifyBox(const BoundCube &b) const
+{
+	//The retained regions (before inversion) are all convex,
+	// so if every corner is inside, so is the whole box
+	Point3D corners[8];
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		corners[ui]=Point3D(b.getBound(0,ui&1),
+				b.getBound(1,(ui>>1)&1),b.getBound(2,(ui>>2)&1));
+	}
+
+	unsigned int nInside=0;
+	for(unsigned int ui=0;ui<8;ui++)
+		nInside+=(this->*cropFunc)(corners[ui]);
+
+	unsigned int result=CROP_CELL_PARTIAL;
+	if(nInside == 8)
+		result=CROP_CELL_INSIDE;
+	else
+	{
+		//Check for the box being clear of the region
+		bool outside;
+		switch(algorithm)
+		{
+			case CROP_SPHERE_INSIDE:
+			case CROP_SPHERE_OUTSIDE:
+				outside=!b.intersects(pA,fA);
+				break;
+			case CROP_PLANE_FRONT:
+			case CROP_PLANE_BACK:
+				//Half-space complement is also convex
+				outside=!nInside;
+				break;
+			case CROP_AAB_INSIDE:
+			case CROP_AAB_OUTSIDE:
+			{
+				outside=false;
+				for(unsigned int ui=0;ui<3;ui++)
+				{
+					outside|= (b.getBound(ui,1) <= pA[ui] ||
+							b.getBound(ui,0) >= pB[ui]);
+				}
+				break;
+			}
+			case CROP_CYLINDER_INSIDE_AXIAL:
+			case CROP_CYLINDER_INSIDE_RADIAL:
+			case CROP_CYLINDER_OUTSIDE:
+			{
+				//Test the box's bounding sphere against the cylinder
+				Point3D centre=b.getCentroid();
+				float boxRad=0;
+				for(unsigned int ui=0;ui<3;ui++)
+					boxRad+=b.getSize(ui)*b.getSize(ui);
+				boxRad=sqrtf(boxRad)*0.5f;
+
+				Point3f p;
+				Point3D ptmp=centre-pA;
+				p.fx=ptmp[0];
+				p.fy=ptmp[1];
+				p.fz=ptmp[2];
+				if(!nearAxis)
+					quat_rot_apply_quat(&p,&qA);
+
+				float radius=sqrtf(fB);
+				outside = (fabs(p.fz) >= fA+boxRad || 
+					sqrtf(p.fx*p.fx+p.fy*p.fy) >= radius+boxRad);
+				break;
+			}
+			default:
+				ASSERT(false);
+				outside=false;
+		}
+
+		if(outside)
+			result=CROP_CELL_OUTSIDE;
+	}
+
+	if(invertedClip && result != CROP_CELL_PARTIAL)
+		result = (result == CROP_CELL_INSIDE) ? CROP_CELL_OUTSIDE : CROP_CELL_INSIDE;
+
+	return result;
+}
+
 bool CropHelper::filterSphereInside(const Point3D &p) const
 {
 	return p.sqrDist(pA) < fA;
@@ -541,3 +841,200 @@ void CropHelper::setFilterMode(size_t filterMode)
 }
 
 
+IonSpatialIndex::IonSpatialIndex()
+{
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		nCells[ui]=1;
+		cellWidth[ui]=0;
+	}
+}
+
+size_t IonSpatialIndex::cellOf(const Point3D &p) const
+{
+	size_t cell=0;
+	for(int ui=2;ui>=0;ui--)
+	{
+		unsigned int pos=0;
+		if(cellWidth[ui] > 0)
+		{
+			float f=(p[ui]-bounds.getBound(ui,0))/cellWidth[ui];
+			if(f > 0)
+				pos=std::min((unsigned int)f,nCells[ui]-1);
+		}
+		cell=cell*nCells[ui] + pos;
+	}
+	return cell;
+}
+
+void IonSpatialIndex::getCellBounds(size_t cell, BoundCube &b) const
+{
+	//Pad the cell, so that rounding in cellOf cannot place an
+	// ion just outside its cell
+	float pad=std::max(cellWidth[0],std::max(cellWidth[1],cellWidth[2]))*1e-3f;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		unsigned int pos=cell%nCells[ui];
+		cell/=nCells[ui];
+
+		float lower,upper;
+		lower=bounds.getBound(ui,0)+pos*cellWidth[ui];
+		if(pos+1 == nCells[ui])
+			upper=bounds.getBound(ui,1);
+		else
+			upper=lower+cellWidth[ui];
+		b.setBound(ui,0,lower-pad);
+		b.setBound(ui,1,upper+pad);
+	}
+}
+
+unsigned int IonSpatialIndex::build(const IonSelection &sel)
+{
+	const size_t n=sel.size();
+	unsigned int nT=1;
+#ifdef _OPENMP
+	nT=omp_get_max_threads();
+#endif
+
+	try
+	{
+		//Find the bounds of the selection
+		vector<BoundCube> cubes(nT);
+		for(unsigned int ui=0;ui<nT;ui++)
+			cubes[ui].setInverseLimits(true);
+		#pragma omp parallel for
+		for(size_t ui=0;ui<n;ui++)
+		{
+			unsigned int tid=0;
+#ifdef _OPENMP
+			tid=omp_get_thread_num();
+#endif
+			cubes[tid].expand(sel[ui].getPosRef());
+		}
+		bounds.setInverseLimits(true);
+		for(unsigned int ui=0;ui<nT;ui++)
+			bounds.expand(cubes[ui]);
+
+		//Choose near-cubic cells, so that the mean occupancy is
+		// about SPATIAL_INDEX_CELL_OCCUPANCY. Flat axes get a single cell
+		size_t targetCells=std::min(SPATIAL_INDEX_MAX_CELLS,
+				std::max((size_t)1,n/SPATIAL_INDEX_CELL_OCCUPANCY));
+		float volume=1;
+		unsigned int nDims=0;
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			if(n && bounds.getSize(ui) > sqrtf(std::numeric_limits<float>::epsilon()))
+			{
+				volume*=bounds.getSize(ui);
+				nDims++;
+			}
+		}
+
+		size_t totalCells=1;
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			nCells[ui]=1;
+			cellWidth[ui]=0;
+			if(nDims && bounds.getSize(ui) > sqrtf(std::numeric_limits<float>::epsilon()))
+			{
+				float side=powf(volume/(float)targetCells,1.0f/(float)nDims);
+				nCells[ui]=std::max(1u,(unsigned int)ceilf(bounds.getSize(ui)/side));
+				cellWidth[ui]=bounds.getSize(ui)/(float)nCells[ui];
+			}
+			totalCells*=nCells[ui];
+		}
+
+		//Counting sort of the ion offsets by cell. Each block counts its 
+		// own ions, so the sort is stable, and needs no locking
+		const size_t nBlocks=std::min((size_t)nT,std::max((size_t)1,n/CROP_BLOCK_SIZE));
+		vector<vector<unsigned int> > blockCount(nBlocks);
+		for(size_t ui=0;ui<nBlocks;ui++)
+			blockCount[ui].resize(totalCells,0);
+
+		#pragma omp parallel for
+		for(size_t ui=0;ui<nBlocks;ui++)
+		{
+			size_t end=(n*(ui+1))/nBlocks;
+			vector<unsigned int> &count=blockCount[ui];
+			for(size_t uj=(n*ui)/nBlocks;uj<end;uj++)
+				count[cellOf(sel[uj].getPosRef())]++;
+		}
+
+		if(*Filter::wantAbort)
+			return ERR_CROP_CALLBACK_FAIL;
+
+		//Convert counts into each block's starting offset within each cell
+		cellStart.resize(totalCells+1);
+		vector<vector<size_t> > blockPos(nBlocks);
+		for(size_t ui=0;ui<nBlocks;ui++)
+			blockPos[ui].resize(totalCells);
+		size_t running=0;
+		for(size_t ui=0;ui<totalCells;ui++)
+		{
+			cellStart[ui]=running;
+			for(size_t uj=0;uj<nBlocks;uj++)
+			{
+				blockPos[uj][ui]=running;
+				running+=blockCount[uj][ui];
+			}
+		}
+		cellStart[totalCells]=running;
+		ASSERT(running == n);
+		blockCount.clear();
+
+		order.resize(n);
+		#pragma omp parallel for
+		for(size_t ui=0;ui<nBlocks;ui++)
+		{
+			size_t end=(n*(ui+1))/nBlocks;
+			vector<size_t> &pos=blockPos[ui];
+			for(size_t uj=(n*ui)/nBlocks;uj<end;uj++)
+				order[pos[cellOf(sel[uj].getPosRef())]++]=uj;
+		}
+	}
+	catch(std::bad_alloc)
+	{
+		cellStart.clear();
+		order.clear();
+		return ERR_CROP_INSUFFICIENT_MEM;
+	}
+
+	return 0;
+}
+
+size_t IonSpatialIndex::estimateBytes(size_t nIons)
+{
+	size_t nCells=std::min(SPATIAL_INDEX_MAX_CELLS,
+			std::max((size_t)1,nIons/SPATIAL_INDEX_CELL_OCCUPANCY));
+	return (nIons + nCells+1)*sizeof(size_t);
+}
+
+bool IonSpatialIndex::wantIndex(const IonStreamData *d)
+{
+	return d->cached && d->indexInBudget && 
+		d->getNumBasicObjects() >= SPATIAL_INDEX_MIN_IONS;
+}
+
+const IonSpatialIndex *IonSpatialIndex::getIndex(const IonStreamData *d, size_t selection)
+{
+	const vector<IonSelection> &sel=d->shareIons();
+	ASSERT(selection < sel.size());
+	ASSERT(!d->hasPendingTransform());
+
+	if(d->spatialIndex.size() != sel.size())
+		d->spatialIndex.resize(sel.size());
+
+	if(!d->spatialIndex[selection])
+	{
+		IonSpatialIndex *index = new IonSpatialIndex;
+		if(index->build(sel[selection]))
+		{
+			delete index;
+			return 0;
+		}
+		d->spatialIndex[selection].reset(index);
+	}
+
+	ASSERT(d->spatialIndex[selection]->size() == sel[selection].size());
+	return d->spatialIndex[selection].get();
+}
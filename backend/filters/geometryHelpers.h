@@ -43,7 +43,18 @@ enum
 	ERR_CROP_INSUFFICIENT_MEM,
 };
 
+//Relationship of a box to the region retained by a crop
+enum
+{
+	CROP_CELL_OUTSIDE,
+	CROP_CELL_INSIDE,
+	CROP_CELL_PARTIAL
+};
+
 class CropHelper;
+class IonSelection;
+class IonStreamData;
+class IonSpatialIndex;
 
 //Type declaration for pointer to constant member function.
 // typename is in the middle of the declaration (i.e. "CropFuncPtr")
@@ -127,18 +138,6 @@ class CropHelper
 		//intialise the function pointer for the chosen algorithm
 		void setAlgorithm();
 
-
-		//Run the input filtering in linear (single CPU) mode
-		// allocHint, if >0 , is the recommended fraction of input to reserve
-		// ahead of copying
-		unsigned int runFilterLinear(const std::vector<IonHit> &dataIn,
-				std::vector<IonHit> &dataOut,float allocHint, 
-				float minProg, float maxProg, unsigned int &prog);
-	
-		//Run the input filtering in parallel (multi CPU) mode
-		unsigned int runFilterParallel(const std::vector<IonHit> &dataIn,
-				std::vector<IonHit> &dataOut,float allocHint,
-				float minProg, float maxProg, unsigned int &prog);
 	public:
 	
 		//Input vectors and scalars represent the fundamental
@@ -148,11 +147,46 @@ class CropHelper
 		
 		//Filter the input ion data in order to generate output points
 		// output data may contain previous data - this will be appended to,
-		// not overwritten
+		// not overwritten. Uses runFilterParallel for large inputs, if
+		// more than one thread is available, or runFilterLinear otherwise
 		unsigned int runFilter(const std::vector<IonHit> &dataIn,
 				std::vector<IonHit> &dataOut,
 				float progStart, float progEnd,unsigned int &prog) ;
 
+		//Run the input filtering in linear (single CPU) mode
+		// allocHint, if >0 , is the recommended fraction of input to reserve
+		// ahead of copying
+		unsigned int runFilterLinear(const std::vector<IonHit> &dataIn,
+				std::vector<IonHit> &dataOut,float allocHint, 
+				float minProg, float maxProg, unsigned int &prog);
+	
+		//Run the input filtering in parallel (multi CPU) mode
+		// output size is computed exactly, so no allocation hint is needed.
+		// Output is in input order, as for runFilterLinear
+		unsigned int runFilterParallel(const std::vector<IonHit> &dataIn,
+				std::vector<IonHit> &dataOut,
+				float minProg, float maxProg, unsigned int &prog);
+
+		//Filter the selected ions, without copying them. The offsets into
+		// the selection's source array of the ions that pass are appended to 
+		// selected, in input order
+		unsigned int runFilterSelection(const IonSelection &selIn,
+				std::vector<size_t> &selected,
+				float progStart, float progEnd,unsigned int &prog) ;
+
+
+		//As runFilterSelection, but uses a spatial index over the selection
+		// to accept or reject whole cells, testing only ions in cells that
+		// cross the primitive boundary. Offsets are appended in input order
+		unsigned int runFilterIndexed(const IonSelection &selIn,
+				const IonSpatialIndex &index, std::vector<size_t> &selected,
+				float progStart, float progEnd,unsigned int &prog) ;
+
+		//Find if the box lies wholly inside (CROP_CELL_INSIDE) or outside 
+		// (CROP_CELL_OUTSIDE) the retained region, or crosses its boundary
+		// (CROP_CELL_PARTIAL). This is conservative, so may report
+		// CROP_CELL_PARTIAL for boxes that are actually inside or outside
+		unsigned int classifyBox(const BoundCube &b) const;
 
 		void setMapMaxima(size_t maxima){ASSERT(maxima); mapMax=maxima;};
 		//Map an ion from its 3D coordinate to a 1D coordinate along the 
@@ -164,6 +198,59 @@ class CropHelper
 
 };
 
+//Uniform grid over the ions in a selection. The offsets of the ions 
+// are grouped by cell, in input order within each cell, so that whole
+// cells can be accepted or rejected by a query primitive
+class IonSpatialIndex
+{
+	private:
+		//Bounds of the indexed ions
+		BoundCube bounds;
+		//Number of cells, and cell size, along each axis
+		unsigned int nCells[3];
+		float cellWidth[3];
+		//Offsets into order of the first entry for each cell. Has one
+		// more element than there are cells
+		std::vector<size_t> cellStart;
+		//Offsets of the ions in the indexed selection, grouped by cell
+		std::vector<size_t> order;
+
+		//Obtain the cell containing the given point
+		size_t cellOf(const Point3D &p) const;
+	public:
+		IonSpatialIndex();
+
+		//Build the grid for the given selection. Returns nonzero
+		// on allocation failure or abort
+		unsigned int build(const IonSelection &sel);
+
+		//Number of indexed ions
+		size_t size() const { return order.size();}
+
+		size_t numCells() const { return cellStart.empty() ? 0 : cellStart.size()-1;}
+		//Memory held by the index, in bytes
+		size_t numBytes() const { return (cellStart.capacity() + order.capacity())*sizeof(size_t);}
+		//Approximate memory needed to index the given number of ions
+		static size_t estimateBytes(size_t nIons);
+		//Obtain the bounds of the given cell. Slightly enlarged, so 
+		// that ions on the cell boundary are always contained
+		void getCellBounds(size_t cell, BoundCube &b) const;
+		//Range of entries for the given cell, [begin,end)
+		size_t cellBegin(size_t cell) const { return cellStart[cell];}
+		size_t cellEnd(size_t cell) const { return cellStart[cell+1];}
+		//Convert an entry into an offset into the indexed selection
+		size_t selectionIndex(size_t entry) const { return order[entry];}
+
+		//True if the stream is worth indexing: it is large, and is held 
+		// in a cache (with room for the index), so queries against it 
+		// will be repeated
+		static bool wantIndex(const IonStreamData *d);
+
+		//Obtain the index for a selection of the stream's ions (as 
+		// given by shareIons), building it if needed. The index is kept
+		// with the stream, until its ions change. Returns 0 on failure
+		static const IonSpatialIndex *getIndex(const IonStreamData *d, size_t selection);
+};
 
 //Primitive Descriptions: What you need to pass in
 //---
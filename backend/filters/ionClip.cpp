@@ -420,37 +420,66 @@ unsigned int IonClipFilter::refresh(const std::vector<const FilterStreamData *>
 			{
 				case STREAM_TYPE_IONS:
 				{
+					const IonStreamData *src=(const IonStreamData *)dataIn[ui];
 					d=new IonStreamData;
 					d->parent=this;
-					minProg=cumulativeSize/(float)totalSize;
-					cumulativeSize+=d->data.size();
-					maxProg=cumulativeSize/(float)totalSize;
 
-					//Filter input data to output data.
-					if(cropper.runFilter(((const IonStreamData *)dataIn[ui])->data,
-						d->data,minProg,maxProg,progress.filterProgress))
+					//Select the passing ions from the input, rather than copying them
+					const vector<IonSelection> &srcSel=src->shareIons();
+					//Large cached inputs are spatially indexed, which is much faster
+					// when the primitive is repeatedly moved (e.g. when dragged)
+					bool useIndex=IonSpatialIndex::wantIndex(src);
+					for(size_t uj=0;uj<srcSel.size();uj++)
 					{
-						delete d;
-						return CALLBACK_FAIL; 
+						minProg=cumulativeSize/(float)totalSize;
+						cumulativeSize+=srcSel[uj].size();
+						maxProg=cumulativeSize/(float)totalSize;
+
+						const IonSpatialIndex *index=0;
+						if(useIndex)
+							index=IonSpatialIndex::getIndex(src,uj);
+
+						IonSelection sel;
+						sel.source=srcSel[uj].source;
+						unsigned int errCode;
+						if(index)
+						{
+							errCode=cropper.runFilterIndexed(srcSel[uj],*index,sel.indices,
+								minProg*100.0f,maxProg*100.0f,progress.filterProgress);
+						}
+						else
+						{
+							errCode=cropper.runFilterSelection(srcSel[uj],sel.indices,
+								minProg*100.0f,maxProg*100.0f,progress.filterProgress);
+						}
+
+						if(errCode)
+						{
+							delete d;
+							return CALLBACK_FAIL; 
+						}
+
+						if(sel.indices.size())
+							d->selections.push_back(sel);
 					}
 
-					if(d->data.size())
+					if(d->hasSelections())
 					{
 						//Copy over other attributes
-						d->r = ((IonStreamData *)dataIn[ui])->r;
-						d->g = ((IonStreamData *)dataIn[ui])->g;
-						d->b =((IonStreamData *)dataIn[ui])->b;
-						d->a =((IonStreamData *)dataIn[ui])->a;
-						d->ionSize =((IonStreamData *)dataIn[ui])->ionSize;
+						d->r = src->r;
+						d->g = src->g;
+						d->b =src->b;
+						d->a =src->a;
+						d->ionSize =src->ionSize;
 
 						//getOut is const, so shouldn't be modified
 						cacheAsNeeded(d);
 
 						getOut.push_back(d);
-						d=0;
 					}
 					else
 						delete d;
+					d=0;
 					break;
 				}
 				default:
@@ -1028,6 +1057,12 @@ bool cylinderTest(const Point3D &pAxis, const unsigned int *span, float testRadi
 //Test the axis-aligned box primitve
 bool rectTest();
 
+//Test that spatially indexed clipping matches unindexed clipping
+bool indexedCropTest();
+
+//Test that the linear and parallel copying crops give the same, ordered output
+bool cropPathsTest();
+
 
 bool IonClipFilter::runUnitTests()
 {
@@ -1053,6 +1088,12 @@ bool IonClipFilter::runUnitTests()
 	if(!rectTest())
 		return false;
 
+	if(!indexedCropTest())
+		return false;
+
+	if(!cropPathsTest())
+		return false;
+
 	return true;
 }
 
@@ -1098,7 +1139,9 @@ bool sphereTest()
 
 	TEST(streamOut[0]->getNumBasicObjects() > 0, "clipped point count");
 
-	const IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	//Clipped ions are selections, so copy them out
+	dOut->materialiseSelections();
 
 	for(unsigned int ui=0;ui<dOut->data.size();ui++)
 	{
@@ -1152,7 +1195,9 @@ bool planeTest()
 	TEST(streamOut.size() == 1,"stream count");
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
 	
-	const IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	//Clipped ions are selections, so copy them out
+	dOut->materialiseSelections();
 
 	for(unsigned int ui=0;ui<dOut->data.size();ui++)
 	{
@@ -1203,7 +1248,9 @@ bool cylinderTest(const Point3D &pAxis, const unsigned int *span, float testRadi
 	TEST(streamOut.size() == 1,"stream count");
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
 	
-	const IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	//Clipped ions are selections, so copy them out
+	dOut->materialiseSelections();
 
 	DrawCylinder *dC = new DrawCylinder;
 	dC->setRadius(testRadius);
@@ -1275,7 +1322,9 @@ bool rectTest()
 
 	TEST(streamOut.size() == 1,"stream count");
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
-	const IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	IonStreamData *dOut=(IonStreamData*)streamOut[0];
+	//Clipped ions are selections, so copy them out
+	dOut->materialiseSelections();
 	
 	BoundCube b;
 	b.setBounds(pOrigin-pCorner,pOrigin+pCorner);
@@ -1292,6 +1341,176 @@ bool rectTest()
 	return true;
 }
 
+bool indexedCropTest()
+{
+	//Random points, plus lattice points, which fall exactly on
+	// the primitive and cell boundaries
+	unsigned int span[]={ 
+			5, 7, 9
+			};	
+	IonStreamData *d=synthData(span,5000);
+	RandNumGen rng;
+	rng.initialise(1234);
+	for(unsigned int ui=0;ui<20000;ui++)
+	{
+		IonHit h;
+		h.setPos(Point3D(rng.genUniformDev()*span[0],
+			rng.genUniformDev()*span[1],rng.genUniformDev()*span[2]));
+		h.setMassToCharge(1);
+		d->data.push_back(h);
+	}
+
+	const vector<IonSelection> &srcSel=d->shareIons();
+	TEST(srcSel.size() == 1,"shared selection count");
+
+	IonSpatialIndex index;
+	TEST(!index.build(srcSel[0]),"index build");
+	TEST(index.size() == srcSel[0].size(),"index size");
+	TEST(index.numCells() > 1,"index cell count");
+
+	//Mode, then primitive parameters
+	vector<size_t> modes;
+	vector<vector<Point3D> > vecs;
+	vector<vector<float> > scalars;
+	Point3D centre(2.5,3.5,4.5);
+	for(unsigned int ui=0;ui<2;ui++)
+	{
+		modes.push_back(ui ? CROP_SPHERE_OUTSIDE : CROP_SPHERE_INSIDE);
+		vecs.push_back(vector<Point3D>(1,centre));
+		scalars.push_back(vector<float>(1,2.0f));
+		
+		modes.push_back(ui ? CROP_PLANE_BACK: CROP_PLANE_FRONT);
+		vecs.push_back(vector<Point3D>(1,centre));
+		vecs.back().push_back(Point3D(1,1,0.5));
+		scalars.push_back(vector<float>());
+		
+		modes.push_back(ui ? CROP_AAB_OUTSIDE: CROP_AAB_INSIDE);
+		vecs.push_back(vector<Point3D>(1,centre));
+		vecs.back().push_back(Point3D(1,2,3));
+		scalars.push_back(vector<float>());
+	}
+
+	const size_t cylModes[] = { CROP_CYLINDER_INSIDE_AXIAL, 
+			CROP_CYLINDER_INSIDE_RADIAL,CROP_CYLINDER_OUTSIDE};
+	for(unsigned int ui=0;ui<THREEDEP_ARRAYSIZE(cylModes);ui++)
+	{
+		//Off-axis and on-axis cylinders
+		modes.push_back(cylModes[ui]);
+		vecs.push_back(vector<Point3D>(1,centre));
+		vecs.back().push_back(Point3D(2,3,6));
+		scalars.push_back(vector<float>(1,1.5f));
+		
+		modes.push_back(cylModes[ui]);
+		vecs.push_back(vector<Point3D>(1,centre));
+		vecs.back().push_back(Point3D(0,0,4));
+		scalars.push_back(vector<float>(1,1.5f));
+	}
+
+	for(size_t ui=0;ui<modes.size();ui++)
+	{
+		CropHelper cropper(srcSel[0].size(),modes[ui],vecs[ui],scalars[ui]);
+
+		vector<size_t> linear,indexed;
+		unsigned int prog;
+		TEST(!cropper.runFilterSelection(srcSel[0],linear,0,100,prog),"linear crop");
+		TEST(!cropper.runFilterIndexed(srcSel[0],index,indexed,0,100,prog),"indexed crop");
+
+		TEST(linear.size() && linear.size() < srcSel[0].size(),"crop selects some ions");
+		TEST(linear == indexed,"indexed crop matches linear crop");
+	}
+
+	//Indexed crops must keep input order, even if the selection
+	// does not run in source order
+	IonSelection reversed;
+	reversed.source=srcSel[0].source;
+	for(size_t ui=srcSel[0].size();ui--;)
+		reversed.indices.push_back(ui);
+	IonSpatialIndex reversedIndex;
+	TEST(!reversedIndex.build(reversed),"reversed index build");
+	{
+	CropHelper cropper(reversed.size(),modes[0],vecs[0],scalars[0]);
+	vector<size_t> linear,indexed;
+	unsigned int prog;
+	TEST(!cropper.runFilterSelection(reversed,linear,0,100,prog),"reversed linear crop");
+	TEST(!cropper.runFilterIndexed(reversed,reversedIndex,indexed,0,100,prog),"reversed indexed crop");
+	TEST(linear.size() && linear == indexed,"indexed crop keeps selection order");
+	}
+
+	delete d;
+	return true;
+}
+
+bool cropPathsTest()
+{
+	//Several parallel blocks worth of random points. The mass is
+	// the input position, so the order of the output can be checked
+	const unsigned int NUM_PTS=200000;
+	const float BOX_SIZE=10.0f;
+	vector<IonHit> ions(NUM_PTS);
+	RandNumGen rng;
+	rng.initialise(4321);
+	for(unsigned int ui=0;ui<NUM_PTS;ui++)
+	{
+		ions[ui].setPos(Point3D(rng.genUniformDev(),rng.genUniformDev(),
+				rng.genUniformDev())*BOX_SIZE);
+		ions[ui].setMassToCharge(ui);
+	}
+
+	Point3D centre(5,5,5);
+	const size_t modes[] = { CROP_SPHERE_INSIDE, CROP_SPHERE_OUTSIDE,
+			CROP_PLANE_FRONT, CROP_PLANE_BACK,
+			CROP_CYLINDER_INSIDE_AXIAL, CROP_CYLINDER_OUTSIDE,
+			CROP_AAB_INSIDE, CROP_AAB_OUTSIDE};
+	for(unsigned int ui=0;ui<THREEDEP_ARRAYSIZE(modes);ui++)
+	{
+		vector<Point3D> vecs(1,centre);
+		vector<float> scalars;
+		switch(modes[ui])
+		{
+			case CROP_SPHERE_INSIDE:
+			case CROP_SPHERE_OUTSIDE:
+				scalars.push_back(3.0f);
+				break;
+			case CROP_PLANE_FRONT:
+			case CROP_PLANE_BACK:
+				vecs.push_back(Point3D(1,1,0.5));
+				break;
+			case CROP_CYLINDER_INSIDE_AXIAL:
+			case CROP_CYLINDER_OUTSIDE:
+				vecs.push_back(Point3D(2,3,6));
+				scalars.push_back(2.0f);
+				break;
+			case CROP_AAB_INSIDE:
+			case CROP_AAB_OUTSIDE:
+				vecs.push_back(Point3D(1,2,3));
+				break;
+		}
+
+		CropHelper cropper(ions.size(),modes[ui],vecs,scalars);
+
+		//Output is appended to, so start with an existing ion
+		vector<IonHit> linear(1,ions[0]),parallel(1,ions[0]);
+		unsigned int prog;
+		TEST(!cropper.runFilterLinear(ions,linear,0,0,100,prog),"linear crop");
+		TEST(!cropper.runFilterParallel(ions,parallel,0,100,prog),"parallel crop");
+
+		TEST(linear.size() > 1 && linear.size() < ions.size(),"crop selects some ions");
+		TEST(linear.size() == parallel.size(),"parallel crop count");
+		for(size_t uj=0;uj<linear.size();uj++)
+		{
+			TEST(linear[uj].getMassToCharge() == parallel[uj].getMassToCharge() &&
+				linear[uj].getPosRef().sqrDist(parallel[uj].getPosRef()) == 0,
+				"parallel crop matches linear crop");
+		}
+		for(size_t uj=2;uj<parallel.size();uj++)
+		{
+			TEST(parallel[uj-1].getMassToCharge() < parallel[uj].getMassToCharge(),
+				"parallel crop keeps input order");
+		}
+	}
+
+	return true;
+}
 
 IonStreamData *synthData(const unsigned int span[], unsigned int numPts)
 {
@@ -94,6 +94,9 @@ class IonClipFilter :  public Filter
 		//!Set internal property value using a selection binding 
 		void setPropFromBinding(const SelectionBinding &b);
 
+		//!Clipped ions are selected from the input, so input may also be a selection
+		bool acceptsIonSelections() const { return true;}
+
 #ifdef DEBUG
 		bool runUnitTests();
 #endif
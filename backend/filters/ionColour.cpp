@@ -41,7 +41,33 @@ enum
 
 enum
 {
-	IONCOLOUR_ABORT_ERR
+	IONCOLOUR_ABORT_ERR=1,
+	IONCOLOUR_BAD_ALLOC,
+	IONCOLOUR_ERR_ENUM_END
+};
+
+//Assigns ions to colours by linear mapping of mass-to-charge in the map range
+class IonColourBinner
+{
+	private:
+		const vector<IonHit> *ions;
+		float mapStart,mapEnd;
+		unsigned int nColours;
+	public:
+		IonColourBinner(const vector<IonHit> &h, float start, float end,
+			unsigned int n) : ions(&h), mapStart(start),mapEnd(end),nColours(n) {}
+
+		unsigned int bin(size_t offset) const
+		{
+			float tmp;	
+			tmp= ((*ions)[offset].getMassToCharge()-mapStart)/(mapEnd-mapStart);
+			tmp = std::max(0.0f,tmp);
+			tmp = std::min(tmp,1.0f);
+			
+			return (unsigned int)(tmp*(float)(nColours-1));	
+		}
+
+		const IonHit &value(size_t offset) const { return (*ions)[offset];}
 };
 
 IonColourFilter::IonColourFilter() : colourMap(0),reverseMap(false), 
@@ -125,9 +151,16 @@ unsigned int IonColourFilter::refresh(const std::vector<const FilterStreamData *
 
 	//Did we find any ions in this pass?
 	bool foundIons=false;	
-	unsigned int totalSize=numElements(dataIn);
-	unsigned int curProg=NUM_CALLBACK;
-	size_t n=0;
+	size_t totalSize=numElements(dataIn);
+
+	vector<vector<IonHit> *> bins(nColours);
+	for(unsigned int ui=0;ui<nColours;ui++)
+		bins[ui]=&(d[ui]->data);
+
+	//One binner for each input ion stream, so that all streams 
+	// are split together
+	vector<IonColourBinner> binners;
+	vector<size_t> counts;
 	for(unsigned int ui=0;ui<dataIn.size() ;ui++)
 	{
 		switch(dataIn[ui]->getStreamType())
@@ -135,6 +168,7 @@ unsigned int IonColourFilter::refresh(const std::vector<const FilterStreamData *
 			case STREAM_TYPE_IONS: 
 			{
 				foundIons=true;
+				const vector<IonHit> &ions=((const IonStreamData *)dataIn[ui])->data;
 
 				//Check for ion size consistency	
 				if(haveIonSize)
@@ -147,37 +181,9 @@ unsigned int IonColourFilter::refresh(const std::vector<const FilterStreamData *
 					ionSize=((const IonStreamData *)dataIn[ui])->ionSize;
 					haveIonSize=true;
 				}
-				for(vector<IonHit>::const_iterator it=((const IonStreamData *)dataIn[ui])->data.begin();
-					       it!=((const IonStreamData *)dataIn[ui])->data.end(); ++it)
-				{
-					//Work out the colour map assignment from the mass to charge.
-					// linear assignment in range
-					unsigned int colour;
-
-					float tmp;	
-					tmp= (it->getMassToCharge()-mapBounds[0])/(mapBounds[1]-mapBounds[0]);
-					tmp = std::max(0.0f,tmp);
-					tmp = std::min(tmp,1.0f);
-					
-					colour=(unsigned int)(tmp*(float)(nColours-1));	
-					d[colour]->data.push_back(*it);
-				
-					//update progress every CALLBACK ions
-					if(!curProg--)
-					{
-						n+=NUM_CALLBACK;
-						progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-						curProg=NUM_CALLBACK;
-						if(*Filter::wantAbort)
-						{
-							for(unsigned int ui=0;ui<nColours;ui++)
-								delete d[ui];
-							return IONCOLOUR_ABORT_ERR;
-						}
-					}
-				}
 
-				
+				binners.push_back(IonColourBinner(ions,mapBounds[0],mapBounds[1],nColours));
+				counts.push_back(ions.size());
 				break;
 			}
 			default:
@@ -186,6 +192,29 @@ unsigned int IonColourFilter::refresh(const std::vector<const FilterStreamData *
 		}
 	}
 
+	//Split the ions into their colours, in parallel
+	unsigned int errCode;
+	try
+	{
+		vector<const IonColourBinner *> binnerPtrs(binners.size());
+		for(size_t ui=0;ui<binners.size();ui++)
+			binnerPtrs[ui]=&binners[ui];
+		errCode=scatterToBins(binnerPtrs,counts,bins,
+			progress.filterProgress,0,totalSize);
+	}
+	catch(std::bad_alloc &)
+	{
+		errCode=IONCOLOUR_BAD_ALLOC;
+	}
+
+	if(errCode)
+	{
+		for(unsigned int ui=0;ui<nColours;ui++)
+			delete d[ui];
+		return errCode == IONCOLOUR_BAD_ALLOC ? 
+			IONCOLOUR_BAD_ALLOC : IONCOLOUR_ABORT_ERR;
+	}
+
 	//create the colour bar as needed
 	if(foundIons && showColourBar)
 	{
@@ -407,8 +436,15 @@ bool IonColourFilter::setProperty(  unsigned int key,
 
 std::string  IonColourFilter::getSpecificErrString(unsigned int code) const
 {
-	//Currently the only error is aborting
-	return std::string(TRANS("Aborted"));
+	const char *errStrs[] = { "",
+		NTRANS("Aborted"),
+		NTRANS("Insufficient memory to colour ions"),
+	};
+	
+	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(errStrs) == IONCOLOUR_ERR_ENUM_END);
+	ASSERT(code < IONCOLOUR_ERR_ENUM_END);
+
+	return TRANS(errStrs[code]);
 }
 
 void IonColourFilter::setPropFromBinding(const SelectionBinding &b)
@@ -651,11 +687,76 @@ bool ionCountTest()
 }
 
 
+//Check that a large, multi-threaded split keeps every ion, in order
+bool ionScatterTest()
+{
+	const unsigned int NUM_PTS=200000;
+	vector<const FilterStreamData*> streamIn,streamOut;
+	//Two input streams, which are split together. Ions are 
+	// numbered in input order across both streams
+	IonStreamData *d[2];
+	for(unsigned int uj=0;uj<2;uj++)
+	{
+		d[uj]=sythIonCountData(NUM_PTS/2,0,100);
+		//Interleave the masses, so every colour is spread through the input.
+		// Only the map end itself falls in the last colour, so include it
+		for(unsigned int ui=0;ui<NUM_PTS/2;ui++)
+		{
+			unsigned int id=uj*NUM_PTS/2+ui;
+			d[uj]->data[ui].setPos(Point3D(id,0,0));
+			d[uj]->data[ui].setMassToCharge((float)((id*7919)%NUM_PTS)/(float)(NUM_PTS-1)*100.0f);
+		}
+		streamIn.push_back(d[uj]);
+	}
+
+	IonColourFilter *f = new IonColourFilter;
+	f->setCaching(false);
+
+	bool needUpdate;
+	TEST(f->setProperty(KEY_IONCOLOURFILTER_NCOLOURS,"64",needUpdate),"Set prop");
+	TEST(f->setProperty(KEY_IONCOLOURFILTER_MAPSTART,"0",needUpdate),"Set prop");
+	TEST(f->setProperty(KEY_IONCOLOURFILTER_MAPEND,"100",needUpdate),"Set prop");
+	TEST(f->setProperty(KEY_IONCOLOURFILTER_SHOWBAR,"0",needUpdate),"Set prop");
+	
+	ProgressData p;
+	TEST(!f->refresh(streamIn,streamOut,p),"refresh error code");
+	delete f;
+	delete d[0];
+	delete d[1];
+	
+	TEST(streamOut.size() == 64,"stream count");
+
+	size_t total=0;
+	for(unsigned int ui=0;ui<streamOut.size();ui++)
+	{
+		const IonStreamData *out=(const IonStreamData *)streamOut[ui];
+		const vector<IonHit> &h=out->data;
+		total+=h.size();
+		TEST(h.size() == h.capacity(),"exact output size");
+		for(size_t uj=1;uj<h.size();uj++)
+		{
+			//Input order is kept within each colour
+			TEST(h[uj-1][0] < h[uj][0],"ion order");
+			TEST(fabs(h[uj].getMassToCharge() - h[0].getMassToCharge()) < 100.0f/63.0f,
+						"colour mass range");
+		}
+	}
+	TEST(total == NUM_PTS,"ion count");
+
+	for(unsigned int ui=0;ui<streamOut.size();ui++)
+		delete streamOut[ui];
+
+	return true;
+}
+
 bool IonColourFilter::runUnitTests()
 {
 	if(!ionCountTest())
 		return false;
 
+	if(!ionScatterTest())
+		return false;
+
 	return true;
 }
 
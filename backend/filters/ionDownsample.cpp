@@ -202,19 +202,59 @@ unsigned int IonDownsampleFilter::refresh(const std::vector<const FilterStreamDa
 					if(!totalSize)
 						continue;
 
+					const IonStreamData *src=(const IonStreamData *)dataIn[ui];
 					IonStreamData *d;
 					d=new IonStreamData;
 					d->parent=this;
 					try
 					{
-						if(fixedNumOut)
+						//Select the sampled ions from the input, rather than copying them
+						const vector<IonSelection> &srcSel=src->shareIons();
+						size_t n=0;
+						for(size_t uj=0;uj<srcSel.size();uj++)
 						{
-							float frac;
-							frac = (float)(((const IonStreamData*)dataIn[ui])->data.size())/(float)totalSize;
+							const IonSelection &in=srcSel[uj];
+							IonSelection sel;
+							sel.source=in.source;
+							if(fixedNumOut)
+							{
+								float frac;
+								frac = (float)(in.size())/(float)totalSize;
+
+								randomDigitSelection(sel.indices,in.size(),rng,
+									(size_t)(maxAfterFilter*frac),progress.filterProgress,
+											*Filter::wantAbort,strongRandom);
 
-							randomSelect(d->data,((const IonStreamData *)dataIn[ui])->data,
-										rng,maxAfterFilter*frac,progress.filterProgress,
-												*wantAbort,strongRandom);
+								//Convert to offsets in the source array
+								if(!in.selectAll)
+								{
+									for(size_t uk=0;uk<sel.indices.size();uk++)
+										sel.indices[uk]=in.indices[sel.indices[uk]];
+								}
+							}
+							else
+							{
+								//Reserve 90% of storage needed.
+								//highly likely with even modest numbers of ions
+								//that this will be exceeded
+								sel.indices.reserve((size_t)(fraction*0.9*in.size()));
+
+								for(size_t uk=0;uk<in.size();uk++)
+								{
+									if(rng.genUniformDev() <  fraction)
+										sel.indices.push_back(in.sourceIndex(uk));
+								
+									if(!(n++ % NUM_CALLBACK))
+									{
+										progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
+										if(*Filter::wantAbort)
+										{
+											delete d;
+											return FILTER_ERR_ABORT;
+										}
+									}
+								}
+							}
 
 							if(*Filter::wantAbort)
 							{
@@ -222,31 +262,8 @@ unsigned int IonDownsampleFilter::refresh(const std::vector<const FilterStreamDa
 								return FILTER_ERR_ABORT;
 							}
 
-						}
-						else
-						{
-
-							size_t n=0;
-							//Reserve 90% of storage needed.
-							//highly likely with even modest numbers of ions
-							//that this will be exceeded
-							d->data.reserve((size_t)(fraction*0.9*totalSize));
-
-							ASSERT(dataIn[ui]->getStreamType() == STREAM_TYPE_IONS);
-
-							for(std::vector<IonHit>::const_iterator it=((const IonStreamData *)dataIn[ui])->data.begin();
-								       it!=((const IonStreamData *)dataIn[ui])->data.end(); ++it)
-							{
-								if(rng.genUniformDev() <  fraction)
-									d->data.push_back(*it);
-							
-								progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-								if(*Filter::wantAbort)
-								{
-									delete d;
-									return FILTER_ERR_ABORT;
-								}
-							}
+							if(sel.indices.size())
+								d->selections.push_back(sel);
 						}
 					}
 					catch(std::bad_alloc)
@@ -256,7 +273,7 @@ unsigned int IonDownsampleFilter::refresh(const std::vector<const FilterStreamDa
 					}
 
 					//skip ion output sets with no ions in them
-					if(d->data.empty())
+					if(!d->hasSelections())
 					{
 						delete d;
 						continue;
@@ -826,6 +843,7 @@ bool fixedSampleTest()
 	TEST(streamOut.size() == 1, "Stream count");
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS, "stream type");
 	TEST(streamOut[0]->getNumBasicObjects() == numOutput, "output ions (basicobject)"); 
+	((IonStreamData*)streamOut[0])->materialiseSelections();
 	TEST( ((IonStreamData*)streamOut[0])->data.size() == numOutput, "output ions (direct)")
 
 	delete streamOut[0];
@@ -106,6 +106,9 @@ class IonDownsampleFilter : public Filter
 		
 		//!Get the stream types that will be possibly used during ::refresh	
 		unsigned int getRefreshUseMask() const;	
+
+		//!Sampled ions are selected from the input, except when sampling per-species
+		bool acceptsIonSelections() const { return !perSpecies;}
 		
 #ifdef DEBUG
 		//Fire off the unit tests for this class. returns false if *any* test fails
@@ -370,7 +370,7 @@ unsigned int IonInfoFilter::refresh(const std::vector<const FilterStreamData *>
 			{
 				//OK, so here we need to do a convex hull estimation of the volume.
 				unsigned int err;
-				err=convexHullEstimateVol(dataIn,computedVol);
+				err=convexHullEstimateVol(dataIn,&(progress.filterProgress),computedVol);
 				if(err)
 					return err;
 
@@ -693,37 +693,18 @@ void IonInfoFilter::setPropFromBinding(const SelectionBinding &b)
 }
 
 unsigned int IonInfoFilter::convexHullEstimateVol(const vector<const FilterStreamData*> &data, 
-								float &volume)
+							unsigned int *progress, float &volume)
 {
 	volume=0;
 
-	//TODO: replace with real progress
-	unsigned int dummyProgress;
-
-	//Compute the convex hull, leaving the qhull data structure intact
-	const bool NO_FREE_QHULL=false;
-	const bool WANT_QHULL_VOL=true;
 	vector<Point3D> hullPts;
-	if(computeConvexHull(data,&dummyProgress,
-			hullPts,WANT_QHULL_VOL,NO_FREE_QHULL))
+	unsigned int err;
+	err=computeConvexHull(data,progress,hullPts,&volume);
+	if(err == HULL_ERR_USER_ABORT)
+		return ERR_USER_ABORT;
+	else if(err)
 		return ERR_BAD_QHULL;
 
-	Point3D midPt(0,0,0);
-
-	for(size_t ui=0;ui<hullPts.size();ui++)
-		midPt+=hullPts[ui];
-	
-	midPt*=1.0f/(float)hullPts.size();
-
-	//We don't need this result anymore
-	hullPts.clear();
-
-	volume=qh totvol;
-
-
-	//Free the convex hull mem
-	freeConvexHull();
-
 	return 0;
 }
 
@@ -1052,6 +1033,54 @@ bool volumeSphereTest()
 	return true;
 }
 
+//Check that hulls of large, filled datasets are correct, and
+// that two hulls can be computed at once
+bool concurrentHullTest()
+{
+	const float BOX_SIZE=10.0f;
+	IonStreamData *d=new IonStreamData();
+	makeBox(BOX_SIZE,d);
+
+	RandNumGen rng;
+	rng.initialise(4321);
+	for(unsigned int ui=0;ui<200000;ui++)
+	{
+		IonHit h;
+		h.setPos(Point3D(rng.genUniformDev(),rng.genUniformDev(),
+				rng.genUniformDev())*BOX_SIZE);
+		h.setMassToCharge(1);
+		d->data.push_back(h);
+	}
+
+	vector<const FilterStreamData*> streamIn;
+	streamIn.push_back(d);
+
+	float vol[2];
+	unsigned int err[2],prog[2];
+	vector<Point3D> hullPts[2];
+	#pragma omp parallel for
+	for(unsigned int ui=0;ui<2;ui++)
+		err[ui]=computeConvexHull(streamIn,prog+ui,hullPts[ui],vol+ui);
+
+	const float volReal=BOX_SIZE*BOX_SIZE*BOX_SIZE;
+	BoundCube b;
+	b.setBounds(Point3D(-0.01f,-0.01f,-0.01f),Point3D(BOX_SIZE,BOX_SIZE,BOX_SIZE)*1.001f);
+	for(unsigned int ui=0;ui<2;ui++)
+	{
+		TEST(!err[ui],"hull error code");
+		TEST(fabs(vol[ui]-volReal) < 0.01f*volReal,"hull volume");
+		TEST(hullPts[ui].size() >= 8,"hull vertex count");
+		for(size_t uj=0;uj<hullPts[ui].size();uj++)
+		{
+			TEST(b.containsPt(hullPts[ui][uj]),"hull vertex in box");
+		}
+	}
+	TEST(fabs(vol[0]-vol[1]) < 1e-3f*volReal,"concurrent hulls agree");
+
+	delete d;
+	return true;
+}
+
 bool IonInfoFilter::runUnitTests()
 {
 	if(!volumeBoxTest())
@@ -1059,6 +1088,9 @@ bool IonInfoFilter::runUnitTests()
 	
 	if(!volumeSphereTest())
 		return false;
+
+	if(!concurrentHullTest())
+		return false;
 	
 	return true;
 }
@@ -72,10 +72,9 @@ class IonInfoFilter : public Filter
 		size_t volumeEstimationStringFromID(const char *str) const;
 
 		//Convex hull volume estimation routine.
-		//returns 0 on success. global "qh " "object"  will contain
-		//the hull. Volume is computed.
+		//returns 0 on success. Volume is computed.
 		static unsigned int convexHullEstimateVol(const std::vector<const FilterStreamData*> &data, 
-							float &vol);
+							unsigned int *progress, float &vol);
 	public:
 		//!Constructor
 		IonInfoFilter();
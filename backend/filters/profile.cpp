@@ -21,6 +21,10 @@
 #include "filterCommon.h"
 #include "geometryHelpers.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using std::vector;
 using std::string;
 using std::pair;
@@ -75,44 +79,52 @@ ProfileFilter::ProfileFilter() : primitiveType(PRIMITIVE_CYLINDER_AXIAL),
 	haveRangeParent=false;
 }
 
-//Puts an ion in its appropriate range position, given ionID mapping,
-//range data (if any), mass to charge and the output table
-void ProfileFilter::binIon(unsigned int targetBin, const RangeStreamData* rng, 
-	const map<unsigned int,unsigned int> &ionIDMapping,
-	vector<vector<size_t> > &frequencyTable, float massToCharge) 
+//Add an ion to a dense [column][bin] histogram, if it maps into the 
+// primitive, and when ranging, lies in a counted range
+inline void binIon(const CropHelper &mapping, const IonHit &h, 
+	const RangeStreamData *rng, const vector<unsigned int> &rangeColumn,
+	unsigned int numBins, size_t *hist)
 {
-	//if we have no range data, then simply increment its position in a 1D table
-	//which will later be used as "count" data (like some kind of density plot)
-	if(!rng)
-	{
-		ASSERT(frequencyTable.size() == 1);
-		//There is a really annoying numerical boundary case
-		//that makes the target bin equate to the table size. 
-		//disallow this.
-		if(targetBin < frequencyTable[0].size())
-		{
-			vector<size_t>::iterator it;
-			it=frequencyTable[0].begin()+targetBin;
-			#pragma omp critical
-			(*it)++;
-		}
+	unsigned int targetBin;
+	targetBin=mapping.mapIon1D(h);
+
+	//Unmappable ions are -1, so also fail this test. There is a
+	// numerical boundary case that can make the target bin equal
+	// the table size, also disallow this
+	if(targetBin >= numBins)
 		return;
-	}
 
+	if(rng)
+	{
+		//Classify the ion using the range data
+		unsigned int rangeID;
+		rangeID= rng->rangeFile->getRangeID(h.getMassToCharge());
+		if(rangeID != (unsigned int)-1 && 
+			rangeColumn[rangeID] != (unsigned int)-1)
+			hist[rangeColumn[rangeID]*numBins + targetBin]++;
+	}
+	else
+		hist[targetBin]++;
+}
 
-	//We have range data, we need to use it to classify the ion and then increment
-	//the appropriate position in the table
-	unsigned int rangeID = rng->rangeFile->getRangeID(massToCharge);
+//Build a lookup table from range ID to frequency table column, given the
+// ionID mapping. Ranges that should not be counted map to -1
+void ProfileFilter::buildRangeColumnMap(const RangeStreamData* rng, 
+	const map<unsigned int,unsigned int> &ionIDMapping,
+	vector<unsigned int> &rangeColumn) 
+{
+	const RangeFile *rngF=rng->rangeFile;
 
-	if(rangeID != (unsigned int)(-1) && rng->enabledRanges[rangeID])
+	rangeColumn.assign(rngF->getNumRanges(),(unsigned int)-1);
+	for(unsigned int ui=0;ui<rangeColumn.size();ui++)
 	{
-		unsigned int ionID=rng->rangeFile->getIonID(rangeID); 
-		unsigned int pos;
-		pos = ionIDMapping.find(ionID)->second;
-		vector<size_t>::iterator it;
-		it=frequencyTable[pos].begin()+targetBin;
-		#pragma omp critical
-		(*it)++;
+		if(!rng->enabledRanges[ui])
+			continue;
+
+		map<unsigned int,unsigned int>::const_iterator it;
+		it=ionIDMapping.find(rngF->getIonID(ui));
+		if(it != ionIDMapping.end())
+			rangeColumn[ui]=it->second;
 	}
 }
 
@@ -407,6 +419,32 @@ unsigned int ProfileFilter::refresh(const std::vector<const FilterStreamData *>
 	}
 
 
+	//Lookup from range ID to frequency table column, so the
+	// inner loop does not need to search the ion ID mapping
+	vector<unsigned int> rangeColumn;
+	if(rngData)
+		buildRangeColumnMap(rngData,ionIDMapping,rangeColumn);
+
+	//Each thread accumulates into its own dense histogram,
+	// laid out as [column][bin], which are summed at the end.
+	// This avoids any locking in the binning loop
+	const size_t nColumns=ionFrequencies.size();
+	unsigned int nThreads=1;
+#ifdef _OPENMP
+	nThreads=omp_get_max_threads();
+#endif
+	vector<vector<size_t> > threadHist;
+	try
+	{
+		threadHist.resize(nThreads);
+		for(unsigned int ui=0;ui<nThreads;ui++)
+			threadHist[ui].resize(nColumns*numBins,0);
+	}
+	catch(std::bad_alloc)
+	{
+		return ERR_MEMALLOC;
+	}
+
 	size_t n=0;
 	size_t totalSize=numElements(dataIn);
 
@@ -427,59 +465,90 @@ unsigned int ProfileFilter::refresh(const std::vector<const FilterStreamData *>
 			case STREAM_TYPE_IONS:
 			{
 				const IonStreamData *dIon = (const IonStreamData*)dataIn[ui];
-#ifdef _OPENMP
 				//OpenMP abort is not v. good, simply spin instead of working
 				bool spin=false;
-#endif
-				//Process ion streams
-			
-				size_t nIons=dIon->data.size();	
-				#pragma omp parallel for shared(n)
-				for(size_t uj=0;uj<nIons;uj++)
+
+				const vector<IonSelection> &srcSel=dIon->shareIons();
+				//Large cached inputs are spatially indexed, so only cells 
+				// that overlap the primitive need to be visited. This is
+				// much faster when the primitive is repeatedly moved
+				bool useIndex=IonSpatialIndex::wantIndex(dIon);
+				size_t nIons=0;
+				for(size_t us=0;us<srcSel.size() && !spin;us++)
 				{
-#ifdef _OPENMP
-					//if parallelised, abort computaiton
-					if(spin) continue;
-#endif
-					unsigned int targetBin;
-					targetBin=dataMapping.mapIon1D(dIon->data[uj]);
+					const IonSelection &sel=srcSel[us];
+					const IonSpatialIndex *index=0;
+					if(useIndex)
+						index=IonSpatialIndex::getIndex(dIon,us);
 
-					//Keep ion if inside cylinder 
-					if(targetBin!=(unsigned int)-1)
+					#pragma omp parallel
 					{
-						//Push data into the correct bin.
-						// based upon eg ranging information and target 1D bin
-						binIon(targetBin,rngData,ionIDMapping,ionFrequencies,
-								dIon->data[uj].getMassToCharge());
-					}
-
+						unsigned int thisT=0;
 #ifdef _OPENMP
-					#pragma omp atomic
-					n++; //FIXME: Performance - we could use a separate non-sahred counter to reduce locking?
-
-					if(omp_get_thread_num() == 0)	
-					{
+						thisT=omp_get_thread_num();
 #endif
-						progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-						if(*Filter::wantAbort)
+						size_t *hist=&(threadHist[thisT][0]);
+						size_t localCount=0,nextProgress=PROGRESS_REDUCE;
+
+						if(index)
 						{
-							#ifdef _OPENMP
-							spin=true;
-							#else
-							return ERR_ABORT;
-							#endif 
+							#pragma omp for schedule(dynamic,16)
+							for(size_t uj=0;uj<index->numCells();uj++)
+							{
+								if(spin) continue;
+
+								BoundCube b;
+								index->getCellBounds(uj,b);
+								if(dataMapping.classifyBox(b) != CROP_CELL_OUTSIDE)
+								{
+									for(size_t uk=index->cellBegin(uj);uk<index->cellEnd(uj);uk++)
+									{
+										binIon(dataMapping,sel[index->selectionIndex(uk)],
+											rngData,rangeColumn,numBins,hist);
+									}
+								}
+								localCount+=index->cellEnd(uj)-index->cellBegin(uj);
+								
+								if(!thisT && localCount >=nextProgress)
+								{
+									//Estimate overall progress from this thread's share
+									nextProgress=localCount+PROGRESS_REDUCE;
+									progress.filterProgress= (unsigned int)((float)(n+nIons+localCount*nThreads)/
+												((float)totalSize)*100.0f);
+									if(*Filter::wantAbort)
+										spin=true;
+								}
+							}
+						}
+						else
+						{
+							#pragma omp for
+							for(size_t uj=0;uj<sel.size();uj++)
+							{
+								if(spin) continue;
+
+								binIon(dataMapping,sel[uj],rngData,rangeColumn,numBins,hist);
+
+								localCount++;
+								if(!thisT && localCount >=nextProgress)
+								{
+									nextProgress=localCount+PROGRESS_REDUCE;
+									progress.filterProgress= (unsigned int)((float)(n+nIons+localCount*nThreads)/
+												((float)totalSize)*100.0f);
+									if(*Filter::wantAbort)
+										spin=true;
+								}
+							}
 						}
-#ifdef _OPENMP
 					}
-#endif
+					nIons+=sel.size();
 				}
 
-#ifdef _OPENMP
 				//Check to see if we aborted the Calculation
 				if(spin)
 					return ERR_ABORT;
-#endif
-					
+
+				n+=nIons;
 				break;
 			}
 			default:
@@ -489,6 +558,17 @@ unsigned int ProfileFilter::refresh(const std::vector<const FilterStreamData *>
 				
 	}
 
+	//Merge the per-thread histograms into the frequency table
+	#pragma omp parallel for
+	for(size_t ui=0;ui<nColumns*numBins;ui++)
+	{
+		size_t sum=0;
+		for(unsigned int uj=0;uj<nThreads;uj++)
+			sum+=threadHist[uj][ui];
+		ionFrequencies[ui/numBins][ui%numBins]=sum;
+	}
+	threadHist.clear();
+
 #ifdef DEBUG
 	ASSERT(ionFrequencies.size());
 	//Ion frequencies must be of equal length
@@ -1670,6 +1750,7 @@ unsigned int ProfileFilter::getPrimitiveId(const std::string &primitiveName)
 
 bool testDensityCylinder();
 bool testCompositionCylinder();
+bool testCompositionExactCounts();
 void synthComposition(const vector<pair<float,float> > &compositionData,
 			vector<IonHit> &h);
 IonStreamData *synthLinearProfile(const Point3D &start, const Point3D &end,
@@ -1683,6 +1764,9 @@ bool ProfileFilter::runUnitTests()
 	if(!testCompositionCylinder())
 		return false;
 
+	if(!testCompositionExactCounts())
+		return false;
+
 	return true;
 }
 
@@ -1882,6 +1966,211 @@ bool testDensityCylinder()
 }
 
 
+//Check that the ranged counts match an ion-by-ion reference count exactly
+bool testCompositionExactCounts()
+{
+	const size_t NUM_PTS=20000;
+	const unsigned int NUM_BINS=50;
+
+	Point3D startPt(-1.0f,-1.0f,-1.0f),endPt(1.0f,1.0f,1.0f);
+	IonStreamData *d= synthLinearProfile(startPt,endPt,
+			0.5f, NUM_PTS);
+
+	{
+	vector<std::pair<float,float>  > vecCompositions;
+	vecCompositions.push_back(make_pair(1.0f,0.2f));
+	vecCompositions.push_back(make_pair(2.0f,0.3f));
+	vecCompositions.push_back(make_pair(3.0f,0.3f));
+	vecCompositions.push_back(make_pair(4.0f,0.2f));
+	synthComposition(vecCompositions,d->data);
+	}
+
+	//Three species. A has a second, disabled range, and
+	// C is disabled entirely
+	RangeStreamData *rngStream;
+	rngStream = new RangeStreamData;
+	rngStream->rangeFile = new RangeFile;
+	
+	RGBf rgb; rgb.red=rgb.green=rgb.blue=1.0f;
+
+	unsigned int aIon,bIon,cIon;
+	std::string tmpStr;
+	tmpStr="A";
+	aIon=rngStream->rangeFile->addIon(tmpStr,tmpStr,rgb);
+	tmpStr="B";
+	bIon=rngStream->rangeFile->addIon(tmpStr,tmpStr,rgb);
+	tmpStr="C";
+	cIon=rngStream->rangeFile->addIon(tmpStr,tmpStr,rgb);
+	rngStream->rangeFile->addRange(1.5,2.5,aIon);
+	rngStream->rangeFile->addRange(2.5,3.5,bIon);
+	rngStream->rangeFile->addRange(3.5,4.5,cIon);
+	rngStream->rangeFile->addRange(0.5,1.5,aIon);
+	rngStream->enabledIons.resize(3,true);
+	rngStream->enabledIons[cIon]=false;
+	rngStream->enabledRanges.resize(4,true);
+	rngStream->enabledRanges[2]=false;
+	rngStream->enabledRanges[3]=false;
+
+	ProfileFilter *f = new ProfileFilter;
+	f->setCaching(false);
+
+	vector<const FilterStreamData*> streamIn,streamOut;
+	
+	Point3D origin,axis;
+	origin=(startPt+endPt)*0.5f;
+	axis=(endPt-startPt)*0.5f;
+	bool needUp; std::string s;
+	stream_cast(s,origin);
+	TEST(f->setProperty(PROFILE_KEY_ORIGIN,s,needUp),"set origin");
+	stream_cast(s,axis);
+	TEST(f->setProperty(PROFILE_KEY_NORMAL,s,needUp),"set direction");
+	TEST(f->setProperty(PROFILE_KEY_MINEVENTS,"0",needUp),"set min events");
+	TEST(f->setProperty(PROFILE_KEY_NORMALISE,"0",needUp),"Disable normalisation");
+	TEST(f->setProperty(PROFILE_KEY_RADIUS,"5",needUp),"Set radius");
+	TEST(f->setProperty(PROFILE_KEY_FIXEDBINS,"1",needUp),"Set fixed bins");
+	stream_cast(s,NUM_BINS);
+	TEST(f->setProperty(PROFILE_KEY_NUMBINS,s,needUp),"Set bin count");
+	
+	streamIn.push_back(rngStream);
+	f->initFilter(streamIn,streamOut);
+	streamIn.push_back(d);
+
+	ProgressData p;
+	TEST(!f->refresh(streamIn,streamOut,p),"Refresh error code");
+	delete f;
+	//The filter reads the ions as a selection, so restore them
+	d->materialiseSelections();
+
+	//Compute the reference counts, one ion at a time
+	vector<vector<size_t> > refCounts(2,vector<size_t>(NUM_BINS,0));
+	{
+	vector<Point3D> vecs;
+	vecs.push_back(origin);
+	vecs.push_back(axis);
+	vector<float> scalars(1,5.0f);
+	CropHelper mapping(d->data.size(),CROP_CYLINDER_INSIDE_AXIAL,vecs,scalars);
+	mapping.setMapMaxima(NUM_BINS);
+
+	const RangeFile *rngF=rngStream->rangeFile;
+	for(size_t ui=0;ui<d->data.size();ui++)
+	{
+		unsigned int bin,rangeID,ionID;
+		bin=mapping.mapIon1D(d->data[ui]);
+		if(bin >=NUM_BINS)
+			continue;
+
+		rangeID=rngF->getRangeID(d->data[ui].getMassToCharge());
+		if(rangeID == (unsigned int)-1 || !rngStream->enabledRanges[rangeID])
+			continue;
+
+		ionID=rngF->getIonID(rangeID);
+		if(ionID == aIon)
+			refCounts[0][bin]++;
+		else if(ionID == bIon)
+			refCounts[1][bin]++;
+	}
+	}
+	delete d;
+
+	size_t nPlots=0;
+	for(unsigned int ui=0;ui<streamOut.size();ui++)
+	{
+		if(streamOut[ui]->getStreamType() != STREAM_TYPE_PLOT)
+			continue;
+
+		const PlotStreamData *plotData = (const PlotStreamData *)streamOut[ui];
+		TEST(plotData->index < 2,"plot index");
+		TEST(plotData->xyData.size() == NUM_BINS,"bin count");
+		for(size_t uj=0;uj<NUM_BINS;uj++)
+		{
+			TEST(plotData->xyData[uj].second == 
+				(float)refCounts[plotData->index][uj],"exact bin count");
+		}
+		nPlots++;
+	}
+	TEST(nPlots == 2,"Plot count");
+
+	delete rngStream->rangeFile;
+	for(unsigned int ui=0;ui<streamOut.size();ui++)
+		delete streamOut[ui];
+
+	return true;
+}
+
+bool benchmarkProfileScaling(std::ostream &strm)
+{
+#ifdef _OPENMP
+	const size_t NUM_PTS=10000000;
+	//Best of this many refreshes is reported, to skip warm-up
+	const unsigned int NUM_REPEATS=3;
+	Point3D startPt(-1.0f,-1.0f,-1.0f),endPt(1.0f,1.0f,1.0f);
+	IonStreamData *d= synthLinearProfile(startPt,endPt,
+			0.5f, NUM_PTS);
+
+	ProfileFilter *f = new ProfileFilter;
+	f->setCaching(false);
+
+	bool needUp; std::string s;
+	stream_cast(s,Point3D((startPt+endPt)*0.5f));
+	TEST(f->setProperty(PROFILE_KEY_ORIGIN,s,needUp),"set origin");
+	stream_cast(s,Point3D((endPt-startPt)*0.5f));
+	TEST(f->setProperty(PROFILE_KEY_NORMAL,s,needUp),"set direction");
+	TEST(f->setProperty(PROFILE_KEY_NORMALISE,"0",needUp),"Disable normalisation");
+	TEST(f->setProperty(PROFILE_KEY_MINEVENTS,"0",needUp),"set min events");
+	TEST(f->setProperty(PROFILE_KEY_RADIUS,"5",needUp),"Set radius");
+
+	vector<const FilterStreamData*> streamIn;
+	streamIn.push_back(d);
+
+	const int maxThreads=omp_get_max_threads();
+	vector<pair<float,float> > firstResult;
+	double singleTime=0;
+	bool ok=true;
+	for(int nThreads=1;nThreads<=maxThreads && ok;nThreads*=2)
+	{
+		omp_set_num_threads(nThreads);
+
+		double bestTime=std::numeric_limits<double>::max();
+		for(unsigned int ui=0;ui<NUM_REPEATS && ok;ui++)
+		{
+			vector<const FilterStreamData*> streamOut;
+			ProgressData p;
+			double t=omp_get_wtime();
+			ok=!f->refresh(streamIn,streamOut,p);
+			bestTime=std::min(bestTime,omp_get_wtime()-t);
+
+			for(unsigned int uj=0;uj<streamOut.size();uj++)
+			{
+				if(streamOut[uj]->getStreamType() == STREAM_TYPE_PLOT)
+				{
+					const PlotStreamData *plotData=(const PlotStreamData *)streamOut[uj];
+					if(firstResult.empty())
+						firstResult=plotData->xyData;
+					else if(plotData->xyData != firstResult)
+						ok=false;
+				}
+				delete streamOut[uj];
+			}
+		}
+
+		if(nThreads == 1)
+			singleTime=bestTime;
+
+		strm << "Profile binning, " << NUM_PTS << " points, " << nThreads << " thread(s): " << 
+			bestTime << " s, speedup " << singleTime/bestTime << std::endl;
+	}
+	omp_set_num_threads(maxThreads);
+
+	delete f;
+	delete d;
+
+	TEST(ok,"thread count independent result");
+#else
+	strm << "Profile binning benchmark needs OpenMP" << std::endl;
+#endif
+	return true;
+}
+
 //first value in pair is target mass, second value is target composition
 void synthComposition(const vector<std::pair<float,float> > &compositionData,
 			vector<IonHit> &h)
@@ -89,9 +89,9 @@ class ProfileFilter : public Filter
 		bool haveRangeParent;
 		//--
 		
-		//!internal function for binning an ion dependant upon range data
-		static void binIon(unsigned int targetBin, const RangeStreamData* rng, const std::map<unsigned int,unsigned int> &ionIDMapping,
-			std::vector<std::vector<size_t> > &frequencyTable, float massToCharge);
+		//!internal function for building the range ID to frequency table column lookup
+		static void buildRangeColumnMap(const RangeStreamData* rng, const std::map<unsigned int,unsigned int> &ionIDMapping,
+			std::vector<unsigned int> &rangeColumn);
 
 		static unsigned int getPrimitiveId(const std::string &s);;
 
@@ -119,6 +119,9 @@ class ProfileFilter : public Filter
 		unsigned int refresh(const std::vector<const FilterStreamData *> &dataIn,
 						std::vector<const FilterStreamData *> &getOut, 
 						ProgressData &progress);
+
+		//!Ions are read through their selections, so these do not need copying
+		bool acceptsIonSelections() const { return true;}
 		
 		virtual std::string typeString() const { return std::string(TRANS("Comp. Prof."));};
 
@@ -156,4 +159,10 @@ class ProfileFilter : public Filter
 #endif
 };
 
+#ifdef DEBUG
+//!Time profile binning at increasing thread counts, writing the timings to strm.
+// Not part of the unit tests, as it is slow and changes the OpenMP thread count
+bool benchmarkProfileScaling(std::ostream &strm);
+#endif
+
 #endif
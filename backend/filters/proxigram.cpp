@@ -184,6 +184,10 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 					const OpenVDBGridStreamData  *vdbgs; 
 					vdbgs = (const OpenVDBGridStreamData *)dataIn[ui];
 
+					//Sparse voxel point clouds are not isosurface grids
+					if(vdbgs->representationType != VOXEL_REPRESENT_ISOSURF)
+						continue;
+
 					grid = vdbgs->grid->deepCopy();
 					isoLevel_proxi = vdbgs->isovalue;
 				}	
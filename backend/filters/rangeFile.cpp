@@ -99,6 +99,45 @@ void RangeFileFilter::initFilter(const std::vector<const FilterStreamData *> &da
 	
 }
 
+//Assigns selected ions to the output stream of their ion type, or the 
+// unranged stream. Ions in disabled ranges or ions are dropped
+class RangeSelectionBinner
+{
+	private:
+		const IonSelection &sel;
+		const RangeFile &rng;
+		const vector<char> &enabledRanges,&enabledIons;
+		bool dropUnranged;
+		unsigned int unrangedBin;
+	public:
+		RangeSelectionBinner(const IonSelection &s, const RangeFile &r,
+			const vector<char> &enRanges, const vector<char> &enIons,
+			bool drop, unsigned int unranged) : sel(s), rng(r),
+			enabledRanges(enRanges), enabledIons(enIons),
+			dropUnranged(drop), unrangedBin(unranged) {}
+
+		unsigned int bin(size_t offset) const
+		{
+			unsigned int rangeID;
+			rangeID=rng.getRangeID(sel[offset].getMassToCharge());
+
+			//If ion is unranged, then it will have a rangeID of -1
+			if(rangeID == (unsigned int)-1)
+				return dropUnranged ? SCATTER_DISCARD : unrangedBin;
+
+			unsigned int ionID;
+			ionID=rng.getIonID(rangeID);
+
+			//Only retain the ion if the ionID and rangeID are enabled
+			if(enabledRanges[rangeID] && enabledIons[ionID])
+				return ionID;
+
+			return SCATTER_DISCARD;
+		}
+
+		size_t value(size_t offset) const { return sel.sourceIndex(offset);}
+};
+
 unsigned int RangeFileFilter::refresh(const std::vector<const FilterStreamData *> &dataIn,
 		std::vector<const FilterStreamData *> &getOut, ProgressData &progress)
 {
@@ -153,13 +192,8 @@ unsigned int RangeFileFilter::refresh(const std::vector<const FilterStreamData *
 		sameSize=true;
 
 
-		vector<size_t> dSizes;
-		dSizes.resize(d.size(),0);
 		size_t totalSize=numElements(dataIn);
 
-
-		//Check to see if there are any enabled ranges
-		
 		//Generate output filter streams. 
 		for(unsigned int ui=0;ui<d.size(); ui++)
 		{
@@ -167,266 +201,106 @@ unsigned int RangeFileFilter::refresh(const std::vector<const FilterStreamData *
 			d[ui]->parent=this;
 		}
 		
-		const unsigned int RANGE_ALLOC_STEP=157; //is prime - less likely to form sequence?
-		if(!haveEnabled)
-		{
-			//There are no enabled ranges at all.
-			dSizes.back()=totalSize;
-		}
-		else
+		//Step 1: Go through each data stream, if it is an ion stream, range it.
+		// Output streams select their ions from the input, rather than copying
+		//=========================================
+		size_t n=0;
+		for(unsigned int ui=0;ui<dataIn.size() ;ui++)
 		{
-			//Step 1: Do a first sweep to obtain range sizes needed
-			// then reserve the same amount of mem as we need on the output
-			//========================
-			//Don't examine every ion to determine the allocation size.
-			// perform step-wise examination of dataset
-			for(unsigned int ui=0;ui<dataIn.size() ;ui++)
+			switch(dataIn[ui]->getStreamType())
 			{
-				switch(dataIn[ui]->getStreamType())
+				case STREAM_TYPE_IONS: 
 				{
-					case STREAM_TYPE_IONS: 
+					const IonStreamData *src=(const IonStreamData *)dataIn[ui];
+					const vector<IonSelection> &srcSel=src->shareIons();
+					if(!haveEnabled)
 					{
-
-#ifdef _OPENMP
-						//Create a unique array for each thread, so they don't try
-						//to modify the same data structure
-						unsigned int nT =omp_get_max_threads(); 
-						vector<size_t> *dSizeArr = new vector<size_t>[nT];
-						for(unsigned int uk=0;uk<nT;uk++)
-							dSizeArr[uk].resize(dSizes.size(),0);
-#endif
-						const IonStreamData *src = ((const IonStreamData *)dataIn[ui]);
-						size_t n=0;
-
-
-						unsigned int curProg=NUM_CALLBACK;
-						bool spin=false;
-						#pragma omp parallel for firstprivate(curProg)
-						for(size_t uj=0; uj<src->data.size();uj+=RANGE_ALLOC_STEP)
-						{
-#ifdef _OPENMP
-							unsigned int thisT=omp_get_thread_num();
-#endif
-							if(spin)
-								continue;
-							
-							//get the range ID for this particular ion.
-							unsigned int rangeID;
-							rangeID=rng.getRangeID(src->data[uj].getMassToCharge());
-
-							//If ion is unranged, then it will have a rangeID of -1
-							if(rangeID != (unsigned int)-1 && enabledRanges[rangeID] )
-							{
-								unsigned int ionID=rng.getIonID(rangeID);
-
-								//if we are going to keep the ion
-								//then increment this array size
-								if(enabledIons[ionID])
-								{
-									#ifdef _OPENMP
-										dSizeArr[thisT][ionID]++;
-									#else
-										dSizes[ionID]++;
-									#endif
-
-								}
-							}
-							
-							//update progress periodically
-							if(!curProg--)
-							{
-#pragma omp critical
-								{
-								n+=NUM_CALLBACK;
-								progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-								curProg=NUM_CALLBACK;
-
-
-								if(*Filter::wantAbort)
-									spin=true;
-								}
-							}
-						}
-
-						if(spin)
-						{
-#ifdef _OPENMP
-							delete[] dSizeArr;
-#endif
-							return RANGEFILE_ABORT_FAIL;
-						}
-#ifdef _OPENMP
-						//Merge the arrays back together
-						for(unsigned int uk=0;uk<nT;uk++)
-						{
-							for(unsigned int uj=0;uj<dSizes.size();uj++)
-								dSizes[uj] = dSizes[uj]+dSizeArr[uk][uj];
-						}
-						delete[] dSizeArr;
-#endif
-
+						//There are no enabled ranges at all,
+						// so everything goes in the "unranged" section
+						for(size_t uj=0;uj<srcSel.size();uj++)
+							d.back()->selections.push_back(srcSel[uj]);
+						break;
 					}
-				}
-			}
-		}
-
-		//reserve the vector to the exact size we need
-		try
-		{
-			//slightly over-allocate to allow for any variance
-			for(size_t ui=0;ui<d.size();ui++)
-				d[ui]->data.reserve(dSizes[ui]*1.05f*RANGE_ALLOC_STEP+10);
-		}
-		catch(std::bad_alloc)
-		{
-			for(size_t ui=0;ui<d.size();ui++)
-				delete d[ui];
-			return RANGEFILE_BAD_ALLOC;
-		}
-
-		dSizes.clear();
-		//===================================
 
-		
-
-		//Step 2: Go through each data stream, if it is an ion stream, range it.
-		//=========================================
-		if(haveEnabled)
-		{
-			//	I tried parallelising this a few different ways, but the linear performance was simply better.
-			//		- Tried an array of openmp locks
-			//		- Tried keeping a unique offset number and fixing the size of the output vectors
-			//		- Tried straight criticalling the push_back
-			//	 Trying to merge vectors in // is tricky. result was 9-10x slower than linear
-		
-			size_t n=0;
-			for(unsigned int ui=0;ui<dataIn.size() ;ui++)
-			{
-				switch(dataIn[ui]->getStreamType())
-				{
-					case STREAM_TYPE_IONS: 
+					//Set the default (unranged) ion colour, by using
+					//the first input ion colour.
+					if(!haveDefIonColour)
 					{
-						//Set the default (unranged) ion colour, by using
-						//the first input ion colour.
-						if(!haveDefIonColour)
-						{
-							defIonColour.red =  ((IonStreamData *)dataIn[ui])->r;
-							defIonColour.green =  ((IonStreamData *)dataIn[ui])->g;
-							defIonColour.blue =  ((IonStreamData *)dataIn[ui])->b;
-							haveDefIonColour=true;
-						}
-					
-						//Check for ion size consistency	
-						if(haveIonSize)
-						{
-							sameSize &= (fabs(ionSize-((const IonStreamData *)dataIn[ui])->ionSize) 
-											< std::numeric_limits<float>::epsilon());
-						}
-						else
-						{
-							ionSize=((const IonStreamData *)dataIn[ui])->ionSize;
-							haveIonSize=true;
-						}
+						defIonColour.red =  src->r;
+						defIonColour.green =  src->g;
+						defIonColour.blue =  src->b;
+						haveDefIonColour=true;
+					}
+				
+					//Check for ion size consistency	
+					if(haveIonSize)
+					{
+						sameSize &= (fabs(ionSize-src->ionSize) 
+										< std::numeric_limits<float>::epsilon());
+					}
+					else
+					{
+						ionSize=src->ionSize;
+						haveIonSize=true;
+					}
 
-						unsigned int curProg=NUM_CALLBACK;
-						const size_t off=d.size()-1;
 
-						for(vector<IonHit>::const_iterator it=((const IonStreamData *)dataIn[ui])->data.begin();
-							       it!=((const IonStreamData *)dataIn[ui])->data.end(); ++it)
+					const size_t off=d.size()-1;
+					try
+					{
+						for(size_t uj=0;uj<srcSel.size();uj++)
 						{
-							unsigned int rangeID;
-							rangeID=rng.getRangeID(it->getMassToCharge());
+							const IonSelection &in=srcSel[uj];
 
-							//If ion is unranged, then it will have a rangeID of -1
-							if(rangeID != (unsigned int)-1)
+							//One selection for each output stream
+							vector<IonSelection> sel(d.size());
+							vector<vector<size_t> *> bins(d.size());
+							for(size_t uk=0;uk<sel.size();uk++)
 							{
-								unsigned int ionID;
-								ionID=rng.getIonID(rangeID);
-
-								//Only retain the ion if the ionID and rangeID are enabled
-								if(enabledRanges[rangeID] && enabledIons[ionID])
-								{
-									ASSERT(ionID < enabledRanges.size());
-
-									d[ionID]->data.push_back(*it);
-								}
+								sel[uk].source=in.source;
+								bins[uk]=&sel[uk].indices;
 							}
-							else if(!dropUnranged)//If it is unranged, then the rangeID is still -1 (as above).
+
+							RangeSelectionBinner binner(in,rng,enabledRanges,
+									enabledIons,dropUnranged,off);
+							if(scatterToBins(in.size(),binner,bins,
+								progress.filterProgress,n,totalSize))
 							{
-								d[off]->data.push_back(*it);
+								//Free space allocated for output ion streams...
+								for(unsigned int ui=0;ui<d.size();ui++)
+									delete d[ui];
+								return RANGEFILE_ABORT_FAIL;
 							}
+							n+=in.size();
 
-							//update progress periodically
-							if(!curProg--)
+							for(size_t uk=0;uk<sel.size();uk++)
 							{
-								n+=NUM_CALLBACK;
-								progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-								curProg=NUM_CALLBACK;
-
-								
-								if(*Filter::wantAbort)
-								{
-									//Free space allocated for output ion streams...
-									for(unsigned int ui=0;ui<d.size();ui++)
-										delete d[ui];
-									return RANGEFILE_ABORT_FAIL;
-								}
+								if(sel[uk].indices.size())
+									d[uk]->selections.push_back(sel[uk]);
 							}
-
 						}
-
-
 					}
-						break;
-					case STREAM_TYPE_RANGE:
-						//Purposely do nothing. This blocks propagation of other ranges
-						//i.e. there can only be one in any given node of the tree.
-						break;
-					default:
-						getOut.push_back(dataIn[ui]);
-						break;
-				}
-			}
-		}
-		else
-		{
-			//We have no ranges enabled, thus everything must go in the "unranged" section
-			d.back()->data.resize(totalSize);
-
-			size_t off=0;
-			for(unsigned int ui=0;ui<dataIn.size() ;ui++)
-			{
-				switch(dataIn[ui]->getStreamType())
-				{
-					case STREAM_TYPE_IONS:
+					catch(std::bad_alloc)
 					{
-						const vector<IonHit> &ionHitVec=((const IonStreamData *)dataIn[ui])->data;
-						vector<IonHit> &outputVec=(d.back())->data;
-#pragma omp parallel for
-						for(size_t ui=0;ui<ionHitVec.size();ui++)
-							outputVec[off+ui]=ionHitVec[ui];
-						break;
+						for(size_t uj=0;uj<d.size();uj++)
+							delete d[uj];
+						return RANGEFILE_BAD_ALLOC;
 					}
-					case STREAM_TYPE_RANGE:
-						break;
-					default:
-						getOut.push_back(dataIn[ui]);
-						break;
+					break;
 				}
-			}
-
-			if(*Filter::wantAbort)
-			{
-				//Free space allocated for output ion streams...
-				for(unsigned int ui=0;ui<d.size();ui++)
-					delete d[ui];
-				return RANGEFILE_ABORT_FAIL;
+				case STREAM_TYPE_RANGE:
+					//Purposely do nothing. This blocks propagation of other ranges
+					//i.e. there can only be one in any given node of the tree.
+					break;
+				default:
+					getOut.push_back(dataIn[ui]);
+					break;
 			}
 		}
 		//=========================================
 
 
-		//Step 3 : Set up any properties for the output streams that we need, like colour, size, caching. Trim any empty results.
+		//Step 2 : Set up any properties for the output streams that we need, like colour, size, caching. Trim any empty results.
 		//======================================
 		//Set the colour of the output ranges
 		//and whether to cache.
@@ -461,7 +335,7 @@ unsigned int RangeFileFilter::refresh(const std::vector<const FilterStreamData *
 		//remove any zero sized ranges
 		for(unsigned int ui=0;ui<d.size();)
 		{
-			if(!(d[ui]->data.size()))
+			if(!(d[ui]->getNumBasicObjects()))
 			{
 				delete d[ui];
 				std::swap(d[ui],d.back());
@@ -1460,8 +1334,10 @@ bool testRanged()
 		if(streamOut[ui]->getStreamType() == STREAM_TYPE_IONS)
 		{
 			numIons.push_back(streamOut[ui]->getNumBasicObjects());
-			const IonStreamData *dI;
+			IonStreamData *dI;
 			dI = (IonStreamData*)streamOut[ui];
+			//Ranged ions are selections, so copy them out
+			dI->materialiseSelections();
 			for(unsigned int uj=0;uj<streamOut.size(); uj++)
 			{
 				TEST(rng.isRanged(dI->data[uj].getMassToCharge()),
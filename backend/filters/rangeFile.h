@@ -134,6 +134,9 @@ class RangeFileFilter : public Filter
 		void setPropFromBinding(const SelectionBinding &b)  ;
 
 		bool getDropUnranged() const { return dropUnranged; }
+
+		//!Ranged ions are selected from the input, so input may also be a selection
+		bool acceptsIonSelections() const { return true;}
 #ifdef DEBUG
 		bool runUnitTests();
 #endif
@@ -26,6 +26,7 @@
 #include "filterCommon.h"
 #include "algorithms/binomial.h"
 #include "algorithms/K3DTree-mk2.h"
+#include "algorithms/cellList.h"
 #include "backend/plot.h"
 #include "../APT/APTFileIO.h"
 
@@ -625,6 +626,63 @@ unsigned int SpatialAnalysisFilter::refresh(const std::vector<const FilterStream
 	return result;
 }
 
+//Selects the output ions for the replace algorithm, for use with scatterToBins.
+// Input ions are kept (subtract) or dropped (intersect) if they have no match,
+// and all are kept by union. Matched ions take the file's ion, if requested
+class ReplaceBinner
+{
+	private:
+		const vector<IonHit> &inIons, &fileIons;
+		//Offset of each input ion's matching file ion, or -1
+		const vector<size_t> &matches;
+		unsigned int mode;
+		bool useFileIon;
+	public:
+		ReplaceBinner(const vector<IonHit> &in, const vector<IonHit> &file,
+			const vector<size_t> &m, unsigned int replaceMode, bool replaceMass) :
+			inIons(in), fileIons(file), matches(m), mode(replaceMode),
+				useFileIon(replaceMass && replaceMode != REPLACE_MODE_SUBTRACT) {}
+
+		unsigned int bin(size_t offset) const
+		{
+			switch(mode)
+			{
+				case REPLACE_MODE_SUBTRACT:
+					return matches[offset] == (size_t)-1 ? 0 : SCATTER_DISCARD;
+				case REPLACE_MODE_INTERSECT:
+					return matches[offset] != (size_t)-1 ? 0 : SCATTER_DISCARD;
+				case REPLACE_MODE_UNION:
+					return 0;
+				default:
+					ASSERT(false);
+					return SCATTER_DISCARD;
+			}
+		}
+
+		const IonHit &value(size_t offset) const
+		{
+			if(useFileIon && matches[offset] != (size_t)-1)
+				return fileIons[matches[offset]];
+			return inIons[offset];
+		}
+};
+
+//Selects the ions that were not matched, for use with scatterToBins
+class UnmatchedBinner
+{
+	private:
+		const vector<IonHit> &ions;
+		const vector<char> &matched;
+	public:
+		UnmatchedBinner(const vector<IonHit> &h, const vector<char> &m) :
+			ions(h), matched(m) {}
+
+		unsigned int bin(size_t offset) const
+			{ return matched[offset] ? SCATTER_DISCARD : 0; }
+
+		const IonHit &value(size_t offset) const { return ions[offset];}
+};
+
 size_t SpatialAnalysisFilter::algorithmReplace(ProgressData &progress, size_t totalDataSize, 
 			const vector<const FilterStreamData *>  &dataIn, 
 			vector<const FilterStreamData * > &getOut)
@@ -668,103 +726,57 @@ size_t SpatialAnalysisFilter::algorithmReplace(ProgressData &progress, size_t to
 	BoundCube b;
 	tree.getBoundCube(b);
 
-	//map the offset of the nearest to
-	//the tree ID 
-	vector<size_t > nearestVec;
-	nearestVec.resize(inIons.size());
-
-	//TODO: pair vector might be faster
-	// as we can use it in sequence, and can use openmp
-	map<size_t,size_t> matchedMap;
-
-	//Find the nearest point for all points in the dataset
-
-	#pragma omp parallel for 
-	for(size_t ui=0;ui<inIons.size();ui++)
-	{
-		nearestVec[ui]=tree.findNearestUntagged(inIons[ui].getPos(),b,false);
-	}
-
-	float sqrReplaceTol=replaceTolerance*replaceTolerance;
+	//For each input ion, the offset of the matching file ion,
+	// or -1 if there is no file ion within the tolerance.
+	// Each entry is written by one thread only, so no locking is needed
+	vector<size_t> matchVec;
+	matchVec.resize(inIons.size());
 
-	//Filter this to only points that had an NN within range
+	const float sqrReplaceTol=replaceTolerance*replaceTolerance;
 	#pragma omp parallel for 
 	for(size_t ui=0;ui<inIons.size();ui++)
 	{
-		if(nearestVec[ui]!=(size_t)-1 && inIons[ui].getPos().sqrDist(*tree.getPt(nearestVec[ui])) <=sqrReplaceTol)
-		{
-			#pragma omp critical
-			matchedMap[ui]=tree.getOrigIndex(nearestVec[ui]);
-		}
+		size_t nearest;
+		nearest=tree.findNearestUntagged(inIons[ui].getPos(),b,false);
+		if(nearest!=(size_t)-1 && inIons[ui].getPos().sqrDist(*tree.getPt(nearest)) <=sqrReplaceTol)
+			matchVec[ui]=tree.getOrigIndex(nearest);
+		else
+			matchVec[ui]=(size_t)-1;
 	}
 
-	nearestVec.clear();
-
 
 	progress.step=4;
 	progress.stepName=TRANS("Compute");
 	progress.filterProgress=0;
 
-	//Finish if no matches
-	if(matchedMap.empty())
-	{
-		progress.filterProgress=100;
-		return 0;
-	}
-
+	//Compact the selected ions, in input order, so that the
+	// output does not depend upon the number of threads
 	vector<IonHit> outIons;
-	switch(replaceMode)
-	{
-		case REPLACE_MODE_SUBTRACT:
-		{
-			//In subtraction mode, we should have
-			// at least this many ions
-			if(inIons.size() > matchedMap.size())
-				outIons.reserve(inIons.size()-matchedMap.size());
-			
-			//
-			#pragma omp parallel for
-			for(unsigned int ui=0;ui<inIons.size();ui++)
-			{
-				map<size_t,size_t>::iterator it;
-				it=matchedMap.find(ui);
-				if(it != matchedMap.end())
-					continue;
+	vector<vector<IonHit> *> outBins(1,&outIons);
+	size_t progressTotal=inIons.size();
+	if(replaceMode == REPLACE_MODE_UNION)
+		progressTotal+=fileIons.size();
 
-				#pragma omp critical
-				outIons.push_back(inIons[ui]);
-			}
-			break;
-		}
-		case REPLACE_MODE_INTERSECT:
-		{
-			outIons.reserve(matchedMap.size());
+	ReplaceBinner binner(inIons,fileIons,matchVec,replaceMode,replaceMass);
+	if(scatterToBins(inIons.size(),binner,outBins,progress.filterProgress,0,progressTotal))
+		return ERR_ABORT_FAIL;
 
-			if(replaceMass)
-			{
-				for(map<size_t,size_t>::const_iterator it=matchedMap.begin();it!=matchedMap.end();++it)
-				{
-					outIons.push_back(fileIons[it->second]);
-					ASSERT(fileIons[it->second].getPosRef().sqrDist(inIons[it->first].getPosRef()) < sqrReplaceTol);
-				}
-			}
-			else
-			{
-				for(map<size_t,size_t>::const_iterator it=matchedMap.begin();it!=matchedMap.end();++it)
-				{
-					outIons.push_back(inIons[it->first]);
-				}
-			}
-			break;
-		}
-		case REPLACE_MODE_UNION:
+	if(replaceMode == REPLACE_MODE_UNION)
+	{
+		//Add the file ions that no input ion matched, in file order
+		vector<char> fileMatched(fileIons.size(),0);
+		for(size_t ui=0;ui<matchVec.size();ui++)
 		{
-			ASSERT(false);
-			break;
+			if(matchVec[ui] != (size_t)-1)
+				fileMatched[matchVec[ui]]=1;
 		}
-		default:
-			ASSERT(false);
+
+		UnmatchedBinner fileBinner(fileIons,fileMatched);
+		if(scatterToBins(fileIons.size(),fileBinner,outBins,progress.filterProgress,
+						inIons.size(),progressTotal))
+			return ERR_ABORT_FAIL;
 	}
+	progress.filterProgress=100;
 
 	//Only output ions if any were found
 	if(outIons.size())
@@ -2739,8 +2751,18 @@ size_t SpatialAnalysisFilter::algorithmDensity(ProgressData &progress,
 	treeDomain.setBounds(p);
 
 	//Build the tree (its roughly nlogn timing, but worst case n^2)
+	// Fixed radius searches only need neighbour counts, which
+	// the radius search can provide without visiting each neighbour
 	K3DTree kdTree;
-	kdTree.buildByRef(p);
+	FixedRadiusSearch radiusSearch;
+	if(stopMode == STOP_MODE_RADIUS)
+	{
+		radiusSearch.resetPts(p,distMax);
+		if(!radiusSearch.build())
+			return FILTER_ERR_ABORT;
+	}
+	else
+		kdTree.buildByRef(p);
 
 
 	if(*Filter::wantAbort)
@@ -2836,84 +2858,44 @@ size_t SpatialAnalysisFilter::algorithmDensity(ProgressData &progress,
 				}
 				else if(stopMode == STOP_MODE_RADIUS)
 				{
-#ifdef _OPENMP
 					bool spin=false;
-#endif
-					float maxSqrRad = distMax*distMax;
-					float vol = 4.0/3.0*M_PI*maxSqrRad*distMax; //Sphere volume=4/3 Pi R^3
-					#pragma omp parallel for shared(spin) firstprivate(treeDomain,curProg)
+					const unsigned int progressStep=NUM_CALLBACK/100;
+					curProg=progressStep;
+					float vol = 4.0/3.0*M_PI*distMax*distMax*distMax; //Sphere volume=4/3 Pi R^3
+					#pragma omp parallel for shared(spin) firstprivate(curProg)
 					for(size_t uj=0;uj<d->data.size();uj++)
 					{
-						Point3D r;
-						const Point3D *res;
-						float deadDistSqr;
-						unsigned int numInRad;
-#ifdef _OPENMP
 						if(spin)
 							continue;
-#endif	
-						r=d->data[uj].getPosRef();
-						numInRad=0;
-						deadDistSqr=0;
 
-						//Assign the mass to charge using nn density estimates
-						//TODO: Use multi-neareast search algorithm?
-						do
-						{
-							res=kdTree.findNearest(r,treeDomain,deadDistSqr);
+						//Number of points in the sphere, including this one
+						size_t numInRad;
+						numInRad=radiusSearch.countPtsInSphere(d->data[uj].getPosRef());
 
-							//Check to see if we found something
-							if(!res)
-							{
-#pragma omp critical
-								badPts.push_back(make_pair(uj, ui));
-								break;
-							}
-							
-							if(res->sqrDist(r) >maxSqrRad)
-								break;
-							numInRad++;
-							//Advance ever so slightly beyond the next ion
-							deadDistSqr = res->sqrDist(r)+std::numeric_limits<float>::epsilon();
-							//Update progress as needed
-							if(!curProg--)
-							{
-#pragma omp critical
-								{
-								progress.filterProgress= (unsigned int)((float)n/(float)totalDataSize*100.0f);
-								if(*Filter::wantAbort)
-								{
-#ifdef _OPENMP
-									spin=true;
-#else
-									delete newD;
-									return ERR_ABORT_FAIL;
-#endif
-								}
-								}
-#ifdef _OPENMP
-								if(spin)
-									break;
-#endif
-								curProg=NUM_CALLBACK/(10*nnMax);
-							}
-						}while(true);
-						
-						n++;
-						//Set the mass as the volume of sphere * the number of NN
+						//Set the mass as the number density within the sphere
 						newD->data[uj].setMassToCharge(numInRad/vol);
 						//Keep original position
-						newD->data[uj].setPos(r);
-						
+						newD->data[uj].setPos(d->data[uj].getPosRef());
+
+						//Update progress as needed
+						if(!curProg--)
+						{
+							#pragma omp critical 
+							{
+							n+=progressStep;
+							progress.filterProgress= (unsigned int)(((float)n/(float)totalDataSize)*100.0f);
+							if(*Filter::wantAbort)
+								spin=true;
+							}
+							curProg=progressStep;
+						}
 					}
 
-#ifdef _OPENMP
 					if(spin)
 					{
 						delete newD;
 						return ERR_ABORT_FAIL;
 					}
-#endif
 				}
 				else
 				{
@@ -3028,8 +3010,18 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 	treeDomain.setBounds(p);
 
 	//Build the tree (its roughly nlogn timing, but worst case n^2)
+	// Fixed radius searches only need neighbour counts, which
+	// the radius search can provide without visiting each neighbour
 	K3DTree kdTree;
-	kdTree.buildByRef(p);
+	FixedRadiusSearch radiusSearch;
+	if(stopMode == STOP_MODE_RADIUS)
+	{
+		radiusSearch.resetPts(p,distMax);
+		if(!radiusSearch.build())
+			return FILTER_ERR_ABORT;
+	}
+	else
+		kdTree.buildByRef(p);
 
 
 	//Update progress 
@@ -3132,69 +3124,20 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 				}
 				else if(stopMode == STOP_MODE_RADIUS)
 				{
-#ifdef _OPENMP
 					bool spin=false;
-#endif
-					float maxSqrRad = distMax*distMax;
-					float vol = 4.0/3.0*M_PI*maxSqrRad*distMax; //Sphere volume=4/3 Pi R^3
-					#pragma omp parallel for shared(spin) firstprivate(treeDomain,curProg)
+					const unsigned int progressStep=NUM_CALLBACK/100;
+					curProg=progressStep;
+					float vol = 4.0/3.0*M_PI*distMax*distMax*distMax; //Sphere volume=4/3 Pi R^3
+					#pragma omp parallel for shared(spin) firstprivate(curProg)
 					for(size_t uj=0;uj<d->data.size();uj++)
 					{
-						Point3D r;
-						const Point3D *res;
-						float deadDistSqr;
-						unsigned int numInRad;
-#ifdef _OPENMP
 						if(spin)
 							continue;
-#endif	
-						r=d->data[uj].getPosRef();
-						numInRad=0;
-						deadDistSqr=0;
 
-						//Assign the mass to charge using nn density estimates
-						do
-						{
-							res=kdTree.findNearest(r,treeDomain,deadDistSqr);
+						//Number of points in the sphere, including this one
+						size_t numInRad;
+						numInRad=radiusSearch.countPtsInSphere(d->data[uj].getPosRef());
 
-							//Check to see if we found something
-							if(!res)
-							{
-#pragma omp critical
-								badPts.push_back(make_pair(uj, ui));
-								break;
-							}
-							
-							if(res->sqrDist(r) >maxSqrRad)
-								break;
-							numInRad++;
-							//Advance ever so slightly beyond the next ion
-							deadDistSqr = res->sqrDist(r)+std::numeric_limits<float>::epsilon();
-							//Update progress as needed
-							if(!curProg--)
-							{
-#pragma omp critical
-								{
-								progress.filterProgress= (unsigned int)((float)n/(float)totalDataSize*100.0f);
-								if(*Filter::wantAbort)
-								{
-#ifdef _OPENMP
-									spin=true;
-#else
-									delete newD;
-									return ERR_ABORT_FAIL;
-#endif
-								}
-								}
-#ifdef _OPENMP
-								if(spin)
-									break;
-#endif
-								curProg=NUM_CALLBACK/(10*nnMax);
-							}
-						}while(true);
-						
-						n++;
 						float density;
 						density = numInRad/vol;
 
@@ -3203,16 +3146,26 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 #pragma omp critical
 							newD->data.push_back(d->data[uj]);
 						}
-						
+
+						//Update progress as needed
+						if(!curProg--)
+						{
+							#pragma omp critical 
+							{
+							n+=progressStep;
+							progress.filterProgress= (unsigned int)(((float)n/(float)totalDataSize)*100.0f);
+							if(*Filter::wantAbort)
+								spin=true;
+							}
+							curProg=progressStep;
+						}
 					}
 
-#ifdef _OPENMP
 					if(spin)
 					{
 						delete newD;
 						return ERR_ABORT_FAIL;
 					}
-#endif
 				}
 				else
 				{
@@ -3967,12 +3920,12 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 		progress.filterProgress=0;
 
 
-		//Build the tree (its roughly nlogn timing, but worst case n^2)
-		K3DTreeMk2 treeNumerator,treeDenominator;
-		treeNumerator.resetPts(numeratorPts);
+		//Build the radius searches (cell list or KD tree, whichever suits the density)
+		FixedRadiusSearch searchNumerator,searchDenominator;
+		searchNumerator.resetPts(numeratorPts,distMax);
 		if(*Filter::wantAbort)
 			return ERR_ABORT_FAIL;
-		treeNumerator.build();
+		searchNumerator.build();
 		if(*Filter::wantAbort)
 			return ERR_ABORT_FAIL;
 
@@ -3980,8 +3933,8 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 		progress.stepName = TRANS("Build Denominator");
 		progress.filterProgress=0;
 
-		treeDenominator.resetPts(denominatorPts);
-		treeDenominator.build();
+		searchDenominator.resetPts(denominatorPts,distMax);
+		searchDenominator.build();
 		if(*Filter::wantAbort)
 			return ERR_ABORT_FAIL;
 
@@ -4082,39 +4035,14 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 				continue;
 #endif
 
-			vector<size_t> ptsNum,ptsDenom;
-			//Find the points that are within the search radius
-			treeNumerator.ptsInSphere(pSource[ui].getPosRef(),distMax,ptsNum);
-			treeDenominator.ptsInSphere(pSource[ui].getPosRef(),distMax,ptsDenom);
-
-			//Check to see if there is any self-matching going on. Don't allow zero-distance matches
-			// as this biases the composition towards the chosen source points
-			//TODO: Is there a faster way to do this? We might be able to track the original index of the point
-			// that we built, and map it back to the input?
-			//--
+			//Count the points that are within the search radius.
+			// Don't allow zero-distance matches, as this biases the
+			// composition towards the chosen source points
 			unsigned int nCount,dCount;
-			nCount=0;
-			for(unsigned int uj=0;uj<ptsNum.size(); uj++)
-			{
-				size_t ptIdx;
-				ptIdx=ptsNum[uj];
-				float dist;
-				dist = treeNumerator.getPtRef(ptIdx).sqrDist(pSource[ui].getPosRef());
-				if(dist > DISTANCE_EPSILON)
-					nCount++;
-			}
-
-			dCount=0;
-			for(unsigned int uj=0;uj<ptsDenom.size(); uj++)
-			{
-				size_t ptIdx;
-				ptIdx=ptsDenom[uj];
-				float dist;
-				dist = treeDenominator.getPtRef(ptIdx).sqrDist(pSource[ui].getPosRef());
-				if(dist> DISTANCE_EPSILON)
-					dCount++;
-			}
-			//--
+			nCount=searchNumerator.countPtsInSphere(pSource[ui].getPosRef(),
+								true,DISTANCE_EPSILON);
+			dCount=searchDenominator.countPtsInSphere(pSource[ui].getPosRef(),
+								true,DISTANCE_EPSILON);
 			
 			//compute concentration
 			if( nCount + dCount )
@@ -4325,8 +4253,10 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 bool densityPairTest();
 bool nnHistogramTest();
 bool rdfPlotTest();
+bool reducedHullTest();
 bool axialDistTest();
 bool replaceTest();
+bool replaceModesTest();
 bool localConcTestRadius();
 bool localConcTestNN();
 
@@ -4341,10 +4271,15 @@ bool SpatialAnalysisFilter::runUnitTests()
 	if(!rdfPlotTest())
 		return false;
 
+	if(!reducedHullTest())
+		return false;
+
 	if(!axialDistTest())
 		return false;
 	if(!replaceTest())
 		return false;
+	if(!replaceModesTest())
+		return false;
 	if(!localConcTestRadius())
 		return false;
 
@@ -4534,6 +4469,45 @@ bool rdfPlotTest()
 	return true;
 }
 
+//Check that the hull used for surface-distance exclusion is shrunk
+// by the requested distance, and that no point outside it is kept
+bool reducedHullTest()
+{
+	const float BOX_SIZE=10.0f;
+	const float REDUCE_DIST=1.0f;
+	const unsigned int NUM_PTS=200000;
+
+	RandNumGen rng;
+	rng.initialise(1234);
+	vector<Point3D> pts(NUM_PTS);
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		pts[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),
+				rng.genUniformDev())*BOX_SIZE;
+	}
+
+	unsigned int progress;
+	vector<Point3D> reducedPts;
+	TEST(!GetReducedHullPts(pts,REDUCE_DIST,&progress,
+			*(Filter::wantAbort),reducedPts),"reduced hull");
+
+	//The hull is scaled about its centroid, and so should be
+	// (slightly larger than) the box, inset on all sides
+	BoundCube b;
+	b.setBounds(Point3D(REDUCE_DIST,REDUCE_DIST,REDUCE_DIST)*0.95f,
+		Point3D(BOX_SIZE,BOX_SIZE,BOX_SIZE)-Point3D(REDUCE_DIST,REDUCE_DIST,REDUCE_DIST)*0.95f);
+	for(size_t ui=0;ui<reducedPts.size();ui++)
+	{
+		TEST(b.containsPt(reducedPts[ui]),"reduced point inside inset box");
+	}
+
+	const float innerFrac=(BOX_SIZE-2*REDUCE_DIST)/BOX_SIZE;
+	TEST(fabs((float)reducedPts.size()/NUM_PTS - innerFrac*innerFrac*innerFrac) < 0.02f,
+			"reduced point fraction");
+
+	return true;
+}
+
 bool axialDistTest()
 {
 	//Build some points to pass to the filter
@@ -4679,6 +4653,93 @@ bool replaceTest()
 }
 
 
+//Run the replace algorithm in the given mode, with the file data
+// taking mass 1 at (i,i,i) for i in [0,10), and the input data mass 2
+// at (i,i,i) for i in [5,15). Returns false on failure
+bool runReplaceMode(const std::string &ionFile, unsigned int mode,
+				vector<IonHit> &outIons)
+{
+	IonStreamData *d = new IonStreamData;
+	for(unsigned int ui=5;ui<15;ui++)
+		d->data.push_back(IonHit(Point3D(ui,ui,ui),2));
+
+	SpatialAnalysisFilter *f=new SpatialAnalysisFilter;
+	f->setCaching(false);	
+	
+	bool needUp;
+	string s;
+	s=TRANS(SPATIAL_ALGORITHMS[ALGORITHM_REPLACE]);
+	TEST(f->setProperty(KEY_ALGORITHM,s,needUp),"Set prop");
+	TEST(f->setProperty(KEY_REPLACE_FILE,ionFile,needUp),"Set prop");
+	s=TRANS(REPLACE_ALGORITHMS[mode]);
+	TEST(f->setProperty(KEY_REPLACE_ALGORITHM,s,needUp),"Set prop");
+	if(mode != REPLACE_MODE_SUBTRACT)
+	{
+		s="1";
+		TEST(f->setProperty(KEY_REPLACE_VALUE,s,needUp),"Set prop");
+	}
+
+	ProgressData p;
+	vector<const FilterStreamData*> streamIn,streamOut;
+	streamIn.push_back(d);
+	TEST(!f->refresh(streamIn,streamOut,p),"refresh OK");
+	delete f;
+	delete d;
+
+	TEST(streamOut.size() == 1,"stream count");
+	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
+	outIons=((const IonStreamData*)streamOut[0])->data;
+	delete streamOut[0];
+
+	return true;
+}
+
+bool replaceModesTest()
+{
+	std::string ionFile=createTmpFilename(NULL,".pos");
+		
+	vector<IonHit> ions;
+	for(unsigned int ui=0;ui<10;ui++)
+		ions.push_back(IonHit(Point3D(ui,ui,ui),1));
+	IonHit::makePos(ions,ionFile.c_str());
+
+	//Subtract keeps the unmatched input ions, in input order
+	TEST(runReplaceMode(ionFile,REPLACE_MODE_SUBTRACT,ions),"subtract");
+	TEST(ions.size() == 5,"subtract count");
+	for(unsigned int ui=0;ui<ions.size();ui++)
+	{
+		TEST(ions[ui].getPosRef() == Point3D(ui+10,ui+10,ui+10),"subtract order");
+		TEST(ions[ui].getMassToCharge() == 2,"subtract value");
+	}
+
+	//Intersect keeps the matched ions, taking the file's values
+	TEST(runReplaceMode(ionFile,REPLACE_MODE_INTERSECT,ions),"intersect");
+	TEST(ions.size() == 5,"intersect count");
+	for(unsigned int ui=0;ui<ions.size();ui++)
+	{
+		TEST(ions[ui].getPosRef() == Point3D(ui+5,ui+5,ui+5),"intersect order");
+		TEST(ions[ui].getMassToCharge() == 1,"intersect value");
+	}
+
+	//Union gives all input ions, then the file ions that were not matched
+	TEST(runReplaceMode(ionFile,REPLACE_MODE_UNION,ions),"union");
+	TEST(ions.size() == 15,"union count");
+	for(unsigned int ui=0;ui<10;ui++)
+	{
+		TEST(ions[ui].getPosRef() == Point3D(ui+5,ui+5,ui+5),"union order");
+		TEST(ions[ui].getMassToCharge() == (ui < 5 ? 1 : 2),"union value");
+	}
+	for(unsigned int ui=10;ui<15;ui++)
+	{
+		TEST(ions[ui].getPosRef() == Point3D(ui-10,ui-10,ui-10),"union file order");
+		TEST(ions[ui].getMassToCharge() == 1,"union file value");
+	}
+
+	wxRemoveFile(ionFile);
+	return true;
+}
+
+
 //--- Local concentration tests --
 const IonStreamData *createLCIonStream()
 {
@@ -96,8 +96,21 @@ const char *TRANSFORM_ORIGIN_STRING[]={
 					NTRANS("Boundbox Centre"),
 					NTRANS("Mass Centre")
 					};
-					
-	
+
+//Return true if the mode only alters ion positions, via an affine transform
+bool isAffineMode(unsigned int mode)
+{
+	switch(mode)
+	{
+		case MODE_TRANSLATE:
+		case MODE_SCALE_ISOTROPIC:
+		case MODE_SCALE_ANISOTROPIC:
+		case MODE_ROTATE:
+			return true;
+		default:
+			return false;
+	}
+}
 	
 //=== Transform filter === 
 TransformFilter::TransformFilter()
@@ -146,9 +159,63 @@ Filter *TransformFilter::cloneUncached() const
 
 size_t TransformFilter::numBytesForCache(size_t nObjects) const
 {
+	//Affine modes select the input ions, rather than copying them
+	if(isAffineMode(transformMode))
+		return nObjects*sizeof(size_t);
+
 	return nObjects*sizeof(IonHit);
 }
 
+bool TransformFilter::acceptsIonSelections() const
+{
+	return isAffineMode(transformMode);
+}
+
+bool TransformFilter::acceptsPendingTransforms() const
+{
+	//Affine modes compose their transform with that of the input, 
+	// but all other modes require the final positions
+	return isAffineMode(transformMode);
+}
+
+AffineTransform3D TransformFilter::getAffineTransform() const
+{
+	ASSERT(isAffineMode(transformMode));
+	ASSERT(vectorParams.size());
+	Point3D origin=vectorParams[0];
+	switch(transformMode)
+	{
+		case MODE_TRANSLATE:
+			ASSERT(vectorParams.size() == 1);
+			ASSERT(scalarParams.size() == 0);
+			return AffineTransform3D::translation(-origin);
+		case MODE_SCALE_ISOTROPIC:
+		{
+			ASSERT(vectorParams.size() == 1);
+			ASSERT(scalarParams.size() == 1);
+			float scaleFactor=scalarParams[0];
+			return AffineTransform3D::scaling(
+				Point3D(scaleFactor,scaleFactor,scaleFactor),origin);
+		}
+		case MODE_SCALE_ANISOTROPIC:
+			ASSERT(vectorParams.size() == 2);
+			return AffineTransform3D::scaling(vectorParams[1],origin);
+		case MODE_ROTATE:
+		{
+			ASSERT(vectorParams.size() == 2);
+			ASSERT(scalarParams.size() == 1);
+			Point3D axis =vectorParams[1];
+			axis.normalise();
+			float angle=scalarParams[0]*M_PI/180.0f;
+			return AffineTransform3D::rotation(axis,-angle,origin);
+		}
+		default:
+			ASSERT(false);
+	}
+
+	return AffineTransform3D();
+}
+
 DrawStreamData* TransformFilter::makeMarkerSphere(SelectionDevice* &s) const
 {
 	//construct a new primitive, do not cache
@@ -212,19 +279,17 @@ unsigned int TransformFilter::refresh(const std::vector<const FilterStreamData *
 		{
 			BoundCube masterB;
 			masterB.setInverseLimits();
-			#pragma omp parallel for
 			for(unsigned int ui=0;ui<dataIn.size() ;ui++)
 			{
-				BoundCube thisB;
-
 				if(dataIn[ui]->getStreamType() == STREAM_TYPE_IONS)
 				{
 					const IonStreamData* ions;
 					ions = (const IonStreamData*)dataIn[ui];
-					if(ions->data.size())
+					if(ions->getNumBasicObjects())
 					{
-						IonHit::getBoundCube(ions->data,thisB);
-						#pragma omp critical
+						//Bounds are computed in parallel, within each stream
+						BoundCube thisB;
+						ions->getTransformedBoundCube(thisB);
 						masterB.expand(thisB);
 					}
 				}
@@ -240,29 +305,51 @@ unsigned int TransformFilter::refresh(const std::vector<const FilterStreamData *
 		{
 			Point3D massCentre(0,0,0);
 			size_t numCentres=0;
-			#pragma omp parallel for
 			for(unsigned int ui=0;ui<dataIn.size() ;ui++)
 			{
-				Point3D massContrib;
 				if(dataIn[ui]->getStreamType() == STREAM_TYPE_IONS)
 				{
 					const IonStreamData* ions;
 					ions = (const IonStreamData*)dataIn[ui];
 
-					if(ions->data.size())
+					if(ions->getNumBasicObjects())
 					{
-						Point3D thisCentre;
-						thisCentre=Point3D(0,0,0);
-						for(unsigned int uj=0;uj<ions->data.size();uj++)
-							thisCentre+=ions->data[uj].getPosRef();
-						massContrib=thisCentre*1.0/(float)ions->data.size();
-						#pragma omp critical
-						massCentre+=massContrib;
+						double sumX=0,sumY=0,sumZ=0;
+						const vector<IonSelection> &sel=ions->shareIons();
+						for(size_t uj=0;uj<sel.size();uj++)
+						{
+							const IonSelection &s=sel[uj];
+							//Sum in blocks, so we can abort between them
+							for(size_t start=0;start<s.size();start+=NUM_CALLBACK*64)
+							{
+								size_t end=std::min(start+NUM_CALLBACK*64,s.size());
+								#pragma omp parallel for reduction(+:sumX,sumY,sumZ)
+								for(size_t uk=start;uk<end;uk++)
+								{
+									const Point3D &p=s[uk].getPosRef();
+									sumX+=p.getValue(0);
+									sumY+=p.getValue(1);
+									sumZ+=p.getValue(2);
+								}
+
+								if(*Filter::wantAbort)
+									return FILTER_ERR_ABORT;
+							}
+						}
+
+						double nIons=ions->getNumBasicObjects();
+						Point3D thisCentre(sumX/nIons,sumY/nIons,sumZ/nIons);
+
+						//Affine transforms preserve the centre of mass
+						massCentre+=ions->pendingTransform.apply(thisCentre);
 						numCentres++;
 					}
 				}
 			}
-			vectorParams[0]=massCentre*1.0/(float)numCentres;
+			if(!numCentres)
+				vectorParams[0]=Point3D(0,0,0);
+			else
+				vectorParams[0]=massCentre*1.0/(float)numCentres;
 			break;
 
 		}
@@ -306,7 +393,58 @@ unsigned int TransformFilter::refresh(const std::vector<const FilterStreamData *
 		return 0;
 	}
 
-	if( transformMode != MODE_VALUE_SHUFFLE)
+	if(isAffineMode(transformMode))
+	{
+		//Geometric transforms are not applied here. Instead the 
+		// input ions are selected where they are, and our transform is
+		// composed with any transform still pending on the input. The 
+		// positions are then transformed once, by the first consumer
+		// that needs them
+		AffineTransform3D t=getAffineTransform();
+		size_t n=0;
+		for(unsigned int ui=0;ui<dataIn.size() ;ui++)
+		{
+			if(dataIn[ui]->getStreamType() != STREAM_TYPE_IONS)
+			{
+				//Just copy across the ptr, if we are unfamiliar with this type
+				getOut.push_back(dataIn[ui]);
+				continue;
+			}
+
+			const IonStreamData *src = (const IonStreamData *)dataIn[ui];
+			IonStreamData *d=new IonStreamData;
+			d->parent=this;
+			try
+			{
+				d->selections=src->shareIons();
+			}
+			catch(std::bad_alloc)
+			{
+				delete d;
+				return ERR_NOMEM;
+			}
+			d->r = src->r;
+			d->g = src->g;
+			d->b = src->b;
+			d->a = src->a;
+			d->ionSize = src->ionSize;
+			d->valueType=src->valueType;
+			d->pendingTransform=t*src->pendingTransform;
+
+			n+=d->getNumBasicObjects();
+			progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
+			if(*Filter::wantAbort)
+			{
+				delete d;
+				return FILTER_ERR_ABORT;
+			}
+
+			cacheAsNeeded(d);
+
+			getOut.push_back(d);
+		}
+	}
+	else if( transformMode != MODE_VALUE_SHUFFLE)
 	{
 		//Don't cross the streams. Why? It would be bad.
 		//  - I'm fuzzy on the whole good-bad thing, what do you mean bad?
@@ -319,332 +457,6 @@ unsigned int TransformFilter::refresh(const std::vector<const FilterStreamData *
 		{
 			switch(transformMode)
 			{
-				case MODE_SCALE_ISOTROPIC:
-				{
-					//We are going to scale the incoming point data
-					//around the specified origin.
-					ASSERT(vectorParams.size() == 1);
-					ASSERT(scalarParams.size() == 1);
-					float scaleFactor=scalarParams[0];
-					Point3D origin=vectorParams[0];
-
-					switch(dataIn[ui]->getStreamType())
-					{
-						case STREAM_TYPE_IONS:
-						{
-							//Set up scaling output ion stream 
-							IonStreamData *d=new IonStreamData;
-							d->parent=this;
-							const IonStreamData *src = (const IonStreamData *)dataIn[ui];
-
-							try
-							{
-								d->data.resize(src->data.size());
-							}
-							catch(std::bad_alloc)
-							{
-								delete d;
-								return ERR_NOMEM;
-							}
-							d->r = src->r;
-							d->g = src->g;
-							d->b = src->b;
-							d->a = src->a;
-							d->ionSize = src->ionSize;
-							d->valueType=src->valueType;
-
-							ASSERT(src->data.size() <= totalSize);
-#ifdef _OPENMP
-							unsigned int curProg=PROGRESS_REDUCE;
-							//Parallel version
-							bool spin=false;
-							#pragma omp parallel for shared(spin,n)
-							for(unsigned int ui=0;ui<src->data.size();ui++)
-							{
-								if(spin)
-									continue;
-
-								if(!curProg--)
-								{
-									unsigned int thisT=omp_get_thread_num();
-									#pragma omp critical
-									{
-									n+=NUM_CALLBACK;
-									progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-									}
-
-
-									if(thisT == 0)
-									{
-										if(*Filter::wantAbort)
-											spin=true;
-									}
-								}
-
-
-								//set the position for the given ion
-								d->data[ui].setPos((src->data[ui].getPosRef() - origin)*scaleFactor+origin);
-								d->data[ui].setMassToCharge(src->data[ui].getMassToCharge());
-							}
-							if(spin)
-							{			
-								delete d;
-								return FILTER_ERR_ABORT;
-							}
-
-#else
-							//Single threaded version
-							size_t pos=0;
-							//Copy across the ions into the target
-							for(vector<IonHit>::const_iterator it=src->data.begin();
-								       it!=src->data.end(); ++it)
-							{
-								//set the position for the given ion
-								d->data[pos].setPos((it->getPosRef() - origin)*scaleFactor+origin);
-								d->data[pos].setMassToCharge(it->getMassToCharge());
-								//update progress 
-								progress.filterProgress= (unsigned int)((float)(n++)/((float)totalSize)*100.0f);
-								if(*Filter::wantAbort)
-								{
-									delete d;
-									return FILTER_ERR_ABORT;
-								}
-								pos++;
-							}
-
-							ASSERT(pos == d->data.size());
-#endif
-							ASSERT(d->data.size() == src->data.size());
-
-							cacheAsNeeded(d);
-
-							getOut.push_back(d);
-							break;
-						}
-						default:
-							//Just copy across the ptr, if we are unfamiliar with this type
-							getOut.push_back(dataIn[ui]);	
-							break;
-					}
-					break;
-				}
-				case MODE_SCALE_ANISOTROPIC:
-				{
-					//We are going to scale the incoming point data
-					//around the specified origin.
-					ASSERT(vectorParams.size() == 2);
-					
-					
-					Point3D origin=vectorParams[0];
-					Point3D transformVec=vectorParams[1];
-					switch(dataIn[ui]->getStreamType())
-					{
-						case STREAM_TYPE_IONS:
-						{
-							//Set up scaling output ion stream 
-							IonStreamData *d=new IonStreamData;
-							d->parent=this;
-							const IonStreamData *src = (const IonStreamData *)dataIn[ui];
-
-							try
-							{
-								d->data.resize(src->data.size());
-							}
-							catch(std::bad_alloc)
-							{
-								delete d;
-								return ERR_NOMEM;
-							}
-							d->r = src->r;
-							d->g = src->g;
-							d->b = src->b;
-							d->a = src->a;
-							d->ionSize = src->ionSize;
-							d->valueType=src->valueType;
-
-							ASSERT(src->data.size() <= totalSize);
-#ifdef _OPENMP
-							unsigned int curProg=PROGRESS_REDUCE;
-							//Parallel version
-							bool spin=false;
-							#pragma omp parallel for shared(spin)
-							for(unsigned int ui=0;ui<src->data.size();ui++)
-							{
-								unsigned int thisT=omp_get_thread_num();
-								if(spin)
-									continue;
-
-								if(!curProg--)
-								{
-									#pragma omp critical
-									{
-									n+=NUM_CALLBACK;
-									progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-									}
-
-
-									if(thisT == 0)
-									{
-										if(*Filter::wantAbort)
-											spin=true;
-									}
-								}
-
-
-								//set the position for the given ion
-								d->data[ui].setPos((src->data[ui].getPosRef() - origin)*transformVec+origin);
-								d->data[ui].setMassToCharge(src->data[ui].getMassToCharge());
-							}
-							if(spin)
-							{			
-								delete d;
-								return FILTER_ERR_ABORT;
-							}
-
-#else
-							//Single threaded version
-							size_t pos=0;
-							//Copy across the ions into the target
-							for(vector<IonHit>::const_iterator it=src->data.begin();
-								       it!=src->data.end(); ++it)
-							{
-								//set the position for the given ion
-								d->data[pos].setPos((it->getPosRef() - origin)*transformVec+origin);
-								d->data[pos].setMassToCharge(it->getMassToCharge());
-								progress.filterProgress= (unsigned int)((float)(n++)/((float)totalSize)*100.0f);
-								if(*Filter::wantAbort)
-								{
-									delete d;
-									return FILTER_ERR_ABORT;
-								}
-								pos++;
-							}
-
-							ASSERT(pos == d->data.size());
-#endif
-							ASSERT(d->data.size() == src->data.size());
-
-							cacheAsNeeded(d);
-
-							getOut.push_back(d);
-							break;
-						}
-						default:
-							//Just copy across the ptr, if we are unfamiliar with this type
-							getOut.push_back(dataIn[ui]);	
-							break;
-					}
-
-
-					
-
-					break;
-				}
-				case MODE_TRANSLATE:
-				{
-					//We are going to scale the incoming point data
-					//around the specified origin.
-					ASSERT(vectorParams.size() == 1);
-					ASSERT(scalarParams.size() == 0);
-					Point3D origin =vectorParams[0];
-					switch(dataIn[ui]->getStreamType())
-					{
-						case STREAM_TYPE_IONS:
-						{
-							//Set up scaling output ion stream 
-							IonStreamData *d=new IonStreamData;
-							d->parent=this;
-							
-							const IonStreamData *src = (const IonStreamData *)dataIn[ui];
-							try
-							{
-								d->data.resize(src->data.size());
-							}
-							catch(std::bad_alloc)
-							{
-								delete d;
-								return ERR_NOMEM;
-							}
-							d->r = src->r;
-							d->g = src->g;
-							d->b = src->b;
-							d->a = src->a;
-							d->ionSize = src->ionSize;
-							d->valueType=src->valueType;
-							
-							ASSERT(src->data.size() <= totalSize);
-#ifdef _OPENMP
-							//Parallel version
-							unsigned int curProg=PROGRESS_REDUCE;
-							bool spin=false;
-#pragma omp parallel for shared(spin)
-							for(unsigned int ui=0;ui<src->data.size();ui++)
-							{
-								if(spin)
-									continue;
-								
-								if(!curProg--)
-								{
-#pragma omp critical
-									{
-										n+=PROGRESS_REDUCE;
-										progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-									}
-									
-									
-									if(omp_get_thread_num() == 0)
-									{
-										if(*Filter::wantAbort)
-											spin=true;
-									}
-								}
-								
-								
-								//set the position for the given ion
-								d->data[ui].setPos((src->data[ui].getPosRef() - origin));
-								d->data[ui].setMassToCharge(src->data[ui].getMassToCharge());
-							}
-							if(spin)
-							{			
-								delete d;
-								return FILTER_ERR_ABORT;
-							}
-							
-#else
-							//Single threaded version
-							size_t pos=0;
-							//Copy across the ions into the target
-							for(vector<IonHit>::const_iterator it=src->data.begin();
-								it!=src->data.end(); ++it)
-							{
-								//set the position for the given ion
-								d->data[pos].setPos((it->getPosRef() - origin));
-								d->data[pos].setMassToCharge(it->getMassToCharge());
-								//update progress every CALLBACK ions
-								progress.filterProgress= (unsigned int)((float)(n++)/((float)totalSize)*100.0f);
-								if(*Filter::wantAbort)
-								{
-									delete d;
-									return FILTER_ERR_ABORT;
-								}
-								pos++;
-							}
-							ASSERT(pos == d->data.size());
-#endif
-							ASSERT(d->data.size() == src->data.size());
-
-							cacheAsNeeded(d);
-							
-							getOut.push_back(d);
-							break;
-						}
-						default:
-							//Just copy across the ptr, if we are unfamiliar with this type
-							getOut.push_back(dataIn[ui]);	
-							break;
-					}
-					break;
-				}
 				case MODE_TRANSLATE_VALUE:
 				{
 					//We are going to scale the incoming point data
@@ -785,96 +597,6 @@ unsigned int TransformFilter::refresh(const std::vector<const FilterStreamData *
 					}
 				}
 				break;
-				case MODE_ROTATE:
-				{
-					Point3D origin=vectorParams[0];
-					switch(dataIn[ui]->getStreamType())
-					{
-						case STREAM_TYPE_IONS:
-						{
-
-							const IonStreamData *src = (const IonStreamData *)dataIn[ui];
-							//Set up output ion stream 
-							IonStreamData *d=new IonStreamData;
-							d->parent=this;
-							try
-							{
-								d->data.resize(src->data.size());
-							}
-							catch(std::bad_alloc)
-							{
-								delete d;
-								return ERR_NOMEM;
-							}
-
-							d->estimateIonParameters(src);
-
-							//We are going to rotate the incoming point data
-							//around the specified origin.
-							ASSERT(vectorParams.size() == 2);
-							ASSERT(scalarParams.size() == 1);
-							Point3D axis =vectorParams[1];
-							axis.normalise();
-							float angle=scalarParams[0]*M_PI/180.0f;
-
-							unsigned int curProg=NUM_CALLBACK;
-
-							Point3f rotVec,p;
-							rotVec.fx=axis[0];
-							rotVec.fy=axis[1];
-							rotVec.fz=axis[2];
-
-							Quaternion q1;
-
-							//Generate the rotating quaternion
-							quat_get_rot_quat(&rotVec,-angle,&q1);
-							ASSERT(src->data.size() <= totalSize);
-
-
-							size_t pos=0;
-
-							//TODO: Parallelise rotation
-							//Copy across the ions into the target
-							for(vector<IonHit>::const_iterator it=src->data.begin();
-								       it!=src->data.end(); ++it)
-							{
-								p.fx=it->getPosRef()[0]-origin[0];
-								p.fy=it->getPosRef()[1]-origin[1];
-								p.fz=it->getPosRef()[2]-origin[2];
-								quat_rot_apply_quat(&p,&q1);
-								//set the position for the given ion
-								d->data[pos].setPos(p.fx+origin[0],
-										p.fy+origin[1],p.fz+origin[2]);
-								d->data[pos].setMassToCharge(it->getMassToCharge());
-								//update progress every CALLBACK ions
-								if(!curProg--)
-								{
-									n+=NUM_CALLBACK;
-									progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-									if(*Filter::wantAbort)
-									{
-										delete d;
-										return FILTER_ERR_ABORT;
-									}
-									curProg=NUM_CALLBACK;
-								}
-								pos++;
-							}
-
-							ASSERT(d->data.size() == src->data.size());
-
-							cacheAsNeeded(d);
-							
-							getOut.push_back(d);
-							break;
-						}
-						default:
-							getOut.push_back(dataIn[ui]);
-							break;
-					}
-
-					break;
-				}
 				case MODE_SPATIAL_NOISE:
 				{
 					ASSERT(scalarParams.size() ==1 &&
@@ -1755,6 +1477,7 @@ bool translateTest();
 bool scaleTest();
 bool scaleAnisoTest();
 bool shuffleTest();
+bool chainTest();
 
 class MassCompare
 {
@@ -1780,6 +1503,9 @@ bool TransformFilter::runUnitTests()
 	if(!shuffleTest())
 		return false;
 
+	if(!chainTest())
+		return false;
+
 	return true;
 }
 
@@ -1871,7 +1597,9 @@ bool rotateTest()
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
 	TEST(streamOut[0]->getNumBasicObjects() == d->data.size(),"Ion count invariance");
 
-	const IonStreamData *outData=(IonStreamData*)streamOut[0];
+	IonStreamData *outData=(IonStreamData*)streamOut[0];
+	//Positions are only transformed on demand
+	outData->applyPendingTransform();
 
 	Point3D massCentre[2];
 	massCentre[0]=massCentre[1]=Point3D(0,0,0);
@@ -1953,7 +1681,9 @@ bool translateTest()
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
 	TEST(streamOut[0]->getNumBasicObjects() == d->data.size(),"Ion count invariance");
 
-	const IonStreamData *outData=(IonStreamData*)streamOut[0];
+	IonStreamData *outData=(IonStreamData*)streamOut[0];
+	//Positions are only transformed on demand
+	outData->applyPendingTransform();
 
 	//Bound cube should move exactly as per the translation
 	BoundCube bc[2];
@@ -2033,7 +1763,9 @@ bool scaleTest()
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
 	TEST(streamOut[0]->getNumBasicObjects() == d->data.size(),"Ion count invariance");
 
-	const IonStreamData *outData=(IonStreamData*)streamOut[0];
+	IonStreamData *outData=(IonStreamData*)streamOut[0];
+	//Positions are only transformed on demand
+	outData->applyPendingTransform();
 
 	//Scaling around its centre of mass
 	// should scale the bounding box by the cube of the scale factor
@@ -2187,4 +1919,106 @@ bool shuffleTest()
 	return true;
 }
 
+bool chainTest()
+{
+	IonStreamData *d;
+	const unsigned int NUM_PTS=1000;
+	unsigned int span[]={ 
+			5, 7, 9
+			};	
+	d=synthDataPoints(span,NUM_PTS);
+
+	//Build a translate->rotate->scale chain 
+	//---
+	TransformFilter *f[3];
+	for(unsigned int ui=0;ui<3;ui++)
+		f[ui] = new TransformFilter;
+
+	bool needUp;
+	TEST(f[0]->setProperty(KEY_MODE,
+		TRANSFORM_MODE_STRING[MODE_TRANSLATE],needUp),"set translate mode");
+	TEST(f[0]->setProperty(KEY_ORIGIN,"(1,2,3)",needUp),"Set Origin");
+	
+	TEST(f[1]->setProperty(KEY_MODE,
+		TRANSFORM_MODE_STRING[MODE_ROTATE],needUp),"set rotate mode");
+	TEST(f[1]->setProperty(KEY_ROTATE_AXIS,"(0,0,1)",needUp),"set rotate axis");
+	TEST(f[1]->setProperty(KEY_ROTATE_ANGLE,"90",needUp),"set rotate angle");
+	
+	TEST(f[2]->setProperty(KEY_MODE,
+		TRANSFORM_MODE_STRING[MODE_SCALE_ISOTROPIC],needUp),"Set scale mode");
+	TEST(f[2]->setProperty(KEY_ORIGINMODE,
+		TRANSFORM_ORIGIN_STRING[ORIGINMODE_MASSCENTRE],needUp),"Set origin->mass mode");
+	TEST(f[2]->setProperty(KEY_SCALEFACTOR,"2",needUp),"Set scalefactor");
+
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		TEST(f[ui]->acceptsPendingTransforms(),"affine modes accept pending transforms");
+		TEST(f[ui]->acceptsIonSelections(),"affine modes accept selections");
+		TEST(f[ui]->setProperty(KEY_TRANSFORM_SHOWORIGIN,"0",needUp),"Set show origin");
+	}
+	//---
+
+	//Run the chain, once deferring the transforms, 
+	// and once applying the transform after each step
+	IonStreamData *result[2];
+	for(unsigned int pass=0;pass<2;pass++)
+	{
+		vector<const FilterStreamData*> streamIn,streamOut;
+		streamIn.push_back(d);
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			ProgressData p;
+			TEST(!f[ui]->refresh(streamIn,streamOut,p),"refresh error code");
+			TEST(streamOut.size() == 1,"stream count");
+			TEST(streamOut[0]->getNumBasicObjects() == NUM_PTS,"Ion count invariance");
+
+			IonStreamData *outData=(IonStreamData*)streamOut[0];
+			if(pass)
+				outData->applyPendingTransform();
+			else
+			{
+				TEST(outData->hasPendingTransform(), "positions should be deferred");
+				TEST(outData->hasSelections() && 
+					&(outData->selections[0].sourceIons()) == &(d->data),"ions should be shared, not copied");
+			}
+
+			if(streamIn[0] != d)
+				delete streamIn[0];
+			streamIn.swap(streamOut);
+			streamOut.clear();
+		}
+		result[pass]=(IonStreamData*)streamIn[0];
+	}
+
+	for(unsigned int ui=0;ui<3;ui++)
+		delete f[ui];
+
+	result[0]->applyPendingTransform();
+	TEST(!result[0]->hasPendingTransform(),"transform should be applied");
+	for(size_t ui=0;ui<NUM_PTS;ui++)
+	{
+		TEST(result[0]->data[ui].getMassToCharge() == d->data[ui].getMassToCharge(),
+			"mass invariance");
+		TEST(result[0]->data[ui].getPosRef().sqrDist(result[1]->data[ui].getPosRef()) < 
+				10.0f*sqrtf(std::numeric_limits<float>::epsilon()),"deferred/immediate transform agreement");
+	}
+
+	//Check a point by hand. Translate, then rotate about z, 
+	// then scale about mass centre (which is unchanged by the scaling) 
+	Point3D massCentre(0,0,0);
+	for(size_t ui=0;ui<NUM_PTS;ui++)
+		massCentre+=result[1]->data[ui].getPosRef();
+	massCentre*=1.0f/(float)NUM_PTS;
+
+	Point3D p=d->data[1].getPos() - Point3D(1,2,3);
+	quat_rot(p,Point3D(0,0,1),-M_PI/2.0f);
+	p=massCentre + (p-massCentre)*2.0f;
+	TEST(p.sqrDist(result[0]->data[1].getPosRef()) < 0.01f, "hand-computed transform");
+
+	delete result[0];
+	delete result[1];
+	delete d;
+	return true;
+}
+
 #endif
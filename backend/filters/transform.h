@@ -48,6 +48,9 @@ class TransformFilter : public Filter
 
 		//!Make the marker sphere
 		DrawStreamData* makeMarkerSphere(SelectionDevice* &s) const;
+
+		//!Obtain the position transform for the current (affine) mode 
+		AffineTransform3D getAffineTransform() const;
 		
 		//!random number generator
 		RandNumGen randGen;
@@ -98,6 +101,12 @@ class TransformFilter : public Filter
 		//!Set internal property value using a selection binding  (Disabled, this filter has no bindings)
 		void setPropFromBinding(const SelectionBinding &b);
 
+		//!Returns true for modes that only apply an affine transform
+		bool acceptsPendingTransforms() const;
+
+		//!Returns true for modes that only apply an affine transform
+		bool acceptsIonSelections() const;
+
 #ifdef DEBUG
 		bool runUnitTests();
 #endif
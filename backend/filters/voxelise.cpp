@@ -60,7 +60,8 @@ enum
 	KEY_FILTER_RATIO,
 	KEY_FILTER_STDEV,
 	KEY_ENABLE_NUMERATOR,
-	KEY_ENABLE_DENOMINATOR
+	KEY_ENABLE_DENOMINATOR,
+	KEY_STORAGE_MODE
 };
 
 //!Normalisation method
@@ -83,6 +84,15 @@ enum
 };
 
 
+//!Voxel storage for the point cloud and slice representations
+enum
+{
+	VOXELISE_STORAGE_AUTO,// sparse for large grids
+	VOXELISE_STORAGE_DENSE,
+	VOXELISE_STORAGE_SPARSE,
+	VOXELISE_STORAGE_MAX // keep this at the end so it's a bookend for the last value
+};
+
 //Boundary behaviour for filtering 
 enum
 {
@@ -133,6 +143,17 @@ const char *VOXELISE_FILTER_TYPE_STRING[]={
 	NTRANS("Lapl. of Gauss. (edges)"),
 	};
 
+const char *VOXELISE_STORAGE_STRING[]={
+	NTRANS("Automatic"),
+	NTRANS("Dense"),
+	NTRANS("Sparse")
+	};
+
+//Grids with more voxels than this use sparse storage, if automatic.
+// Sparse storage costs more per occupied voxel, but needs none
+// for empty space, which is most of the bounding box for a tip
+const size_t AUTO_SPARSE_MIN_VOXELS=1<<24;
+
 const char *VOXELISE_SLICE_INTERP_STRING[]={
 	NTRANS("None"),
 	NTRANS("Linear")
@@ -143,10 +164,48 @@ int countPoints(Voxels<float> &v, const std::vector<IonHit> &points,
 				bool noWrap)
 {
 
+	size_t binCount[3];
+	v.getSize(binCount[0],binCount[1],binCount[2]);
+	const size_t nVox=v.getSize();
+
+	//Bin the points in blocks, so we can check for abort between them.
+	// How to count is chosen once, for all the points
+	const unsigned int strategy=v.countStrategy(points.size());
+	std::vector<unsigned int> threadCounts;
+	std::vector<size_t> offsets(std::min(points.size(),COUNT_BLOCK_SIZE));
+	for(size_t start=0; start<points.size(); start+=COUNT_BLOCK_SIZE)
+	{
+		if(*Filter::wantAbort)
+			return 1;
+
+		const size_t n=std::min(COUNT_BLOCK_SIZE,points.size()-start);
+#pragma omp parallel for if(n >= COUNT_PARALLEL_MIN)
+		for (size_t ui=0; ui<n; ui++)
+		{
+			size_t x,y,z;
+			v.getIndexWithUpper(x,y,z,points[start+ui].getPos());
+			//Ensure it lies within the dataset
+			if (x < binCount[0] && y < binCount[1] && z< binCount[2])
+				offsets[ui]=v.getOffset(x,y,z);
+			else
+				offsets[ui]=nVox;
+		}
+
+		v.countOffsets(&offsets[0],n,noWrap,strategy,threadCounts);
+	}
+	v.addThreadCounts(threadCounts,noWrap);
+	return 0;
+}
+
+//Sparse counterpart to the above
+int countPoints(SparseVoxels &v, const std::vector<IonHit> &points, 
+				bool noWrap)
+{
 	size_t x,y,z;
 	size_t binCount[3];
 	v.getSize(binCount[0],binCount[1],binCount[2]);
 
+	openvdb::FloatGrid::Accessor acc=v.getGrid()->getAccessor();
 	unsigned int downSample=MAX_CALLBACK;
 	for (size_t ui=0; ui<points.size(); ui++)
 	{
@@ -160,24 +219,54 @@ int countPoints(Voxels<float> &v, const std::vector<IonHit> &points,
 		//Ensure it lies within the dataset
 		if (x < binCount[0] && y < binCount[1] && z< binCount[2])
 		{
-			{
-				float value;
-				value=v.getData(x,y,z)+1.0f;
-
-				ASSERT(value >= 0.0f);
-				//Prevent wrap-around errors
-				if (noWrap) {
-					if (value > v.getData(x,y,z))
-						v.setData(x,y,z,value);
-				} else {
-					v.setData(x,y,z,value);
-				}
-			}
+			openvdb::Coord ijk(x,y,z);
+			float oldValue=acc.getValue(ijk);
+			float value=oldValue+1.0f;
+
+			ASSERT(value >= 0.0f);
+			//Prevent wrap-around errors
+			if (!noWrap || value > oldValue)
+				acc.setValue(ijk,value);
 		}
 	}
 	return 0;
 }
 
+//Apply the selected smoothing filter. Returns false if aborted
+static bool filterVoxels(Voxels<float> &v, unsigned int mode, float stdev, float ratio)
+{
+	switch(mode)
+	{
+		case VOXELISE_FILTERTYPE_NONE:
+			break;
+		case VOXELISE_FILTERTYPE_GAUSS:
+			v.isotropicGaussianSmooth(stdev,ratio);
+			break;
+		case VOXELISE_FILTERTYPE_LAPLACE:
+			v.laplaceOfGaussian(stdev,ratio);
+			break;
+		default:
+			ASSERT(false);
+	}
+	return true;
+}
+
+static bool filterVoxels(SparseVoxels &v, unsigned int mode, float stdev, float ratio)
+{
+	switch(mode)
+	{
+		case VOXELISE_FILTERTYPE_NONE:
+			return true;
+		case VOXELISE_FILTERTYPE_GAUSS:
+			return v.isotropicGaussianSmooth(stdev,ratio,*Filter::wantAbort);
+		case VOXELISE_FILTERTYPE_LAPLACE:
+			return v.laplaceOfGaussian(stdev,ratio,*Filter::wantAbort);
+		default:
+			ASSERT(false);
+	}
+	return true;
+}
+
 // == Voxels filter ==
 VoxeliseFilter::VoxeliseFilter() 
 : fixedWidth(false), normaliseType(VOXELISE_NORMALISETYPE_NONE)
@@ -224,6 +313,7 @@ VoxeliseFilter::VoxeliseFilter()
 
 	sliceInterpolate=VOX_INTERP_NONE;
 	sliceAxis=0;
+	storageMode=VOXELISE_STORAGE_AUTO;
 	sliceOffset=0.5;
 	showColourBar=false;
 
@@ -290,6 +380,7 @@ Filter *VoxeliseFilter::cloneUncached() const
 	p->sliceInterpolate = sliceInterpolate;
 	p->sliceAxis = sliceAxis;
 	p->sliceOffset = sliceOffset;
+	p->storageMode = storageMode;
 
 	p->cache=cache;
 	p->cacheOK=false;
@@ -300,6 +391,7 @@ Filter *VoxeliseFilter::cloneUncached() const
 void VoxeliseFilter::clearCache() 
 {
 	voxelCache.clear();
+	sparseCache=SparseVoxels();
 	Filter::clearCache();
 }
 
@@ -671,8 +763,9 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 				return 0;
 			}
 
-			Voxels<float> voxelData;
-			if(!voxelCache.getSize())
+			//Rebuild the voxels, if we have no cached copy
+			bool sparse;
+			if(!voxelCache.getSize() && !sparseCache.getSize())
 			{
 				Point3D minP,maxP;
 
@@ -707,143 +800,48 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 				//Disallow empty bounding boxes (ie, produce no output)
 				if(minP == maxP)
 					return 0;
-	
-				//Rebuild the voxels from the point data
-				Voxels<float> vsDenom;
-				voxelData.init(nBins[0], nBins[1], nBins[2], bc);
-				voxelData.fill(0);
-		
-				if (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL ||
-					normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL) {
-					//Check we actually have incoming data
-					ASSERT(rsdIncoming);
-					vsDenom.init(nBins[0], nBins[1], nBins[2], bc);
-					vsDenom.fill(0);
-				}
 
-				const IonStreamData *is;
-				if(rsdIncoming)
-				{
+				sparse=useSparseStorage(nBins[0]*nBins[1]*nBins[2]);
 
-					for (size_t i = 0; i < dataIn.size(); i++) 
-					{
-				
-						//Check for ion stream types. Don't use anything else in counting
-						if (dataIn[i]->getStreamType() != STREAM_TYPE_IONS) continue;
-				
-						is= (const IonStreamData *)dataIn[i];
-
-				
-						//Count the numerator ions	
-						if(is->data.size())
-						{
-							//Check what Ion type this stream belongs to. Assume all ions
-							//in the stream belong to the same group
-							unsigned int ionID;
-							ionID = getIonstreamIonID(is,rsdIncoming->rangeFile);
-
-							bool thisIonEnabled;
-							if(ionID!=(unsigned int)-1)
-								thisIonEnabled=enabledIons[0][ionID];
-							else
-								thisIonEnabled=false;
-
-							if(thisIonEnabled)
-							{
-								countPoints(voxelData,is->data,true);
-							}
-						}
-			
-						//If the user requests normalisation, compute the denominator dataset
-						if (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL) {
-							if(is->data.size())
-							{
-								//Check what Ion type this stream belongs to. Assume all ions
-								//in the stream belong to the same group
-								unsigned int ionID;
-								ionID = rsdIncoming->rangeFile->getIonID(is->data[0].getMassToCharge());
-
-								bool thisIonEnabled;
-								if(ionID!=(unsigned int)-1)
-									thisIonEnabled=enabledIons[1][ionID];
-								else
-									thisIonEnabled=false;
-
-								if(thisIonEnabled)
-									countPoints(vsDenom,is->data,true);
-							}
-						} else if (normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)
-						{
-							countPoints(vsDenom,is->data,true);
-						}
-
-						if(*Filter::wantAbort)
-							return VOXELISE_ABORT_ERR;
-					}
-		
-					//Perform normalsiation	
-					if (normaliseType == VOXELISE_NORMALISETYPE_VOLUME)
-						voxelData.calculateDensity();
-					else if (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL ||
-							 normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)
-						voxelData /= vsDenom;
-				}
+				unsigned int errCode;
+				if(sparse)
+					errCode=buildVoxels(dataIn,bc,sparseCache);
 				else
-				{
-					//No range data.  Just count
-					for (size_t i = 0; i < dataIn.size(); i++) 
-					{
-				
-						if(dataIn[i]->getStreamType() == STREAM_TYPE_IONS)
-						{
-							is= (const IonStreamData *)dataIn[i];
-
-							countPoints(voxelData,is->data,true);
-					
-							if(*Filter::wantAbort)
-								return VOXELISE_ABORT_ERR;
-
-						}
-					}
-					ASSERT(normaliseType != VOXELISE_NORMALISETYPE_COUNT2INVOXEL
-							&& normaliseType!=VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL);
-					if (normaliseType == VOXELISE_NORMALISETYPE_VOLUME)
-						voxelData.calculateDensity();
-				}	
-
-				vsDenom.clear();
+					errCode=buildVoxels(dataIn,bc,voxelCache);
 
-
-				//Perform voxel filtering
-				switch(filterMode)
+				if(errCode)
 				{
-					case VOXELISE_FILTERTYPE_NONE:
-						break;
-					case VOXELISE_FILTERTYPE_GAUSS:
-					{	
-						voxelData.isotropicGaussianSmooth(gaussDev,filterRatio);
-						break;
-					}
-					case VOXELISE_FILTERTYPE_LAPLACE:
-					{
-						voxelData.laplaceOfGaussian(gaussDev,filterRatio);
-						break;
-					}
-					default:
-						ASSERT(false);
+					voxelCache.clear();
+					sparseCache=SparseVoxels();
+					return errCode;
 				}
-	
-				voxelCache=voxelData;
 			}
 			else
+				sparse=sparseCache.getSize();
+
+			if(sparse)
 			{
-				//Use the cached value
-				voxelData=voxelCache;
+				//Report the saving over dense storage
+				string sActive,sMem,sDenseMem;
+				stream_cast(sActive,sparseCache.numActive());
+				stream_cast(sMem,sparseCache.getMemUsage()/(1024*1024));
+				stream_cast(sDenseMem,sparseCache.getSize()*sizeof(float)/(1024*1024));
+				consoleOutput.push_back(std::string(TRANS("Sparse voxels, occupied: ")) + sActive +
+					TRANS(", memory (MB): ") + sMem + TRANS(", dense would need (MB): ") + sDenseMem);
 			}
 	
 			float min,max;
-			voxelData.minMax(min,max);
-
+			Point3D p1,p2;
+			if(sparse)
+			{
+				sparseCache.minMax(min,max);
+				sparseCache.getBounds(p1,p2);
+			}
+			else
+			{
+				voxelCache.minMax(min,max);
+				voxelCache.getBounds(p1,p2);
+			}
 
 			string sMin,sMax;
 			stream_cast(sMin,min);
@@ -853,11 +851,7 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 
 
 			//Update the bounding cube
-			{
-			Point3D p1,p2;
-			voxelData.getBounds(p1,p2);
 			lastBounds.setBounds(p1,p2);
-			}
 
 
 		switch(representation)
@@ -865,28 +859,49 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 
 			case VOXEL_REPRESENT_POINTCLOUD:
 			{
-				VoxelStreamData *vs = new VoxelStreamData();
-				vs->parent=this;
-				std::swap(*(vs->data),voxelData);
-				vs->representationType= representation;
-				vs->splatSize = splatSize;
-				vs->isoLevel=isoLevel;
-				vs->r=rgba.r();
-				vs->g=rgba.g();
-				vs->b=rgba.b();
-				vs->a=rgba.a();
+				FilterStreamData *outData;
+				if(sparse)
+				{
+					OpenVDBGridStreamData *gs = new OpenVDBGridStreamData();
+					gs->parent=this;
+					gs->grid = sparseCache.getGrid()->deepCopy();
+					gs->voxelsize = sparseCache.getPitch()[0];
+					sparseCache.getSize(gs->binCount[0],gs->binCount[1],gs->binCount[2]);
+					gs->representationType= representation;
+					gs->splatSize = splatSize;
+					gs->isovalue=isoLevel;
+					gs->r=rgba.r();
+					gs->g=rgba.g();
+					gs->b=rgba.b();
+					gs->a=rgba.a();
+					outData=gs;
+				}
+				else
+				{
+					VoxelStreamData *vs = new VoxelStreamData();
+					vs->parent=this;
+					*(vs->data)=voxelCache;
+					vs->representationType= representation;
+					vs->splatSize = splatSize;
+					vs->isoLevel=isoLevel;
+					vs->r=rgba.r();
+					vs->g=rgba.g();
+					vs->b=rgba.b();
+					vs->a=rgba.a();
+					outData=vs;
+				}
 
 				if(cache)
 				{
-					vs->cached=1;
+					outData->cached=1;
 					cacheOK=true;
-					filterOutputs.push_back(vs);
+					filterOutputs.push_back(outData);
 				}
 				else
-					vs->cached=0;
+					outData->cached=0;
 				
 				//Store the voxels on the output
-				getOut.push_back(vs);
+				getOut.push_back(outData);
 				break;
 			}
 			case VOXEL_REPRESENT_AXIAL_SLICE:
@@ -898,8 +913,16 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 				{
 				DrawTexturedQuad *dq = new DrawTexturedQuad();
 
-				getTexturedSlice(voxelData,sliceAxis,sliceOffset,
+				if(sparse)
+				{
+					getTexturedSlice(sparseCache,sliceAxis,sliceOffset,
+							sliceInterpolate,minV,maxV,*dq);
+				}
+				else
+				{
+					getTexturedSlice(voxelCache,sliceAxis,sliceOffset,
 							sliceInterpolate,minV,maxV,*dq);
+				}
 
 				dq->setColour(1,1,1,rgba.a());
 				dq->canSelect=true;
@@ -941,6 +964,189 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 
 
 
+bool VoxeliseFilter::useSparseStorage(size_t nVoxels) const
+{
+	switch(storageMode)
+	{
+		case VOXELISE_STORAGE_DENSE:
+			return false;
+		case VOXELISE_STORAGE_SPARSE:
+			return true;
+		case VOXELISE_STORAGE_AUTO:
+			return nVoxels > AUTO_SPARSE_MIN_VOXELS;
+		default:
+			ASSERT(false);
+	}
+	return false;
+}
+
+//Set the voxels to the given size, with all voxels zero
+static void initVoxels(Voxels<float> &v, const unsigned long long *nBins, 
+						const BoundCube &bounds)
+{
+	v.init(nBins[0], nBins[1], nBins[2], bounds);
+	v.fill(0);
+}
+
+static void initVoxels(SparseVoxels &v, const unsigned long long *nBins, 
+						const BoundCube &bounds)
+{
+	//Sparse voxels read as zero until set
+	v.init(nBins[0], nBins[1], nBins[2], bounds);
+}
+
+template<class VOXEL_T>
+unsigned int VoxeliseFilter::buildVoxels(const std::vector<const FilterStreamData *> &dataIn,
+				const BoundCube &bounds, VOXEL_T &voxelData) const
+{
+	VOXEL_T vsDenom;
+	initVoxels(voxelData,nBins,bounds);
+
+	if (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL ||
+		normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL) {
+		//Check we actually have incoming data
+		ASSERT(rsdIncoming);
+		initVoxels(vsDenom,nBins,bounds);
+	}
+
+	const IonStreamData *is;
+	if(rsdIncoming)
+	{
+
+		for (size_t i = 0; i < dataIn.size(); i++) 
+		{
+	
+			//Check for ion stream types. Don't use anything else in counting
+			if (dataIn[i]->getStreamType() != STREAM_TYPE_IONS) continue;
+	
+			is= (const IonStreamData *)dataIn[i];
+
+	
+			//Count the numerator ions	
+			if(is->data.size())
+			{
+				//Check what Ion type this stream belongs to. Assume all ions
+				//in the stream belong to the same group
+				unsigned int ionID;
+				ionID = getIonstreamIonID(is,rsdIncoming->rangeFile);
+
+				bool thisIonEnabled;
+				if(ionID!=(unsigned int)-1)
+					thisIonEnabled=enabledIons[0][ionID];
+				else
+					thisIonEnabled=false;
+
+				if(thisIonEnabled)
+				{
+					countPoints(voxelData,is->data,true);
+				}
+			}
+
+			//If the user requests normalisation, compute the denominator dataset
+			if (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL) {
+				if(is->data.size())
+				{
+					//Check what Ion type this stream belongs to. Assume all ions
+					//in the stream belong to the same group
+					unsigned int ionID;
+					ionID = rsdIncoming->rangeFile->getIonID(is->data[0].getMassToCharge());
+
+					bool thisIonEnabled;
+					if(ionID!=(unsigned int)-1)
+						thisIonEnabled=enabledIons[1][ionID];
+					else
+						thisIonEnabled=false;
+
+					if(thisIonEnabled)
+						countPoints(vsDenom,is->data,true);
+				}
+			} else if (normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)
+			{
+				countPoints(vsDenom,is->data,true);
+			}
+
+			if(*Filter::wantAbort)
+				return VOXELISE_ABORT_ERR;
+		}
+
+		//Perform normalsiation	
+		if (normaliseType == VOXELISE_NORMALISETYPE_VOLUME)
+			voxelData.calculateDensity();
+		else if (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL ||
+				 normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)
+			voxelData /= vsDenom;
+	}
+	else
+	{
+		//No range data.  Just count
+		for (size_t i = 0; i < dataIn.size(); i++) 
+		{
+	
+			if(dataIn[i]->getStreamType() == STREAM_TYPE_IONS)
+			{
+				is= (const IonStreamData *)dataIn[i];
+
+				countPoints(voxelData,is->data,true);
+		
+				if(*Filter::wantAbort)
+					return VOXELISE_ABORT_ERR;
+
+			}
+		}
+		ASSERT(normaliseType != VOXELISE_NORMALISETYPE_COUNT2INVOXEL
+				&& normaliseType!=VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL);
+		if (normaliseType == VOXELISE_NORMALISETYPE_VOLUME)
+			voxelData.calculateDensity();
+	}	
+
+	vsDenom.clear();
+
+	//Perform voxel filtering
+	if(!filterVoxels(voxelData,filterMode,gaussDev,filterRatio))
+		return VOXELISE_ABORT_ERR;
+
+	return 0;
+}
+
+void VoxeliseFilter::updateCachedAppearance()
+{
+	if(!cacheOK)
+		return;
+
+	for(unsigned int ui=0;ui<filterOutputs.size();ui++)
+	{
+		switch(filterOutputs[ui]->getStreamType())
+		{
+			case STREAM_TYPE_VOXEL:
+			{
+				VoxelStreamData *d;
+				d=(VoxelStreamData*)filterOutputs[ui];
+				d->splatSize=splatSize;
+				d->isoLevel=isoLevel;
+				d->r=rgba.r();
+				d->g=rgba.g();
+				d->b=rgba.b();
+				d->a=rgba.a();
+				break;
+			}
+			case STREAM_TYPE_OPENVDBGRID:
+			{
+				OpenVDBGridStreamData *vdbgs;
+				vdbgs = (OpenVDBGridStreamData*)filterOutputs[ui];
+				vdbgs->splatSize=splatSize;
+				vdbgs->isovalue = isoLevel;
+				vdbgs->r=rgba.r();
+				vdbgs->g=rgba.g();
+				vdbgs->b=rgba.b();
+				vdbgs->a=rgba.a();
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+
 void VoxeliseFilter::setPropFromBinding(const SelectionBinding &b)
 {
 	switch(b.getID())
@@ -1090,6 +1296,21 @@ void VoxeliseFilter::getProperties(FilterPropGroup &propertyList) const
 	p.helpText=TRANS("Method to use to normalise scalar value in each voxel");
 	p.key=KEY_NORMALISE_TYPE;
 	propertyList.addProperty(p,curGroup);
+
+	if(representation == VOXEL_REPRESENT_POINTCLOUD ||
+		representation == VOXEL_REPRESENT_AXIAL_SLICE)
+	{
+		choices.clear();
+		for(unsigned int ui=0;ui<VOXELISE_STORAGE_MAX;ui++)
+			choices.push_back(make_pair(ui,TRANS(VOXELISE_STORAGE_STRING[ui])));
+		
+		p.name=TRANS("Storage");
+		p.data=choiceString(choices,storageMode);
+		p.type=PROPERTY_TYPE_CHOICE;
+		p.helpText=TRANS("Sparse storage only holds occupied voxels, using less memory for large, mostly empty grids. Automatic uses sparse storage for large grids");
+		p.key=KEY_STORAGE_MODE;
+		propertyList.addProperty(p,curGroup);
+	}
 	propertyList.setGroupTitle(curGroup,TRANS("Computation"));
 
 	curGroup++;
@@ -1489,15 +1710,7 @@ bool VoxeliseFilter::setProperty(unsigned int key,
 				//Go in and manually adjust the cached
 				//entries to have the new value, rather
 				//than doing a full recomputation
-				if(cacheOK)
-				{
-					for(unsigned int ui=0;ui<filterOutputs.size();ui++)
-					{
-						VoxelStreamData *d;
-						d=(VoxelStreamData*)filterOutputs[ui];
-						d->splatSize=splatSize;
-					}
-				}
+				updateCachedAppearance();
 
 			}
 			break;
@@ -1515,15 +1728,7 @@ bool VoxeliseFilter::setProperty(unsigned int key,
 			//Go in and manually adjust the cached
 			//entries to have the new value, rather
 			//than doing a full recomputation
-			if(cacheOK)
-			{
-				for(unsigned int ui=0;ui<filterOutputs.size();ui++)
-				{	
-					OpenVDBGridStreamData *vdbgs;
-					vdbgs = (OpenVDBGridStreamData*)filterOutputs[ui];
-					vdbgs->a = rgba.a();
-				}
-			}
+			updateCachedAppearance();
 			break;
 		}
 		case KEY_ISOLEVEL:
@@ -1538,15 +1743,7 @@ bool VoxeliseFilter::setProperty(unsigned int key,
 			//Go in and manually adjust the cached
 			//entries to have the new value, rather
 			//than doing a full recomputation
-			if(cacheOK)
-			{
-				for(unsigned int ui=0;ui<filterOutputs.size();ui++)
-				{	
-					OpenVDBGridStreamData *vdbgs;
-					vdbgs = (OpenVDBGridStreamData*)filterOutputs[ui];
-					vdbgs->isovalue = isoLevel;
-				}
-			}
+			updateCachedAppearance();
 			break;
 		}
 		case KEY_COLOUR:
@@ -1565,33 +1762,7 @@ bool VoxeliseFilter::setProperty(unsigned int key,
 			//Go in and manually adjust the cached
 			//entries to have the new value, rather
 			//than doing a full recomputation
-			if(cacheOK)
-			{
-				for(unsigned int ui=0;ui<filterOutputs.size();ui++)
-				{
-					switch(representation)
-					{
-						case VOXEL_REPRESENT_AXIAL_SLICE:
-						case VOXEL_REPRESENT_POINTCLOUD:
-						{
-
-							VoxelStreamData *d;
-							d=(VoxelStreamData*)filterOutputs[ui];
-							d->r=rgba.r();
-							d->g=rgba.g();
-							d->b=rgba.b();
-						}
-						case VOXEL_REPRESENT_ISOSURF:
-						{
-							OpenVDBGridStreamData *vdbgs;
-							vdbgs = (OpenVDBGridStreamData*)filterOutputs[ui];
-							vdbgs->r=rgba.r();
-							vdbgs->g=rgba.g();
-							vdbgs->b=rgba.b();
-						}
-					}
-				}
-			}
+			updateCachedAppearance();
 			break;
 		}
 		case KEY_VOXEL_REPRESENTATION_MODE:
@@ -1602,38 +1773,15 @@ bool VoxeliseFilter::setProperty(unsigned int key,
 			if (i == VOXEL_REPRESENT_END)
 				return false;
 			needUpdate=true;
-			//Go in and manually adjust the cached
-			//entries to have the new value, rather
-			//than doing a full recomputation
 
-			//TODO: Can we instead of caching the Stream, simply cache the voxel data?
+			//Point clouds and slices are built from the same voxels,
+			// so switching between them only needs the output rebuilt.
+			// The voxel caches are kept
+			bool keepVoxels = VOXEL_REPRESENT_KEEPCACHE[i] && 
+					VOXEL_REPRESENT_KEEPCACHE[representation];
 			representation=i;
-			if(cacheOK && (VOXEL_REPRESENT_KEEPCACHE[i] && VOXEL_REPRESENT_KEEPCACHE[representation]))
-			{
-				for(unsigned int ui=0;ui<filterOutputs.size();ui++)
-				{
-
-					switch(representation)
-					{
-						case VOXEL_REPRESENT_AXIAL_SLICE:
-						case VOXEL_REPRESENT_POINTCLOUD:
-						{
-							VoxelStreamData *d;
-							d=(VoxelStreamData*)filterOutputs[ui];
-							d->representationType=representation;
-
-						}
-
-						case VOXEL_REPRESENT_ISOSURF:
-						{
-							OpenVDBGridStreamData *vdbgs;
-							vdbgs = (OpenVDBGridStreamData*)filterOutputs[ui];
-							vdbgs->representationType=representation;
-						}	
-					}
-
-				}
-			}
+			if(keepVoxels)
+				Filter::clearCache();
 			else
 			{
 				clearCache();
@@ -1642,6 +1790,24 @@ bool VoxeliseFilter::setProperty(unsigned int key,
 			
 			break;
 		}
+		case KEY_STORAGE_MODE:
+		{
+			unsigned int i;
+			for (i = 0; i < VOXELISE_STORAGE_MAX; i++)
+			{
+				if (value == TRANS(VOXELISE_STORAGE_STRING[i])) 
+					break;
+			}
+			if (i == VOXELISE_STORAGE_MAX)
+				return false;
+			if(i!=storageMode)
+			{
+				needUpdate=true;
+				storageMode=i;
+				clearCache();
+			}
+			break;
+		}
 		case KEY_ENABLE_NUMERATOR:
 		{
 			bool b;
@@ -1968,6 +2134,7 @@ bool VoxeliseFilter::writeState(std::ostream &f,unsigned int format, unsigned in
 			f << tabs(depth+1) << "<isovalue value=\""<<isoLevel << "\"/>" << endl;
 			f << tabs(depth+1) << "<colour r=\"" <<  rgba.r()<< "\" g=\"" << rgba.g() << "\" b=\"" <<rgba.b()
 				<< "\" a=\"" << rgba.a() << "\"/>" <<endl;
+			f << tabs(depth+1) << "<storage value=\""<<storageMode << "\"/>" << endl;
 
 			f << tabs(depth+1) << "<axialslice>" << endl;
 			f << tabs(depth+2) << "<offset value=\""<<sliceOffset<< "\"/>" << endl;
@@ -2170,6 +2337,18 @@ bool VoxeliseFilter::readState(xmlNodePtr &nodePtr, const std::string &stateFile
 
 	//====
 
+	//Retrieve storage mode, if present (older files do not have it)
+	{
+	xmlNodePtr tmpNode=nodePtr;
+	if(XMLGetNextElemAttrib(tmpNode,storageMode,"storage","value"))
+	{
+		if(storageMode >= VOXELISE_STORAGE_MAX)
+			return false;
+	}
+	else
+		storageMode=VOXELISE_STORAGE_AUTO;
+	}
+
 	//try to retrieve slice, where possible
 	if(!XMLHelpFwdToElem(nodePtr,"axialslice"))
 	{
@@ -2240,7 +2419,8 @@ unsigned int VoxeliseFilter::getRefreshEmitMask() const
 		case VOXEL_REPRESENT_POINTCLOUD:
 		case VOXEL_REPRESENT_AXIAL_SLICE:
 			{
-				return STREAM_TYPE_VOXEL | STREAM_TYPE_DRAW;
+				//Sparse point clouds are emitted as grids
+				return STREAM_TYPE_VOXEL | STREAM_TYPE_OPENVDBGRID | STREAM_TYPE_DRAW;
 			}
 	}
 }
@@ -2262,7 +2442,8 @@ unsigned int VoxeliseFilter::getRefreshUseMask() const
 	}
 }
 
-void VoxeliseFilter::getTexturedSlice(const Voxels<float> &v, 
+template<class VOXEL_T>
+void VoxeliseFilter::getTexturedSlice(const VOXEL_T &v, 
 			size_t axis,float offset, size_t interpolateMode,
 			float &minV,float &maxV,DrawTexturedQuad &texQ) const
 {
@@ -2404,11 +2585,13 @@ bool voxelSingleCountTest()
 	TEST(!f->refresh(streamIn,streamOut,p),"Refresh error code");
 	delete f;
 
-	TEST(streamOut.size() == 1,"stream count");
-	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_VOXEL,"Stream type");
+	//Ions are passed through, followed by the voxels
+	TEST(streamOut.size() == 2,"stream count");
+	TEST(streamOut[0] == ionData,"Ion passthrough");
+	TEST(streamOut[1]->getStreamType() == STREAM_TYPE_VOXEL,"Stream type");
 
 
-	const VoxelStreamData *v= (const VoxelStreamData*)streamOut[0];
+	const VoxelStreamData *v= (const VoxelStreamData*)streamOut[1];
 
 	TEST(v->data->max() <=numIons,
 			"voxel max less than input stream")
@@ -2422,7 +2605,7 @@ bool voxelSingleCountTest()
 		sqrtf(std::numeric_limits<float>::epsilon()),"voxel counting all input ions ");
 
 	delete ionData;
-	delete streamOut[0];
+	delete v;
 
 	return true;
 }
@@ -2501,12 +2684,17 @@ bool voxelMultiCountTest()
 	ProgressData p;
 	TEST(!f->refresh(streamIn,streamOut,p),"Refresh error code");
 	delete f;
+	//Ions and ranges are passed through, followed by the voxels
+	TEST(streamOut.size() == streamIn.size()+1,"stream count");
+	for(unsigned int ui=0;ui<streamIn.size();ui++)
+	{
+		TEST(streamOut[ui] == streamIn[ui],"Input passthrough");
+	}
+	TEST(streamOut.back()->getStreamType() == STREAM_TYPE_VOXEL,"Stream type");
 	for(unsigned int ui=0;ui<MAX_NUM_RANGES;ui++)
 		delete streamIn[ui];
-	TEST(streamOut.size() == 2,"stream count");
-	TEST(streamOut[1]->getStreamType() == STREAM_TYPE_VOXEL,"Stream type");
 	
-	const VoxelStreamData *v= (const VoxelStreamData*)streamOut[1];
+	const VoxelStreamData *v= (const VoxelStreamData*)streamOut.back();
 
 	TEST(v->data->max() <=1.0f,
 			"voxel max less than input stream")
@@ -2530,6 +2718,100 @@ bool voxelMultiCountTest()
 }
 
 
+bool voxelSparseStorageTest()
+{
+	//Check that sparse storage gives the same voxels as dense storage
+	
+	vector<IonHit> ionVec;
+	ionVec.resize(5);
+	ionVec[0].setPos(Point3D(0.1,0.1,0.1));
+	ionVec[1].setPos(Point3D(0.1,0.0,0.1));
+	ionVec[2].setPos(Point3D(0.0,0.1,0.1));
+	ionVec[3].setPos(Point3D(0.1,0.1,0.0));
+	ionVec[4].setPos(Point3D(0.0,0.1,0.0));
+	for(unsigned int ui=0;ui<ionVec.size();ui++)
+		ionVec[ui].setMassToCharge(1);
+
+	IonStreamData *ionData = new IonStreamData;
+	std::swap(ionData->data,ionVec);
+
+	vector<const FilterStreamData*> streamIn,streamOut[2];
+	streamIn.push_back(ionData);
+
+	//Voxel output from each run
+	const FilterStreamData *voxOut[2];
+
+	const unsigned int STORAGE[2] = { VOXELISE_STORAGE_DENSE, VOXELISE_STORAGE_SPARSE};
+	for(unsigned int ui=0;ui<2;ui++)
+	{
+		VoxeliseFilter *f = new VoxeliseFilter;
+		f->setCaching(false);
+
+		bool needUpdate;
+		TEST(f->setProperty(KEY_NBINSX,"6",needUpdate),"num bins x");
+		TEST(f->setProperty(KEY_NBINSY,"5",needUpdate),"num bins y");
+		TEST(f->setProperty(KEY_NBINSZ,"4",needUpdate),"num bins z");
+		TEST(f->setProperty(KEY_FILTER_MODE,
+			TRANS(VOXELISE_FILTER_TYPE_STRING[VOXELISE_FILTERTYPE_GAUSS]),needUpdate),
+					"Set filter mode");
+		TEST(f->setProperty(KEY_VOXEL_REPRESENTATION_MODE,
+			TRANS(REPRESENTATION_TYPE_STRING[VOXEL_REPRESENT_POINTCLOUD]),needUpdate),
+					"Set representation");
+		TEST(f->setProperty(KEY_STORAGE_MODE,
+			TRANS(VOXELISE_STORAGE_STRING[STORAGE[ui]]),needUpdate),"Set storage");
+
+		ProgressData p;
+		TEST(!f->refresh(streamIn,streamOut[ui],p),"Refresh error code");
+		delete f;
+
+		//Ions are passed through, followed by the voxels
+		TEST(streamOut[ui].size() == 2,"stream count");
+		TEST(streamOut[ui][0] == ionData,"Ion passthrough");
+		voxOut[ui]=streamOut[ui][1];
+	}
+
+	TEST(voxOut[0]->getStreamType() == STREAM_TYPE_VOXEL,"Dense stream type");
+	TEST(voxOut[1]->getStreamType() == STREAM_TYPE_OPENVDBGRID,"Sparse stream type");
+
+	const VoxelStreamData *v= (const VoxelStreamData*)voxOut[0];
+	const OpenVDBGridStreamData *g= (const OpenVDBGridStreamData*)voxOut[1];
+	TEST(g->representationType == VOXEL_REPRESENT_POINTCLOUD,"Sparse representation");
+
+	size_t nx,ny,nz;
+	v->data->getSize(nx,ny,nz);
+	openvdb::FloatGrid::ConstAccessor acc=g->grid->getConstAccessor();
+	for(size_t ui=0;ui<nx;ui++)
+	{
+		for(size_t uj=0;uj<ny;uj++)
+		{
+			for(size_t uk=0;uk<nz;uk++)
+			{
+				float denseV=v->data->getData(ui,uj,uk);
+				float sparseV=acc.getValue(openvdb::Coord(ui,uj,uk));
+				TEST(fabs(denseV-sparseV) < 1e-4f,"Sparse matches dense");
+			}
+		}
+	}
+
+	//Export spans every voxel, not just those holding data
+	Voxels<float> exported;
+	TEST(g->toDense(exported),"Sparse to dense");
+	size_t ex,ey,ez;
+	exported.getSize(ex,ey,ez);
+	TEST(ex == nx && ey == ny && ez == nz,"Sparse export size");
+	Point3D pMin[2],pMax[2];
+	exported.getBounds(pMin[0],pMax[0]);
+	v->data->getBounds(pMin[1],pMax[1]);
+	TEST(pMin[0].sqrDist(pMin[1]) < 1e-4f && pMax[0].sqrDist(pMax[1]) < 1e-4f,
+					"Sparse export bounds");
+
+	delete ionData;
+	delete voxOut[0];
+	delete voxOut[1];
+
+	return true;
+}
+
 bool VoxeliseFilter::runUnitTests()
 {
 
@@ -2539,6 +2821,9 @@ bool VoxeliseFilter::runUnitTests()
 	if(!voxelMultiCountTest())
 		return false;
 
+	if(!voxelSparseStorageTest())
+		return false;
+
 
 	return true;
 }
@@ -20,6 +20,7 @@
 #include "../filter.h"
 
 #include "common/voxels.h"
+#include "algorithms/sparseVoxels.h"
 
 #include "../../common/translation.h"
 
@@ -42,6 +43,11 @@ private:
 
 	//Cache to use for voxel info
 	Voxels<float> voxelCache;
+	//Cache to use for voxel info, if using sparse storage
+	SparseVoxels sparseCache;
+
+	//!Voxel storage to use for point cloud and slice output
+	unsigned int storageMode;
 
 	//!number of bins (if using fixed bins)
 	unsigned long long nBins[INDEX_LENGTH];
@@ -98,10 +104,24 @@ private:
 	float sliceOffset;
 
 	//Obtain a textured slice from the given voxel set
-	void getTexturedSlice(const Voxels<float> &f,
+	// (Voxels<float> or SparseVoxels)
+	template<class VOXEL_T>
+	void getTexturedSlice(const VOXEL_T &f,
 		size_t axis,float offset, size_t interpolateMode,
 		float &minV, float &maxV, DrawTexturedQuad &texQ) const;
 
+	//!True if the given number of voxels should be stored sparsely
+	bool useSparseStorage(size_t nVoxels) const;
+
+	//!Count, normalise and filter the input into the given voxel set
+	// (Voxels<float> or SparseVoxels). Returns 0 on success, or error code
+	template<class VOXEL_T>
+	unsigned int buildVoxels(const std::vector<const FilterStreamData *> &dataIn,
+					const BoundCube &bounds, VOXEL_T &voxelData) const;
+
+	//!Update the appearance of cached output to match the current settings
+	void updateCachedAppearance();
+
 	BoundCube lastBounds;
 
 	//Cache to use for vdbgrid info
@@ -20,6 +20,7 @@
 
 #include "filtertree.h"
 #include "filters/allFilter.h"
+#include "filters/geometryHelpers.h"
 
 #include "common/xmlHelper.h"
 #include "common/stringFuncs.h"
@@ -231,6 +232,86 @@ void popPointerStack(std::stack<vector<const FilterStreamData * > > &inDataStack
 	}
 }
 
+//Build the input for a filter, which may not be able to read selected
+// ions, or ions with a pending transform. The input streams may be cached
+// upstream, or shared with the filter's siblings, so are not modified;
+// instead the filter is given its own copies of any streams that it
+// cannot read. The copies are uncached, and are also recorded in "copies".
+// Returns false if out of memory
+bool materialiseInputs(const vector<const FilterStreamData *> &in,
+		const Filter *f, vector<const FilterStreamData *> &filterIn, 
+		vector<const FilterStreamData *> &copies)
+{
+	filterIn.resize(in.size());
+	for(size_t ui=0;ui<in.size();ui++)
+	{
+		filterIn[ui]=in[ui];
+		if(in[ui]->getStreamType() != STREAM_TYPE_IONS)
+			continue;
+
+		const IonStreamData *ions=(const IonStreamData*)in[ui];
+		if(!(ions->hasSelections() && !f->acceptsIonSelections()) &&
+			!(ions->hasPendingTransform() && !f->acceptsPendingTransforms()))
+			continue;
+
+		IonStreamData *copy=ions->cloneMaterialised();
+		if(!copy)
+			return false;
+		copies.push_back(copy);
+		filterIn[ui]=copy;
+	}
+
+	return true;
+}
+
+//Free the input copies made by materialiseInputs, except those that the
+// filter has passed through to its output. Those are now uncached output,
+// and are freed along with it
+void releaseInputCopies(const vector<const FilterStreamData *> &copies,
+		const vector<const FilterStreamData *> &out)
+{
+	for(size_t ui=0;ui<copies.size();ui++)
+	{
+		if(std::find(out.begin(),out.end(),copies[ui]) == out.end())
+			delete copies[ui];
+	}
+}
+
+//Replace any output ion streams that hold selections or pending 
+// transforms with materialised copies, so that the scene and exports see
+// plain ions. Streams passed through from the filter's input belong to
+// upstream filters, and are left alone. Returns false if out of memory
+bool materialiseOutputs(vector<const FilterStreamData *> &out,
+		const vector<const FilterStreamData *> &in)
+{
+	for(size_t ui=0;ui<out.size();ui++)
+	{
+		if(out[ui]->getStreamType() != STREAM_TYPE_IONS)
+			continue;
+
+		const IonStreamData *ions=(const IonStreamData*)out[ui];
+		if(!ions->needsMaterialise())
+			continue;
+
+		IonStreamData *copy=ions->cloneMaterialised();
+		if(!copy)
+			return false;
+
+		//A stream may be output more than once
+		for(size_t uj=ui;uj<out.size();uj++)
+		{
+			if(out[uj] == ions)
+				out[uj]=copy;
+		}
+
+		//Uncached streams made by this filter are no longer needed 
+		if(!ions->cached && std::find(in.begin(),in.end(),ions) == in.end())
+			delete ions;
+	}
+
+	return true;
+}
+
 FilterTree::FilterTree()
 {
 	maxCachePercent=DEFAULT_MAX_CACHE_PERCENT;
@@ -621,6 +702,44 @@ void FilterTree::getConsoleMessagesToNodes(std::vector<tree<Filter *>::iterator
 	}
 }
 
+//Approximate size in bytes of an ion stream, including any spatial 
+// indices that are held with it
+static size_t ionStreamBytes(const IonStreamData *d)
+{
+	size_t bytes=d->getNumBasicObjects()*sizeof(IonHit);
+	for(size_t ui=0;ui<d->spatialIndex.size();ui++)
+	{
+		if(d->spatialIndex[ui])
+			bytes+=d->spatialIndex[ui]->numBytes();
+	}
+	return bytes;
+}
+
+//Approximate size in bytes of the streams in data that were produced by
+// the given filter, for refresh tracing
+static size_t streamBytes(const vector<const FilterStreamData *> &data, const Filter *f)
+{
+	size_t bytes=0;
+	for(size_t ui=0;ui<data.size();ui++)
+	{
+		if(data[ui]->parent != f)
+			continue;
+
+		switch(data[ui]->getStreamType())
+		{
+			case STREAM_TYPE_IONS:
+				bytes+=ionStreamBytes((const IonStreamData*)data[ui]);
+				break;
+			case STREAM_TYPE_PLOT:
+				bytes+=data[ui]->getNumBasicObjects()*2*sizeof(float);
+				break;
+			default:
+				bytes+=data[ui]->getNumBasicObjects()*sizeof(float);
+		}
+	}
+	return bytes;
+}
+
 unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData, 
 		std::vector<SelectionDevice *> &devices,
 		vector<pair<const Filter* , string> > &consoleMessages,
@@ -641,6 +760,10 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 	if(!filters.size())
 		return 0;	
 
+	RefreshTrace *trace=curProg.getTrace();
+	if(trace)
+		trace->beginSpan("Refresh","tree");
+
 	//Destroy any caches that belong to monitored filters that need
 	//refreshing. Failing to do this can lead to filters being skipped
 	//during the refresh 
@@ -753,16 +876,8 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 							currentFilter->setCaching(false);
 							break;
 						case CACHE_DEPTH_FIRST:
-						{
-							float ramFreeForUse;
-							ramFreeForUse= maxCachePercent/(float)100.0f*getAvailRAM();
-
-							bool cache;
-							cache=((float)cacheBytes/(1024*1024) ) < ramFreeForUse;
-
-							currentFilter->setCaching( cache);
+							currentFilter->setCaching(fitsCacheBudget(cacheBytes));
 							break;
-						}
 					}
 				}
 				else
@@ -785,11 +900,23 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 			curProg.maxStep=curProg.step=1;
 			curProg.filterProgress=0;
 
+			if(trace)
+			{
+				trace->beginSpan(currentFilter->getUserString(),"filter");
+				trace->setCacheHit(currentFilter->haveCache());
+			}
+
+			//Filters that cannot handle selections or deferred transforms
+			// must see the final ion data
+			vector<const FilterStreamData *> filterIn,inputCopies;
+			if(!materialiseInputs(inDataStack.top(),currentFilter,filterIn,inputCopies))
+				errCode=FILTERTREE_REFRESH_ERR_MEM;
+
 			//Take the stack top, filter it and generate "curData"
 			try
 			{
-
-				errCode=currentFilter->refresh(inDataStack.top(),curData,curProg);
+				if(!errCode)
+					errCode=currentFilter->refresh(filterIn,curData,curProg);
 			}
 			catch(std::bad_alloc)
 			{
@@ -798,6 +925,11 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 				errCode=FILTERTREE_REFRESH_ERR_MEM;
 			}
 
+			if(errCode)
+				releaseInputCopies(inputCopies,vector<const FilterStreamData *>());
+			else
+				releaseInputCopies(inputCopies,curData);
+
 #ifdef DEBUG
 			//Perform sanity checks on filter output
 			checkRefreshValidity(curData,currentFilter);
@@ -808,10 +940,41 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 			
 			WARN( (curProg.filterProgress == 100 || errCode),progWarn.c_str());
 #endif
+			//Leaf output goes to the scene, which needs plain ions
+			if(!errCode && leafFilters.find(currentFilter) != leafFilters.end() &&
+				!materialiseOutputs(curData,filterIn))
+			{
+				WARN(false,"Memory exhausted materialising output");
+				errCode=FILTERTREE_REFRESH_ERR_MEM;
+			}
+
+			//Downstream filters may index large cached ion streams. Only
+			// allow this where the stream and its index fit in the cache budget
+			if(!errCode)
+			{
+				for(size_t ui=0;ui<curData.size();ui++)
+				{
+					if(curData[ui]->parent != currentFilter || !curData[ui]->cached ||
+						curData[ui]->getStreamType() != STREAM_TYPE_IONS)
+						continue;
+
+					const IonStreamData *d=(const IonStreamData*)curData[ui];
+					d->indexInBudget=fitsCacheBudget(d->getNumBasicObjects()*sizeof(IonHit) + 
+						IonSpatialIndex::estimateBytes(d->getNumBasicObjects()));
+				}
+			}
+
 			//Ensure that (1) yield is called, regardless of what filter does
 			//(2) yield is called after 100% update	
 			curProg.filterProgress=100;	
 
+			if(trace)
+			{
+				trace->endStep();
+				trace->setBytesOut(streamBytes(curData,currentFilter));
+				trace->endSpan();
+			}
+
 
 			vector<SelectionDevice *> curDevices;
 			//Retrieve the user interaction "devices", and send them to the scene
@@ -859,6 +1022,8 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 					if(!data->cached)
 						delete data;
 				}
+				if(trace)
+					trace->endSpan();
 				if(abortRefresh)
 					return FILTER_ERR_ABORT;
 				return errCode;
@@ -934,6 +1099,9 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 	}
 	//======
 
+	if(trace)
+		trace->endSpan();
+
 	return 0;
 }
 
@@ -1421,7 +1589,7 @@ void FilterTree::checkRefreshValidity(const vector< const FilterStreamData *> &c
 				const IonStreamData *ionData;
 				ionData=((const IonStreamData *)f);
 
-				ASSERT(ionData->data.size());
+				ASSERT(ionData->getNumBasicObjects());
 				break;
 			}
 			default:
@@ -1481,6 +1649,14 @@ void FilterTree::checkRefreshValidity(const vector< const FilterStreamData *> &c
 	//Voxel output streams should only have known types
 	for(size_t ui=0; ui<curData.size(); ui++)
 	{
+		if(curData[ui]->getStreamType() == STREAM_TYPE_OPENVDBGRID)
+		{
+			const OpenVDBGridStreamData *p;
+			p =(const OpenVDBGridStreamData*)curData[ui];
+			ASSERT(p->representationType< VOXEL_REPRESENT_END);
+			continue;
+		}
+
 		if(curData[ui]->getStreamType() != STREAM_TYPE_VOXEL)
 			continue;
 
@@ -1804,6 +1980,17 @@ void FilterTree::setCachePercent(unsigned int newCache)
 	}
 }
 
+bool FilterTree::fitsCacheBudget(unsigned long long cacheBytes) const
+{
+	if(cacheStrategy == CACHE_NEVER)
+		return false;
+
+	float ramFreeForUse;
+	ramFreeForUse= maxCachePercent/(float)100.0f*getAvailRAM();
+
+	return ((float)cacheBytes/(1024*1024) ) < ramFreeForUse;
+}
+
 bool FilterTree::hasUpdates() const
 {
 	for(tree<Filter *>::iterator it=filters.begin();it!=filters.end();++it)
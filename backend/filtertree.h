@@ -229,6 +229,8 @@ class FilterTree
 		//---------	
 		
 		void setCachePercent(unsigned int newCache);
+		//!Returns true if the given number of bytes fits in the RAM allowed for caching
+		bool fitsCacheBudget(unsigned long long cacheBytes) const;
 		
 		//Overwrite the contents of the pointed-to range files with
 		// the map contents
@@ -49,6 +49,9 @@ using std::vector;
 // perform a little "push off" by this fudge factor
 const float AXIS_MIN_TOLERANCE=10*sqrtf(std::numeric_limits<float>::epsilon());
 
+//Points kept per pixel column when decimating 1D plots (first,last,min,max)
+const unsigned int PLOT_DECIMATE_POINTS_PER_COLUMN=4;
+
 
 //Mathgl uses some internal for(float=...) constructions, 
 // which are just generally a bad idea, as they often won't terminate
@@ -859,7 +862,8 @@ void PlotWrapper::drawPlot(mglGraph *gr, bool &haveUsedLog) const
 					continue;
 
 				curPlot->drawRegions(gr,min,max);
-				curPlot->drawPlot(gr);
+				//Reduce the data to the pane's resolution
+				curPlot->drawPlot(gr,min.x,max.x,gr->GetWidth());
 				
 				if(drawLegend)
 				{
@@ -1178,7 +1182,7 @@ unsigned int PlotBase::getMode() const
 	ASSERT(false);
 }
 
-Plot1D::Plot1D()
+Plot1D::Plot1D() : xSorted(true), decimColumns(0)
 {
 	//Set the default plot properties
 	plotType=PLOT_LINE_LINES;
@@ -1198,6 +1202,7 @@ PlotBase *Plot1D::clone() const
 	p->xValues=xValues;
 	p->yValues=yValues;
 	p->errBars=errBars;
+	p->xSorted=xSorted;
 
 	copyBase(p);
 
@@ -1214,6 +1219,7 @@ void Plot1D::setErrMode(PLOT_ERROR mode)
 
 void Plot1D::genErrBars() 
 {
+	invalidateDecimation();
 	switch(errMode.mode)
 	{
 		case PLOT_ERROR_NONE:
@@ -1278,6 +1284,9 @@ void Plot1D::setData(const vector<float> &vX, const vector<float> &vY,
 	errBars.resize(vErr.size());
 	std::copy(vErr.begin(),vErr.end(),errBars.begin());
 
+	xSorted=std::is_sorted(xValues.begin(),xValues.end());
+	invalidateDecimation();
+
 	//Compute minima and maxima of plot data, and keep a copy of it
 	float maxThis=-std::numeric_limits<float>::max();
 	float minThis=std::numeric_limits<float>::max();
@@ -1334,6 +1343,8 @@ void Plot1D::setData(const vector<std::pair<float,float> > &v,const vector<float
 		yValues[ui]=v[ui].second;
 	}
 
+	xSorted=std::is_sorted(xValues.begin(),xValues.end());
+	invalidateDecimation();
 
 	computeDataBounds(xValues,minX,maxX);
 	if(vErr.empty())
@@ -1433,6 +1444,11 @@ bool Plot1D::isEmpty() const
 }
 
 void Plot1D::drawPlot(mglGraph *gr) const
+{
+	drawPlot(gr,minX,maxX,0);
+}
+
+void Plot1D::drawPlot(mglGraph *gr, float xMin, float xMax, unsigned int numColumns) const
 {
 #ifdef DEBUG
 	checkConsistent();
@@ -1443,41 +1459,48 @@ void Plot1D::drawPlot(mglGraph *gr) const
 
 	ASSERT(visible);
 	
-
-	//Make a copy of the data we need to use
-	float *bufferX,*bufferY,*bufferErr;
-	bufferX = new float[xValues.size()];
-	bufferY = new float[yValues.size()];
-
-	showErrs=errBars.size();
-	if(showErrs)
-		bufferErr = new float[errBars.size()];
-
-	//Pre-process the data, before handing to mathgl
-	//--
-	for(unsigned int uj=0;uj<xValues.size(); uj++)
+	//Choose between the full data, and data decimated to the
+	// display resolution. Decimation needs x to be sorted
+	const vector<float> *px,*py,*pErr;
+	if(numColumns && xSorted && xMax > xMin)
 	{
-		bufferX[uj] = xValues[uj];
-		bufferY[uj] = yValues[uj];
-
+		if(decimColumns != numColumns || decimXMin != xMin ||
+			decimXMax != xMax || decimStyle != plotMode)
+		{
+			//Bars would merge, so only the column maxima are needed
+			decimatePlotData(xValues,yValues,errBars,xMin,xMax,numColumns,
+				plotMode == PLOT_LINE_BARS,decimX,decimY,decimErr);
+			decimColumns=numColumns;
+			decimXMin=xMin;
+			decimXMax=xMax;
+			decimStyle=plotMode;
+		}
+		px=&decimX;
+		py=&decimY;
+		pErr=&decimErr;
 	}
-	if(showErrs)
+	else
 	{
-		for(unsigned int uj=0;uj<errBars.size(); uj++)
-			bufferErr[uj] = errBars[uj];
+		px=&xValues;
+		py=&yValues;
+		pErr=&errBars;
 	}
-	//--
+
+	if(px->empty())
+		return;
+
+	showErrs=pErr->size();
 	
 	//Mathgl needs to know where to put the error bars.	
-	ASSERT(!showErrs  || errBars.size() ==xValues.size());
+	ASSERT(!showErrs  || pErr->size() ==px->size());
 	
-	//Initialise the mathgl data
+	//Initialise the mathgl data (this makes a copy)
 	//--
-	xDat.Set(bufferX,xValues.size());
-	yDat.Set(bufferY,yValues.size());
+	xDat.Set(&((*px)[0]),px->size());
+	yDat.Set(&((*py)[0]),py->size());
 
 	if(showErrs)
-		eDat.Set(bufferErr,errBars.size());
+		eDat.Set(&((*pErr)[0]),pErr->size());
 	//--
 	
 	
@@ -1539,13 +1562,102 @@ void Plot1D::drawPlot(mglGraph *gr) const
 			break;
 	}
 
-	delete[]  bufferX;
-	delete[]  bufferY;
-	if(showErrs)
-		delete[]  bufferErr;
+}
 
-			
-	
+void decimatePlotData(const vector<float> &x, const vector<float> &y,
+		const vector<float> &err, float xMin, float xMax, 
+		unsigned int numColumns, bool maxOnly, vector<float> &xOut, 
+		vector<float> &yOut, vector<float> &errOut)
+{
+	ASSERT(x.size() == y.size());
+	ASSERT(err.empty() || err.size() == x.size());
+	ASSERT(numColumns && xMax > xMin);
+
+	xOut.clear();
+	yOut.clear();
+	errOut.clear();
+
+	//Find the visible range, plus one neighbour either side
+	size_t begin,end;
+	begin=std::lower_bound(x.begin(),x.end(),xMin)-x.begin();
+	end=std::upper_bound(x.begin(),x.end(),xMax)-x.begin();
+	if(begin)
+		begin--;
+	if(end < x.size())
+		end++;
+
+	bool haveErr=!err.empty();
+
+	//Not enough points to need reduction
+	if(end-begin <= PLOT_DECIMATE_POINTS_PER_COLUMN*numColumns)
+	{
+		xOut.assign(x.begin()+begin,x.begin()+end);
+		yOut.assign(y.begin()+begin,y.begin()+end);
+		if(haveErr)
+			errOut.assign(err.begin()+begin,err.begin()+end);
+		return;
+	}
+
+	xOut.reserve(PLOT_DECIMATE_POINTS_PER_COLUMN*(numColumns+2));
+	yOut.reserve(PLOT_DECIMATE_POINTS_PER_COLUMN*(numColumns+2));
+	if(haveErr)
+		errOut.reserve(PLOT_DECIMATE_POINTS_PER_COLUMN*(numColumns+2));
+
+	const float colScale=(float)numColumns/(xMax-xMin);
+	size_t ui=begin;
+	while(ui<end)
+	{
+		//Points outside the range are kept as-is
+		if(x[ui] < xMin || x[ui] > xMax)
+		{
+			xOut.push_back(x[ui]);
+			yOut.push_back(y[ui]);
+			if(haveErr)
+				errOut.push_back(err[ui]);
+			ui++;
+			continue;
+		}
+
+		//Find the extent of this column, and its extrema
+		unsigned int col=std::min((unsigned int)((x[ui]-xMin)*colScale),numColumns-1);
+		size_t first,minIdx,maxIdx;
+		first=minIdx=maxIdx=ui;
+		for(ui++;ui<end && x[ui] <=xMax;ui++)
+		{
+			if(std::min((unsigned int)((x[ui]-xMin)*colScale),numColumns-1) != col)
+				break;
+
+			if(y[ui] < y[minIdx])
+				minIdx=ui;
+			if(y[ui] > y[maxIdx])
+				maxIdx=ui;
+		}
+
+		size_t keep[4];
+		unsigned int numKeep;
+		if(maxOnly)
+		{
+			keep[0]=maxIdx;
+			numKeep=1;
+		}
+		else
+		{
+			keep[0]=first;
+			keep[1]=minIdx;
+			keep[2]=maxIdx;
+			keep[3]=ui-1;
+			std::sort(keep,keep+4);
+			numKeep=std::unique(keep,keep+4)-keep;
+		}
+
+		for(unsigned int uj=0;uj<numKeep;uj++)
+		{
+			xOut.push_back(x[keep[uj]]);
+			yOut.push_back(y[keep[uj]]);
+			if(haveErr)
+				errOut.push_back(err[keep[uj]]);
+		}
+	}
 }
 
 void Plot1D::getRawData(std::vector<std::vector< float> > &rawData,
@@ -78,6 +78,16 @@ std::string plotErrmodeString(unsigned int errMode);
 //!Return the plot type given a human readable string
 unsigned int plotID(const std::string &plotString);
 
+//!Reduce sorted 1D plot data to a few points per pixel column in [xMin,xMax].
+// Each column keeps its first, last, minimum and maximum points, in x order,
+// so lines and peaks drawn at that resolution are unchanged. If maxOnly is 
+// set, only each column's maximum is kept. The nearest point outside the 
+// range on each side is also kept, so that lines reach the plot edges
+void decimatePlotData(const std::vector<float> &x, const std::vector<float> &y,
+		const std::vector<float> &err, float xMin, float xMax, 
+		unsigned int numColumns, bool maxOnly, std::vector<float> &xOut, 
+		std::vector<float> &yOut, std::vector<float> &errOut);
+
 //!Return the error mode type, given the human readable string
 unsigned int plotErrmodeID(const std::string &s);
 		
@@ -329,8 +339,20 @@ class Plot1D : public PlotBase
 		//Do we want to draw error bars?
 		PLOT_ERROR errMode;	
 
+		//!True if xValues are in non-decreasing order
+		bool xSorted;
+
+		//!Decimated data from the last draw, for its x range, resolution
+		// and plot style. Cached so redraws at the same zoom are cheap
+		mutable std::vector<float> decimX,decimY,decimErr;
+		mutable float decimXMin,decimXMax;
+		mutable unsigned int decimColumns,decimStyle;
+
 		//Set the error bars for this plot
 		void genErrBars();	
+
+		//!Discard any cached decimated data
+		void invalidateDecimation() { decimColumns=0;}
 	public:
 		Plot1D();
 		virtual bool isEmpty() const;
@@ -352,6 +374,11 @@ class Plot1D : public PlotBase
 		//Draw the plot onto a given MGL graph
 		virtual void drawPlot(mglGraph *graph) const;
 
+		//!Draw the plot, reduced to the given number of pixel columns across
+		// the x range [xMin,xMax]. Zero columns draws every point
+		void drawPlot(mglGraph *graph, float xMin, float xMax, 
+						unsigned int numColumns) const;
+
 		//Draw the associated regions		
 		void drawRegions(mglGraph *graph,
 			const mglPoint &min, const mglPoint &max) const;
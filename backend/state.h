@@ -208,6 +208,8 @@ class TreeState
 	
 		//!Set the cache maximum ram usage (0->100) 
 		void setCachePercent(unsigned int newCache);
+		//!Returns true if the given number of bytes may be cached
+		bool fitsCacheBudget(unsigned long long cacheBytes) const { return filterTree.fitsCacheBudget(cacheBytes);}
 			
 		bool hasStateOverrides() const { return filterTree.hasStateOverrides();}
 	
@@ -31,6 +31,10 @@ using std::pair;
 
 bool VisController::isInstantiated = false;
 
+//Level-of-detail trees hold at most this multiple of their per-frame point
+// budget. Larger streams are randomly sampled down to this size first
+const size_t LOD_TREE_BUDGET_FACTOR=8;
+
 //TODO: Remove me, and refactor filters
 bool dummyRefreshCallback(bool dummy)
 {
@@ -138,9 +142,14 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 	//Names for plots
 	vector<std::pair<size_t,string> > plotLabels;
 
-	//rate-limit the number of drawables to show in the scene
-	map<const IonStreamData *, const IonStreamData*> throttleMap;
-	throttleSceneInput(sceneData,throttleMap);
+	//If there are more ions than we may display, draw them from 
+	// level-of-detail trees, sharing the per-frame point budget between 
+	// streams in proportion to their size
+	size_t inputIonCount=0;
+	for(list<vector<const FilterStreamData *> >::const_iterator it=sceneData.begin(); 
+							it!=sceneData.end(); ++it)
+		inputIonCount+=numElements(*it,STREAM_TYPE_IONS);
+	bool useIonLOD = limitIonOutput && limitIonOutput < inputIonCount;
 
 	//-- Build buffer of new objects to send to scene
 	for(list<vector<const FilterStreamData *> > ::iterator it=sceneData.begin(); 
@@ -170,25 +179,27 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 					curIonDraw=new DrawManyPoints;
 
 
-					//Obtain the ion data pointer.
-					// note that we have to use the throttled points
-					// (in throttlemap) if they are there, to prevent
-					// overloading the display system.
 					const IonStreamData *ionData;
 					ionData=((const IonStreamData *)((*it)[ui]));
-					if(throttleMap.find(ionData) != throttleMap.end())
+
+					if(useIonLOD)
 					{
-						ionData=throttleMap[ionData];
+						size_t budget=(size_t)((double)limitIonOutput*
+							ionData->data.size()/inputIonCount);
+						curIonDraw->setLODTree(getIonLODTree(ionData,budget),budget);
+					}
+					else
+					{
+						curIonDraw->resize(ionData->data.size());
+						//Slice out just the coordinate data for the 
+						// ion pointer, run callback immediately 
+						// after, as its a long operation
+						#pragma omp parallel for shared(curIonDraw,ionData)
+						for(size_t ui=0;ui<ionData->data.size();ui++)
+							curIonDraw->setPoint(ui,ionData->data[ui].getPosRef());
+						//Randomly shuffle the ion data before we draw it
+						curIonDraw->shuffle();
 					}
-
-
-					curIonDraw->resize(ionData->data.size());
-					//Slice out just the coordinate data for the 
-					// ion pointer, run callback immediately 
-					// after, as its a long operation
-					#pragma omp parallel for shared(curIonDraw,ionData)
-					for(size_t ui=0;ui<ionData->data.size();ui++)
-						curIonDraw->setPoint(ui,ionData->data[ui].getPosRef());
 					
 					//Set the colour from the ionstream data
 					curIonDraw->setColour(ionData->r,
@@ -197,8 +208,6 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 								ionData->a);
 					//set the size from the ionstream data
 					curIonDraw->setSize(ionData->ionSize);
-					//Randomly shuffle the ion data before we draw it
-					curIonDraw->shuffle();
 				
 					//place in special holder for ions,
 					// as we need to accumulate for display-listing
@@ -387,6 +396,20 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 
 						sceneDrawables.push_back(ld);
 					}
+					else if (vdbSrc->representationType == VOXEL_REPRESENT_POINTCLOUD)
+					{
+						//Sparse voxels, drawn directly from the grid
+						DrawField3D  *d = new DrawField3D;
+						d->setField(vis_grid);
+						d->setColourMapID(0);
+						d->setColourMinMax();
+						d->setBoxColours(vdbSrc->r,vdbSrc->g,vdbSrc->b,vdbSrc->a);
+						d->setPointSize(vdbSrc->splatSize);
+						d->setAlpha(vdbSrc->a);
+						d->wantsLight=false;
+
+						sceneDrawables.push_back(d);
+					}
 					else
 					{
 							ASSERT(false);
@@ -453,15 +476,6 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 			
 	}
 
-	//Free the rate-limited points
-	for(map<const IonStreamData *, const IonStreamData*>::iterator it =throttleMap.begin();
-		it!=throttleMap.end();++it)
-	{
-		delete it->second;
-	}
-	throttleMap.clear();	
-	//---
-
 	//Construct an OpenGL display list from the dataset
 
 	//Check how many points we have. Too many can cause the display list to crash
@@ -531,7 +545,10 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 	vector<DrawManyPoints *> drawIons;
 	for(size_t ui=0;ui<sceneDrawables.size();ui++)
 	{
-		if(sceneDrawables[ui]->getType() == DRAW_TYPE_MANYPOINT)
+		//Level-of-detail points depend upon the view, so cannot
+		// be placed into a display list
+		if(sceneDrawables[ui]->getType() == DRAW_TYPE_MANYPOINT &&
+			!((DrawManyPoints*)sceneDrawables[ui])->hasLODTree())
 		{
 			drawIons.push_back((DrawManyPoints*)sceneDrawables[ui]);
 			sceneDrawables.erase(sceneDrawables.begin()+ui);
@@ -593,52 +610,49 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 	//===============
 }
 
-void VisController::throttleSceneInput(list<vector<const FilterStreamData *> > &sceneData,
-		std::map<const IonStreamData *,const IonStreamData *> &throttleMap) const
+std::shared_ptr<const PointLODTree> VisController::getIonLODTree(const IonStreamData *ionData, size_t budget) const
 {
-	//Count the number of input ions, as we may need to perform culling,
-	if(!limitIonOutput)
-		return;
+	size_t maxPoints=std::min(ionData->data.size(),budget*LOD_TREE_BUDGET_FACTOR);
 
-	size_t inputIonCount=0;
-	for(list<vector<const FilterStreamData *> >::const_iterator it=sceneData.begin(); 
-							it!=sceneData.end(); ++it)
-		inputIonCount+=numElements(*it,STREAM_TYPE_IONS);
+	//Cached streams keep their tree, unless the display limit has changed
+	if(ionData->lodTree && ionData->lodTree->size() == maxPoints)
+		return ionData->lodTree;
+	ionData->lodTree.reset();
 
-	//If limit is higher than what we have, no culling required
-	if(limitIonOutput >=inputIonCount)
-		return;
-
-	//Need to cull
-	float cullFraction = (float)limitIonOutput/(float)inputIonCount;
-
-	for(list<vector<const FilterStreamData *> >::iterator it=sceneData.begin(); 
-							it!=sceneData.end(); ++it)
+	vector<Point3D> pts(maxPoints);
+	if(maxPoints < ionData->data.size())
 	{
-		for(unsigned int ui=0;ui<it->size(); ui++)
-		{
-			if((*it)[ui]->getStreamType() != STREAM_TYPE_IONS)
-				continue;
-			//Obtain the ion data pointer
-			const IonStreamData *ionData;
-			ionData=((const IonStreamData *)((*it)[ui]));
-
-
-			//Duplicate this object, then forget
-			// about the old one. The freeing will be done by
-			//the refresh thread as needed, so don't free here.
-
-			// We can't modify the input, even when uncached,
-			// as the object is const
-			IonStreamData *newIonData;
-			newIonData=ionData->cloneSampled(cullFraction);
-			throttleMap[ionData]  = newIonData;
-
-		}
+		//Too many ions to hold in the tree, so draw it from a random sample
+		vector<size_t> sample;
+		RandNumGen rng;
+		rng.initTimer();
+		unsigned int dummyProgress;
+		ATOMIC_BOOL dummyAbort;
+		dummyAbort=false;
+		randomDigitSelection(sample,ionData->data.size(),rng,
+				maxPoints,dummyProgress,dummyAbort);
+
+		#pragma omp parallel for
+		for(size_t ui=0;ui<pts.size();ui++)
+			pts[ui]=ionData->data[sample[ui]].getPosRef();
 	}
-		
+	else
+	{
+		#pragma omp parallel for
+		for(size_t ui=0;ui<pts.size();ui++)
+			pts[ui]=ionData->data[ui].getPosRef();
+	}
+
+	PointLODTree *tree = new PointLODTree;
+	tree->build(pts);
+	std::shared_ptr<const PointLODTree> treePtr(tree);
 
+	//Only keep the tree with the stream if the stream is cached, and the 
+	// tree fits in the RAM allowed for caching. Otherwise the scene owns it
+	if(ionData->cached && state.treeState.fitsCacheBudget(tree->numBytes()))
+		ionData->lodTree=treePtr;
 
+	return treePtr;
 }
 
 void VisController::updateRawGrid() const
@@ -104,9 +104,9 @@ class VisController
 
 		//!Update the console strings
 		void updateConsole(const std::vector<std::string> &v, const Filter *f) const;
-		//!Limit the number of objects we are sending to the scene
-		void throttleSceneInput(std::list<std::vector<const FilterStreamData *> > &outputData, 
-			std::map<const IonStreamData *, const IonStreamData *> &throttleMap) const;
+		//!Obtain the level-of-detail tree for an ion stream, building it if needed.
+		// Budget is the number of points that may be drawn from the stream per frame
+		std::shared_ptr<const PointLODTree> getIonLODTree(const IonStreamData *ionData, size_t budget) const;
 	public:
 		AnalysisState state;
 		Scene scene;
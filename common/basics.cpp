@@ -39,6 +39,8 @@
 #if !defined(__WIN32__) && !defined(__WIN64__)
 #include <sys/types.h>
 #include <sys/stat.h>
+//Needed for peak memory usage
+#include <sys/resource.h>
 #endif
 
 #include <cstring>
@@ -118,6 +120,31 @@ void popLocale()
 }
 
 
+ThreadCNumericLocale::ThreadCNumericLocale()
+{
+#if defined(WIN32) || defined(WIN64)
+	oldThreadMode=_configthreadlocale(_ENABLE_PER_THREAD_LOCALE);
+	oldLocale=strdup(setlocale(LC_NUMERIC,NULL));
+	setlocale(LC_NUMERIC,"C");
+#else
+	cLocale=newlocale(LC_NUMERIC_MASK,"C",(locale_t)0);
+	ASSERT(cLocale);
+	oldLocale=uselocale(cLocale);
+#endif
+}
+
+ThreadCNumericLocale::~ThreadCNumericLocale()
+{
+#if defined(WIN32) || defined(WIN64)
+	setlocale(LC_NUMERIC,oldLocale);
+	free(oldLocale);
+	_configthreadlocale(oldThreadMode);
+#else
+	uselocale(oldLocale);
+	freelocale(cLocale);
+#endif
+}
+
 bool dummyCallback(bool)
 {
 	return true;
@@ -1299,6 +1326,24 @@ size_t getAvailRAM()
 #endif
 }
 
+size_t getPeakRAM()
+{
+#if defined(_WIN32) || defined(_WIN64) || defined(__CYGWIN__)
+	//Would need psapi, which we do not link against
+	return 0;
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF,&usage))
+		return 0;
+	#ifdef __APPLE__
+		//OSX reports bytes, rather than kB
+		return usage.ru_maxrss/1024;
+	#else
+		return usage.ru_maxrss;
+	#endif
+#endif
+}
+
 bool strhas(const char *cpTest, const char *cpPossible)
 {
 	while(*cpTest)
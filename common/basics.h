@@ -57,6 +57,15 @@
 #include "mathfuncs.h"
 #include "common/assertion.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <clocale>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+
 
 #include <vector>
 #include <sstream>
@@ -74,6 +83,26 @@ void pushLocale(const char *newLocale, int type);
 //Restore old locale code
 void popLocale();
 
+//!Use the "C" numeric locale in the calling thread only, whilst in scope.
+// Unlike pushLocale, this is safe to use from worker threads, as the
+// locale of other threads (e.g. the GUI) is unaffected
+class ThreadCNumericLocale
+{
+	private:
+#if defined(WIN32) || defined(WIN64)
+		int oldThreadMode;
+		char *oldLocale;
+#else
+		locale_t cLocale,oldLocale;
+#endif
+		//Not copyable
+		ThreadCNumericLocale(const ThreadCNumericLocale &);
+		ThreadCNumericLocale &operator=(const ThreadCNumericLocale &);
+	public:
+		ThreadCNumericLocale();
+		~ThreadCNumericLocale();
+};
+
 
 
 //C file peek function
@@ -277,6 +306,10 @@ int getTotalRAM();
 //!Get available ram in MB
 size_t getAvailRAM();
 
+//!Get the largest resident memory used by this process so far, in kB.
+// Returns zero if this is not known
+size_t getPeakRAM();
+
 //!Determine if a given path is a not a directory, 
 bool isNotDirectory(const char *filename);
 
@@ -689,9 +722,10 @@ template<class T> size_t randomSelect(std::vector<T> &result, const std::vector<
 }
 
 //Randomly select subset [0,max). Subset will be (somewhat) sorted on output
+// Returns -1 on abort, otherwise returns number of randomly selected items
 template<class T> size_t randomDigitSelection(std::vector<T> &result, const size_t max,
 			RandNumGen &rng, size_t num,unsigned int &progress,
-			bool strongRandom=false)
+			ATOMIC_BOOL &wantAbort, bool strongRandom=false)
 {
 	//If there are not enough points, just copy it across in whole
 	if(max <=num)
@@ -736,7 +770,7 @@ template<class T> size_t randomDigitSelection(std::vector<T> &result, const size
 		ticks.erase(itLast,ticks.end());
 		
 		//Top up with unique entries
-		while(ticks.size() < numTicksNeeded)
+		while(ticks.size() < numTicksNeeded && !wantAbort)
 		{
 			size_t moreTicks=numTicksNeeded-ticks.size();
 			for(size_t uk=0;uk<moreTicks;uk++)
@@ -753,6 +787,8 @@ template<class T> size_t randomDigitSelection(std::vector<T> &result, const size
 			ticks.erase(itLast,ticks.end());
 		}
 
+		if(wantAbort)
+			return -1;
 
 		ASSERT(ticks.size() == numTicksNeeded);
 		//---------
@@ -769,7 +805,13 @@ template<class T> size_t randomDigitSelection(std::vector<T> &result, const size
 
 				result[pos]=*it;
 				pos++;
-				progress= (unsigned int)((float)(curProg)/((float)num)*100.0f);
+				if(!curProg--)
+				{
+					progress= (unsigned int)((float)(pos)/((float)num)*100.0f);
+					if(wantAbort)
+						return -1;
+					curProg=CURPROG;
+				}
 			}
 		}
 		else
@@ -777,16 +819,22 @@ template<class T> size_t randomDigitSelection(std::vector<T> &result, const size
 			//Sort the ticks properly (mostly sorted anyway..)
 			std::sort(ticks.begin(),ticks.end());
 			
-			unsigned int curTick=0;
-			for(size_t ui=0;ui<numTicksNeeded; ui++)
+			size_t curTick=0;
+			for(size_t ui=0;ui<max; ui++)
 			{
 				//Don't copy if this is marked
-				if(ui == ticks[curTick])
+				if(curTick < ticks.size() && ui == ticks[curTick])
 					curTick++;
 				else
 					result[ui-curTick]=ui;
 				
-				progress= (unsigned int)((float)(curProg)/((float)num)*100.0f);
+				if(!curProg--)
+				{
+					progress= (unsigned int)((float)(ui)/((float)max)*100.0f);
+					if(wantAbort)
+						return -1;
+					curProg=CURPROG;
+				}
 			}
 		}
 
@@ -812,6 +860,9 @@ template<class T> size_t randomDigitSelection(std::vector<T> &result, const size
 		l.setMaskPeriod(j);
 		l.setState(start);
 
+		const unsigned int CURPROG=70000;
+		unsigned int curProg=CURPROG;
+
 		size_t ui=0;	
 		//generate unique weak random numbers.
 		while(ui<num)
@@ -826,6 +877,14 @@ template<class T> size_t randomDigitSelection(std::vector<T> &result, const size
 				result[ui] =res;
 				ui++;
 			}
+
+			if(!curProg--)
+			{
+				progress= (unsigned int)((float)(ui)/((float)num)*100.0f);
+				if(wantAbort)
+					return -1;
+				curProg=CURPROG;
+			}
 		}
 	}
 	return num;
@@ -852,4 +911,72 @@ void vectorMultiErase(std::vector<T> &vec, const std::vector<bool> &wantKill)
 	vec.resize(vec.size()-shift);
 }
 
+//Write a sequence of blocks to a stream, in order. Each block's bytes
+// are produced by converter(blockNumber,buffer), which is called from
+// several threads at once. Blocks are converted a batch at a time, one
+// block per thread, whilst the previous batch is written. If blockSizes
+// is given, it receives the number of bytes in each block.
+// Returns false if the stream failed
+template<class Converter>
+bool writeOrderedBlocks(std::ostream &f, size_t nBlocks, const Converter &converter,
+				std::vector<size_t> *blockSizes=0)
+{
+	size_t batchSize=1;
+#ifdef _OPENMP
+	batchSize=omp_get_max_threads();
+#endif
+	std::vector<std::vector<char> > buffers[2];
+	buffers[0].resize(batchSize);
+	buffers[1].resize(batchSize);
+
+	if(blockSizes)
+		blockSizes->resize(nBlocks);
+
+	//Number of converted blocks in the waiting buffer, still to be written
+	size_t nWaiting=0;
+	unsigned int filling=0;
+	for(size_t batchStart=0;batchStart<nBlocks;batchStart+=batchSize)
+	{
+		const size_t nBatch=std::min(batchSize,nBlocks-batchStart);
+		const std::vector<std::vector<char> > &waiting=buffers[!filling];
+		std::vector<std::vector<char> > &converting=buffers[filling];
+
+#pragma omp parallel
+		{
+			//One thread writes out the previous batch, then joins the conversion
+#pragma omp single nowait
+			{
+				for(size_t ui=0;ui<nWaiting;ui++)
+				{
+					if(waiting[ui].size())
+						f.write(&(waiting[ui][0]),waiting[ui].size());
+				}
+			}
+
+#pragma omp for schedule(dynamic)
+			for(size_t ui=0;ui<nBatch;ui++)
+			{
+				converter(batchStart+ui,converting[ui]);
+				if(blockSizes)
+					(*blockSizes)[batchStart+ui]=converting[ui].size();
+			}
+		}
+
+		if(!f.good())
+			return false;
+
+		nWaiting=nBatch;
+		filling=!filling;
+	}
+
+	const std::vector<std::vector<char> > &waiting=buffers[!filling];
+	for(size_t ui=0;ui<nWaiting;ui++)
+	{
+		if(waiting[ui].size())
+			f.write(&(waiting[ui][0]),waiting[ui].size());
+	}
+
+	return f.good();
+}
+
 #endif
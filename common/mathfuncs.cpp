@@ -770,6 +770,100 @@ void quat_rot_apply_quat(Point3f *point, const Quaternion *rotQuat)
 	quat_pointmult(point, &temp,rotQuat);
 }
 	
+AffineTransform3D::AffineTransform3D()
+{
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		for(unsigned int uj=0;uj<4;uj++)
+			m[ui][uj]= (ui==uj) ? 1.0f : 0.0f;
+	}
+}
+
+AffineTransform3D AffineTransform3D::translation(const Point3D &delta)
+{
+	AffineTransform3D t;
+	for(unsigned int ui=0;ui<3;ui++)
+		t.m[ui][3]=delta[ui];
+	return t;
+}
+
+AffineTransform3D AffineTransform3D::scaling(const Point3D &scale, const Point3D &origin)
+{
+	//(p-origin)*scale + origin
+	AffineTransform3D t;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		t.m[ui][ui]=scale[ui];
+		t.m[ui][3]=origin[ui]-scale[ui]*origin[ui];
+	}
+	return t;
+}
+
+AffineTransform3D AffineTransform3D::rotation(const Point3D &axis, float angle, 
+							const Point3D &origin)
+{
+	Point3f rotVec;
+	rotVec.fx=axis[0];
+	rotVec.fy=axis[1];
+	rotVec.fz=axis[2];
+
+	Quaternion q;
+	quat_get_rot_quat(&rotVec,angle,&q);
+
+	//Rotation is linear, so the matrix columns are the 
+	// rotated basis vectors
+	AffineTransform3D t;
+	for(unsigned int uj=0;uj<3;uj++)
+	{
+		Point3f basis;
+		basis.fx = (uj == 0) ? 1.0f : 0.0f;
+		basis.fy = (uj == 1) ? 1.0f : 0.0f;
+		basis.fz = (uj == 2) ? 1.0f : 0.0f;
+		quat_rot_apply_quat(&basis,&q);
+
+		t.m[0][uj]=basis.fx;
+		t.m[1][uj]=basis.fy;
+		t.m[2][uj]=basis.fz;
+	}
+
+	//Rotate about origin : R(p-origin)+origin
+	Point3D rotOrigin=t.apply(origin);
+	for(unsigned int ui=0;ui<3;ui++)
+		t.m[ui][3]=origin[ui]-rotOrigin[ui];
+
+	return t;
+}
+
+bool AffineTransform3D::isIdentity() const
+{
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		for(unsigned int uj=0;uj<4;uj++)
+		{
+			if(m[ui][uj] != ((ui==uj) ? 1.0f : 0.0f))
+				return false;
+		}
+	}
+	return true;
+}
+
+AffineTransform3D AffineTransform3D::operator*(const AffineTransform3D &other) const
+{
+	AffineTransform3D t;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		for(unsigned int uj=0;uj<4;uj++)
+		{
+			//Implicit last row of other is [0 0 0 1]
+			float v = (uj==3) ? m[ui][3] : 0.0f;
+			for(unsigned int uk=0;uk<3;uk++)
+				v+=m[ui][uk]*other.m[uk][uj];
+			t.m[ui][uj]=v;
+		}
+	}
+	return t;
+}
+
 //For the table to work, we need the sizeof(size_T) at preprocess time
 #ifndef SIZEOF_SIZE_T
 #error sizeof(size_t) macro is undefined... At time of writing, this is usually 4 (32 bit) or 8. You can work it out from a simple C++ program which prints out sizeof(size_t). This cant be done automatically due to preprocessor behaviour.
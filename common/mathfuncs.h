@@ -248,6 +248,47 @@ void quat_get_rot_quat(const Point3f *rotVec, float angle,  Quaternion *rotQuat)
 //Use previously generated quats from quat_get_rot_quats to rotate a point
 void quat_rot_apply_quat(Point3f *point, const Quaternion *rotQuat);
 
+//!3D affine transformation (rotation, scaling, translation)
+/*! Stored as the upper 3 rows of a 4x4 homogeneous matrix,
+ * the last row being implicitly [0 0 0 1]
+ */
+class AffineTransform3D
+{
+	private:
+		//!Row-major matrix entries. Column 3 is the translation 
+		float m[3][4];
+	public:
+		//!Constructor - initialises to the identity transform
+		AffineTransform3D();
+
+		//!Translation by the given vector
+		static AffineTransform3D translation(const Point3D &delta);
+		//!Per-axis scaling about the given origin
+		static AffineTransform3D scaling(const Point3D &scale, const Point3D &origin);
+		//!Rotation by angle (radians) around normalised axis, about the given origin
+		// Sense of rotation matches quat_rot
+		static AffineTransform3D rotation(const Point3D &axis, float angle, 
+							const Point3D &origin);
+
+		//!Returns true if this is exactly the identity transform
+		bool isIdentity() const;
+
+		//!Get the given matrix entry; row must be <3, col < 4
+		float getValue(unsigned int row, unsigned int col) const { return m[row][col];}
+
+		//!Compose transforms. The result applies "other" first, then this
+		AffineTransform3D operator*(const AffineTransform3D &other) const;
+
+		//!Transform a single point
+		inline Point3D apply(const Point3D &p) const
+		{
+			const float *v=p.getValueArr();
+			return Point3D(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2] + m[0][3],
+				m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2] + m[1][3],
+				m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2] + m[2][3]);
+		}
+};
+
 //This class implements a Linear Feedback Shift Register (in software) 
 //This is a mathematical construct based upon polynomials over closed natural numbers (N mod p).
 //This will generate a weakly random digit string, but with guaranteed no duplicates, using O(1)
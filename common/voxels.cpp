@@ -115,6 +115,50 @@ bool pointIn2DConvexPoly(float px,float py,
 	return true;
 }
 
+void gaussianKernel(float stdev, float windowRatio, unsigned int order,
+				vector<float> &kernel)
+{
+	ASSERT(stdev > 0 && windowRatio > 0);
+	ASSERT(order == 0 || order == 2);
+
+	int radius=(int)(windowRatio*stdev+0.5);
+	if(!radius)
+		radius=1;
+
+	//Sample the Gaussian, or its second derivative. Constant
+	// prefactors are removed by the normalisation
+	vector<double> k(2*radius+1);
+	double sqrDev=(double)stdev*stdev;
+	double dc=0;
+	for(int ui=-radius;ui<=radius;ui++)
+	{
+		double g=exp(-(double)ui*ui/(2.0*sqrDev));
+		if(order)
+			g*=((double)ui*ui/sqrDev - 1.0)/sqrDev;
+		k[ui+radius]=g;
+		dc+=g;
+	}
+
+	double norm=0;
+	if(order)
+	{
+		//Remove the DC component, so the kernel gives zero response to
+		// a constant field, then scale to unit second moment (x^2/2)
+		dc/=(double)k.size();
+		for(int ui=-radius;ui<=radius;ui++)
+		{
+			k[ui+radius]-=dc;
+			norm+=k[ui+radius]*(double)ui*ui/2.0;
+		}
+	}
+	else
+		norm=dc;
+
+	kernel.resize(k.size());
+	for(size_t ui=0;ui<k.size();ui++)
+		kernel[ui]=k[ui]/norm;
+}
+
 //FIXME: This code is unfinished.
 template<class T>
 vector<Point3D> getVoxelIntersectionPoints(const BoundCube &b, const Point3D &p, const Point3D &normal, 
@@ -230,6 +274,8 @@ vector<Point3D> getVoxelIntersectionPoints(const BoundCube &b, const Point3D &p,
 #ifdef DEBUG
 #include <algorithm>
 
+#include "common/mathfuncs.h"
+
 const float FLOAT_SMALL=
 	sqrt(numeric_limits<float>::epsilon());
 
@@ -384,6 +430,205 @@ bool pointInPoly()
 }
 
 
+bool kernelTests()
+{
+	vector<float> k;
+	gaussianKernel(1.5f,3.0f,0,k);
+	//radius of 3*1.5, rounded
+	TEST(k.size() == 11,"kernel size");
+	float sum=0;
+	for(size_t ui=0;ui<k.size();ui++)
+		sum+=k[ui];
+	TEST(fabs(sum - 1.0f) < 1e-5f,"Gaussian kernel normalisation");
+	TEST(k[5] > k[4] && k[4] == k[6],"Gaussian kernel shape");
+
+	gaussianKernel(1.5f,3.0f,2,k);
+	TEST(k.size() == 11,"kernel size");
+	float moment=0;
+	sum=0;
+	for(size_t ui=0;ui<k.size();ui++)
+	{
+		float x=(float)ui-5.0f;
+		sum+=k[ui];
+		moment+=k[ui]*x*x/2.0f;
+	}
+	//Zero response to constants, unit response to x^2/2
+	TEST(fabs(sum) < 1e-5f,"second derivative kernel DC");
+	TEST(fabs(moment - 1.0f) < 1e-5f,"second derivative kernel normalisation");
+	TEST(k[5] < 0,"second derivative kernel shape");
+
+	return true;
+}
+
+//Check countPoints against a serial count, for the given grid size
+template<class T>
+bool countPointsTest(size_t nBins, size_t nPts, bool clustered)
+{
+	Voxels<T> v;
+	v.resize(nBins,nBins,nBins,Point3D(0,0,0),Point3D(1,1,1));
+	v.fill(0);
+
+	RandNumGen rng;
+	rng.initialise(12345);
+	vector<Point3D> pts(nPts);
+	for(size_t ui=0;ui<nPts;ui++)
+	{
+		if(clustered)
+			pts[ui]=Point3D(0.5,0.5,0.5);
+		else
+		{
+			pts[ui]=Point3D(0.999f*rng.genUniformDev(),0.999f*rng.genUniformDev(),
+						0.999f*rng.genUniformDev());
+		}
+	}
+
+	vector<size_t> counts(v.getSize(),0);
+	for(size_t ui=0;ui<nPts;ui++)
+	{
+		size_t x,y,z;
+		v.getIndex(x,y,z,pts[ui]);
+		counts[v.getOffset(x,y,z)]++;
+	}
+
+	TEST(!v.countPoints(pts,true,false),"countPoints");
+
+	for(size_t ui=0;ui<counts.size();ui++)
+	{
+		//Counts saturate at the largest value that T can count to
+		T expected=0;
+		for(size_t uj=0;uj<counts[ui];uj++)
+		{
+			T next=expected+T(1);
+			if(!(next > expected))
+				break;
+			expected=next;
+		}
+		TEST(v.getData(ui) == expected,"exact voxel counts");
+	}
+
+	return true;
+}
+
+bool countTests()
+{
+	//Ensure the parallel paths are used, even on one core
+#ifdef _OPENMP
+	int oldThreads=omp_get_max_threads();
+	omp_set_num_threads(4);
+#endif
+
+	//Small grid, counted into per-thread grids
+	bool ok=countPointsTest<float>(4,100000,false);
+	//Large grid, counted in per-thread slabs
+	ok=ok && countPointsTest<float>(64,100000,false);
+	//Saturation
+	ok=ok && countPointsTest<unsigned char>(4,100000,true);
+	ok=ok && countPointsTest<unsigned char>(64,100000,true);
+	//Serial
+	ok=ok && countPointsTest<float>(8,1000,false);
+	//Several blocks. Per-thread grids are too costly for one block of 
+	// this grid, but not for all the points, which sets how all are counted
+	{
+	Voxels<float> v;
+	v.resize(80,80,80,Point3D(0,0,0),Point3D(1,1,1));
+	ok=ok && v.countStrategy(COUNT_BLOCK_SIZE) == COUNT_THREAD_SLABS &&
+		v.countStrategy(3*COUNT_BLOCK_SIZE) == COUNT_THREAD_GRIDS;
+	}
+	ok=ok && countPointsTest<float>(80,3*COUNT_BLOCK_SIZE+1000,false);
+	ok=ok && countPointsTest<unsigned char>(4,COUNT_BLOCK_SIZE+1000,true);
+
+#ifdef _OPENMP
+	omp_set_num_threads(oldThreads);
+#endif
+	return ok;
+}
+
+//Check the blocked filters against vigra's, on a random field with
+// unequal sides, so each axis and both boundaries are exercised
+bool filterCompareTest()
+{
+	const size_t nX=23,nY=17,nZ=12;
+	const float stdev=1.5f, windowRatio=3.0f;
+
+	RandNumGen rng;
+	rng.initialise(12345);
+	Voxels<float> v;
+	v.resize(nX,nY,nZ);
+	vigra::MultiArray<3,float> src(vigra::Shape3(nX,nY,nZ));
+	for(size_t ui=0;ui<nX;ui++)
+	{
+		for(size_t uj=0;uj<nY;uj++)
+		{
+			for(size_t uk=0;uk<nZ;uk++)
+			{
+				float f=rng.genUniformDev();
+				v.setData(ui,uj,uk,f);
+				src[vigra::Shape3(ui,uj,uk)]=f;
+			}
+		}
+	}
+
+	vigra::ConvolutionOptions<3> opt = vigra::ConvolutionOptions<3>().filterWindowSize(windowRatio);
+	for(unsigned int filter=0;filter<2;filter++)
+	{
+		Voxels<float> vFilt;
+		v.clone(vFilt);
+		vigra::MultiArray<3,float> ref(src.shape());
+		if(filter)
+		{
+			vFilt.laplaceOfGaussian(stdev,windowRatio);
+			vigra::laplacianOfGaussianMultiArray(vigra::srcMultiArrayRange(src),
+					vigra::destMultiArray(ref),stdev,opt);
+		}
+		else
+		{
+			vFilt.isotropicGaussianSmooth(stdev,windowRatio);
+			vigra::gaussianSmoothMultiArray(vigra::srcMultiArrayRange(src),
+					vigra::destMultiArray(ref),stdev,opt);
+		}
+
+		float maxErr=0;
+		for(size_t ui=0;ui<nX;ui++)
+		{
+			for(size_t uj=0;uj<nY;uj++)
+			{
+				for(size_t uk=0;uk<nZ;uk++)
+				{
+					maxErr=std::max(maxErr,(float)fabs(vFilt.getData(ui,uj,uk)
+							- ref[vigra::Shape3(ui,uj,uk)]));
+				}
+			}
+		}
+		TEST(maxErr < 1e-4f,"filter matches vigra");
+	}
+
+	//Smoothing a constant field leaves it unchanged, and its Laplacian is zero
+	v.fill(2.0f);
+	v.isotropicGaussianSmooth(stdev,windowRatio);
+	TEST(fabs(v.getData(0,0,0) - 2.0f) < 1e-5f,"constant field smoothing");
+	TEST(fabs(v.getData(nX-1,nY/2,nZ-1) - 2.0f) < 1e-5f,"constant field smoothing");
+	v.laplaceOfGaussian(stdev,windowRatio);
+	TEST(fabs(v.getData(nX/2,0,nZ/2)) < 1e-5f,"constant field Laplacian");
+
+	return true;
+}
+
+bool filterTests()
+{
+	//Ensure the parallel paths are used, even on one core
+#ifdef _OPENMP
+	int oldThreads=omp_get_max_threads();
+	omp_set_num_threads(4);
+#endif
+
+	bool ok=filterCompareTest();
+
+#ifdef _OPENMP
+	omp_set_num_threads(oldThreads);
+#endif
+	return ok;
+}
+
 bool runVoxelTests()
 {
 	bool wantAbort=false;
@@ -393,6 +638,9 @@ bool runVoxelTests()
 	TEST(simpleMath(), "voxel simple maths");	
 
 	TEST(pointInPoly(),"point-in-poly tests");
+	TEST(kernelTests(),"filter kernel tests");
+	TEST(countTests(),"point counting tests");
+	TEST(filterTests(),"separable filter tests");
 //	TEST(edgeCountTests(), "voxel edge tests");	
 	return true;	
 }
@@ -78,6 +78,13 @@ enum{
 	ADJ_PLUS
 };
 
+//Ways in which countOffsets can count points
+enum{
+	COUNT_SERIAL,
+	COUNT_THREAD_GRIDS,
+	COUNT_THREAD_SLABS
+};
+
 //Error codes
 enum{
 	VOXELS_BAD_FILE_READ=1,
@@ -89,6 +96,20 @@ enum{
 //Must be power of two (buffer size when loading files, in sizeof(T)s)
 const unsigned int ITEM_BUFFER_SIZE=65536;
 
+//Number of points to bin at a time when counting
+const size_t COUNT_BLOCK_SIZE=1<<20;
+//Below this many points, counting is done serially
+const size_t COUNT_PARALLEL_MIN=1<<14;
+//Largest total size of the per-thread count grids, in bytes
+const size_t COUNT_PRIVATE_MAX_BYTES=64*1024*1024;
+
+//Target size of the working buffers for each tile in separable
+// filtering, in bytes. Sized to sit in a per-core cache
+const size_t CONVOLVE_TILE_BYTES=256*1024;
+//Bounds on the number of adjacent lines filtered together in each tile
+const size_t CONVOLVE_TILE_MIN_WIDTH=8;
+const size_t CONVOLVE_TILE_MAX_WIDTH=64;
+
 //!Clipping direction constants
 /*! Controls the clipping direction when performing clipping operations
  */
@@ -105,6 +126,42 @@ enum {
 	VOXEL_BOUNDS_INVALID_ERR
 };
 
+//!Build a sampled 1D Gaussian kernel (order 0) or Gaussian second
+// derivative kernel (order 2) for separable filtering, with radius
+// windowRatio*stdev (in voxels). Weights are normalised as vigra does,
+// so results match isotropicGaussianSmooth and laplaceOfGaussian.
+// The kernel is centred on element kernel.size()/2
+void gaussianKernel(float stdev, float windowRatio, unsigned int order,
+				std::vector<float> &kernel);
+
+//!Reflect an index into [0,n), without repeating the end values
+// (n=4: ... 2 1 | 0 1 2 3 | 2 1 ...), as vigra's BORDER_TREATMENT_REFLECT
+inline long mirrorVoxelIndex(long i, long n)
+{
+	if(n == 1)
+		return 0;
+
+	long period=2*(n-1);
+	i%=period;
+	if(i < 0)
+		i+=period;
+	if(i >= n)
+		i=period-i;
+	return i;
+}
+
+//!Convolve an x-fastest 3D array in place along one axis, with a kernel
+// centred on element kernel.size()/2 and mirrored boundaries
+/*! The array is treated as [outer][axis][inner], and filtered in tiles
+ * of adjacent lines that are copied into a small buffer, so that each
+ * tile is cache resident and the innermost loop runs over contiguous
+ * values, which the compiler can vectorise. Tiles are shared between
+ * threads. Arithmetic is in float, whatever the type of the data
+ */
+template<class U>
+void convolveAxisMirrored(U *data, const size_t *dims, unsigned int axis,
+				const std::vector<float> &kernel);
+
 #ifdef DEBUG
 	bool runVoxelTests();
 #endif
@@ -121,6 +178,10 @@ template<class T> class Voxels
 		//!Number of bins in data set (X,Y,Z)
 		size_t binCount[3];
 
+		//!Add count to the nth voxel, one at a time. If noWrap is set,
+		// stop when adding one no longer increases the value
+		void addCount(size_t n, size_t count, bool noWrap);
+
 		//!Voxel array 
 		vigra::MultiArray<3,T> voxels;
 		
@@ -169,6 +230,9 @@ template<class T> class Voxels
 		inline T getData(size_t *array) const;
 		//!Retrieve value of the nth voxel
 		inline T getData(size_t i) const { return voxels[i];}
+		//!Get the n for getData(n) that matches the XYZ voxel
+		size_t getOffset(size_t x, size_t y, size_t z) const 
+			{ return x + binCount[0]*(y + binCount[1]*z);}
 
 		void setEntry(size_t n, const T &val) { voxels[n] = val;};
 		//!Retrieve a reference to the data ata  given position
@@ -181,10 +245,12 @@ template<class T> class Voxels
 		//Obtain an interpolated entry. The interpolated values are obtained by padding
 		void getInterpolatedData(const Point3D &pt, T &v) const;
 
-		//Perform in-place gaussian smoothing
+		//Perform in-place gaussian smoothing. Gives the same result as
+		// vigra's gaussianSmoothMultiArray, but is blocked and multi-threaded
 		void isotropicGaussianSmooth(float stdev,float windowRatio);
 
-		//Perform in-place laplacian smoothing
+		//Perform in-place laplacian smoothing, as per
+		// vigra's laplacianOfGaussianMultiArray
 		void laplaceOfGaussian(float stdev, float windowRatio);
 
 		//get an interpolated slice from a section of the data
@@ -366,6 +432,24 @@ template<class T> class Voxels
 		 */
 		int countPoints( const std::vector<Point3D> &points, bool noWrap=true, bool doErase=false);
 
+		//!Add one to the voxel at each offset (as per getData(n)), 
+		// skipping offsets outside the dataset. noWrap is as for countPoints
+		void countOffsets(const size_t *offsets, size_t n, bool noWrap=true);
+
+		//!Choose how to count the given total number of points (COUNT_ enum)
+		/*! Small grids are counted into a private grid per thread, then
+		 * summed. Larger grids are split into one slab per thread, and
+		 * each thread updates only the voxels in its own slab
+		 */
+		unsigned int countStrategy(size_t totalPoints) const;
+		//!As countOffsets, for one block of many, using a strategy chosen 
+		// for all the blocks by countStrategy. For COUNT_THREAD_GRIDS, 
+		// counts accumulate in threadCounts until addThreadCounts is called
+		void countOffsets(const size_t *offsets, size_t n, bool noWrap,
+			unsigned int strategy, std::vector<unsigned int> &threadCounts);
+		//!Add the per-thread counts from countOffsets into the grid
+		void addThreadCounts(std::vector<unsigned int> &threadCounts, bool noWrap);
+
 		//!Integrate the datataset via the trapezoidal method
 		T trapezIntegral() const;	
 		//! Convert voxel intensity into voxel density
@@ -1331,34 +1415,170 @@ int Voxels<T>::countPoints( const std::vector<Point3D> &points, bool noWrap, boo
 		fill(0);	
 	}
 
-	size_t x,y,z;
-
-	for(size_t ui=0; ui<points.size(); ui++)
+	const size_t nVox=voxels.size();
+	//Choose how to count once, for all the points, so that per-thread
+	// grids are cleared and summed only once
+	const unsigned int strategy=countStrategy(points.size());
+	std::vector<unsigned int> threadCounts;
+	std::vector<size_t> offsets(std::min(points.size(),COUNT_BLOCK_SIZE));
+	for(size_t start=0; start<points.size(); start+=COUNT_BLOCK_SIZE)
 	{
 		if(*voxelsWantAbort)
 			return VOXEL_ABORT_ERR;
-		
-		T value;
-		getIndex(x,y,z,points[ui]);
 
-		//Ensure it lies within the dataset	
-		if(x < binCount[0] && y < binCount[1] && z< binCount[2])
+		const size_t n=std::min(COUNT_BLOCK_SIZE,points.size()-start);
+
+		//Find the voxel for each point. Points outside
+		// the dataset get an offset past the end
+#pragma omp parallel for if(n >= COUNT_PARALLEL_MIN)
+		for(size_t ui=0; ui<n; ui++)
+		{
+			size_t x,y,z;
+			getIndex(x,y,z,points[start+ui]);
+
+			if(x < binCount[0] && y < binCount[1] && z< binCount[2])
+				offsets[ui]=getOffset(x,y,z);
+			else
+				offsets[ui]=nVox;
+		}
+
+		countOffsets(&offsets[0],n,noWrap,strategy,threadCounts);
+	}
+	addThreadCounts(threadCounts,noWrap);
+
+	return 0;
+}
+
+template<class T>
+void Voxels<T>::addCount(size_t n, size_t count, bool noWrap)
+{
+	T v=voxels[n];
+	for(size_t ui=0;ui<count;ui++)
+	{
+		T value=v+T(1);
+		//Prevent wrap-around errors
+		if(noWrap && !(value > v))
+			break;
+		v=value;
+	}
+	voxels[n]=v;
+}
+
+template<class T>
+void Voxels<T>::countOffsets(const size_t *offsets, size_t n, bool noWrap)
+{
+	std::vector<unsigned int> threadCounts;
+	countOffsets(offsets,n,noWrap,countStrategy(n),threadCounts);
+	addThreadCounts(threadCounts,noWrap);
+}
+
+template<class T>
+unsigned int Voxels<T>::countStrategy(size_t totalPoints) const
+{
+	const size_t nVox=voxels.size();
+
+	size_t nThreads=1;
+#ifdef _OPENMP
+	nThreads=omp_get_max_threads();
+#endif
+
+	if(nThreads == 1 || totalPoints < COUNT_PARALLEL_MIN)
+		return COUNT_SERIAL;
+
+	//Private grids must be cheap to clear and sum, compared to the counting
+	if(nVox*nThreads <= totalPoints && 
+		nVox*nThreads*sizeof(unsigned int) <= COUNT_PRIVATE_MAX_BYTES &&
+		totalPoints < std::numeric_limits<unsigned int>::max())
+		return COUNT_THREAD_GRIDS;
+
+	return COUNT_THREAD_SLABS;
+}
+
+template<class T>
+void Voxels<T>::countOffsets(const size_t *offsets, size_t n, bool noWrap,
+		unsigned int strategy, std::vector<unsigned int> &threadCounts)
+{
+	const size_t nVox=voxels.size();
+
+	size_t nThreads=1;
+#ifdef _OPENMP
+	nThreads=omp_get_max_threads();
+#endif
+
+	switch(strategy)
+	{
+		case COUNT_SERIAL:
+		{
+			for(size_t ui=0;ui<n;ui++)
+			{
+				if(offsets[ui] < nVox)
+					addCount(offsets[ui],1,noWrap);
+			}
+			break;
+		}
+		case COUNT_THREAD_GRIDS:
 		{
+			if(threadCounts.empty())
+				threadCounts.resize(nVox*nThreads,0);
+			ASSERT(threadCounts.size() == nVox*nThreads);
+#pragma omp parallel
 			{
-				value=getData(x,y,z)+T(1);
-
-				//Prevent wrap-around errors
-				if (noWrap) {
-					if(value > getData(x,y,z))
-						setData(x,y,z,value);
-				} else {
-					setData(x,y,z,value);
+				size_t thisThread=0;
+#ifdef _OPENMP
+				thisThread=omp_get_thread_num();
+#endif
+				unsigned int *counts=&threadCounts[0] + thisThread*nVox;
+#pragma omp for
+				for(size_t ui=0;ui<n;ui++)
+				{
+					if(offsets[ui] < nVox)
+						counts[offsets[ui]]++;
+				}
+			}
+			break;
+		}
+		case COUNT_THREAD_SLABS:
+		{
+			//Every thread reads all the offsets, but only writes to its own slab
+#pragma omp parallel for schedule(static,1)
+			for(size_t ui=0;ui<nThreads;ui++)
+			{
+				const size_t slabStart=nVox*ui/nThreads;
+				const size_t slabEnd=nVox*(ui+1)/nThreads;
+				for(size_t uj=0;uj<n;uj++)
+				{
+					if(offsets[uj] >= slabStart && offsets[uj] < slabEnd)
+						addCount(offsets[uj],1,noWrap);
 				}
 			}
-		}	
+			break;
+		}
+		default:
+			ASSERT(false);
 	}
+}
 
-	return 0;
+template<class T>
+void Voxels<T>::addThreadCounts(std::vector<unsigned int> &threadCounts, bool noWrap)
+{
+	if(threadCounts.empty())
+		return;
+
+	const size_t nVox=voxels.size();
+	const size_t nThreads=threadCounts.size()/nVox;
+	ASSERT(nThreads*nVox == threadCounts.size());
+
+#pragma omp parallel for
+	for(size_t ui=0;ui<nVox;ui++)
+	{
+		size_t total=0;
+		for(size_t uj=0;uj<nThreads;uj++)
+			total+=threadCounts[uj*nVox+ui];
+		if(total)
+			addCount(ui,total,noWrap);
+	}
+
+	std::vector<unsigned int>().swap(threadCounts);
 }
 
 template<class T>
@@ -1614,24 +1834,142 @@ void Voxels<T>::getInterpolatedData(const Point3D &p, T &v) const
 	
 }	
 
+template<class U>
+void convolveAxisMirrored(U *data, const size_t *dims, unsigned int axis,
+				const std::vector<float> &kernel)
+{
+	ASSERT(axis < 3);
+	ASSERT(kernel.size() % 2 == 1);
+
+	size_t inner=1,outer=1;
+	for(unsigned int ui=0;ui<axis;ui++)
+		inner*=dims[ui];
+	for(unsigned int ui=axis+1;ui<3;ui++)
+		outer*=dims[ui];
+	const size_t len=dims[axis];
+	if(!inner || !outer || !len)
+		return;
+
+	const size_t kLen=kernel.size();
+	const long radius=kLen/2;
+	const size_t padLen=len+2*radius;
+
+	//Filter as many adjacent lines at once as will fit in the tile buffers.
+	// Along x, lines are not adjacent in memory, so take them one at a time
+	size_t width=1;
+	if(inner > 1)
+	{
+		width=CONVOLVE_TILE_BYTES/((padLen+len)*sizeof(float));
+		width=std::max(width,CONVOLVE_TILE_MIN_WIDTH);
+		width=std::min(width,CONVOLVE_TILE_MAX_WIDTH);
+		width=std::min(width,inner);
+	}
+	const size_t tilesPerBlock=(inner+width-1)/width;
+	const long nTiles=outer*tilesPerBlock;
+
+	#pragma omp parallel
+	{
+		std::vector<float> in(padLen*width),out(len*width);
+
+		#pragma omp for schedule(dynamic)
+		for(long ti=0;ti<nTiles;ti++)
+		{
+			size_t start=(ti%tilesPerBlock)*width;
+			size_t w=std::min(width,inner-start);
+			U *base=data+(ti/tilesPerBlock)*len*inner+start;
+
+			//Gather the tile, padding each end by mirroring
+			for(size_t ui=0;ui<padLen;ui++)
+			{
+				const U *src=base+mirrorVoxelIndex((long)ui-radius,len)*inner;
+				float *dst=&in[ui*w];
+				for(size_t uj=0;uj<w;uj++)
+					dst[uj]=src[uj];
+			}
+
+			std::fill(out.begin(),out.begin()+len*w,0.0f);
+			if(w == 1)
+			{
+				//Single line. Run along it for each kernel weight
+				for(size_t uk=0;uk<kLen;uk++)
+				{
+					const float weight=kernel[uk];
+					const float *src=&in[uk];
+					float *dst=&out[0];
+					for(size_t ui=0;ui<len;ui++)
+						dst[ui]+=weight*src[ui];
+				}
+			}
+			else
+			{
+				for(size_t ui=0;ui<len;ui++)
+				{
+					float *dst=&out[ui*w];
+					for(size_t uk=0;uk<kLen;uk++)
+					{
+						const float weight=kernel[uk];
+						const float *src=&in[(ui+uk)*w];
+						for(size_t uj=0;uj<w;uj++)
+							dst[uj]+=weight*src[uj];
+					}
+				}
+			}
+
+			//Scatter the result back
+			for(size_t ui=0;ui<len;ui++)
+			{
+				U *dst=base+ui*inner;
+				const float *src=&out[ui*w];
+				for(size_t uj=0;uj<w;uj++)
+					dst[uj]=(U)src[uj];
+			}
+		}
+	}
+}
+
 template<class T>
 void Voxels<T>::isotropicGaussianSmooth(float stdev,float windowRatio)
 {
-	//perform in-place smoothing
-	vigra::ConvolutionOptions<3> opt  = vigra::ConvolutionOptions<3>().filterWindowSize(windowRatio);
-	vigra::gaussianSmoothMultiArray(vigra::srcMultiArrayRange(voxels),
-			vigra::destMultiArray(voxels),stdev,opt);
+	std::vector<float> kernel;
+	gaussianKernel(stdev,windowRatio,0,kernel);
 
+	//The Gaussian is separable, so smooth along each axis in turn, in place
+	for(unsigned int ui=0;ui<3;ui++)
+		convolveAxisMirrored(voxels.data(),binCount,ui,kernel);
 }
 
 template<class T>
 void Voxels<T>::laplaceOfGaussian(float stdev, float windowRatio)
 {
-	//perform in-place smoothing
-	vigra::ConvolutionOptions<3> opt  = vigra::ConvolutionOptions<3>().filterWindowSize(windowRatio);
-	vigra::laplacianOfGaussianMultiArray(vigra::srcMultiArrayRange(voxels),
-			vigra::destMultiArray(voxels),stdev,opt);
+	std::vector<float> smooth,deriv;
+	gaussianKernel(stdev,windowRatio,0,smooth);
+	gaussianKernel(stdev,windowRatio,2,deriv);
+
+	//Sum, over each axis, the second derivative along that axis
+	// of the data smoothed along the other two
+	const long n=voxels.size();
+	std::vector<float> sum(n),term(n);
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		std::vector<float> &dest = ui ? term : sum;
+		#pragma omp parallel for
+		for(long uj=0;uj<n;uj++)
+			dest[uj]=voxels[uj];
+
+		for(unsigned int uk=0;uk<3;uk++)
+			convolveAxisMirrored(&dest[0],binCount,uk,(uk == ui) ? deriv : smooth);
+
+		if(ui)
+		{
+			#pragma omp parallel for
+			for(long uj=0;uj<n;uj++)
+				sum[uj]+=term[uj];
+		}
+	}
 
+	#pragma omp parallel for
+	for(long uj=0;uj<n;uj++)
+		voxels[uj]=(T)sum[uj];
 }
 
 template<class T>
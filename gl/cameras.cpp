@@ -985,6 +985,53 @@ bool CameraLookAt::readState(xmlNodePtr nodePtr)
 	return true;
 }	
 
+void CameraLookAt::getPickRay(float x, float y, float aspect,
+				float pickSize, PickRay &ray) const
+{
+	//Build the same orthonormal basis as gluLookAt
+	Point3D forwards,across,up;
+	forwards=target-origin;
+	forwards.normalise();
+	across=forwards.crossProd(upDirection);
+	across.normalise();
+	up=across.crossProd(forwards);
+
+	//Normalised device coordinates, y flipped to point upwards
+	float ndcX,ndcY;
+	ndcX=2.0f*x-1.0f;
+	ndcY=1.0f-2.0f*y;
+
+	switch(projectionMode)
+	{
+		case PROJECTION_MODE_PERSPECTIVE:
+		{
+			//apply() passes half the FOV angle to gluPerspective
+			// as the vertical view angle
+			float halfHeight=tan(fovAngle/4.0f*M_PI/180.0);
+			ray.origin=origin;
+			ray.direction=forwards + across*(ndcX*halfHeight*aspect) 
+						+ up*(ndcY*halfHeight);
+			ray.direction.normalise();
+			ray.tMin=nearPlane;
+			ray.radius=0;
+			ray.radiusSlope=2.0f*halfHeight*pickSize;
+			break;
+		}
+		case PROJECTION_MODE_ORTHOGONAL:
+		{
+			ray.origin=origin + across*(ndcX*orthoScale*aspect) 
+						+ up*(ndcY*orthoScale);
+			ray.direction=forwards;
+			ray.tMin=nearPlane;
+			ray.radius=2.0f*orthoScale*pickSize;
+			ray.radiusSlope=0;
+			break;
+		}
+		default:
+			ASSERT(false);
+	}
+}
+
 float CameraLookAt::getViewWidth(float depth) const
 {
 	if(projectionMode == PROJECTION_MODE_PERSPECTIVE)
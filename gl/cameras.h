@@ -67,6 +67,22 @@ enum
 	CAMERA_DIR_XMINUS, //5
 };
 
+//!A ray cast from a camera through a point in the viewport, for picking
+struct PickRay
+{
+	//!Start of the ray
+	Point3D origin;
+	//!Unit direction of the ray
+	Point3D direction;
+	//!Distance along the ray before which hits are clipped (near plane)
+	float tMin;
+	//!Pick tolerance radius at the ray start, and its growth per unit distance
+	float radius,radiusSlope;
+
+	//!Pick tolerance radius at distance t along the ray
+	float toleranceAt(float t) const { return radius + radiusSlope*t;}
+};
+
 class CameraProperty
 {
 	public:
@@ -169,6 +185,12 @@ class Camera
 		//!Ensures that the given boundingbox should look nice, and be visible
 		virtual void ensureVisible(const BoundCube &b, unsigned int face=3)=0;
 
+		//!Compute the ray through the viewport position (x,y), each in [0,1],
+		// y increasing downwards. pickSize is the half-height of the pick 
+		// region, as a fraction of the viewport height
+		virtual void getPickRay(float x, float y, float outputRatio,
+				float pickSize, PickRay &ray) const=0;
+
 		//!Obtain the properties specific to a camera
 		virtual void getProperties(CameraProperties &p) const =0;
 		//!Set the camera property from a key & string pair
@@ -264,6 +286,10 @@ class CameraLookAt : public Camera
 		so "0" is perpendicular to the Z axis and is "visible"
 		 */
 		virtual void ensureVisible(const BoundCube &b, unsigned int face=3);
+
+		//!Compute the pick ray through the given viewport position
+		void getPickRay(float x, float y, float outAspect,
+				float pickSize, PickRay &ray) const;
 		
 		//!Return the user-settable properties of the camera
 		void getProperties(CameraProperties &p) const;
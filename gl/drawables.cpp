@@ -31,9 +31,22 @@
 #include "backend/filters/openvdb_includes.h"
 
 #include <math.h> // for sqrt
+#include <queue>
+#include <functional>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 const float DEPTH_SORT_REORDER_EPSILON = 1e-2;
 
+//Number of points held by each level-of-detail octree node
+const size_t LOD_NODE_CAPACITY=4096;
+//Maximum depth of level-of-detail octree
+const unsigned int LOD_MAX_DEPTH=20;
+//Nodes smaller than this on screen (px) are not refined further
+const float LOD_MIN_REFINE_PIXELS=64.0f;
+
 //Static class variables
 //====
 const Camera *DrawableObj::curCamera = 0;
@@ -48,8 +61,253 @@ TexturePool *DrawableObj::texPool=0;
 unsigned int DrawableObj::winX;
 unsigned int DrawableObj::winY;
 
+RenderStatistics DrawableObj::renderStats;
+
+float DepthSorter::motionThreshold=DEPTH_SORT_REORDER_EPSILON;
+
 //==
 
+//Maximum fraction of out-of-order neighbours for which we attempt 
+// to repair the previous depth ordering, rather than fully resorting
+const float DEPTH_SORT_ADAPTIVE_FRACTION = 0.05f;
+//Maximum number of element moves per element during adaptive repair
+const size_t DEPTH_SORT_ADAPTIVE_MAX_WORK = 8;
+//Radix sort digit width (bits)
+const unsigned int DEPTH_SORT_RADIX_BITS=11;
+
+//Stable, parallel counting sort of values by one radix digit of keys
+void radixSortPass(const std::vector<uint32_t> &keysIn, const std::vector<unsigned int> &valsIn,
+		std::vector<uint32_t> &keysOut, std::vector<unsigned int> &valsOut, unsigned int shift)
+{
+	const size_t RADIX=1<<DEPTH_SORT_RADIX_BITS;
+	const uint32_t MASK=RADIX-1;
+	const size_t n=keysIn.size();
+
+	size_t nChunks=1;
+#ifdef _OPENMP
+	nChunks=omp_get_max_threads();
+#endif
+	//Don't split up small inputs
+	nChunks=std::max((size_t)1,std::min(nChunks,n/(4*RADIX)));
+
+	std::vector<size_t> counts(nChunks*RADIX,0);
+
+	//Histogram each chunk's digits
+	#pragma omp parallel for
+	for(size_t ui=0;ui<nChunks;ui++)
+	{
+		size_t *chunkCount=&counts[ui*RADIX];
+		size_t end=(n*(ui+1))/nChunks;
+		for(size_t uj=(n*ui)/nChunks;uj<end;uj++)
+			chunkCount[(keysIn[uj]>>shift)&MASK]++;
+	}
+
+	//Convert to output offsets; digit-major, then chunk, to keep stability 
+	size_t total=0;
+	for(size_t digit=0;digit<RADIX;digit++)
+	{
+		for(size_t ui=0;ui<nChunks;ui++)
+		{
+			size_t c=counts[ui*RADIX+digit];
+			counts[ui*RADIX+digit]=total;
+			total+=c;
+		}
+	}
+
+	//Scatter
+	#pragma omp parallel for
+	for(size_t ui=0;ui<nChunks;ui++)
+	{
+		size_t *chunkOffset=&counts[ui*RADIX];
+		size_t end=(n*(ui+1))/nChunks;
+		for(size_t uj=(n*ui)/nChunks;uj<end;uj++)
+		{
+			size_t dest=chunkOffset[(keysIn[uj]>>shift)&MASK]++;
+			keysOut[dest]=keysIn[uj];
+			valsOut[dest]=valsIn[uj];
+		}
+	}
+}
+
+void DepthSorter::setPositions(std::vector<Point3D> &pts)
+{
+	refPositions=0;
+	ownPositions.swap(pts);
+	resetOrder();
+}
+
+void DepthSorter::referencePositions(const std::vector<Point3D> &pts)
+{
+	ownPositions.clear();
+	refPositions=&pts;
+	resetOrder();
+}
+
+void DepthSorter::resetOrder()
+{
+	order.clear();
+	orderValid=false;
+
+	BoundCube bc;
+	if(positions().size())
+	{
+		bc.setBounds(positions());
+		centre=bc.getCentroid();
+	}
+}
+
+void DepthSorter::clear()
+{
+	ownPositions.clear();
+	refPositions=0;
+	order.clear();
+	orderValid=false;
+}
+
+const std::vector<unsigned int> &DepthSorter::sort(const Point3D &camOrigin,
+						RenderStatistics &stats)
+{
+	const std::vector<Point3D> &positions=this->positions();
+	if(positions.empty())
+	{
+		order.clear();
+		return order;
+	}
+
+	timeval startTime;
+	gettimeofday(&startTime,NULL);
+
+	if(!orderValid || order.size() != positions.size())
+	{
+		radixSort(camOrigin);
+		stats.elementsSorted+=positions.size();
+		stats.sortsFull++;
+	}
+	else
+	{
+		//Skip resorting if camera has not moved significantly
+		float camDist=sqrtf(camOrigin.sqrDist(centre));
+		if(sqrtf(camOrigin.sqrDist(lastCamOrigin)) <= motionThreshold*camDist)
+		{
+			stats.sortsSkipped++;
+			return order;
+		}
+
+		//Obtain distances in the previous ordering, 
+		// and count the number of out-of-order neighbours 
+		std::vector<float> dists(order.size());
+		size_t numDescents=0;
+		#pragma omp parallel for
+		for(size_t ui=0;ui<order.size();ui++)
+		{
+			dists[ui]=positions[order[ui]].sqrDist(camOrigin);
+		}
+		for(size_t ui=1;ui<dists.size();ui++)
+		{
+			if(dists[ui] > dists[ui-1])
+				numDescents++;
+		}
+
+		if(numDescents > DEPTH_SORT_ADAPTIVE_FRACTION*dists.size() ||
+				!adaptiveSort(dists))
+		{
+			radixSort(camOrigin);
+			stats.sortsFull++;
+		}
+		else
+			stats.sortsRepaired++;
+		stats.elementsSorted+=positions.size();
+	}
+
+	lastCamOrigin=camOrigin;
+
+	timeval endTime;
+	gettimeofday(&endTime,NULL);
+	stats.sortTime+=(float)(endTime.tv_sec - startTime.tv_sec) + 
+			(endTime.tv_usec-startTime.tv_usec)/1.0e6;
+
+	return order;
+}
+
+bool DepthSorter::adaptiveSort(std::vector<float> &dists)
+{
+	ASSERT(dists.size() == order.size());
+	const size_t maxWork=DEPTH_SORT_ADAPTIVE_MAX_WORK*dists.size();
+
+	//Work on copies, so we can give up part way through
+	std::vector<float> d(dists);
+	std::vector<unsigned int> o(order);
+	size_t work=0;
+	for(size_t ui=1;ui<d.size();ui++)
+	{
+		float curDist=d[ui];
+		unsigned int curIdx=o[ui];
+		size_t uj=ui;
+		//Back to front, so distances must be decreasing
+		while(uj && d[uj-1] < curDist)
+		{
+			d[uj]=d[uj-1];
+			o[uj]=o[uj-1];
+			uj--;
+		}
+		d[uj]=curDist;
+		o[uj]=curIdx;
+
+		work+=ui-uj;
+		if(work > maxWork)
+			return false;
+	}
+
+	order.swap(o);
+	dists.swap(d);
+	return true;
+}
+
+void DepthSorter::radixSort(const Point3D &camOrigin)
+{
+	const std::vector<Point3D> &positions=this->positions();
+	const size_t n=positions.size();
+	std::vector<float> dists(n);
+	float minDist=std::numeric_limits<float>::max();
+	float maxDist=0;
+
+	#pragma omp parallel for
+	for(size_t ui=0;ui<n;ui++)
+		dists[ui]=positions[ui].sqrDist(camOrigin);
+
+	for(size_t ui=0;ui<n;ui++)
+	{
+		minDist=std::min(minDist,dists[ui]);
+		maxDist=std::max(maxDist,dists[ui]);
+	}
+
+	//Quantise distances, so that the farthest has the smallest key
+	std::vector<uint32_t> keys(n),keysTmp(n);
+	std::vector<unsigned int> vals(n),valsTmp(n);
+	double scale=0;
+	if(maxDist > minDist)
+		scale= (double)std::numeric_limits<uint32_t>::max()/((double)maxDist-(double)minDist);
+
+	#pragma omp parallel for
+	for(size_t ui=0;ui<n;ui++)
+	{
+		keys[ui]=(uint32_t)(((double)maxDist-(double)dists[ui])*scale);
+		vals[ui]=ui;
+	}
+	
+	//Least significant digit first
+	for(unsigned int shift=0;shift<32;shift+=DEPTH_SORT_RADIX_BITS)
+	{
+		radixSortPass(keys,vals,keysTmp,valsTmp,shift);
+		keys.swap(keysTmp);
+		vals.swap(valsTmp);
+	}
+
+	order.swap(vals);
+	orderValid=true;
+}
+
+
 
 //Draw a cone pointing in the axisVec direction, positioned at 
 //	- (if translateAxis is true, origin+axisVec, otherwise origin)
@@ -291,6 +549,112 @@ Point3D DrawableObj::getCentroid() const
 	ASSERT(!isExplodable());
 }
 
+bool DrawableObj::intersectRay(const PickRay &ray, float &t) const
+{
+	BoundCube b;
+	getBoundingBox(b);
+	if(!b.isValid())
+		return false;
+
+	return intersectRayBox(ray,b,pickTolerance(ray,b),t);
+}
+
+bool intersectRayBox(const PickRay &ray, const BoundCube &b, float pad, float &tHit)
+{
+	//Slab test
+	float tNear=ray.tMin;
+	float tFar=std::numeric_limits<float>::max();
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		float lo,hi;
+		lo=b.getBound(ui,0)-pad;
+		hi=b.getBound(ui,1)+pad;
+
+		//Ray parallel to slab
+		if(fabs(ray.direction[ui]) < std::numeric_limits<float>::epsilon())
+		{
+			if(ray.origin[ui] < lo || ray.origin[ui] > hi)
+				return false;
+			continue;
+		}
+
+		float invDir=1.0f/ray.direction[ui];
+		float t0,t1;
+		t0=(lo-ray.origin[ui])*invDir;
+		t1=(hi-ray.origin[ui])*invDir;
+		if(t0 > t1)
+			std::swap(t0,t1);
+
+		tNear=std::max(tNear,t0);
+		tFar=std::min(tFar,t1);
+		if(tNear > tFar)
+			return false;
+	}
+
+	tHit=tNear;
+	return true;
+}
+
+float pickTolerance(const PickRay &ray, const BoundCube &b)
+{
+	Point3D low,high;
+	b.getBounds(low,high);
+	float farDist = sqrtf(ray.origin.sqrDist(b.getCentroid())) + 
+				0.5f*sqrtf(low.sqrDist(high));
+	return ray.toleranceAt(farDist);
+}
+
+//Intersect a pick ray with the line segment a-b, using the ray's tolerance
+// as the segment's radius
+static bool intersectRaySegment(const PickRay &ray, const Point3D &a, 
+					const Point3D &b, float &t)
+{
+	Point3D seg,w;
+	seg=b-a;
+	w=ray.origin-a;
+
+	float segSqr,dirSeg,dirW,segW;
+	segSqr=seg.sqrMag();
+	dirSeg=ray.direction.dotProd(seg);
+	dirW=ray.direction.dotProd(w);
+	segW=seg.dotProd(w);
+
+	//Find the segment parameter of the closest approach between the 
+	// infinite lines, then clamp it to the segment. 
+	float s;
+	float denom = segSqr - dirSeg*dirSeg;
+	if(segSqr < std::numeric_limits<float>::epsilon())
+		s=0;
+	else if(denom < std::numeric_limits<float>::epsilon()*segSqr)
+		s=0; //Parallel; any point will do
+	else
+		s=(segW - dirSeg*dirW)/denom;
+	s=std::min(std::max(s,0.0f),1.0f);
+
+	//Nearest ray position to the clamped segment point
+	Point3D segPt;
+	segPt=a+seg*s;
+	float tRay=(segPt-ray.origin).dotProd(ray.direction);
+	if(tRay < ray.tMin)
+	{
+		//Clip to the near plane, and re-find the segment point
+		tRay=ray.tMin;
+		if(segSqr >= std::numeric_limits<float>::epsilon())
+		{
+			s=(ray.origin+ray.direction*tRay-a).dotProd(seg)/segSqr;
+			s=std::min(std::max(s,0.0f),1.0f);
+			segPt=a+seg*s;
+		}
+	}
+
+	float tol=ray.toleranceAt(tRay);
+	if((ray.origin+ray.direction*tRay).sqrDist(segPt) > tol*tol)
+		return false;
+
+	t=tRay;
+	return true;
+}
+
 //=====
 
 DrawPoint::DrawPoint() : origin(0.0f,0.0f,0.0f), r(1.0f), g(1.0f), b(1.0f), a(1.0f)
@@ -358,6 +722,11 @@ void DrawVector::getBoundingBox(BoundCube &b) const
 	b.setBounds(origin,vector+origin);
 }
 
+bool DrawVector::intersectRay(const PickRay &ray, float &t) const
+{
+	return intersectRaySegment(ray,origin,origin+vector,t);
+}
+
 void DrawVector::setColour(float rnew, float gnew, float bnew, float anew)
 {
 	r=rnew;
@@ -754,6 +1123,32 @@ void DrawSphere::getBoundingBox(BoundCube &b) const
 	}
 }
 
+bool DrawSphere::intersectRay(const PickRay &ray, float &t) const
+{
+	Point3D delta;
+	delta=origin-ray.origin;
+
+	//Distance along ray to closest approach of centre
+	float tCentre=delta.dotProd(ray.direction);
+	float rad=radius+ray.toleranceAt(std::max(tCentre,0.0f));
+
+	float sqrPerp=delta.sqrMag()-tCentre*tCentre;
+	if(sqrPerp > rad*rad)
+		return false;
+
+	float halfChord=sqrtf(rad*rad-sqrPerp);
+	t=tCentre-halfChord;
+	if(t < ray.tMin)
+	{
+		//Front surface is clipped, so we may see the back face
+		t=tCentre+halfChord;
+		if(t < ray.tMin)
+			return false;
+	}
+
+	return true;
+}
+
 void DrawSphere::setOrigin(const Point3D &p)
 {
 	origin = p;
@@ -956,6 +1351,76 @@ void DrawCylinder::setColour(float rnew, float gnew, float bnew, float anew)
 	a=anew;
 }
 
+bool DrawCylinder::intersectRay(const PickRay &ray, float &t) const
+{
+	float length=sqrtf(direction.sqrMag());
+	if(length < std::numeric_limits<float>::epsilon())
+		return false;
+
+	Point3D axis;
+	axis=direction*(1.0f/length);
+
+	//Cylinder is centred on the origin, and spans +-length/2 along axis.
+	// Work in components parallel and perpendicular to the axis
+	Point3D delta;
+	delta=ray.origin-origin;
+	float tol=ray.toleranceAt(std::max(-delta.dotProd(ray.direction),0.0f));
+	float rad=radius+tol;
+	float halfLen=0.5f*length+tol;
+
+	float deltaAx,dirAx;
+	deltaAx=delta.dotProd(axis);
+	dirAx=ray.direction.dotProd(axis);
+	Point3D deltaPerp,dirPerp;
+	deltaPerp=delta-axis*deltaAx;
+	dirPerp=ray.direction-axis*dirAx;
+
+	float tBest=std::numeric_limits<float>::max();
+
+	//Curved surface. Solve |deltaPerp + t*dirPerp|^2 = rad^2
+	float qa,qb,qc;
+	qa=dirPerp.sqrMag();
+	qb=2.0f*deltaPerp.dotProd(dirPerp);
+	qc=deltaPerp.sqrMag()-rad*rad;
+	if(qa > std::numeric_limits<float>::epsilon())
+	{
+		float disc=qb*qb-4.0f*qa*qc;
+		if(disc >=0)
+		{
+			float sqrtDisc=sqrtf(disc);
+			float roots[2];
+			roots[0]=(-qb-sqrtDisc)/(2.0f*qa);
+			roots[1]=(-qb+sqrtDisc)/(2.0f*qa);
+			for(unsigned int ui=0;ui<2;ui++)
+			{
+				if(roots[ui] < ray.tMin || roots[ui] >=tBest)
+					continue;
+				if(fabs(deltaAx+roots[ui]*dirAx) <= halfLen)
+					tBest=roots[ui];
+			}
+		}
+	}
+
+	//End caps
+	if(fabs(dirAx) > std::numeric_limits<float>::epsilon())
+	{
+		for(int side=-1;side<=1;side+=2)
+		{
+			float tCap=(side*halfLen-deltaAx)/dirAx;
+			if(tCap < ray.tMin || tCap >=tBest)
+				continue;
+			if((deltaPerp+dirPerp*tCap).sqrMag() <= rad*rad)
+				tBest=tCap;
+		}
+	}
+
+	if(tBest == std::numeric_limits<float>::max())
+		return false;
+
+	t=tBest;
+	return true;
+}
+
 void DrawCylinder::getBoundingBox(BoundCube &b) const
 {
 
@@ -996,7 +1461,271 @@ void DrawCylinder::getBoundingBox(BoundCube &b) const
 
 //======
 
-DrawManyPoints::DrawManyPoints() : r(1.0f),g(1.0f),b(1.0f),a(1.0f), size(1.0f)
+bool LODView::setFromCamera(const Camera *cam, unsigned int winX, unsigned int winY)
+{
+	if(!cam || !winX || !winY)
+		return false;
+
+	float aspect=(float)winX/(float)winY;
+	pixelHeight=winY;
+	switch(cam->type())
+	{
+		case CAM_LOOKAT:
+		{
+			const CameraLookAt *c=(const CameraLookAt *)cam;
+			origin=c->getOrigin();
+			
+			//Same basis as gluLookAt
+			forwards=c->getTarget()-origin;
+			forwards.normalise();
+			across=forwards.crossProd(c->getUpDirection());
+			across.normalise();
+			up=across.crossProd(forwards);
+
+			perspective=(c->getProjectionMode() == PROJECTION_MODE_PERSPECTIVE);
+			if(perspective)
+			{
+				//Camera passes half its FOV to gluPerspective, as the 
+				// vertical view angle
+				halfHeight=tan(c->getFOV()/4.0f*M_PI/180.0);
+			}
+			else
+				halfHeight=c->getOrthoScale();
+			halfWidth=halfHeight*aspect;
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+bool LODView::isVisible(const Point3D &centre, float radius) const
+{
+	Point3D delta;
+	delta=centre-origin;
+	float depth,x,y;
+	depth=delta.dotProd(forwards);
+	x=delta.dotProd(across);
+	y=delta.dotProd(up);
+
+	if(perspective)
+	{
+		if(depth < -radius)
+			return false;
+
+		//Distance outside each side plane of the frustum. The plane 
+		// normals are (+-across - forwards*halfWidth)/norm, etc.
+		float normW=sqrtf(1.0f+halfWidth*halfWidth);
+		float normH=sqrtf(1.0f+halfHeight*halfHeight);
+		if((fabs(x) - depth*halfWidth) > radius*normW)
+			return false;
+		if((fabs(y) - depth*halfHeight) > radius*normH)
+			return false;
+		return true;
+	}
+	
+	return fabs(x) <= halfWidth+radius && fabs(y) <= halfHeight+radius;
+}
+
+float LODView::projectedSize(const Point3D &centre, float radius) const
+{
+	if(!perspective)
+		return radius*pixelHeight/halfHeight;
+
+	//Camera inside (or very near) the sphere, treat it as huge
+	float dist=sqrtf(centre.sqrDist(origin))-radius;
+	if(dist <= std::numeric_limits<float>::epsilon())
+		return std::numeric_limits<float>::max();
+
+	return radius*pixelHeight/(dist*halfHeight);
+}
+
+void PointLODTree::build(std::vector<Point3D> &p)
+{
+	pts.swap(p);
+	p.clear();
+	nodes.clear();
+	pointBounds.setInvalid();
+	if(pts.empty())
+		return;
+
+	//Randomise point order. Every partitioning step below is stable, so
+	// any contiguous range of a node's points is then a random sample
+	std::random_shuffle(pts.begin(),pts.end());
+
+	//Root node is the cube that contains all points
+	pointBounds.setBounds(pts);
+	BoundCube b=pointBounds;
+	{
+	Point3D c=b.getCentroid();
+	float halfSize=0.5f*b.getLargestDim();
+	Point3D offset(halfSize,halfSize,halfSize);
+	b.setBounds(c-offset,c+offset);
+	}
+
+	LODNode root;
+	root.bound=b;
+	root.start=0;
+	root.count=0;
+	nodes.push_back(root);
+
+	//Number of points in each node's subtree, which starts at node.start 
+	std::vector<size_t> subtreeSize(1,pts.size());
+	std::vector<Point3D> buffer(pts.size());
+
+	//Build level by level, splitting each level's nodes in parallel
+	size_t levelBegin=0,levelEnd=1;
+	unsigned int depth=0;
+	while(levelBegin < levelEnd)
+	{
+		std::vector<size_t> octantCount(8*(levelEnd-levelBegin),0);
+
+		#pragma omp parallel for schedule(dynamic)
+		for(size_t ui=levelBegin;ui<levelEnd;ui++)
+		{
+			LODNode &node=nodes[ui];
+			size_t total=subtreeSize[ui];
+			if(total <=LOD_NODE_CAPACITY || depth == LOD_MAX_DEPTH)
+			{
+				node.count=total;
+				continue;
+			}
+
+			//Keep a sample here, and pass the rest to the octants
+			node.count=LOD_NODE_CAPACITY;
+			size_t begin=node.start+node.count;
+			size_t end=node.start+total;
+			Point3D centre=node.bound.getCentroid();
+
+			size_t *counts=&octantCount[8*(ui-levelBegin)];
+			for(size_t uj=begin;uj<end;uj++)
+			{
+				unsigned int oct=(pts[uj][0] >=centre[0]) | 
+						((pts[uj][1] >= centre[1])<<1) | 
+						((pts[uj][2] >= centre[2])<<2);
+				counts[oct]++;
+			}
+
+			//Stable scatter into octant order
+			size_t offsets[8];
+			offsets[0]=begin;
+			for(unsigned int uj=1;uj<8;uj++)
+				offsets[uj]=offsets[uj-1]+counts[uj-1];
+			for(size_t uj=begin;uj<end;uj++)
+			{
+				unsigned int oct=(pts[uj][0] >=centre[0]) | 
+						((pts[uj][1] >= centre[1])<<1) | 
+						((pts[uj][2] >= centre[2])<<2);
+				buffer[offsets[oct]++]=pts[uj];
+			}
+			std::copy(buffer.begin()+begin,buffer.begin()+end,pts.begin()+begin);
+		}
+
+		//Create the children of this level's nodes
+		for(size_t ui=levelBegin;ui<levelEnd;ui++)
+		{
+			nodes[ui].firstChild=nodes.size();
+			nodes[ui].numChildren=0;
+			
+			size_t *counts=&octantCount[8*(ui-levelBegin)];
+			size_t offset=nodes[ui].start+nodes[ui].count;
+			Point3D low,high,centre;
+			nodes[ui].bound.getBounds(low,high);
+			centre=nodes[ui].bound.getCentroid();
+			for(unsigned int oct=0;oct<8;oct++)
+			{
+				if(!counts[oct])
+					continue;
+
+				LODNode child;
+				Point3D cLow,cHigh;
+				for(unsigned int uj=0;uj<3;uj++)
+				{
+					if(oct & (1<<uj))
+					{
+						cLow[uj]=centre[uj];
+						cHigh[uj]=high[uj];
+					}
+					else
+					{
+						cLow[uj]=low[uj];
+						cHigh[uj]=centre[uj];
+					}
+				}
+				child.bound.setBounds(cLow,cHigh);
+				child.start=offset;
+				child.count=0;
+				nodes.push_back(child);
+				subtreeSize.push_back(counts[oct]);
+
+				offset+=counts[oct];
+				nodes[ui].numChildren++;
+			}
+		}
+
+		levelBegin=levelEnd;
+		levelEnd=nodes.size();
+		depth++;
+	}
+
+	for(size_t ui=0;ui<nodes.size();ui++)
+	{
+		Point3D low,high;
+		nodes[ui].bound.getBounds(low,high);
+		nodes[ui].centre=nodes[ui].bound.getCentroid();
+		nodes[ui].radius=0.5f*sqrtf(low.sqrDist(high));
+	}
+}
+
+void PointLODTree::getBoundingBox(BoundCube &b) const
+{
+	b=pointBounds;
+}
+
+size_t PointLODTree::selectNodes(const LODView &view, size_t pointBudget, 
+				std::vector<unsigned int> &selected) const
+{
+	selected.clear();
+	if(nodes.empty() || !view.isVisible(nodes[0].centre,nodes[0].radius))
+		return 0;
+
+	//Refine the largest nodes on screen first
+	std::priority_queue<std::pair<float,unsigned int> > queue;
+	queue.push(std::make_pair(view.projectedSize(nodes[0].centre,nodes[0].radius),0u));
+
+	size_t numPts=0;
+	while(!queue.empty())
+	{
+		unsigned int nodeIdx=queue.top().second;
+		queue.pop();
+
+		const LODNode &node=nodes[nodeIdx];
+		//Always draw the root, so that something is visible
+		if(nodeIdx && numPts + node.count > pointBudget)
+			break;
+
+		selected.push_back(nodeIdx);
+		numPts+=node.count;
+
+		for(unsigned int ui=node.firstChild;ui<node.firstChild+node.numChildren;ui++)
+		{
+			const LODNode &child=nodes[ui];
+			if(!view.isVisible(child.centre,child.radius))
+				continue;
+
+			//Child is too small on screen to need more detail
+			float size=view.projectedSize(child.centre,child.radius);
+			if(size < LOD_MIN_REFINE_PIXELS)
+				continue;
+
+			queue.push(std::make_pair(size,ui));
+		}
+	}
+
+	return numPts;
+}
+
+DrawManyPoints::DrawManyPoints() : r(1.0f),g(1.0f),b(1.0f),a(1.0f), size(1.0f), pointBudget(0)
 {
 	wantsLight=false;
 }
@@ -1014,6 +1743,11 @@ DrawableObj* DrawManyPoints::clone() const
 
 void DrawManyPoints::getBoundingBox(BoundCube &b) const
 {
+	if(lodTree)
+	{
+		lodTree->getBoundingBox(b);
+		return;
+	}
 
 	//Update the cache as needed
 	if(!haveCachedBounds)
@@ -1069,6 +1803,12 @@ void DrawManyPoints::setSize(float f)
 	size=f;
 }
 
+void DrawManyPoints::setLODTree(const std::shared_ptr<const PointLODTree> &tree, size_t budget)
+{
+	lodTree=tree;
+	pointBudget=budget;
+}
+
 void DrawManyPoints::draw() const
 {
 	//Don't draw transparent objects
@@ -1076,6 +1816,29 @@ void DrawManyPoints::draw() const
 		return;
 
 	glPointSize(size); 
+	if(lodTree)
+	{
+		//Choose the tree nodes to draw for the current view
+		LODView view;
+		if(!view.setFromCamera(curCamera,winX,winY))
+			return;
+
+		std::vector<unsigned int> selected;
+		renderStats.pointsDrawn+=lodTree->selectNodes(view,pointBudget,selected);
+
+		glColor4f(r,g,b,a);
+		glEnableClientState(GL_VERTEX_ARRAY);
+		for(size_t ui=0;ui<selected.size();ui++)
+		{
+			size_t count;
+			const Point3D *nodePts=lodTree->getNodePoints(selected[ui],count);
+			glVertexPointer(3,GL_FLOAT,sizeof(Point3D),nodePts->getValueArr());
+			glDrawArrays(GL_POINTS,0,count);
+		}
+		glDisableClientState(GL_VERTEX_ARRAY);
+		return;
+	}
+
 	glBegin(GL_POINTS);
 		glColor4f(r,g,b,a);
 		//TODO: Consider Vertex buffer objects. would be faster, but less portable.
@@ -1084,6 +1847,7 @@ void DrawManyPoints::draw() const
 			glVertex3fv(pts[ui].getValueArr());
 		}
 	glEnd();
+	renderStats.pointsDrawn+=pts.size();
 }
 
 //======
@@ -1600,6 +2364,51 @@ void DrawRectPrism::getBoundingBox(BoundCube &b) const
 			pMax[0],pMax[1],pMax[2]);
 }
 
+bool DrawRectPrism::intersectRay(const PickRay &ray, float &t) const
+{
+	BoundCube b;
+	getBoundingBox(b);
+	float pad=pickTolerance(ray,b);
+
+	if(!intersectRayBox(ray,b,pad,t))
+		return false;
+
+	if(drawMode != DRAW_WIREFRAME)
+		return true;
+
+	//Wireframe boxes can only be hit on their edges
+	bool haveHit=false;
+	float tBest=std::numeric_limits<float>::max();
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		//Connect each corner to the neighbours with a larger index
+		Point3D corner( (ui&1) ? pMax[0]: pMin[0],
+				(ui&2) ? pMax[1]: pMin[1],
+				(ui&4) ? pMax[2]: pMin[2]);
+		for(unsigned int bit=1;bit<8;bit<<=1)
+		{
+			if(ui & bit)
+				continue;
+
+			unsigned int uj=ui|bit;
+			Point3D other( (uj&1) ? pMax[0]: pMin[0],
+					(uj&2) ? pMax[1]: pMin[1],
+					(uj&4) ? pMax[2]: pMin[2]);
+
+			float tEdge;
+			if(intersectRaySegment(ray,corner,other,tEdge) && tEdge < tBest)
+			{
+				tBest=tEdge;
+				haveHit=true;
+			}
+		}
+	}
+
+	if(haveHit)
+		t=tBest;
+	return haveHit;
+}
+
 void DrawRectPrism::draw() const
 {
 	ASSERT(r <=1.0f && g<=1.0f && b <=1.0f && a <=1.0f);
@@ -2381,10 +3190,30 @@ DrawField3D::~DrawField3D()
 }
 
 
+void DrawField3D::getFieldBounds(Point3D &minB, Point3D &maxB) const
+{
+	if(sparseField)
+	{
+		//Span the voxels that hold data
+		openvdb::CoordBBox bbox = sparseField->evalActiveVoxelBoundingBox();
+		openvdb::Vec3d lo,hi;
+		lo=sparseField->indexToWorld(bbox.min());
+		hi=sparseField->indexToWorld(bbox.max()+openvdb::Coord(1,1,1));
+		minB=Point3D(lo[0],lo[1],lo[2]);
+		maxB=Point3D(hi[0],hi[1],hi[2]);
+		return;
+	}
+
+	ASSERT(field);
+	minB=field->getMinBounds();
+	maxB=field->getMaxBounds();
+}
+
 void DrawField3D::getBoundingBox(BoundCube &b) const
 {
-	ASSERT(field)
-	b.setBounds(field->getMinBounds(),field->getMaxBounds());
+	Point3D minB,maxB;
+	getFieldBounds(minB,maxB);
+	b.setBounds(minB,maxB);
 }
 
 
@@ -2393,6 +3222,12 @@ void DrawField3D::setField(const Voxels<float> *newField)
 	field=newField;
 }
 
+void DrawField3D::setField(openvdb::FloatGrid::Ptr newField)
+{
+	sparseField=newField;
+	ptsCacheOK=false;
+}
+
 void DrawField3D::setRenderMode(unsigned int mode)
 {
 	volumeRenderMode=mode;
@@ -2400,8 +3235,13 @@ void DrawField3D::setRenderMode(unsigned int mode)
 
 void DrawField3D::setColourMinMax()
 {
-	colourMapBound[0]=field->min();
-	colourMapBound[1]=field->max();
+	if(sparseField)
+		sparseField->evalMinMax(colourMapBound[0],colourMapBound[1]);
+	else
+	{
+		colourMapBound[0]=field->min();
+		colourMapBound[1]=field->max();
+	}
 
 	ASSERT(colourMapBound[0] <=colourMapBound[1]);
 }
@@ -2412,24 +3252,49 @@ void DrawField3D::draw() const
 	if(alphaVal < sqrtf(std::numeric_limits<float>::epsilon()))
 		return;
 
-	ASSERT(field);
+	ASSERT(field || sparseField);
 
 	//Depend upon the render mode
 	switch(volumeRenderMode)
 	{
 		case VOLUME_POINTS:
 		{
-			size_t fieldSizeX,fieldSizeY,fieldSizeZ;
-			Point3D p;
+			if(!ptsCacheOK && sparseField)
+			{
+				//Visit only the voxels that hold data
+				ptsCache.clear();
+				ptsColours.clear();
+				openvdb::Vec3d halfVoxel=sparseField->voxelSize()*0.5;
+				for (openvdb::FloatGrid::ValueOnCIter iter = sparseField->cbeginValueOn(); iter; ++iter)
+				{
+					float v=iter.getValue();
+					if(v <= std::numeric_limits<float>::epsilon())
+						continue;
 
-			field->getSize(fieldSizeX,fieldSizeY, fieldSizeZ);
+					RGBThis rgb;
+					colourMapWrap(colourMapID,rgb.v,v, 
+							colourMapBound[0],colourMapBound[1],false);
 
-			Point3D delta;
-			delta = field->getPitch();
-			delta*=0.5;
-			if(!ptsCacheOK)
+					openvdb::Vec3d pos=sparseField->indexToWorld(iter.getCoord())+halfVoxel;
+					ptsCache.push_back(Point3D(pos[0],pos[1],pos[2]));
+					ptsColours.push_back(rgb);
+				}
+
+				depthOrder.referencePositions(ptsCache);
+
+				ptsCacheOK=true;
+			}
+			else if(!ptsCacheOK)
 			{
+				size_t fieldSizeX,fieldSizeY,fieldSizeZ;
+
+				field->getSize(fieldSizeX,fieldSizeY, fieldSizeZ);
+
+				Point3D delta;
+				delta = field->getPitch();
+				delta*=0.5;
 				ptsCache.clear();
+				ptsColours.clear();
 				for(unsigned int uiX=0; uiX<fieldSizeX; uiX++)
 				{
 					for(unsigned int uiY=0; uiY<fieldSizeY; uiY++)
@@ -2446,36 +3311,24 @@ void DrawField3D::draw() const
 										field->getData(uiX,uiY,uiZ), 
 										colourMapBound[0],colourMapBound[1],false);
 								
-								ptsCache.push_back(make_pair(field->getPoint(uiX,uiY,uiZ)+delta,rgb));
+								ptsCache.push_back(field->getPoint(uiX,uiY,uiZ)+delta);
+								ptsColours.push_back(rgb);
 							}
 						}
 					}
 				}
 					
+				depthOrder.referencePositions(ptsCache);
 
 				ptsCacheOK=true;
 			}
 
 			if(alphaVal < 1.0f && useAlphaBlend)
 			{
-				//We need to generate some points, then sort them by distance
+				//Points must be drawn in order of distance
 				//from eye (back to front), otherwise they will not blend properly
-				std::vector<std::pair<float,unsigned int >  > eyeDists;
-
-				Point3D camOrigin = curCamera->getOrigin();
-
-				eyeDists.resize(ptsCache.size());
-				
-				//Set up an original index for the eye distances
-				#pragma omp parallel for
-				for(unsigned int ui=0;ui<ptsCache.size();ui++)
-				{
-					eyeDists[ui].first=ptsCache[ui].first.sqrDist(camOrigin);
-					eyeDists[ui].second=ui;
-				}
-
-				ComparePairFirstReverse cmp;
-				std::sort(eyeDists.begin(),eyeDists.end(),cmp);	
+				const std::vector<unsigned int> &eyeOrder = 
+					depthOrder.sort(curCamera->getOrigin(),renderStats);
 
 				//render each element in the field as a point
 				//the colour of the point is determined by its scalar value
@@ -2485,13 +3338,13 @@ void DrawField3D::draw() const
 				for(unsigned int ui=0;ui<ptsCache.size();ui++)
 				{
 					unsigned int idx;
-					idx=eyeDists[ui].second;
+					idx=eyeOrder[ui];
 					//Tell openGL about it
-					glColor4f(((float)(ptsCache[idx].second.v[0]))/255.0f, 
-							((float)(ptsCache[idx].second.v[1]))/255.0f,
-							((float)(ptsCache[idx].second.v[2]))/255.0f, 
+					glColor4f(((float)(ptsColours[idx].v[0]))/255.0f, 
+							((float)(ptsColours[idx].v[1]))/255.0f,
+							((float)(ptsColours[idx].v[2]))/255.0f, 
 							alphaVal);
-					glVertex3fv(ptsCache[idx].first.getValueArr());
+					glVertex3fv(ptsCache[idx].getValueArr());
 				}
 				glEnd();
 				glDepthMask(GL_TRUE);
@@ -2503,11 +3356,11 @@ void DrawField3D::draw() const
 				for(unsigned int ui=0;ui<ptsCache.size();ui++)
 				{
 					//Tell openGL about it
-					glColor4f(((float)(ptsCache[ui].second.v[0]))/255.0f, 
-							((float)(ptsCache[ui].second.v[1]))/255.0f,
-							((float)(ptsCache[ui].second.v[2]))/255.0f, 
+					glColor4f(((float)(ptsColours[ui].v[0]))/255.0f, 
+							((float)(ptsColours[ui].v[1]))/255.0f,
+							((float)(ptsColours[ui].v[2]))/255.0f, 
 							1.0f);
-					glVertex3fv(ptsCache[ui].first.getValueArr());
+					glVertex3fv(ptsCache[ui].getValueArr());
 				}
 				glEnd();
 			}
@@ -2529,8 +3382,9 @@ void DrawField3D::draw() const
 		else
 			alphaUse=1.0f;
 		
-		drawBox(field->getMinBounds(),field->getMaxBounds(),
-			boxColourR, boxColourG,boxColourB,alphaUse);
+		Point3D minB,maxB;
+		getFieldBounds(minB,maxB);
+		drawBox(minB,maxB,boxColourR, boxColourG,boxColourB,alphaUse);
 	}
 }
 
@@ -2582,6 +3436,7 @@ void DrawIsoSurface::swapVoxels(Voxels<float> *f)
 	std::swap(f,voxels);
 	cacheOK=false;
 	mesh.clear();
+	depthOrder.clear();
 }
 
 
@@ -2591,6 +3446,13 @@ void DrawIsoSurface::updateMesh() const
 	mesh.clear();
 	marchingCubes(*voxels, threshold,mesh);
 
+	//Sort triangles by their centroids
+	vector<Point3D> centroids(mesh.size());
+	#pragma omp parallel for
+	for(size_t ui=0;ui<mesh.size();ui++)
+		mesh[ui].getCentroid(centroids[ui]);
+	depthOrder.setPositions(centroids);
+
 	cacheOK=true;
 
 }
@@ -2624,26 +3486,10 @@ void DrawIsoSurface::draw() const
 	//rather than direct triangles.
 	if(a < 1.0f && useAlphaBlend )
 	{
-		//We need to sort them by distance
+		//Triangles must be drawn in order of distance
 		//from eye (back to front), otherwise they will not blend properly
-		std::vector<std::pair<float,unsigned int >  > eyeDists;
-
-		Point3D camOrigin = curCamera->getOrigin();
-		eyeDists.resize(mesh.size());
-		
-		//Set up an original index for the eye distances
-		#pragma omp parallel for shared(camOrigin)
-		for(unsigned int ui=0;ui<mesh.size();ui++)
-		{
-			Point3D centroid;
-			mesh[ui].getCentroid(centroid);
-
-			eyeDists[ui].first=centroid.sqrDist(camOrigin);
-			eyeDists[ui].second=ui;
-		}
-
-		ComparePairFirstReverse cmp;
-		std::sort(eyeDists.begin(),eyeDists.end(),cmp);	
+		const std::vector<unsigned int> &eyeOrder = 
+			depthOrder.sort(curCamera->getOrigin(),renderStats);
 					
 
 		glDepthMask(GL_FALSE);
@@ -2655,7 +3501,7 @@ void DrawIsoSurface::draw() const
 		for(unsigned int ui=0;ui<mesh.size();ui++)
 		{
 			unsigned int idx;
-			idx=eyeDists[ui].second;
+			idx=eyeOrder[ui];
 			glNormal3fv(mesh[idx].normal[0].getValueArr());
 			glVertex3fv(mesh[idx].p[0].getValueArr());
 			glNormal3fv(mesh[idx].normal[1].getValueArr());
@@ -3159,3 +4005,220 @@ DrawableObj *Draw2DCircle::clone() const
 	return p;	
 }
 
+
+#ifdef DEBUG
+#include "common/translation.h"
+
+bool testPointLOD()
+{
+	RandNumGen rng;
+	rng.initialise(0xC0FFEE);
+
+	const size_t NUM_PTS=200000;
+	vector<Point3D> pts(NUM_PTS);
+	for(size_t ui=0;ui<NUM_PTS;ui++)
+	{
+		pts[ui]=Point3D(rng.genUniformDev()*10,rng.genUniformDev()*10,
+				rng.genUniformDev()*10);
+	}
+	vector<Point3D> original=pts;
+
+	PointLODTree tree;
+	tree.build(pts);
+	TEST(pts.empty(),"tree takes input points");
+	TEST(tree.size() == NUM_PTS,"tree point count");
+	TEST(tree.numNodes() > 1,"tree is subdivided");
+	TEST(tree.numBytes() >= NUM_PTS*sizeof(Point3D),"tree memory estimate");
+
+	//Every point lies in exactly one node
+	size_t total=0;
+	double sumTree[3]={0,0,0},sumOrig[3]={0,0,0};
+	for(unsigned int ui=0;ui<tree.numNodes();ui++)
+	{
+		size_t count;
+		const Point3D *p=tree.getNodePoints(ui,count);
+		total+=count;
+		for(size_t uj=0;uj<count;uj++)
+		{
+			for(unsigned int uk=0;uk<3;uk++)
+				sumTree[uk]+=p[uj][uk];
+		}
+	}
+	for(size_t ui=0;ui<NUM_PTS;ui++)
+	{
+		for(unsigned int uk=0;uk<3;uk++)
+			sumOrig[uk]+=original[ui][uk];
+	}
+	TEST(total == NUM_PTS,"node point counts");
+	for(unsigned int uk=0;uk<3;uk++)
+	{
+		TEST(fabs(sumTree[uk]-sumOrig[uk]) < 1e-3*sumOrig[uk],"node points match input");
+	}
+
+	//Distant view, with limited budget
+	CameraLookAt cam;
+	cam.setOrigin(Point3D(5,5,60));
+	cam.setTarget(Point3D(5,5,5));
+	cam.setUpDirection(Point3D(0,1,0));
+
+	LODView view;
+	TEST(view.setFromCamera(&cam,800,600),"LOD view from camera");
+	TEST(view.isVisible(Point3D(5,5,5),0),"target visible");
+	TEST(!view.isVisible(Point3D(5,5,70),1),"point behind camera culled");
+
+	const size_t BUDGET=20000;
+	vector<unsigned int> selected;
+	size_t numDrawn=tree.selectNodes(view,BUDGET,selected);
+	TEST(numDrawn && numDrawn <=BUDGET,"point budget respected");
+	size_t selectedCount=0;
+	for(size_t ui=0;ui<selected.size();ui++)
+	{
+		size_t count;
+		tree.getNodePoints(selected[ui],count);
+		selectedCount+=count;
+	}
+	TEST(selectedCount == numDrawn,"drawn count matches selected nodes");
+
+	//Zoom into a corner of the data. With an unlimited budget, every
+	// point in the view must be drawn, without rebuilding the tree
+	cam.setOrigin(Point3D(1,1,4));
+	cam.setTarget(Point3D(1,1,0));
+	TEST(view.setFromCamera(&cam,800,600),"LOD view from camera");
+	numDrawn=tree.selectNodes(view,NUM_PTS,selected);
+	TEST(numDrawn < NUM_PTS,"distant nodes culled");
+
+	size_t visibleDrawn=0;
+	for(size_t ui=0;ui<selected.size();ui++)
+	{
+		size_t count;
+		const Point3D *p=tree.getNodePoints(selected[ui],count);
+		for(size_t uj=0;uj<count;uj++)
+		{
+			if(view.isVisible(p[uj],0))
+				visibleDrawn++;
+		}
+	}
+	size_t visibleTotal=0;
+	for(size_t ui=0;ui<NUM_PTS;ui++)
+	{
+		if(view.isVisible(original[ui],0))
+			visibleTotal++;
+	}
+	TEST(visibleTotal,"some points visible");
+	TEST(visibleDrawn == visibleTotal,"full detail when zoomed in");
+
+	//Orthographic view still selects within budget
+	TEST(cam.setProperty(CAMERA_KEY_LOOKAT_PROJECTIONMODE,TRANS("Orthogonal")),"set ortho");
+	TEST(view.setFromCamera(&cam,800,600),"LOD view from camera");
+	TEST(!view.perspective,"ortho LOD view");
+	numDrawn=tree.selectNodes(view,BUDGET,selected);
+	TEST(numDrawn && numDrawn <=BUDGET,"ortho point budget respected");
+
+	return true;
+}
+
+//Check that the given back to front order matches a std::sort of the 
+// squared distances, to within the radix sort's depth quantisation
+bool depthOrderMatchesSort(const vector<Point3D> &pts, const Point3D &camOrigin,
+				const vector<unsigned int> &order)
+{
+	TEST(order.size() == pts.size(),"depth order size");
+
+	vector<float> dists(pts.size());
+	for(size_t ui=0;ui<pts.size();ui++)
+		dists[ui]=pts[ui].sqrDist(camOrigin);
+
+	vector<float> sorted(dists);
+	std::sort(sorted.begin(),sorted.end(),std::greater<float>());
+	const float tolerance=(sorted.front()-sorted.back())*1e-6f;
+
+	vector<bool> seen(pts.size(),false);
+	for(size_t ui=0;ui<order.size();ui++)
+	{
+		TEST(order[ui] < pts.size() && !seen[order[ui]],"depth order is a permutation");
+		seen[order[ui]]=true;
+		TEST(fabs(dists[order[ui]]-sorted[ui]) <= tolerance,"depth order matches std::sort");
+	}
+
+	return true;
+}
+
+bool testDepthSort()
+{
+	RandNumGen rng;
+	rng.initialise(0xBEEF);
+
+	//Random depths. The first sort, and large camera jumps, sort fully
+	{
+	const size_t NUM_PTS=100000;
+	vector<Point3D> pts(NUM_PTS);
+	for(size_t ui=0;ui<NUM_PTS;ui++)
+	{
+		pts[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),
+				rng.genUniformDev())*10.0f;
+	}
+
+	DepthSorter sorter;
+	sorter.referencePositions(pts);
+
+	RenderStatistics stats;
+	Point3D cam(5,5,60);
+	if(!depthOrderMatchesSort(pts,cam,sorter.sort(cam,stats)))
+		return false;
+	TEST(stats.sortsFull == 1,"first sort is full");
+
+	//Camera motion well under the threshold reuses the order
+	stats.reset();
+	sorter.sort(cam+Point3D(0,0,1e-3f),stats);
+	TEST(stats.sortsSkipped == 1,"small motion skips sort");
+
+	//Viewing from the other side reverses the order
+	stats.reset();
+	cam=Point3D(5,5,-50);
+	if(!depthOrderMatchesSort(pts,cam,sorter.sort(cam,stats)))
+		return false;
+	TEST(stats.sortsFull == 1,"camera jump sorts fully");
+	}
+
+	//Nearly sorted depths. Points lie along the z axis, some in pairs at 
+	// equal z. Moving the camera across the axis swaps only the pairs, 
+	// which the insertion sort repairs
+	{
+	const size_t NUM_LEVELS=10000;
+	//One in this many levels holds a pair
+	const size_t PAIR_SPACING=50;
+	vector<Point3D> pts;
+	for(size_t ui=0;ui<NUM_LEVELS;ui++)
+	{
+		if(ui%PAIR_SPACING)
+			pts.push_back(Point3D(rng.genUniformDev()*0.1f,0,ui));
+		else
+		{
+			pts.push_back(Point3D(-1,0,ui));
+			pts.push_back(Point3D(1,0,ui));
+		}
+	}
+	vector<Point3D> original(pts);
+
+	//Always resort, however small the camera move
+	DepthSorter::setMotionThreshold(0);
+
+	DepthSorter sorter;
+	sorter.setPositions(pts);
+	RenderStatistics stats;
+	Point3D cam(-5,0,-10);
+	if(!depthOrderMatchesSort(original,cam,sorter.sort(cam,stats)))
+		return false;
+
+	stats.reset();
+	cam=Point3D(5,0,-10);
+	if(!depthOrderMatchesSort(original,cam,sorter.sort(cam,stats)))
+		return false;
+	TEST(stats.sortsRepaired == 1,"nearly sorted order is repaired");
+
+	DepthSorter::setMotionThreshold(DEPTH_SORT_REORDER_EPSILON);
+	}
+
+	return true;
+}
+#endif
@@ -27,6 +27,7 @@
 #endif
 
 #include <sys/time.h>
+#include <memory>
 
 #include "textures.h"
 #include "cameras.h"
@@ -135,6 +136,100 @@ enum
 
 
 
+//!Statistics gathered from drawables whilst rendering a frame
+struct RenderStatistics
+{
+	//!Time spent depth-sorting transparent elements (seconds)
+	float sortTime;
+	//!Number of elements that were re-ordered by depth sorting
+	size_t elementsSorted;
+	//!Number of depth sorts skipped, as the camera had not moved enough
+	size_t sortsSkipped;
+	//!Number of depth sorts that repaired the previous order
+	size_t sortsRepaired;
+	//!Number of depth sorts that fully resorted the elements
+	size_t sortsFull;
+	//!Number of points sent to openGL
+	size_t pointsDrawn;
+	//!Wall time taken to draw the frame (seconds)
+	float frameTime;
+
+	RenderStatistics() { reset();}
+	void reset() { sortTime=0; elementsSorted=0; sortsSkipped=0; 
+			sortsRepaired=0; sortsFull=0; pointsDrawn=0; frameTime=0;}
+};
+
+//!Intersect a ray with a box, enlarged by pad on each side. Returns true 
+// on a hit, setting tHit to the entry distance (clipped to the ray's tMin)
+bool intersectRayBox(const PickRay &ray, const BoundCube &b, float pad, float &tHit);
+
+//!Conservative pick tolerance for a box: the ray's tolerance at the 
+// farthest distance from the ray start to any point in the box
+float pickTolerance(const PickRay &ray, const BoundCube &b);
+
+//!Maintains a back-to-front ordering of elements, for alpha blending
+/*! The ordering from the previous frame is kept. Small camera movements 
+ * leave the order nearly sorted, which is repaired with an adaptive
+ * insertion sort. Larger jumps use a parallel radix sort on quantised depths.
+ * If the camera has moved less than a threshold fraction of its distance
+ * from the elements, the previous order is reused without sorting.
+ */
+class DepthSorter
+{
+	private:
+		//!Element positions given to setPositions
+		std::vector<Point3D> ownPositions;
+		//!Element positions given to referencePositions, if any. Not owned
+		const std::vector<Point3D> *refPositions;
+		//!Centre of the element positions' bounding box
+		Point3D centre;
+		//!Element indices, ordered from back to front
+		std::vector<unsigned int> order;
+		//!Camera location for the current ordering
+		Point3D lastCamOrigin;
+		//!True if order is valid for the current positions
+		bool orderValid;
+
+		//!Fraction of camera-element distance the camera may move before we re-sort
+		static float motionThreshold;
+
+		//!Repair a nearly sorted order using insertion sort, given
+		// distances in the current order. Returns false if too much
+		// work is needed, leaving order and dists unchanged
+		bool adaptiveSort(std::vector<float> &dists);
+		//!Parallel radix sort of all elements, using quantised depths
+		void radixSort(const Point3D &camOrigin);
+
+		//!Positions being sorted
+		const std::vector<Point3D> &positions() const
+			{ return refPositions ? *refPositions : ownPositions;}
+
+		//!Recompute the positions' centre, invalidating any existing order
+		void resetOrder();
+	public:
+		DepthSorter() : refPositions(0), orderValid(false) {}
+
+		//!Set the positions to be sorted, invalidating any existing order.
+		// The positions are taken (swapped) from pts
+		void setPositions(std::vector<Point3D> &pts);
+		
+		//!Sort the given positions without copying them, invalidating any 
+		// existing order. pts must not change or be destroyed until
+		// the positions are next set, or cleared
+		void referencePositions(const std::vector<Point3D> &pts);
+
+		//!Clear the positions and ordering
+		void clear();
+
+		//!Update the ordering for a camera at the given location, and return
+		// the element indices from farthest to nearest.
+		const std::vector<unsigned int> &sort(const Point3D &camOrigin, 
+						RenderStatistics &stats);
+
+		//!Set the relative camera movement below which resorting is skipped
+		static void setMotionThreshold(float f) { motionThreshold=f;}
+};
+
 //!An abstract bas class for drawing primitives
 class DrawableObj
 {
@@ -153,6 +248,9 @@ class DrawableObj
 		static TexturePool *texPool;
 
 		static bool useAlphaBlend;
+
+		//!Statistics for the frame currently being drawn
+		static RenderStatistics renderStats;
 	
 		//Size of the opengl window
 		static unsigned int winX,winY;
@@ -206,6 +304,11 @@ class DrawableObj
 		void setInteract(bool canAct){canSelect=canAct;};
 
 		virtual void getBoundingBox(BoundCube &b) const = 0;
+
+		//!Intersect a pick ray with the object. Returns true on a hit, setting
+		// t to the distance along the ray of the nearest hit.
+		// By default the bounding box is used as a proxy for the geometry
+		virtual bool intersectRay(const PickRay &ray, float &t) const;
 		//!Drawable destructor
 		virtual ~DrawableObj();
 
@@ -222,11 +325,96 @@ class DrawableObj
 		virtual Point3D getCentroid() const  ;
 
 		static void setWindowSize(unsigned int x, unsigned int y){winX=x;winY=y;};	
+		//!Reset the render statistics, at the start of a new frame
+		static void resetRenderStats() { renderStats.reset();}
+		//!Obtain the render statistics accumulated since the last reset
+		static const RenderStatistics &getRenderStats() { return renderStats;}
+		//!Record the time taken to draw the current frame
+		static void setFrameTime(float t) { renderStats.frameTime=t;}
 		static void setBackgroundColour(float r, float g,float b)
 			{backgroundR=r; backgroundG=g;backgroundB=b;}
 
 };
 
+//!View parameters used to choose the level of detail to draw
+struct LODView
+{
+	//!Camera position
+	Point3D origin;
+	//!Orthonormal camera basis
+	Point3D forwards,across,up;
+	//!True for perspective, false for orthographic projection
+	bool perspective;
+	//!Half extents of the view. For perspective, these are at unit 
+	// distance from the camera (i.e. tangents of the half-angles)
+	float halfWidth,halfHeight;
+	//!Height of the viewport in px
+	float pixelHeight;
+
+	//!Obtain the view from a camera, for a window of the given size.
+	// Returns false if the camera type is not supported
+	bool setFromCamera(const Camera *cam, unsigned int winX, unsigned int winY);
+
+	//!Is any part of the sphere potentially visible?
+	bool isVisible(const Point3D &centre, float radius) const;
+	//!Projected diameter of the sphere on screen, in px
+	float projectedSize(const Point3D &centre, float radius) const;
+};
+
+//!Level-of-detail octree for large point clouds
+/*! Each node holds a random subsample of the points within its bounds,
+ * and its descendants hold the remainder. Drawing a node and all of its 
+ * ancestors thus gives a uniform subsample of that region, which becomes
+ * denser with depth. The tree is built once; only node selection is 
+ * performed per-frame.
+ */
+class PointLODTree
+{
+	private:
+		struct LODNode
+		{
+			//!Cubic bounds of the node
+			BoundCube bound;
+			//!Centre and radius of the node's bounding sphere
+			Point3D centre;
+			float radius;
+			//!Range of this node's own points in pts
+			size_t start,count;
+			//!Index of first child in nodes array, and number of children
+			unsigned int firstChild,numChildren;
+		};
+
+		//!Points, grouped by node
+		std::vector<Point3D> pts;
+		//!Nodes, root first. Children of each node are contiguous
+		std::vector<LODNode> nodes;
+		//!Bounds of the points
+		BoundCube pointBounds;
+	public:
+		//!Build the tree, taking the contents of the input vector
+		void build(std::vector<Point3D> &p);
+
+		//!Total number of points in the tree
+		size_t size() const { return pts.size();}
+		//!Approximate memory used by the tree, in bytes
+		size_t numBytes() const { return pts.capacity()*sizeof(Point3D) + nodes.capacity()*sizeof(LODNode);}
+		//!Number of nodes in the tree
+		size_t numNodes() const { return nodes.size();}
+		//!Bounds of the points
+		void getBoundingBox(BoundCube &b) const;
+
+		//!Choose the nodes to draw for the given view. Nodes with the
+		// largest projected size are refined first, until the point 
+		// budget is exhausted, or nodes are too small to need refinement.
+		// Returns the number of points in the selected nodes
+		size_t selectNodes(const LODView &view, size_t pointBudget, 
+				std::vector<unsigned int> &selected) const;
+
+		//!Obtain the points belonging to a node
+		const Point3D *getNodePoints(unsigned int node, size_t &count) const
+			{ count=nodes[node].count; return &pts[nodes[node].start];}
+};
+
 //A single point drawing class 
 class DrawPoint : public DrawableObj
 {
@@ -272,6 +460,11 @@ class DrawManyPoints : public DrawableObj
 
 		mutable bool haveCachedBounds;
 		mutable BoundCube cachedBounds;
+
+		//!Level-of-detail tree. If set, this is drawn instead of pts
+		std::shared_ptr<const PointLODTree> lodTree;
+		//!Maximum number of points to draw from the LOD tree per frame
+		size_t pointBudget;
 	public:
 		//!Constructor
 		DrawManyPoints();
@@ -308,6 +501,12 @@ class DrawManyPoints : public DrawableObj
 		
 		//!return number of points
 		size_t getNumPts() const { return pts.size();};
+
+		//!Draw from a level-of-detail tree, with the given per-frame point budget,
+		// rather than the point vector
+		void setLODTree(const std::shared_ptr<const PointLODTree> &tree, size_t budget);
+		//!True if drawing from a level-of-detail tree
+		bool hasLODTree() const { return (bool)lodTree;}
 };
 
 //!Draw a vector
@@ -374,6 +573,8 @@ class DrawVector: public DrawableObj
 		//!Set the "tail" line size
 		void setLineSize(float size) { lineSize=size;}
 		void getBoundingBox(BoundCube &b) const; 
+		//!Intersect a pick ray with the vector's line
+		bool intersectRay(const PickRay &ray, float &t) const;
 
 
 		//!Recompute the internal parameters using the input vector information
@@ -555,6 +756,8 @@ class DrawSphere : public DrawableObj
 		void draw() const;
 		//!Get the bounding box that encapuslates this object
 		void getBoundingBox(BoundCube &b) const ;
+		//!Intersect a pick ray with the sphere surface
+		bool intersectRay(const PickRay &ray, float &t) const;
 
 		//!Recompute the internal parameters using the input vector information
 		// i.e. this is used for (eg) mouse interaction
@@ -618,6 +821,8 @@ class DrawCylinder : public DrawableObj
 		void draw() const;
 		//!Get the bounding box that encapuslates this object
 		void getBoundingBox(BoundCube &b) const ;
+		//!Intersect a pick ray with the capped cylinder
+		bool intersectRay(const PickRay &ray, float &t) const;
 
 		//!Recompute the internal parameters using the input vector information
 		void recomputeParams(const std::vector<Point3D> &vecs, const std::vector<float> &scalars, unsigned int mode);
@@ -854,6 +1059,8 @@ class DrawRectPrism  : public DrawableObj
 		void setAxisAligned(const BoundCube &b);
 
 		void getBoundingBox(BoundCube &b) const;
+		//!Intersect a pick ray with the box, or its edges in wireframe mode
+		bool intersectRay(const PickRay &ray, float &t) const;
 		
 		//!Recompute the internal parameters using the input vector information
 		void recomputeParams(const std::vector<Point3D> &vecs, const std::vector<float> &scalars, unsigned int mode);
@@ -1066,8 +1273,12 @@ struct RGBThis
 class DrawField3D : public DrawableObj
 {
 	private:
-		mutable std::vector<std::pair<Point3D,RGBThis> > ptsCache;
+		mutable std::vector<Point3D> ptsCache;
+		//!Colour of each point in ptsCache
+		mutable std::vector<RGBThis> ptsColours;
 		mutable bool ptsCacheOK;
+		//!Back to front ordering of ptsCache, for alpha blending
+		mutable DepthSorter depthOrder;
 	protected:
 		//!Alpha transparancy of objects in field
 		float alphaVal;
@@ -1098,6 +1309,12 @@ class DrawField3D : public DrawableObj
 		unsigned int volumeRenderMode;
 		//!The scalar field - used to store data values
 		const Voxels<float> *field;
+		//!Sparse scalar field, used instead of field if set.
+		// Only the active voxels are drawn
+		openvdb::FloatGrid::Ptr sparseField;
+
+		//!Get the bounds of whichever field is in use
+		void getFieldBounds(Point3D &minB, Point3D &maxB) const;
 	public:
 		//!Default Constructor
 		DrawField3D();
@@ -1114,6 +1331,9 @@ class DrawField3D : public DrawableObj
 		
 		//!Set the field pointer 
 		void setField(const Voxels<float> *field); 
+		//!Set a sparse field. Index (x,y,z) is mapped by the grid's
+		// transform to the lower corner of its voxel
+		void setField(openvdb::FloatGrid::Ptr sparseField); 
 
 		//!Set the alpha value for elemnts
 		void setAlpha(float alpha);
@@ -1157,6 +1377,8 @@ private:
 	Voxels<float> *voxels;	
 
 	mutable std::vector<TriangleWithVertexNorm> mesh;
+	//!Back to front ordering of the mesh triangles, for alpha blending
+	mutable DepthSorter depthOrder;
 
 	//!Warning. Although I declare this as const, I do some naughty mutating to the cache.
 	void updateMesh() const;	
@@ -1178,7 +1400,7 @@ public:
 	void draw() const;
 
 	//!Set the isosurface value
-	void setScalarThresh(float thresh) { threshold=thresh;cacheOK=false;mesh.clear();};
+	void setScalarThresh(float thresh) { threshold=thresh;cacheOK=false;mesh.clear();depthOrder.clear();};
 
 	//!Get the bouding box (of the entire scalar field)	
 	void getBoundingBox(BoundCube &b) const ;
@@ -1302,4 +1524,10 @@ class Draw2DCircle : public DrawableObj
 			
 };
 
+#ifdef DEBUG
+bool testPointLOD();
+//!Check depth sorting orders as std::sort does, for each sorting path
+bool testDepthSort();
+#endif
+
 #endif
@@ -34,6 +34,11 @@ const char ANIMATE_PROGRESS_BASENAME[] = {
 	"textures/animProgress"};
 unsigned int ANIMATE_PROGRESS_NUMFRAMES=3;
 
+//Width of the picking region around the cursor, in px
+const float PICK_REGION_SIZE=5.0f;
+//Maximum number of objects in a pick hierarchy leaf
+const unsigned int PICK_LEAF_SIZE=4;
+
 
 
 Scene::Scene() : tempCam(0), cameraSet(true), outWinAspect(1.0f)
@@ -42,6 +47,7 @@ Scene::Scene() : tempCam(0), cameraSet(true), outWinAspect(1.0f)
 	visControl=0;
 
 	lastHovered=lastSelected=(unsigned int)(-1);
+	pickTreeValid=false;
 	lockInteract=false;
 	hoverMode=selectionMode=false;
 	useAlpha=true;
@@ -245,8 +251,12 @@ void Scene::draw(bool noUpdateCam)
 	DrawableObj::setCurCamera(camToUse);
 	DrawableObj::setWindowSize(winX,winY);
 	DrawableObj::setBackgroundColour(rBack,gBack,bBack);
+	DrawableObj::resetRenderStats();
 	Effect::setCurCam(camToUse);
 
+	timeval startTime;
+	gettimeofday(&startTime,NULL);
+
 
 	bool lightsOn=false;
 	//Find number of passes to  perform
@@ -338,6 +348,11 @@ void Scene::draw(bool noUpdateCam)
 		//Draw progress, if needed
 		drawProgressAnim();
 	}
+
+	timeval endTime;
+	gettimeofday(&endTime,NULL);
+	DrawableObj::setFrameTime((float)(endTime.tv_sec - startTime.tv_sec) + 
+			(endTime.tv_usec-startTime.tv_usec)/1.0e6);
 	glError();
 }
 
@@ -655,6 +670,7 @@ void Scene::setTempCam()
 void Scene::addDrawable(DrawableObj const *obj )
 {
 	objects.push_back(obj);
+	pickTreeValid=false;
 	BoundCube bc;
 	obj->getBoundingBox(bc);
 
@@ -687,6 +703,8 @@ void Scene::clearObjs()
 		delete objects[ui];
 	objects.clear();
 	lastHovered=-1;
+	pickTree.clear();
+	pickTreeValid=false;
 }
 
 
@@ -803,102 +821,35 @@ Camera *Scene::getTempCam()
 	return tempCam;
 }
 
-//Adapted from 
-//http://chadweisshaar.com/robotics/docs/html/_v_canvas_8cpp-source.html
-//GPLv3+ permission obtained by email inquiry.
-unsigned int Scene::glSelect(bool storeSelected)
+unsigned int Scene::select(float x, float y, bool storeSelected)
 {
 	ASSERT(!lockInteract);
-
-	glClear(  GL_DEPTH_BUFFER_BIT );
 	//Shouldn't be using a temporary camera.
 	//temporary cameras are only active during movement operations
 	ASSERT(!tempCam);
-	
-	
-	// Need to load a base name so that the other calls can replace it
-	GLuint *selectionBuffer = new GLuint[512];
-	glSelectBuffer(512, selectionBuffer);
-	glRenderMode(GL_SELECT);
-	glInitNames();
-	
-	if(!boundCube.isValid())
-		computeSceneLimits();
 
-	glPushMatrix();
-	//Apply the camera, but do NOT load the identity matrix, as
-	//we have set the pick matrix
-	activeCam->apply(outWinAspect,boundCube,false);
-
-	//Set up the objects. Only NON DISPLAYLIST items can be selected.
-	for(unsigned int ui=0; ui<objects.size(); ui++)
-	{
-		glPushName(ui);
-		if(objects[ui]->canSelect)
-			objects[ui]->draw();
-		glPopName();
-	}
-
-	//OpengGL Faq:
-	//The number of hit records is returned by the call to
-	//glRenderMode(GL_RENDER). Each hit record contains the following
-	//information stored as unsigned ints:
-	//
-	// * Number of names in the name stack for this hit record
-	// * Minimum depth value of primitives (range 0 to 2^32-1)
-	// * Maximum depth value of primitives (range 0 to 2^32-1)
-	// * Name stack contents (one name for each unsigned int).
-	//
-	//You can use the minimum and maximum Z values with the device
-	//coordinate X and Y if known (perhaps from a mouse click)
-	//to determine an object coordinate location of the picked
-	//primitive. You can scale the Z values to the range 0.0 to 1.0,
-	//for example, and use them in a call to gluUnProject().
-	glFlush();
-	GLint hits = glRenderMode(GL_RENDER);
-	
-	//The hit query records are stored in an odd manner
-	//as the name stack is returned with it. This depends
-	//upon how you have constructed your name stack during drawing
-	//(clearly).  I didn't bother fully understanding this, as it does
-	//what I want.
-	GLuint *ptr = selectionBuffer;
-	GLuint *closestNames = 0;
-	GLuint minZ = 0xffffffff;
-	GLuint numClosestNames = 0;
-	for ( int i=0; i<hits; ++i )
+	if(!pickTreeValid)
 	{
-		if ( *(ptr+1) < minZ )
-		{
-			numClosestNames = *ptr;
-			minZ = *(ptr+1);
-			closestNames = ptr+3;
-		}
-		ptr+=*ptr+3;
+		pickTree.build(objects);
+		pickTreeValid=true;
 	}
 
+	//Cast a ray through the cursor, with a tolerance
+	// matching the size of the pick region
+	PickRay ray;
+	float pickSize=0;
+	if(winY)
+		pickSize=0.5f*PICK_REGION_SIZE/(float)winY;
+	activeCam->getPickRay(x,y,outWinAspect,pickSize,ray);
 
-	//Record the nearest item
-	// There should only be one item on the hit stack for the closest item.
-	GLuint closest;
-	if(numClosestNames==1)
-		closest=closestNames[0]; 
-	else 
-		closest=(unsigned int)(-1);
-
-	delete[] selectionBuffer;
-
-	glPopMatrix();
+	float t;
+	unsigned int closest=pickTree.pick(ray,t);
 	
 	//Record the last item if required.
 	if(storeSelected)
-	{
 		lastSelected=closest;
-		return lastSelected;
-	}
-	else
-		return closest;
 
+	return closest;
 }
 
 void Scene::finaliseCam()
@@ -1014,6 +965,9 @@ void Scene::applyDevice(float startX, float startY, float curX, float curY,
 	}
 
 	computeSceneLimits();
+	//Objects may have moved
+	if(activeBindings.size())
+		pickTreeValid=false;
 	//Inform viscontrol about updates, if we have applied any
 	if(activeBindings.size() && permanent)
 	{
@@ -1071,3 +1025,350 @@ void Scene::clearEffects()
 	effects.clear();
 	effectIDs.clear();
 }
+
+//Order object indices by their centre along one axis
+class ComparePickCentres
+{
+	private:
+		const vector<Point3D> &centres;
+		unsigned int axis;
+	public:
+		ComparePickCentres(const vector<Point3D> &c, unsigned int ax) : centres(c), axis(ax) {}
+		bool operator()(unsigned int a, unsigned int b) const
+			{ return centres[a][axis] < centres[b][axis];}
+};
+
+void PickHierarchy::clear()
+{
+	nodes.clear();
+	items.clear();
+	itemIndex.clear();
+}
+
+void PickHierarchy::build(const vector<const DrawableObj *> &objects)
+{
+	clear();
+
+	vector<BoundCube> bounds;
+	vector<Point3D> centres;
+	for(unsigned int ui=0;ui<objects.size();ui++)
+	{
+		if(!objects[ui]->canSelect || objects[ui]->isOverlay())
+			continue;
+
+		BoundCube b;
+		objects[ui]->getBoundingBox(b);
+		if(!b.isValid())
+			continue;
+
+		items.push_back(objects[ui]);
+		itemIndex.push_back(ui);
+		bounds.push_back(b);
+		centres.push_back(b.getCentroid());
+	}
+
+	if(items.empty())
+		return;
+
+	nodes.reserve(2*items.size()/PICK_LEAF_SIZE+1);
+	buildNode(bounds,centres,0,items.size());
+}
+
+unsigned int PickHierarchy::buildNode(vector<BoundCube> &bounds,
+		vector<Point3D> &centres, unsigned int start, unsigned int end)
+{
+	ASSERT(end > start);
+
+	unsigned int nodeIdx=nodes.size();
+	nodes.push_back(PickNode());
+
+	BoundCube nodeBound,centreBound;
+	nodeBound=bounds[start];
+	centreBound.setBounds(centres[start],centres[start]);
+	for(unsigned int ui=start+1;ui<end;ui++)
+	{
+		nodeBound.expand(bounds[ui]);
+		centreBound.expand(centres[ui]);
+	}
+	nodes[nodeIdx].bound=nodeBound;
+
+	if(end-start <= PICK_LEAF_SIZE)
+	{
+		nodes[nodeIdx].start=start;
+		nodes[nodeIdx].count=end-start;
+		return nodeIdx;
+	}
+
+	//Split at the median centre, along the longest axis of the centres
+	unsigned int axis=0;
+	for(unsigned int ui=1;ui<3;ui++)
+	{
+		if(centreBound.getSize(ui) > centreBound.getSize(axis))
+			axis=ui;
+	}
+
+	vector<unsigned int> order(end-start);
+	for(unsigned int ui=0;ui<order.size();ui++)
+		order[ui]=start+ui;
+
+	unsigned int mid=order.size()/2;
+	std::nth_element(order.begin(),order.begin()+mid,order.end(),
+		ComparePickCentres(centres,axis));
+
+	//Apply the permutation to the item arrays
+	{
+	vector<const DrawableObj *> tmpItems(order.size());
+	vector<unsigned int> tmpIndex(order.size());
+	vector<BoundCube> tmpBounds(order.size());
+	vector<Point3D> tmpCentres(order.size());
+	for(unsigned int ui=0;ui<order.size();ui++)
+	{
+		tmpItems[ui]=items[order[ui]];
+		tmpIndex[ui]=itemIndex[order[ui]];
+		tmpBounds[ui]=bounds[order[ui]];
+		tmpCentres[ui]=centres[order[ui]];
+	}
+	std::copy(tmpItems.begin(),tmpItems.end(),items.begin()+start);
+	std::copy(tmpIndex.begin(),tmpIndex.end(),itemIndex.begin()+start);
+	std::copy(tmpBounds.begin(),tmpBounds.end(),bounds.begin()+start);
+	std::copy(tmpCentres.begin(),tmpCentres.end(),centres.begin()+start);
+	}
+
+	unsigned int left,right;
+	left=buildNode(bounds,centres,start,start+mid);
+	right=buildNode(bounds,centres,start+mid,end);
+
+	//nodes may have been reallocated
+	nodes[nodeIdx].child[0]=left;
+	nodes[nodeIdx].child[1]=right;
+	nodes[nodeIdx].count=0;
+	return nodeIdx;
+}
+
+unsigned int PickHierarchy::pick(const PickRay &ray, float &tBest) const
+{
+	unsigned int closest=(unsigned int)-1;
+	tBest=std::numeric_limits<float>::max();
+	if(nodes.empty())
+		return closest;
+
+	float tEnter;
+	if(!intersectRayBox(ray,nodes[0].bound,pickTolerance(ray,nodes[0].bound),tEnter))
+		return closest;
+
+	//Stack of nodes, with their ray entry distances
+	vector<std::pair<unsigned int,float> > stack;
+	stack.push_back(std::make_pair(0u,tEnter));
+	while(!stack.empty())
+	{
+		unsigned int nodeIdx=stack.back().first;
+		tEnter=stack.back().second;
+		stack.pop_back();
+
+		//Can't contain anything nearer than what we have
+		if(tEnter > tBest)
+			continue;
+
+		const PickNode &node=nodes[nodeIdx];
+		if(node.count)
+		{
+			for(unsigned int ui=node.start;ui<node.start+node.count;ui++)
+			{
+				float t;
+				if(items[ui]->intersectRay(ray,t) && t < tBest)
+				{
+					tBest=t;
+					closest=itemIndex[ui];
+				}
+			}
+			continue;
+		}
+
+		//Visit the nearer child first, by pushing it last
+		float tChild[2];
+		bool hit[2];
+		for(unsigned int ui=0;ui<2;ui++)
+		{
+			const BoundCube &b=nodes[node.child[ui]].bound;
+			hit[ui]=intersectRayBox(ray,b,pickTolerance(ray,b),tChild[ui]);
+		}
+
+		unsigned int first=(hit[0] && hit[1] && tChild[1] > tChild[0]) ? 1 : 0;
+		for(unsigned int ui=0;ui<2;ui++)
+		{
+			unsigned int c=(first+ui)%2;
+			if(hit[c] && tChild[c] <= tBest)
+				stack.push_back(std::make_pair(node.child[c],tChild[c]));
+		}
+	}
+
+	return closest;
+}
+
+
+#ifdef DEBUG
+#include "common/mathfuncs.h"
+
+//Find the nearest hit by testing every object
+static unsigned int bruteForcePick(const vector<const DrawableObj *> &objs,
+					const PickRay &ray, float &tBest)
+{
+	unsigned int closest=(unsigned int)-1;
+	tBest=std::numeric_limits<float>::max();
+	for(unsigned int ui=0;ui<objs.size();ui++)
+	{
+		float t;
+		if(objs[ui]->canSelect && objs[ui]->intersectRay(ray,t) && t < tBest)
+		{
+			tBest=t;
+			closest=ui;
+		}
+	}
+	return closest;
+}
+
+bool testScenePicking()
+{
+	//Camera on +z axis, looking at origin. No GL context is needed
+	// to generate rays
+	CameraLookAt cam;
+	cam.setOrigin(Point3D(0,0,10));
+	cam.setTarget(Point3D(0,0,0));
+	cam.setUpDirection(Point3D(0,1,0));
+
+	const float ASPECT=1.0f;
+	const float PICK_SIZE=0.5f*PICK_REGION_SIZE/500.0f;
+
+	PickRay centreRay;
+	cam.getPickRay(0.5f,0.5f,ASPECT,PICK_SIZE,centreRay);
+	TEST(centreRay.direction.sqrDist(Point3D(0,0,-1)) < 1e-6,"centre ray direction");
+
+	vector<const DrawableObj *> objs;
+	PickHierarchy tree;
+	float t;
+
+	//Two spheres on the view axis; far one added first
+	{
+	DrawSphere *farSphere = new DrawSphere;
+	farSphere->setOrigin(Point3D(0,0,-5));
+	farSphere->setRadius(1);
+	farSphere->canSelect=true;
+	objs.push_back(farSphere);
+
+	DrawSphere *nearSphere = new DrawSphere;
+	nearSphere->setOrigin(Point3D(0,0,0));
+	nearSphere->setRadius(1);
+	nearSphere->canSelect=true;
+	objs.push_back(nearSphere);
+	}
+
+	//Hit distances are slightly reduced by the pick region tolerance
+	tree.build(objs);
+	TEST(tree.pick(centreRay,t) == 1,"nearest sphere picked");
+	TEST(fabs(t-9.0f) < 0.1f,"sphere hit distance");
+
+	//Unselectable objects are skipped
+	const_cast<DrawableObj*>(objs[1])->canSelect=false;
+	tree.build(objs);
+	TEST(tree.size() == 1,"unselectable object excluded");
+	TEST(tree.pick(centreRay,t) == 0,"occluder not selectable");
+	const_cast<DrawableObj*>(objs[1])->canSelect=true;
+
+	//Ray near the corner of the view misses everything
+	PickRay edgeRay;
+	cam.getPickRay(0.95f,0.05f,ASPECT,PICK_SIZE,edgeRay);
+	tree.build(objs);
+	TEST(tree.pick(edgeRay,t) == (unsigned int)-1,"miss");
+	
+	//Wireframe box surrounding the spheres; hits only on edges,
+	// solid box is hit on its face
+	DrawRectPrism *box = new DrawRectPrism;
+	box->setAxisAligned(Point3D(-3,-3,-3),Point3D(3,3,3));
+	box->setDrawMode(DRAW_WIREFRAME);
+	box->canSelect=true;
+	objs.push_back(box);
+	tree.build(objs);
+	TEST(tree.pick(centreRay,t) == 1,"wireframe box interior not hit");
+
+	//Perspective camera has a 45 degree vertical FOV (see apply()).
+	// Aim at the box's top front edge, at (0,3,3)
+	float edgeY=0.5f-0.5f*(3.0f/7.0f)/tan(M_PI/8.0);
+	cam.getPickRay(0.5f,edgeY,ASPECT,PICK_SIZE,edgeRay);
+	TEST(tree.pick(edgeRay,t) == 2,"wireframe box edge hit");
+	TEST(fabs(t - sqrtf(49.0f+9.0f)) < 0.1f,"wireframe edge distance");
+
+	box->setDrawMode(DRAW_FLAT);
+	TEST(tree.pick(centreRay,t) == 2,"solid box face hit");
+	TEST(fabs(t-7.0f) < 0.1f,"box face distance");
+	delete box;
+	objs.pop_back();
+
+	//Cylinder across the view axis, in front of the spheres
+	{
+	DrawCylinder *cyl = new DrawCylinder;
+	cyl->setOrigin(Point3D(0,0,2));
+	cyl->setDirection(Point3D(4,0,0));
+	cyl->setRadius(0.5);
+	cyl->canSelect=true;
+	objs.push_back(cyl);
+	}
+	tree.build(objs);
+	TEST(tree.pick(centreRay,t) == 2,"cylinder side hit");
+	TEST(fabs(t-7.5f) < 0.1f,"cylinder hit distance");
+
+	//Orthographic camera sees the same ordering
+	TEST(cam.setProperty(CAMERA_KEY_LOOKAT_PROJECTIONMODE,TRANS("Orthogonal")),"set ortho");
+	cam.getPickRay(0.5f,0.5f,ASPECT,PICK_SIZE,centreRay);
+	TEST(tree.pick(centreRay,t) == 2,"ortho cylinder hit");
+	//Off-axis rays in ortho mode are parallel to the view axis,
+	// so hit the top of the cylinder at the same depth
+	cam.getPickRay(0.5f+0.5f*1.5f/10.0f,0.5f,ASPECT,PICK_SIZE,edgeRay);
+	TEST(edgeRay.direction.sqrDist(Point3D(0,0,-1)) < 1e-6,"ortho rays parallel");
+	TEST(tree.pick(edgeRay,t) == 2,"ortho cylinder hit off-centre");
+	TEST(fabs(t-7.5f) < 0.2f,"ortho cylinder hit distance");
+
+	for(unsigned int ui=0;ui<objs.size();ui++)
+		delete objs[ui];
+	objs.clear();
+
+	//Random field of spheres; hierarchy must match brute force picking
+	RandNumGen rng;
+	rng.initialise(0xBEEF);
+	const unsigned int NUM_SPHERES=2000;
+	for(unsigned int ui=0;ui<NUM_SPHERES;ui++)
+	{
+		DrawSphere *s = new DrawSphere;
+		s->setOrigin(Point3D(rng.genUniformDev()*8-4,
+				rng.genUniformDev()*8-4,rng.genUniformDev()*8-4));
+		s->setRadius(0.05+0.1*rng.genUniformDev());
+		s->canSelect= (ui%7 !=0);
+		objs.push_back(s);
+	}
+	TEST(cam.setProperty(CAMERA_KEY_LOOKAT_PROJECTIONMODE,TRANS("Perspective")),"set perspective");
+	tree.build(objs);
+
+	unsigned int nHits=0;
+	for(unsigned int ui=0;ui<500;ui++)
+	{
+		PickRay r;
+		cam.getPickRay(rng.genUniformDev(),rng.genUniformDev(),ASPECT,PICK_SIZE,r);
+
+		float tTree,tBrute;
+		unsigned int treeHit,bruteHit;
+		treeHit=tree.pick(r,tTree);
+		bruteHit=bruteForcePick(objs,r,tBrute);
+		TEST(treeHit == bruteHit,"hierarchy pick matches brute force");
+		if(treeHit != (unsigned int)-1)
+		{
+			TEST(tTree == tBrute,"hierarchy pick distance");
+			nHits++;
+		}
+	}
+	TEST(nHits,"some random rays hit");
+
+	for(unsigned int ui=0;ui<objs.size();ui++)
+		delete objs[ui];
+
+	return true;
+}
+#endif
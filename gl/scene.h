@@ -32,6 +32,42 @@ class Filter;
 
 #include <vector>
 
+//!Bounding volume hierarchy over selectable drawables, for ray picking
+class PickHierarchy
+{
+	private:
+		struct PickNode
+		{
+			//!Bounds of all objects under this node
+			BoundCube bound;
+			//!Children, if this is not a leaf
+			unsigned int child[2];
+			//!Range of entries in items array, if this is a leaf
+			unsigned int start,count;
+		};
+
+		//!Tree nodes, root first
+		std::vector<PickNode> nodes;
+		//!Objects in leaf order
+		std::vector<const DrawableObj *> items;
+		//!Index of each item in the array passed to build()
+		std::vector<unsigned int> itemIndex;
+
+		//!Recursively build the node for the items in [start,end)
+		unsigned int buildNode(std::vector<BoundCube> &bounds,
+				std::vector<Point3D> &centres, unsigned int start, unsigned int end);
+	public:
+		//!Build the tree from the selectable objects in the vector
+		void build(const std::vector<const DrawableObj *> &objects);
+		//!Remove all objects
+		void clear();
+		//!Number of objects in the tree
+		size_t size() const { return items.size();}
+		//!Return the index of the nearest object hit by the ray, or -1 if 
+		// none. t is set to the hit distance along the ray
+		unsigned int pick(const PickRay &ray, float &t) const;
+};
+
 //!The scene class brings together elements such as objects, lights, and cameras
 //to enable scene rendering
 class Scene
@@ -46,6 +82,11 @@ class Scene
 		//!Objects used for drawing that will not be destroyed
 		std::vector<const DrawableObj * > refObjects;
 
+		//!Ray picking hierarchy for selectable objects
+		PickHierarchy pickTree;
+		//!True if pickTree matches the current objects
+		bool pickTreeValid;
+
 		//!Various OpenGL effects
 		std::vector<const Effect *> effects;
 
@@ -80,7 +121,7 @@ class Scene
 		//!Tells us if we are in hover mode (should we draw hover overlays?)
 		bool hoverMode;
 
-		//!Last selected object from call to glSelect(). -1 if last
+		//!Last selected object from call to select(). -1 if last
 		// call failed to identify an item
 		unsigned int lastSelected;
 
@@ -238,10 +279,10 @@ class Scene
 		//!Call if user has stopped interacting with camera briefly.
 		void finaliseCam();
 
-		//!perform an openGL selection rendering pass. Return 
-		//closest object in depth buffer under position 
+		//!Pick the closest selectable object under the viewport
+		// position (x,y), each in the range [0,1], y downwards.
 		//if nothing, returns -1
-		unsigned int glSelect(bool storeSelection=true);
+		unsigned int select(float x, float y, bool storeSelection=true);
 
 		//!Clear the current selection devices 
 		void clearDevices();
@@ -265,7 +306,7 @@ class Scene
 
 		//!Return the last object over which the cursor was hovered	
 		void setLastHover(unsigned int hover) { lastHovered=hover;};
-		//!Get the last selected object from call to glSelect()
+		//!Get the last selected object from call to select()
 		unsigned int getLastSelected() const { return lastSelected;};
 	
 		//!Return the last object over which the cursor was hovered	
@@ -293,6 +334,9 @@ class Scene
 		//!Get the scene bounding box
 		BoundCube getBound() const { return boundCube;}
 
+		//!Statistics (e.g. frame time, points drawn) for the last frame drawn
+		const RenderStatistics &getRenderStats() const { return DrawableObj::getRenderStats();}
+
 		//!Set the background colour
 		void setBackgroundColour(float newR,float newG,float newB) { rBack=newR;gBack=newG;bBack=newB;};
 
@@ -325,4 +369,8 @@ class Scene
 		static std::string getGlVersion() { return  std::string((char *)glGetString(GL_VERSION)); }
 };
 
+#ifdef DEBUG
+bool testScenePicking();
+#endif
+
 #endif
@@ -1497,10 +1497,10 @@ void RangeEditorDialog::OnTextOverlayEnter(wxCommandEvent &event)
 		totalFragments+=fragmentCount[ui];
 	}
 
-	//Limit the number of fragments allowable, as the total number
-	// of combinations is (species)^fragmentCount. Eg C2 has two
-	// species, 12^C and 13^C, and with 10 items, you get 2^10 combinations
-	size_t MAX_FRAGMENT_COUNT=10;
+	//Limit the number of fragments allowable. The cost of the 
+	// distribution grows with the fragment count and the width
+	// of the resulting mass spectrum, so keep this reasonable
+	size_t MAX_FRAGMENT_COUNT=200;
 	if(totalFragments > MAX_FRAGMENT_COUNT)
 	{
 		textOverlayCmpnt->SetBackgroundColour(wxColour(*wxCYAN));
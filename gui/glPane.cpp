@@ -141,36 +141,22 @@ unsigned int  BasicGLPane::selectionTest(const wxPoint &p,bool &shouldRedraw)
 		return -1; 
 	}
 
-	//TODO: Refactor. Much of this could be pushed into the scene, 
-	//and hence out of this wx panel.
-	
-	//Push on the matrix stack
-	glPushMatrix();
-	
-	GLint oldViewport[4];
-	glGetIntegerv(GL_VIEWPORT, oldViewport);
-	//5x5px picking region. Picking is done by modifying the view
-	//to enlarge the selected region.
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPickMatrix(p.x, oldViewport[3]-p.y,5, 5, oldViewport);
-	glMatrixMode(GL_MODELVIEW);
+	int w, h;
+	GetClientSize(&w, &h);
+	if(!w || !h)
+	{
+		shouldRedraw=false;
+		return -1;
+	}
 
 	int lastSelected = currentScene->getLastSelected();
-	int selectedObject=currentScene->glSelect();
+	int selectedObject=currentScene->select((float)p.x/(float)w,
+						(float)p.y/(float)h);
 
 	//If the object selection hasn't changed, we don't need to redraw
 	//if it has changed, we should redraw
 	shouldRedraw = (lastSelected !=selectedObject);
 
-	//Restore the previous matirx
-	glPopMatrix();
-
-	//Restore the viewport
-	int w, h;
-	GetClientSize(&w, &h);
-	glViewport(0, 0, (GLint) w, (GLint) h);
-
 	return selectedObject;
 }
  
@@ -182,20 +168,17 @@ unsigned int  BasicGLPane::hoverTest(const wxPoint &p,bool &shouldRedraw)
 		shouldRedraw=false;
 		return -1;
 	}
-	//Push on the matrix stack
-	glPushMatrix();
-	
-	GLint oldViewport[4];
-	glGetIntegerv(GL_VIEWPORT, oldViewport);
-	//5x5px picking region. Picking is done by modifying the view
-	//to enlarge the selected region.
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPickMatrix(p.x, oldViewport[3]-p.y,5, 5, oldViewport);
-	glMatrixMode(GL_MODELVIEW);
+	int w, h;
+	GetClientSize(&w, &h);
+	if(!w || !h)
+	{
+		shouldRedraw=false;
+		return -1;
+	}
 
 	unsigned int lastHover = currentScene->getLastHover();
-	unsigned int hoverObject=currentScene->glSelect(false);
+	unsigned int hoverObject=currentScene->select((float)p.x/(float)w,
+						(float)p.y/(float)h,false);
 
 	//FIXME: Should be able to make this more efficient	
 	shouldRedraw =  lastHover!=(unsigned int)-1;
@@ -204,14 +187,6 @@ unsigned int  BasicGLPane::hoverTest(const wxPoint &p,bool &shouldRedraw)
 	currentScene->setLastHover(hoverObject);
 	currentScene->setHoverMode(hoverObject != (unsigned int)-1);
 
-	//Restore the previous matirx
-	glPopMatrix();
-
-	//Restore the viewport
-	int w, h;
-	GetClientSize(&w, &h);
-	glViewport(0, 0, (GLint) w, (GLint) h);
-
 	return hoverObject;
 }
 
@@ -817,6 +792,18 @@ void BasicGLPane::render( wxPaintEvent& evt )
 	currentScene->draw();
 	glFlush();
 	SwapBuffers();
+
+#ifdef DEBUG
+	//Report the cost of depth sorting, for frames that needed to sort
+	const RenderStatistics &stats=currentScene->getRenderStats();
+	if(stats.sortsRepaired || stats.sortsFull)
+	{
+		std::cerr << "Frame " << stats.frameTime*1000.0f << " ms, depth sort " << 
+			stats.sortTime*1000.0f << " ms for " << stats.elementsSorted << 
+			" elements (" << stats.sortsRepaired << " repaired, " << 
+			stats.sortsFull << " full, " << stats.sortsSkipped << " skipped)" << std::endl;
+	}
+#endif
 }
 
 void BasicGLPane::OnEraseBackground(wxEraseEvent &evt)
@@ -421,6 +421,8 @@ MainWindowFrame::MainWindowFrame(wxWindow* parent, int id, const wxString& title
 
 	programmaticEvent=false;
 	currentlyUpdatingScene=false;
+	haveAborted=false;
+	restartRefresh=false;
 	statusTimer = new wxTimer(this,ID_STATUS_TIMER);
 	updateTimer= new wxTimer(this,ID_UPDATE_TIMER);
 	progressTimer= new wxTimer(this,ID_PROGRESS_TIMER);
@@ -1758,7 +1760,9 @@ void MainWindowFrame::setLockUI(bool locking=true,
 			fileMenu->Enable(ID_FILE_OPEN,!locking);
 			fileMenu->Enable(ID_FILE_MERGE,!locking);
 		
-			gridFilterPropGroup->Enable(!locking);
+			//Leave the properties editable when auto-updating, so that
+			// an edit can supersede the running refresh
+			gridFilterPropGroup->Enable(!locking || checkAutoUpdate->GetValue());
 			comboStash->Enable(!locking);
 
 			//Locking of the tools pane
@@ -2127,14 +2131,40 @@ void MainWindowFrame::OnFileExportFilterVideo(wxCommandEvent &event)
 					{
 						for(size_t uj=0;uj<it->size();uj++)
 						{
-							if( ((*it)[uj])->getStreamType() != STREAM_TYPE_VOXEL)
-								continue;
+							size_t writeErr;
+							std::string filename;
+							switch(((*it)[uj])->getStreamType())
+							{
+								case STREAM_TYPE_VOXEL:
+								{
+									const VoxelStreamData *v;
+									v=(const VoxelStreamData*)(*it)[uj];
+									
+									filename = exportDialog->getFilename(ui,FILENAME_VOXEL,offset);
+									writeErr=v->data->writeFile(filename.c_str());
+									break;
+								}
+								case STREAM_TYPE_OPENVDBGRID:
+								{
+									//Sparse voxel point clouds. Write every
+									// voxel, as for dense voxels
+									const OpenVDBGridStreamData *g;
+									g=(const OpenVDBGridStreamData*)(*it)[uj];
+									if(g->representationType != VOXEL_REPRESENT_POINTCLOUD)
+										continue;
+
+									Voxels<float> v;
+									if(!g->toDense(v))
+										continue;
+									filename = exportDialog->getFilename(ui,FILENAME_VOXEL,offset);
+									writeErr=v.writeFile(filename.c_str());
+									break;
+								}
+								default:
+									continue;
+							}
 
-							const VoxelStreamData *v;
-							v=(const VoxelStreamData*)(*it)[uj];
-							
-							std::string filename = exportDialog->getFilename(ui,FILENAME_VOXEL,offset);
-							if(v->data->writeFile(filename.c_str()))
+							if(writeErr)
 							{
 								pair<string,string> errMsg;
 								string tmpStr;
@@ -2376,7 +2406,7 @@ void MainWindowFrame::OnFileExportIons(wxCommandEvent &event)
 	//create a file chooser for later. The format string is special as we use it to demux the 
 	// format later
 	wxFileDialog wxF(this,TRANS("Save pos..."), wxT(""),
-		wxT(""),TRANS("POS Data (*.pos)|*.pos|Text File (*.txt)|*.txt|VTK Legacy (*.vtk)|*.vtk|All Files (*)|*"),wxFD_SAVE);
+		wxT(""),TRANS("POS Data (*.pos)|*.pos|Text File (*.txt)|*.txt|VTK Legacy (*.vtk)|*.vtk|VTK Legacy, binary (*.vtk)|*.vtk|VTK XML (*.vtu)|*.vtu|All Files (*)|*"),wxFD_SAVE);
 	
 	//If the user cancels the file chooser, 
 	//drop them back into the export dialog.
@@ -2431,12 +2461,23 @@ void MainWindowFrame::OnFileExportIons(wxCommandEvent &event)
 
 	//Using the wildcard constant selected, set if we want text or pos
 	unsigned int format;
-	if(wxF.GetFilterIndex() == 0)
-		format = IONFORMAT_POS;
-	else if(wxF.GetFilterIndex() == 1)
-		format = IONFORMAT_TEXT;
-	else
-		format = IONFORMAT_VTK; 
+	switch(wxF.GetFilterIndex())
+	{
+		case 0:
+			format = IONFORMAT_POS;
+			break;
+		case 1:
+			format = IONFORMAT_TEXT;
+			break;
+		case 3:
+			format = IONFORMAT_VTK_BINARY;
+			break;
+		case 4:
+			format = IONFORMAT_VTU;
+			break;
+		default:
+			format = IONFORMAT_VTK; 
+	}
 
 	//write the ion streams to disk
 	if(IonStreamData::exportStreams(exportVec,dataFile,format))
@@ -3414,7 +3455,16 @@ void MainWindowFrame::OnGridFilterPropertyChange(wxPropertyGridEvent &event)
 	// we will handle validation in the backend
 	event.SetValidationFailureBehavior(0);
 	
-	if(programmaticEvent || currentlyUpdatingScene || refreshThreadActive())
+	if(programmaticEvent)
+	{
+		event.Veto();
+		return;
+	}
+
+	//The grid is only left unlocked during a refresh when
+	// auto-updating, in which case the edit replaces the running refresh
+	bool queueEdit=currentlyUpdatingScene || refreshThreadActive();
+	if(queueEdit && !checkAutoUpdate->GetValue())
 	{
 		event.Veto();
 		return;
@@ -3440,6 +3490,15 @@ void MainWindowFrame::OnGridFilterPropertyChange(wxPropertyGridEvent &event)
 	keyStr=event.GetProperty()->GetName();
 	stream_cast(key,keyStr);
 
+	//The filters belong to the refresh thread until it stops, so hold
+	// the edit, and leave the grid showing the new value until then
+	if(queueEdit)
+	{
+		queueFilterProperty(filterId,key,newValue);
+		programmaticEvent=false;
+		return;
+	}
+
 	//Try to apply the new value
 	bool needUpdate;
 	if(!visControl.state.treeState.setFilterProperty(filterId,
@@ -3486,6 +3545,51 @@ void MainWindowFrame::OnGridFilterPropertyChange(wxPropertyGridEvent &event)
 	
 }
 
+void MainWindowFrame::queueFilterProperty(size_t filterId, size_t key, 
+						const std::string &value)
+{
+	pendingFilterProps[std::make_pair(filterId,key)]=value;
+
+	//Stop the running refresh. Filters upstream of the edit keep
+	// any caches they completed, so the restart does not redo them
+	if(!haveAborted)
+	{
+		visControl.state.treeState.setAbort();
+		haveAborted=true;
+	}
+	restartRefresh=true;
+
+	statusMessage(TRANS("Restarting refresh..."),MESSAGE_INFO);
+}
+
+bool MainWindowFrame::applyPendingFilterProperties()
+{
+	ASSERT(!refreshThreadActive());
+
+	bool needUpdate=false;
+	for(std::map<std::pair<size_t,size_t>,std::string>::const_iterator it=pendingFilterProps.begin();
+			it!=pendingFilterProps.end(); ++it)
+	{
+		bool filterNeedUpdate;
+		if(visControl.state.treeState.setFilterProperty(it->first.first,
+				it->first.second,it->second,filterNeedUpdate))
+			needUpdate|=filterNeedUpdate;
+	}
+	pendingFilterProps.clear();
+
+	//Rejected values are still shown in the grid; reload it from the filter 
+	size_t filterId;
+	if(getTreeFilterId(treeFilters->GetSelection(),filterId))
+	{
+		programmaticEvent=true;
+		visControl.updateFilterPropGrid(gridFilterPropGroup,filterId,
+			stlStr(gridFilterPropGroup->SaveEditableState()));
+		programmaticEvent=false;
+	}
+
+	return needUpdate;
+}
+
 void MainWindowFrame::OnGridFilterDClick(wxPropertyGridEvent &event)
 {
 	Refresh();
@@ -3867,6 +3971,8 @@ bool MainWindowFrame::doSceneUpdate(bool ensureVisible)
 
 	ASSERT(!refreshControl);
 	refreshControl = new RefreshController(visControl.state.treeState);
+	if(!refreshTraceFile.empty())
+		refreshControl->curProg.setTrace(&refreshTrace);
 	refreshThread=new RefreshThread(this,refreshControl);
 	progressTimer->Start(PROGRESS_TIMER_DELAY);
 
@@ -3919,7 +4025,8 @@ void MainWindowFrame::finishSceneUpdate(unsigned int errCode)
 				errString=FilterTree::getRefreshErrString(errCode);
 			}
 			
-			statusMessage(errString.c_str(),MESSAGE_ERROR);	
+			if(!errString.empty())
+				statusMessage(errString.c_str(),MESSAGE_ERROR);	
 		}
 
 	
@@ -3991,17 +4098,58 @@ void MainWindowFrame::OnFinishRefreshThread(wxCommandEvent &event)
 	}
 	textConsoleOut->AppendText("\n");	
 
+	//Save the timings of this and earlier refreshes, and summarise them
+	if(!refreshTraceFile.empty())
+	{
+		std::ofstream f(refreshTraceFile.c_str());
+		if(f)
+			refreshTrace.writeChromeTrace(f);
+		else
+			textConsoleOut->AppendText(TRANS("Unable to write refresh trace file: ") + refreshTraceFile + "\n");
+
+		std::ostringstream summary;
+		refreshTrace.writeSummary(summary);
+		textConsoleOut->AppendText(summary.str()+"\n");
+	}
 
-	finishSceneUpdate((unsigned int)event.GetInt());
 
 	//First wait for the refresh thread to terminate
 	refreshThread->Wait();
+
+	//Apply any edits made during the refresh. If they superseded it, 
+	// start again with them straight away, without first showing the 
+	// aborted result
+	const bool haveEdits=!pendingFilterProps.empty();
+	bool needUpdate=false;
+	if(haveEdits)
+		needUpdate=applyPendingFilterProperties();
+
+	if(restartRefresh && needUpdate)
+	{
+		restartRefresh=false;
+
+		delete refreshThread;
+		refreshThread=0;
+		delete refreshControl;
+		refreshControl=0;
+
+		currentlyUpdatingScene=false;
+		doSceneUpdate(ensureResultVisible);
+		return;
+	}
+	restartRefresh=false;
+
+	finishSceneUpdate((unsigned int)event.GetInt());
+
 	delete refreshThread;
 	refreshThread=0;
 
 	delete refreshControl;
 	refreshControl=0;
 
+	if(haveEdits)
+		clearWxTreeImages(treeFilters);
+
 	if(!event.GetInt())
 	{
 		//Set the progress string to complete, if no error
@@ -4666,6 +4814,8 @@ void MainWindowFrame::OnProgressAbort(wxCommandEvent &event)
 	if(!haveAborted)
 		visControl.state.treeState.setAbort();
 	haveAborted=true;
+	//A user abort also cancels any restart queued by property edits
+	restartRefresh=false;
 }
 
 void MainWindowFrame::OnViewFullscreen(wxCommandEvent &event)
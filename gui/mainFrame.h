@@ -49,6 +49,8 @@
 #include "backend/viscontrol.h"
 #include "backend/configFile.h"
 
+#include <map>
+
 
 
 #ifndef THREEDEPICT_H 
@@ -129,6 +131,13 @@ private:
 	//!Complete the scene update. Returns false if failed
 	void finishSceneUpdate(unsigned int errCode);
 
+	//!Hold a filter property edit that arrived during a refresh, and abort
+	// that refresh so that it restarts with the new value
+	void queueFilterProperty(size_t filterId, size_t key, const std::string &value);
+	//!Apply the edits held by queueFilterProperty. Returns true if any
+	// accepted edit requires a refresh
+	bool applyPendingFilterProperties();
+
 	//!Wrapper for viscontrol's update function, as we need to
 	// prevent wx from firing events during tree update
 	void updateWxTreeCtrl( wxTreeCtrl *t, const Filter *f=0);
@@ -155,6 +164,10 @@ private:
 	RefreshThread *refreshThread;
 	//!Refresh control object
 	RefreshController *refreshControl;
+	//!Timings of filter refreshes, recorded if a trace file is set
+	RefreshTrace refreshTrace;
+	//!File to write refresh timings to, as Chrome trace JSON. Empty to disable
+	std::string refreshTraceFile;
 
 	//!Program on-disk configuration class
 	ConfigFile configFile;
@@ -169,6 +182,11 @@ private:
 	bool currentlyUpdatingScene;
 	//!Have we aborted an update
 	bool haveAborted;
+	//!Filter property edits made during a refresh, keyed by filter id and
+	// property key, so that only the latest value for each is kept
+	std::map<std::pair<size_t,size_t>,std::string> pendingFilterProps;
+	//!Should a new refresh start as soon as the current one has stopped?
+	bool restartRefresh;
 	//!Should the gui ensure that the refresh result is visible at the next update?
 	bool ensureResultVisible;
 
@@ -442,6 +460,9 @@ public:
 #endif
     void SetCommandLineFiles(wxArrayString &files);
 
+    //!Record refresh timings, writing them to the given file after each refresh
+    void setRefreshTraceFile(const std::string &file) { refreshTraceFile=file;}
+
     //return type of file, based upon heuristic check
     static unsigned int guessFileType(const std::string &file);
 
@@ -19,6 +19,7 @@
 #include <list>
 #include <set>
 #include <fstream>
+#include <sstream>
 #include <iostream>
 
 
@@ -39,6 +40,12 @@ bool filterTreeTests();
 // Bug was due to incorrect handling of refresh input data stack
 bool filterRefreshNoOut();
 
+//!Check refresh timings are recorded into a trace
+bool filterTraceTests();
+
+//!Check that ions shared between sibling filters are not duplicated
+bool filterSharedIonTests();
+
 //!Test a given filter tree that the refresh works
 bool testFilterTree(const FilterTree &f);
 
@@ -134,6 +141,12 @@ bool filterTests()
 	if(!filterTreeTests())
 		return false;
 
+	if(!filterTraceTests())
+		return false;
+
+	if(!filterSharedIonTests())
+		return false;
+
 	return true;
 }
 
@@ -516,3 +529,201 @@ bool filterRefreshNoOut()
 
 	return true;
 }
+
+bool filterTraceTests()
+{
+	//Steps named through the progress data nest inside the open span
+	{
+	RefreshTrace trace;
+	ProgressData p;
+	p.setTrace(&trace);
+
+	trace.beginSpan("Refresh","tree");
+	trace.beginSpan("A","filter");
+	p.stepName=string("Step 1");
+	p.stepName="Step 2";
+	trace.endStep();
+	trace.setBytesOut(100);
+	trace.endSpan();
+	trace.endSpan();
+
+	//Copies do not record into the trace
+	ProgressData q;
+	q=p;
+	q.stepName="Step 3";
+
+	const vector<RefreshTrace::TRACE_SPAN> &spans=trace.getSpans();
+	TEST(spans.size() == 4,"trace span count");
+	TEST(spans[0].depth == 0 && spans[1].depth == 1,"trace span depth");
+	TEST(spans[2].name == "Step 1" && spans[2].depth == 2,"trace step");
+	TEST(spans[3].name == "Step 2" && spans[3].depth == 2,"trace step");
+	TEST(spans[2].start + spans[2].duration <= spans[3].start,"trace step order");
+	TEST(spans[1].bytesOut == 100,"trace bytes");
+	TEST(p.stepName == "Step 2","step name");
+
+	std::ostringstream json,summary;
+	trace.writeChromeTrace(json);
+	trace.writeSummary(summary);
+	TEST(json.str().find("\"traceEvents\"") != string::npos,"trace JSON");
+	TEST(summary.str().find("A\t1\t0") != string::npos,"trace summary");
+	}
+
+	//A refresh records the tree, and each filter in it
+	{
+	string strData;
+	wxString wxs;
+	wxs= wxFileName::CreateTempFileName(wxT("3Depict-unit-test-"));
+	strData=stlStr(wxs) + string(".txt");
+
+	{
+	ofstream f(strData.c_str());
+	if(!f)
+	{
+		WARN(false,"Unable to write to dir, skipped unit test");
+		return true;
+	}
+	f << "1 2 3 4" << std::endl;
+	f << "2 1 3 5" << std::endl;
+	f.close();
+	}
+
+	DataLoadFilter *fData = new DataLoadFilter;
+	fData->setFilename(strData);
+	fData->setFileMode(DATALOAD_TEXT_FILE);
+
+	FilterTree fTree;
+	fTree.addFilter(fData,0);
+	fTree.addFilter(new IonDownsampleFilter,fData);
+
+	RefreshTrace trace;
+	ProgressData prog;
+	prog.setTrace(&trace);
+	std::list<std::pair<Filter *, std::vector<const FilterStreamData * > > > outData;
+	std::vector<SelectionDevice *> devices;
+	std::vector<std::pair<const Filter *, string > > consoleMessages;
+#ifdef  HAVE_CPP_1X
+	ATOMIC_BOOL wantAbort(false);
+#else
+	ATOMIC_BOOL wantAbort=false;
+#endif
+	TEST(!fTree.refreshFilterTree(outData,devices,consoleMessages,prog,wantAbort),"refresh");
+	fTree.safeDeleteFilterList(outData);
+	wxRemoveFile((strData));
+
+	const vector<RefreshTrace::TRACE_SPAN> &spans=trace.getSpans();
+	TEST(spans.size() >= 3,"refresh trace span count");
+	TEST(spans[0].category == "tree" && spans[0].depth == 0,"refresh trace root");
+	size_t nFilters=0;
+	for(size_t ui=0;ui<spans.size();ui++)
+	{
+		if(spans[ui].category != "filter")
+			continue;
+		nFilters++;
+		TEST(spans[ui].depth == 1,"filter span depth");
+		TEST(spans[ui].bytesOut <= 2*sizeof(IonHit),"filter output size");
+	}
+	TEST(nFilters == 2,"filter span count");
+	}
+
+	return true;
+}
+
+//Expose the cached output of filters, for inspection
+template<class T>
+class CacheProbe : public T
+{
+	public:
+		const IonStreamData *getCachedIons() const
+		{
+			for(size_t ui=0;ui<this->filterOutputs.size();ui++)
+			{
+				if(this->filterOutputs[ui]->getStreamType() == STREAM_TYPE_IONS)
+					return (const IonStreamData *)this->filterOutputs[ui];
+			}
+			return 0;
+		}
+};
+
+bool filterSharedIonTests()
+{
+	string strData;
+	wxString wxs;
+	wxs= wxFileName::CreateTempFileName(wxT("3Depict-unit-test-"));
+	strData=stlStr(wxs) + string(".txt");
+
+	const size_t NUM_IONS=1000;
+	{
+	ofstream f(strData.c_str());
+	if(!f)
+	{
+		WARN(false,"Unable to write to dir, skipped unit test");
+		return true;
+	}
+	for(size_t ui=0;ui<NUM_IONS;ui++)
+		f << ui%10 << " " << (float)ui/NUM_IONS - 0.5f << " " << ui%7 << " 1" << std::endl;
+	f.close();
+	}
+
+	//Data -> (clip, voxelise). Clip selects from the data's ions, and
+	// voxelise, refreshed after it, needs plain ions
+	CacheProbe<DataLoadFilter> *fData = new CacheProbe<DataLoadFilter>;
+	fData->setFilename(strData);
+	fData->setFileMode(DATALOAD_TEXT_FILE);
+	CacheProbe<IonClipFilter> *fClip = new CacheProbe<IonClipFilter>;
+
+	FilterTree fTree;
+	fTree.addFilter(fData,0);
+	fTree.addFilter(fClip,fData);
+	fTree.addFilter(new VoxeliseFilter,fData);
+
+	//Refreshing again must not move or copy the data's ions either
+	for(unsigned int pass=0;pass<2;pass++)
+	{
+		std::list<std::pair<Filter *, std::vector<const FilterStreamData * > > > outData;
+		TEST(testFilterTree(fTree,outData),"shared ion tree refresh");
+		fTree.safeDeleteFilterList(outData);
+
+		const IonStreamData *dataIons=fData->getCachedIons();
+		const IonStreamData *clipIons=fClip->getCachedIons();
+		TEST(dataIons && clipIons,"filters cached");
+
+		//The data stream still holds its ions, once
+		TEST(dataIons->data.size() == NUM_IONS,"data ions unmoved");
+		TEST(!dataIons->hasSelections(),"data ions not shared away");
+
+		//The clip selects from those same ions, without a copy
+		TEST(clipIons->hasSelections(),"clip output is a selection");
+		for(size_t ui=0;ui<clipIons->selections.size();ui++)
+		{
+			TEST(&(clipIons->selections[ui].sourceIons()) == &(dataIons->data),
+					"clip selects from data's own ions");
+		}
+		TEST(clipIons->getNumBasicObjects() < NUM_IONS,"clip output size");
+	}
+
+	wxRemoveFile((strData));
+
+	//Applying a transform must not disturb streams selecting from the ions
+	{
+	IonStreamData src;
+	src.data.resize(NUM_IONS);
+	for(size_t ui=0;ui<NUM_IONS;ui++)
+		src.data[ui].setPos(ui,0,0);
+
+	IonStreamData sel;
+	sel.selections=src.shareIons();
+
+	src.pendingTransform=AffineTransform3D::translation(Point3D(0,1,0));
+	src.applyPendingTransform();
+
+	TEST(src.data.size() == NUM_IONS,"transformed ions kept");
+	TEST(sel.getNumBasicObjects() == NUM_IONS,"selected ions kept");
+	for(size_t ui=0;ui<NUM_IONS;ui++)
+	{
+		TEST(src.data[ui].getPosRef() == Point3D(ui,1,0),"ions transformed");
+		TEST(sel.selections[0][ui].getPosRef() == Point3D(ui,0,0),"selection unchanged");
+	}
+	}
+
+	return true;
+}
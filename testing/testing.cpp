@@ -32,8 +32,11 @@
 #include "backend/APT/vtk.h"
 #include "backend/state.h"
 #include "backend/configFile.h"
+#include "backend/plot.h"
 #include "backend/filters/algorithms/binomial.h"
 #include "backend/filters/algorithms/K3DTree-mk2.h"
+#include "backend/filters/algorithms/cellList.h"
+#include "backend/filters/algorithms/sparseVoxels.h"
 #include "backend/filters/algorithms/K3DTree.h"
 #include "backend/filters/algorithms/mass.h"
 
@@ -45,6 +48,7 @@
 #include "common/xmlHelper.h"
 
 #include "gl/isoSurface.h"
+#include "gl/scene.h"
 
 const char *TESTING_RESOURCE_DIRS[] = {
 		"../test/",
@@ -121,6 +125,33 @@ bool basicFunctionTests()
 	LinearFeedbackShiftReg reg;
 	TEST(reg.verifyTable(16),"Check LFSR table integrity");
 
+	//Check that plot decimation bounds the point count, but keeps peaks
+	{
+	const unsigned int NUM_PTS=100000, NUM_COLS=200;
+	vector<float> x(NUM_PTS),y(NUM_PTS),err;
+	for(unsigned int ui=0;ui<NUM_PTS;ui++)
+	{
+		x[ui]=ui;
+		y[ui]=(ui%7);
+	}
+	//Single point spikes
+	y[12345]=1000;
+	y[54321]=-1000;
+
+	vector<float> xOut,yOut,errOut;
+	decimatePlotData(x,y,err,0,NUM_PTS-1,NUM_COLS,false,xOut,yOut,errOut);
+	TEST(xOut.size() <= 4*NUM_COLS,"decimated point count");
+	TEST(xOut.size() == yOut.size() && errOut.empty(),"decimated sizes");
+	TEST(std::is_sorted(xOut.begin(),xOut.end()),"decimated order");
+	TEST(*std::max_element(yOut.begin(),yOut.end()) == 1000,"decimation max peak");
+	TEST(*std::min_element(yOut.begin(),yOut.end()) == -1000,"decimation min peak");
+	TEST(xOut.front() == 0 && xOut.back() == NUM_PTS-1,"decimation ends");
+
+	//Zoomed in far enough, every point (plus neighbours) is kept
+	decimatePlotData(x,y,err,100,199,NUM_COLS,false,xOut,yOut,errOut);
+	TEST(xOut.size() == 102 && xOut.front() == 99 && xOut.back() == 200,
+						"decimation zoomed range");
+	}
 	
 	return true;
 }
@@ -184,6 +215,15 @@ bool runUnitTests()
 	if(!testIsoSurface())
 		return false;
 
+	if(!testScenePicking())
+		return false;
+
+	if(!testPointLOD())
+		return false;
+
+	if(!testDepthSort())
+		return false;
+
 
 	if(!fileFormatTests())
 		return false;
@@ -566,6 +606,12 @@ bool algorithmTests()
 
 	if(!K3DMk2Tests())
 		return false;
+
+	if(!cellListTests())
+		return false;
+
+	if(!sparseVoxelTests())
+		return false;
 	
 	if(!testBinomial())
 		return false;
@@ -577,5 +623,13 @@ bool fileFormatTests()
 	return testVTKExport();
 }
 
+bool runBenchmarks(std::ostream &strm)
+{
+	if(!benchmarkProfileScaling(strm))
+		return false;
+
+	return true;
+}
+
 
 #endif
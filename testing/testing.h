@@ -30,6 +30,10 @@ bool runUnitTests();
 //Run the particular specified filter tree
 bool testFilterTree(const FilterTree &f);
 
+//Run the timing benchmarks, writing results to strm. These are
+// slow, and so are not run as part of the unit tests
+bool runBenchmarks(std::ostream &strm);
+
 #endif
 
 #endif